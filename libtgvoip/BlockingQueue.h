@@ -60,6 +60,7 @@ public:
 	}
 
 	unsigned int Size(){
+		MutexGuard sync(mutex);
 		return queue.size();
 	}
 
@@ -0,0 +1,144 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "CallCapture.h"
+#include "Buffers.h"
+#include "VoIPController.h"
+#include "VoIPServerConfig.h"
+#include <string.h>
+#include <array>
+
+using namespace tgvoip;
+
+static void WriteDouble(BufferOutputStream& s, double d){
+	int64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	s.WriteInt64(bits);
+}
+
+CallCapture::CallCapture(FILE* file) : file(file){
+	setvbuf(file, NULL, _IOFBF, 64*1024);
+	std::string config=ServerConfig::GetSharedInstance()->GetJsonString();
+	unsigned char buf[10];
+	BufferOutputStream s(buf, sizeof(buf));
+	s.WriteInt32(CALL_CAPTURE_MAGIC);
+	s.WriteInt16(CALL_CAPTURE_VERSION);
+	s.WriteInt32((int32_t)config.length());
+	fwrite(s.GetBuffer(), 1, s.GetLength(), file);
+	fwrite(config.data(), 1, config.length(), file);
+}
+
+CallCapture::~CallCapture(){
+	fclose(file);
+}
+
+void CallCapture::Write(unsigned char type, const unsigned char* payload, size_t len, const unsigned char* data, size_t dataLen){
+	unsigned char header[3];
+	BufferOutputStream s(header, sizeof(header));
+	s.WriteByte(type);
+	s.WriteInt16((int16_t)(len+dataLen));
+	MutexGuard m(mutex);
+	fwrite(header, 1, sizeof(header), file);
+	fwrite(payload, 1, len, file);
+	if(dataLen)
+		fwrite(data, 1, dataLen, file);
+}
+
+void CallCapture::SetIncomingPacket(unsigned char type, uint32_t seq){
+	MutexGuard m(mutex);
+	incomingType=type;
+	incomingSeq=seq;
+}
+
+void CallCapture::RecordStream(unsigned char streamID, uint32_t frameDuration){
+	unsigned char buf[5];
+	BufferOutputStream s(buf, sizeof(buf));
+	s.WriteByte(streamID);
+	s.WriteInt32(frameDuration);
+	Write(RECORD_STREAM, buf, s.GetLength());
+}
+
+void CallCapture::RecordIncoming(const unsigned char* data, size_t len, uint32_t pts, bool isEC, double time){
+	unsigned char buf[18];
+	BufferOutputStream s(buf, sizeof(buf));
+	WriteDouble(s, time);
+	{
+		MutexGuard m(mutex);
+		s.WriteByte(incomingType);
+		s.WriteInt32(incomingSeq);
+	}
+	s.WriteInt32(pts);
+	s.WriteByte((unsigned char)isEC);
+	Write(RECORD_INCOMING, buf, s.GetLength(), data, len);
+}
+
+void CallCapture::RecordOutgoing(const unsigned char* data, size_t len, uint32_t seq, uint32_t pts){
+	unsigned char buf[16];
+	BufferOutputStream s(buf, sizeof(buf));
+	WriteDouble(s, VoIPController::GetCurrentTime());
+	s.WriteInt32(seq);
+	s.WriteInt32(pts);
+	Write(RECORD_OUTGOING, buf, s.GetLength(), data, len);
+}
+
+void CallCapture::RecordJitterTick(){
+	unsigned char buf[8];
+	BufferOutputStream s(buf, sizeof(buf));
+	WriteDouble(s, VoIPController::GetCurrentTime());
+	Write(RECORD_JITTER_TICK, buf, s.GetLength());
+}
+
+void CallCapture::RecordJitterOutput(int offsetInSteps, bool advance){
+	unsigned char buf[13];
+	BufferOutputStream s(buf, sizeof(buf));
+	WriteDouble(s, VoIPController::GetCurrentTime());
+	s.WriteInt32(offsetInSteps);
+	s.WriteByte((unsigned char)advance);
+	Write(RECORD_JITTER_OUTPUT, buf, s.GetLength());
+}
+
+void CallCapture::RecordMinPacketCount(uint32_t count){
+	unsigned char buf[4];
+	BufferOutputStream s(buf, sizeof(buf));
+	s.WriteInt32(count);
+	Write(RECORD_MIN_PACKET_COUNT, buf, s.GetLength());
+}
+
+void CallCapture::RecordDecoder(bool needEC, uint32_t frameDuration){
+	unsigned char buf[5];
+	BufferOutputStream s(buf, sizeof(buf));
+	s.WriteByte((unsigned char)needEC);
+	s.WriteInt32(frameDuration);
+	Write(RECORD_DECODER, buf, s.GetLength());
+}
+
+void CallCapture::RecordDecoded(int playbackDuration, const int16_t* samples, size_t count){
+	unsigned char buf[20];
+	BufferOutputStream s(buf, sizeof(buf));
+	WriteDouble(s, VoIPController::GetCurrentTime());
+	s.WriteInt32(playbackDuration);
+	s.WriteInt32((int32_t)count);
+	s.WriteInt32((int32_t)Checksum(samples, count));
+	Write(RECORD_DECODED, buf, s.GetLength());
+}
+
+uint32_t CallCapture::Checksum(const int16_t* samples, size_t count){
+	static const std::array<uint32_t, 256> table=[]{
+		std::array<uint32_t, 256> t;
+		for(uint32_t i=0;i<256;i++){
+			uint32_t c=i;
+			for(int k=0;k<8;k++)
+				c=c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			t[i]=c;
+		}
+		return t;
+	}();
+	uint32_t crc=0xFFFFFFFF;
+	const unsigned char* p=reinterpret_cast<const unsigned char*>(samples);
+	for(size_t i=0;i<count*2;i++)
+		crc=table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
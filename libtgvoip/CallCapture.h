@@ -0,0 +1,81 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_CALLCAPTURE_H
+#define LIBTGVOIP_CALLCAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "threading.h"
+#include "utils.h"
+
+#define CALL_CAPTURE_MAGIC 0x43564754 // "TGVC"
+#define CALL_CAPTURE_VERSION 1
+
+namespace tgvoip{
+
+	/**
+	 * Per-call binary capture of the incoming audio path, for offline replay.
+	 *
+	 * File layout, all integers little-endian:
+	 *   header: uint32 magic, uint16 version, uint32 length, server config json
+	 *   records: uint8 type, uint16 payload length, payload
+	 * Times are the raw VoIPController::GetCurrentTime() values as IEEE doubles, so the
+	 * jitter buffer sees exactly the same clock on replay.
+	 *
+	 * Jitter buffer records are written while it holds its lock, which makes their order
+	 * in the file the order the operations took effect in.
+	 */
+	class CallCapture{
+	public:
+		enum{
+			// uint8 stream id, uint32 frame duration
+			RECORD_STREAM=1,
+			// double time, uint8 packet type, uint32 seq, uint32 pts, uint8 isEC, data
+			RECORD_INCOMING,
+			// double time, uint32 seq, uint32 pts, data
+			RECORD_OUTGOING,
+			// double time
+			RECORD_JITTER_TICK,
+			// double time, int32 offset in steps, uint8 advance
+			RECORD_JITTER_OUTPUT,
+			// uint32 count
+			RECORD_MIN_PACKET_COUNT,
+			// uint8 needEC, uint32 frame duration
+			RECORD_DECODER,
+			// double time, uint32 playback duration, uint32 sample count, uint32 checksum
+			RECORD_DECODED,
+		};
+
+		TGVOIP_DISALLOW_COPY_AND_ASSIGN(CallCapture);
+		// takes ownership of the file
+		CallCapture(FILE* file);
+		~CallCapture();
+		void SetIncomingPacket(unsigned char type, uint32_t seq);
+		void RecordStream(unsigned char streamID, uint32_t frameDuration);
+		void RecordIncoming(const unsigned char* data, size_t len, uint32_t pts, bool isEC, double time);
+		void RecordOutgoing(const unsigned char* data, size_t len, uint32_t seq, uint32_t pts);
+		void RecordJitterTick();
+		void RecordJitterOutput(int offsetInSteps, bool advance);
+		void RecordMinPacketCount(uint32_t count);
+		void RecordDecoder(bool needEC, uint32_t frameDuration);
+		void RecordDecoded(int playbackDuration, const int16_t* samples, size_t count);
+		// CRC-32 of the decoded samples
+		static uint32_t Checksum(const int16_t* samples, size_t count);
+
+	private:
+		void Write(unsigned char type, const unsigned char* payload, size_t len, const unsigned char* data=NULL, size_t dataLen=0);
+
+		FILE* file;
+		Mutex mutex;
+		unsigned char incomingType=0;
+		uint32_t incomingSeq=0;
+	};
+}
+
+#endif //LIBTGVOIP_CALLCAPTURE_H
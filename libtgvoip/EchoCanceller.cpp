@@ -17,15 +17,24 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <algorithm>
 
 using namespace tgvoip;
 
-EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC){
+EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC) : processedFrames(0), skippedFrames(0){
 #ifndef TGVOIP_NO_DSP
 	this->enableAEC=enableAEC;
 	this->enableAGC=enableAGC;
 	this->enableNS=enableNS;
 	isOn=true;
+	running=false;
+	bufferFarendThread=NULL;
+	farendQueue=NULL;
+	farendBufferPool=NULL;
+
+	// ProcessInput does nothing with all three off, the APM instance alone is hundreds of kilobytes
+	if(!enableAEC && !enableNS && !enableAGC)
+		return;
 
 	webrtc::Config extraConfig;
 #ifdef TGVOIP_USE_DESKTOP_DSP
@@ -75,16 +84,30 @@ EchoCanceller::EchoCanceller(bool enableAEC, bool enableNS, bool enableAGC){
 	}
 	apm->voice_detection()->set_likelihood(webrtc::VoiceDetection::Likelihood::kVeryLowLikelihood);
 
+	// Frames whose peak level stays below the threshold (about -50 dBFS by default, 0 turns the gate off)
+	// skip the APM. The hangover keeps processing for a while after speech so that NS/AGC see the tails,
+	// and one silent frame out of every refresh interval is still processed to keep the noise estimate
+	// and gain adaptation current. With NS or AGC on, skipped frames get the gain those applied to the
+	// last processed silent frame, so the noise floor stays where the full pipeline puts it.
+	silenceThreshold=ServerConfig::GetSharedInstance()->GetInt("webrtc_apm_silence_threshold", 100);
+	silenceHangover=ServerConfig::GetSharedInstance()->GetInt("webrtc_apm_silence_hangover", 20);
+	silenceRefreshInterval=ServerConfig::GetSharedInstance()->GetInt("webrtc_apm_silence_refresh_interval", 10);
+	farendHangoverLeft=0;
+	gateClosed=false;
+
 	audioFrame=new webrtc::AudioFrame();
 	audioFrame->samples_per_channel_=480;
 	audioFrame->sample_rate_hz_=48000;
 	audioFrame->num_channels_=1;
 
-	farendQueue=new BlockingQueue<int16_t*>(11);
-	farendBufferPool=new BufferPool(960*2, 10);
-	running=true;
-	bufferFarendThread=new Thread(std::bind(&EchoCanceller::RunBufferFarendThread, this));
-	bufferFarendThread->Start();
+	// far end audio is only needed to cancel echo
+	if(enableAEC){
+		farendQueue=new BlockingQueue<int16_t*>(11);
+		farendBufferPool=new BufferPool(960*2, 10);
+		running=true;
+		bufferFarendThread=new Thread(std::bind(&EchoCanceller::RunBufferFarendThread, this));
+		bufferFarendThread->Start();
+	}
 
 #else
 	this->enableAEC=this->enableAGC=enableAGC=this->enableNS=enableNS=false;
@@ -129,6 +152,15 @@ void EchoCanceller::RunBufferFarendThread(){
 	while(running){
 		int16_t* samplesIn=farendQueue->GetBlocking();
 		if(samplesIn){
+			if(silenceThreshold>0){
+				if(GetPeakLevel(samplesIn, 960)>=silenceThreshold){
+					farendHangoverLeft=silenceHangover;
+				}else if(gateClosed){
+					// The capture side isn't feeding the AEC either, keep both streams in step
+					farendBufferPool->Reuse(reinterpret_cast<unsigned char*>(samplesIn));
+					continue;
+				}
+			}
 			memcpy(frame.mutable_data(), samplesIn, 480*2);
 			apm->ProcessReverseStream(&frame);
 			memcpy(frame.mutable_data(), samplesIn+480, 480*2);
@@ -152,24 +184,98 @@ void EchoCanceller::ProcessInput(int16_t* inOut, size_t numSamples, bool& hasVoi
 	int delay=audio::AudioInput::GetEstimatedDelay()+audio::AudioOutput::GetEstimatedDelay();
 	assert(numSamples==960);
 
-	memcpy(audioFrame->mutable_data(), inOut, 480*2);
-	if(enableAEC)
-    	apm->set_stream_delay_ms(delay);
-	apm->ProcessStream(audioFrame);
-	if(enableVAD)
-    	hasVoice=apm->voice_detection()->stream_has_voice();
-	memcpy(inOut, audioFrame->data(), 480*2);
-	memcpy(audioFrame->mutable_data(), inOut+480, 480*2);
-	if(enableAEC)
-    	apm->set_stream_delay_ms(delay);
-	apm->ProcessStream(audioFrame);
-	if(enableVAD){
-    	hasVoice=hasVoice || apm->voice_detection()->stream_has_voice();
+	bool voice=false;
+	for(int i=0;i<2;i++){
+		int16_t* samples=inOut+480*i;
+		bool silent=silenceThreshold>0 && GetPeakLevel(samples, 480)<silenceThreshold;
+		if(!ShouldProcessFrame(silent)){
+			skippedFrames++;
+			if(enableNS || enableAGC)
+				ApplyGain(samples, 480, silentGain);
+			continue;
+		}
+		processedFrames++;
+		memcpy(audioFrame->mutable_data(), samples, 480*2);
+		if(enableAEC)
+			apm->set_stream_delay_ms(delay);
+		apm->ProcessStream(audioFrame);
+		if(enableVAD)
+			voice=voice || apm->voice_detection()->stream_has_voice();
+		if(silent && (enableNS || enableAGC))
+			UpdateSilentGain(samples, audioFrame->data(), 480);
+		memcpy(samples, audioFrame->data(), 480*2);
 	}
-	memcpy(inOut+480, audioFrame->data(), 480*2);
+	if(enableVAD)
+		hasVoice=voice;
 #endif
 }
 
+#ifndef TGVOIP_NO_DSP
+bool EchoCanceller::ShouldProcessFrame(bool silent){
+	if(silenceThreshold<=0)
+		return true;
+	bool process;
+	if(!silent){
+		hangoverLeft=silenceHangover;
+		process=true;
+	}else if(silentGain<0 && (enableNS || enableAGC)){
+		// nothing to stand in for NS/AGC on skipped frames until a silent frame went through them
+		process=true;
+	}else if(hangoverLeft>0){
+		hangoverLeft--;
+		process=true;
+	}else if(enableAEC && farendHangoverLeft>0){
+		// the far end is talking, the echo path has to be tracked even if our side is quiet
+		farendHangoverLeft--;
+		process=true;
+	}else if(++silentSinceRefresh>=silenceRefreshInterval){
+		silentSinceRefresh=0;
+		process=true;
+	}else{
+		process=false;
+	}
+	gateClosed=!process;
+	return process;
+}
+
+void EchoCanceller::UpdateSilentGain(const int16_t* in, const int16_t* out, size_t numSamples){
+	double inEnergy=0, outEnergy=0;
+	for(size_t i=0;i<numSamples;i++){
+		inEnergy+=(double)in[i]*in[i];
+		outEnergy+=(double)out[i]*out[i];
+	}
+	// digital silence says nothing about the gain
+	if(inEnergy<numSamples)
+		return;
+	double gain=std::min(sqrt(outEnergy/inEnergy), 8.0);
+	silentGain=silentGain<0 ? (float)gain : (float)(silentGain*0.7+gain*0.3);
+}
+
+void EchoCanceller::ApplyGain(int16_t* samples, size_t numSamples, float gain){
+	for(size_t i=0;i<numSamples;i++){
+		float s=samples[i]*gain;
+		if(s>32767.0f)
+			samples[i]=INT16_MAX;
+		else if(s<-32768.0f)
+			samples[i]=INT16_MIN;
+		else
+			samples[i]=(int16_t)s;
+	}
+}
+
+int EchoCanceller::GetPeakLevel(const int16_t* samples, size_t numSamples){
+	int peak=0;
+	for(size_t i=0;i<numSamples;i++){
+		int s=samples[i];
+		if(s<0)
+			s=-s;
+		if(s>peak)
+			peak=s;
+	}
+	return peak;
+}
+#endif
+
 void EchoCanceller::SetAECStrength(int strength){
 #ifndef TGVOIP_NO_DSP
 	/*if(aec){
@@ -186,10 +292,27 @@ void EchoCanceller::SetAECStrength(int strength){
 void EchoCanceller::SetVoiceDetectionEnabled(bool enabled){
 	enableVAD=enabled;
 #ifndef TGVOIP_NO_DSP
-	apm->voice_detection()->Enable(enabled);
+	if(apm)
+		apm->voice_detection()->Enable(enabled);
 #endif
 }
 
+uint64_t EchoCanceller::GetProcessedFrameCount(){
+	return processedFrames;
+}
+
+uint64_t EchoCanceller::GetSkippedFrameCount(){
+	return skippedFrames;
+}
+
+double EchoCanceller::GetSkippedFrameRatio(){
+	uint64_t skipped=skippedFrames;
+	uint64_t total=skipped+processedFrames;
+	if(!total)
+		return 0.0;
+	return (double)skipped/(double)total;
+}
+
 using namespace tgvoip::effects;
 
 AudioEffect::~AudioEffect(){
@@ -12,6 +12,7 @@
 #include "BlockingQueue.h"
 #include "MediaStreamItf.h"
 #include "utils.h"
+#include <atomic>
 
 namespace webrtc{
 	class AudioProcessing;
@@ -32,6 +33,12 @@ public:
 	void ProcessInput(int16_t* inOut, size_t numSamples, bool& hasVoice);
 	void SetAECStrength(int strength);
 	void SetVoiceDetectionEnabled(bool enabled);
+	/**
+	* Number of 10 ms capture frames that went through the APM and that were skipped as silence
+	*/
+	uint64_t GetProcessedFrameCount();
+	uint64_t GetSkippedFrameCount();
+	double GetSkippedFrameRatio();
 
 private:
 	bool enableAEC;
@@ -48,7 +55,22 @@ private:
 	BlockingQueue<int16_t*>* farendQueue;
 	BufferPool* farendBufferPool;
 	bool running;
+	bool ShouldProcessFrame(bool silent);
+	void UpdateSilentGain(const int16_t* in, const int16_t* out, size_t numSamples);
+	static void ApplyGain(int16_t* samples, size_t numSamples, float gain);
+	static int GetPeakLevel(const int16_t* samples, size_t numSamples);
+	int silenceThreshold;
+	int silenceHangover;
+	int silenceRefreshInterval;
+	int hangoverLeft=0;
+	int silentSinceRefresh=0;
+	// output/input level NS and AGC gave the last processed silent frames, -1 until measured
+	float silentGain=-1;
+	std::atomic<int> farendHangoverLeft;
+	std::atomic<bool> gateClosed;
 #endif
+	std::atomic<uint64_t> processedFrames;
+	std::atomic<uint64_t> skippedFrames;
 };
 
 namespace effects{
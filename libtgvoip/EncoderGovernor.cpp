@@ -0,0 +1,116 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "EncoderGovernor.h"
+#include <algorithm>
+#include "VoIPController.h"
+#include "VoIPServerConfig.h"
+#include "logging.h"
+
+using namespace tgvoip;
+
+#define MIN_COMPLEXITY 1
+#define MAX_COMPLEXITY 10
+// 20 ms in nanoseconds
+#define PACKET_DURATION 20000000.0
+
+EncoderGovernor* EncoderGovernor::GetSharedInstance(){
+	static EncoderGovernor* sharedInstance=new EncoderGovernor();
+	return sharedInstance;
+}
+
+EncoderGovernor::EncoderGovernor() : complexity(MAX_COMPLEXITY), secondaryAllowed(true){
+}
+
+void EncoderGovernor::Register(Stats* stats){
+	MutexGuard m(mutex);
+	encoders.push_back(stats);
+}
+
+void EncoderGovernor::Unregister(Stats* stats){
+	MutexGuard m(mutex);
+	encoders.erase(std::remove(encoders.begin(), encoders.end(), stats), encoders.end());
+	retiredTime+=stats->time.load(std::memory_order_relaxed)-stats->countedTime;
+	retiredPackets+=stats->packets.load(std::memory_order_relaxed)-stats->countedPackets;
+}
+
+void EncoderGovernor::Update(){
+	double time=VoIPController::GetCurrentTime();
+	if(time<windowEnd.load(std::memory_order_relaxed))
+		return;
+	MutexGuard m(mutex);
+	// another encoder may have closed the window while this one waited
+	if(time<windowEnd.load(std::memory_order_relaxed))
+		return;
+	CloseWindow(time);
+}
+
+void EncoderGovernor::CloseWindow(double time){
+	uint64_t windowTime=retiredTime;
+	uint64_t windowPackets=retiredPackets;
+	for(Stats* stats:encoders){
+		uint64_t total=stats->time.load(std::memory_order_relaxed);
+		uint64_t packets=stats->packets.load(std::memory_order_relaxed);
+		windowTime+=total-stats->countedTime;
+		windowPackets+=packets-stats->countedPackets;
+		stats->countedTime=total;
+		stats->countedPackets=packets;
+	}
+	retiredTime=0;
+	retiredPackets=0;
+
+	// config is only consulted once per window
+	ServerConfig* config=ServerConfig::GetSharedInstance();
+	windowLength=config->GetDouble("encoder_governor_window", 2.0);
+	bool first=windowEnd==0;
+	windowEnd=time+windowLength;
+	// the first call only starts the window, nothing was measured over a full one yet
+	if(first || windowPackets==0)
+		return;
+
+	double load=(double)windowTime/windowPackets/PACKET_DURATION;
+	int current=complexity;
+	if(load>config->GetDouble("encoder_governor_high_load", 0.15)){
+		lowLoadSince=0;
+		if(current>MIN_COMPLEXITY)
+			SetComplexity(current, current-1, time, load);
+	}else if(load<config->GetDouble("encoder_governor_low_load", 0.06)){
+		// going up costs more CPU, so it waits for the low load to settle
+		double raiseDelay=config->GetDouble("encoder_governor_raise_delay", 10.0);
+		if(lowLoadSince==0)
+			lowLoadSince=time;
+		if(current<MAX_COMPLEXITY && time-lowLoadSince>=raiseDelay && time-lastChange>=raiseDelay){
+			if(SetComplexity(current, current+1, time, load))
+				lowLoadSince=time;
+		}
+	}else{
+		lowLoadSince=0;
+	}
+}
+
+void EncoderGovernor::ReportOverrun(){
+	// runs on the audio clock path, so no lock here: a step down also pushes the next raise
+	// back by encoder_governor_raise_delay through lastChange
+	double time=VoIPController::GetCurrentTime();
+	int current=complexity;
+	// all encoders overflow together under load, one step per window is enough
+	if(current>MIN_COMPLEXITY && time-lastChange>=windowLength)
+		SetComplexity(current, current-1, time, -1);
+}
+
+bool EncoderGovernor::SetComplexity(int from, int to, double time, double load){
+	// window and overrun paths may race, only one of them takes the step
+	if(!complexity.compare_exchange_strong(from, to))
+		return false;
+	lastChange=time;
+	secondaryAllowed=to>=ServerConfig::GetSharedInstance()->GetInt("encoder_governor_secondary_complexity", 5);
+	if(load>=0){
+		LOGI("Encoder governor: complexity %d -> %d, encoding takes %.1f%% of real time", from, to, load*100);
+	}else{
+		LOGI("Encoder governor: complexity %d -> %d after encoder queue overflow", from, to);
+	}
+	return true;
+}
@@ -0,0 +1,84 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_ENCODERGOVERNOR_H
+#define LIBTGVOIP_ENCODERGOVERNOR_H
+
+#include <atomic>
+#include <vector>
+#include "threading.h"
+
+namespace tgvoip{
+
+	/**
+	 * Process-wide Opus complexity, shared by all encoders.
+	 *
+	 * Encoders count how long encoding takes per 20 ms packet. The more calls compete for
+	 * the CPU, the longer it takes, so the mean over all encoders is a measure of host load.
+	 * Once per encoder_governor_window the governor steps complexity down when the mean is
+	 * above encoder_governor_high_load (share of the packet duration) and back up when it
+	 * stays below encoder_governor_low_load for encoder_governor_raise_delay. The secondary
+	 * (extra EC) encoder is only allowed at encoder_governor_secondary_complexity and above.
+	 * This way every call gets the same, highest quality the host can afford.
+	 */
+	class EncoderGovernor{
+	public:
+		/**
+		 * Encode time of one encoder. The encoder adds to it without taking any lock,
+		 * the governor sums up all registered encoders once per window.
+		 */
+		class Stats{
+		public:
+			// encoding packets 20 ms packets took ns nanoseconds
+			void Add(double ns, unsigned int packets){
+				time.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+				this->packets.fetch_add(packets, std::memory_order_relaxed);
+			}
+
+		private:
+			friend class EncoderGovernor;
+			std::atomic<uint64_t> time{0};
+			std::atomic<uint64_t> packets{0};
+			// part of the totals already counted in previous windows, only touched by the governor
+			uint64_t countedTime=0;
+			uint64_t countedPackets=0;
+		};
+
+		static EncoderGovernor* GetSharedInstance();
+		void Register(Stats* stats);
+		void Unregister(Stats* stats);
+		// called by encoders after each packet, cheap unless the current window is over
+		void Update();
+		// an encoder's input queue overflowed, it could not keep up at all
+		void ReportOverrun();
+		int GetComplexity(){
+			return complexity;
+		}
+		bool IsSecondaryEncoderAllowed(){
+			return secondaryAllowed;
+		}
+
+	private:
+		EncoderGovernor();
+		void CloseWindow(double time);
+		bool SetComplexity(int from, int to, double time, double load);
+
+		std::atomic<int> complexity;
+		std::atomic<bool> secondaryAllowed;
+		std::atomic<double> windowEnd{0};
+		std::atomic<double> windowLength{2.0};
+		std::atomic<double> lastChange{0};
+		// guards everything below
+		Mutex mutex;
+		std::vector<Stats*> encoders;
+		// what unregistered encoders did in the current window
+		uint64_t retiredTime=0;
+		uint64_t retiredPackets=0;
+		double lowLoadSince=0;
+	};
+}
+
+#endif //LIBTGVOIP_ENCODERGOVERNOR_H
@@ -52,6 +52,8 @@ JitterBuffer::~JitterBuffer(){
 
 void JitterBuffer::SetMinPacketCount(uint32_t count){
 	LOGI("jitter: set min packet count %u", count);
+	if(capture)
+		capture->RecordMinPacketCount(count);
 	minDelay=count;
 	minMinDelay=count;
 	//Reset();
@@ -71,13 +73,19 @@ size_t JitterBuffer::CallbackOut(unsigned char *data, size_t len, void *param){
 }
 
 void JitterBuffer::HandleInput(unsigned char *data, size_t len, uint32_t timestamp, bool isEC){
+	HandleInput(data, len, timestamp, isEC, VoIPController::GetCurrentTime());
+}
+
+void JitterBuffer::HandleInput(unsigned char *data, size_t len, uint32_t timestamp, bool isEC, double time){
 	MutexGuard m(mutex);
+	if(capture)
+		capture->RecordIncoming(data, len, timestamp, isEC, time);
 	jitter_packet_t pkt;
 	pkt.size=len;
 	pkt.buffer=data;
 	pkt.timestamp=timestamp;
 	pkt.isEC=isEC;
-	PutInternal(&pkt, !isEC);
+	PutInternal(&pkt, !isEC, time);
 	//LOGV("in, ts=%d, ec=%d", timestamp, isEC);
 
 }
@@ -105,11 +113,22 @@ void JitterBuffer::Reset(){
 }
 
 
+void JitterBuffer::SetStageTimers(StageTimers *timers){
+	stageTimers=timers;
+}
+
+void JitterBuffer::SetCapture(CallCapture *capture){
+	this->capture=capture;
+}
+
 size_t JitterBuffer::HandleOutput(unsigned char *buffer, size_t len, int offsetInSteps, bool advance, int& playbackScaledDuration, bool& isEC){
+	ScopedStageTimer timer(stageTimers, MEDIA_STAGE_JITTER);
 	jitter_packet_t pkt;
 	pkt.buffer=buffer;
 	pkt.size=len;
 	MutexGuard m(mutex);
+	if(capture)
+		capture->RecordJitterOutput(offsetInSteps, advance);
 	if(first){
 		first=false;
 		unsigned int delay=GetCurrentDelay();
@@ -220,7 +239,7 @@ int JitterBuffer::GetInternal(jitter_packet_t* pkt, int offset, bool advance){
 	return JR_BUFFERING;
 }
 
-void JitterBuffer::PutInternal(jitter_packet_t* pkt, bool overwriteExisting){
+void JitterBuffer::PutInternal(jitter_packet_t* pkt, bool overwriteExisting, double time){
 	if(pkt->size>JITTER_SLOT_SIZE){
 		LOGE("The packet is too big to fit into the jitter buffer");
 		return;
@@ -264,7 +283,6 @@ void JitterBuffer::PutInternal(jitter_packet_t* pkt, bool overwriteExisting){
 			prevTime=slots[i].recvTime;
 		}
 	}*/
-	double time=VoIPController::GetCurrentTime();
 	if(expectNextAtTime!=0){
 		double dev=expectNextAtTime-time;
 		//LOGV("packet dev %f", dev);
@@ -338,6 +356,8 @@ unsigned int JitterBuffer::GetCurrentDelay(){
 
 void JitterBuffer::Tick(){
 	MutexGuard m(mutex);
+	if(capture)
+		capture->RecordJitterTick();
 	int i;
 
 	lateHistory.Add(latePacketCount);
@@ -14,9 +14,16 @@
 #include "BlockingQueue.h"
 #include "Buffers.h"
 #include "threading.h"
+#include "StageTimers.h"
+#include "CallCapture.h"
 
 #define JITTER_SLOT_COUNT 64
+#ifdef TGVOIP_GATEWAY_PROFILE
+// audio-only calls, even 60 ms Opus packets at the highest bitrate the servers set stay under this
+#define JITTER_SLOT_SIZE 512
+#else
 #define JITTER_SLOT_SIZE 1024
+#endif
 #define JR_OK 1
 #define JR_MISSING 2
 #define JR_BUFFERING 3
@@ -28,11 +35,15 @@ public:
 	JitterBuffer(MediaStreamItf* out, uint32_t step);
 	~JitterBuffer();
 	void SetMinPacketCount(uint32_t count);
+	void SetStageTimers(StageTimers* timers);
+	void SetCapture(CallCapture* capture);
 	int GetMinPacketCount();
 	unsigned int GetCurrentDelay();
 	double GetAverageDelay();
 	void Reset();
 	void HandleInput(unsigned char* data, size_t len, uint32_t timestamp, bool isEC);
+	// same as above with an explicit receive time, used to replay captures
+	void HandleInput(unsigned char* data, size_t len, uint32_t timestamp, bool isEC, double time);
 	size_t HandleOutput(unsigned char* buffer, size_t len, int offsetInSteps, bool advance, int& playbackScaledDuration, bool& isEC);
 	void Tick();
 	void GetAverageLateCount(double* out);
@@ -41,6 +52,8 @@ public:
 	double GetLastMeasuredDelay();
 
 private:
+	StageTimers* stageTimers=NULL;
+	CallCapture* capture=NULL;
 	struct jitter_packet_t{
 		unsigned char* buffer=NULL;
 		size_t size;
@@ -50,7 +63,7 @@ private:
 	};
 	static size_t CallbackIn(unsigned char* data, size_t len, void* param);
 	static size_t CallbackOut(unsigned char* data, size_t len, void* param);
-	void PutInternal(jitter_packet_t* pkt, bool overwriteExisting);
+	void PutInternal(jitter_packet_t* pkt, bool overwriteExisting, double time);
 	int GetInternal(jitter_packet_t* pkt, int offset, bool advance);
 	void Advance();
 
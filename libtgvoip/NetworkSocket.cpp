@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <stdlib.h>
 #include <string.h>
+#include <map>
 #if defined(_WIN32)
 #include "os/windows/NetworkSocketWinsock.h"
 #include <winsock2.h>
@@ -20,6 +21,8 @@
 
 #define MIN_UDP_PORT 16384
 #define MAX_UDP_PORT 32768
+// a handful of proxy and relay names in practice, the limit only guards against unbounded growth
+#define MAX_DNS_CACHE_ENTRIES 64
 
 using namespace tgvoip;
 
@@ -59,11 +62,33 @@ NetworkSocket *NetworkSocket::Create(NetworkProtocol protocol){
 }
 
 IPv4Address *NetworkSocket::ResolveDomainName(std::string name){
+	// getaddrinfo doesn't tell the record TTL, so successful answers are kept for dns_cache_ttl.
+	// Failures are not cached, the next call retries them.
+	static Mutex cacheMutex;
+	static std::map<std::string, std::pair<uint32_t, double>> cache;
+	double ttl=ServerConfig::GetSharedInstance()->GetDouble("dns_cache_ttl", 300.0);
+	double now=VoIPController::GetCurrentTime();
+	if(ttl>0){
+		MutexGuard m(cacheMutex);
+		std::map<std::string, std::pair<uint32_t, double>>::iterator entry=cache.find(name);
+		if(entry!=cache.end()){
+			if(now-entry->second.second<ttl)
+				return new IPv4Address(entry->second.first);
+			cache.erase(entry);
+		}
+	}
 #ifndef _WIN32
-	return NetworkSocketPosix::ResolveDomainName(name);
+	IPv4Address* addr=NetworkSocketPosix::ResolveDomainName(name);
 #else
-	return NetworkSocketWinsock::ResolveDomainName(name);
+	IPv4Address* addr=NetworkSocketWinsock::ResolveDomainName(name);
 #endif
+	if(addr && ttl>0){
+		MutexGuard m(cacheMutex);
+		if(cache.size()>=MAX_DNS_CACHE_ENTRIES)
+			cache.clear();
+		cache[name]=std::make_pair(addr->GetAddress(), now);
+	}
+	return addr;
 }
 
 void NetworkSocket::GenerateTCPO2States(unsigned char* buffer, TCPO2State* recvState, TCPO2State* sendState){
@@ -228,11 +253,11 @@ const uint8_t *IPv6Address::GetAddress() const{
 	return address;
 }
 
-bool NetworkSocket::Select(std::vector<NetworkSocket *> &readFds, std::vector<NetworkSocket*> &writeFds, std::vector<NetworkSocket *> &errorFds, SocketSelectCanceller *canceller){
+bool NetworkSocket::Select(std::vector<NetworkSocket *> &readFds, std::vector<NetworkSocket*> &writeFds, std::vector<NetworkSocket *> &errorFds, SocketSelectCanceller *canceller, double timeout){
 #ifndef _WIN32
-	return NetworkSocketPosix::Select(readFds, writeFds, errorFds, canceller);
+	return NetworkSocketPosix::Select(readFds, writeFds, errorFds, canceller, timeout);
 #else
-	return NetworkSocketWinsock::Select(readFds, writeFds, errorFds, canceller);
+	return NetworkSocketWinsock::Select(readFds, writeFds, errorFds, canceller, timeout);
 #endif
 }
 
@@ -680,3 +705,11 @@ void NetworkSocketSOCKS5Proxy::SendConnectionCommand(){
 bool NetworkSocketSOCKS5Proxy::NeedSelectForSending(){
 	return state==ConnectionState::Initial || state==ConnectionState::Connected;
 }
+
+NetworkSocket* NetworkSocketSOCKS5Proxy::GetControlSocket(){
+	return tcp;
+}
+
+void NetworkSocketSOCKS5Proxy::SetUdpSocket(NetworkSocket* udp){
+	this->udp=udp;
+}
@@ -85,6 +85,13 @@ namespace tgvoip {
 		friend class NetworkSocketPosix;
 		friend class NetworkSocketWinsock;
 
+		// what the socket found out about IPv4 reachability and NAT64, see Get/SetAddressFamilyInfo
+		struct AddressFamilyInfo{
+			bool v4Available=false;
+			bool nat64Present=false;
+			unsigned char nat64Prefix[12]={0};
+		};
+
 		TGVOIP_DISALLOW_COPY_AND_ASSIGN(NetworkSocket);
 		NetworkSocket(NetworkProtocol protocol);
 		virtual ~NetworkSocket();
@@ -101,6 +108,9 @@ namespace tgvoip {
 		virtual NetworkAddress* GetConnectedAddress(){ return NULL; };
 		virtual uint16_t GetConnectedPort(){ return 0; };
 		virtual void SetTimeouts(int sendTimeout, int recvTimeout){};
+		virtual AddressFamilyInfo GetAddressFamilyInfo(){ return AddressFamilyInfo(); };
+		// used by the next Open() instead of waiting for IPv4 replies and looking up the NAT64 prefix
+		virtual void SetAddressFamilyInfo(const AddressFamilyInfo& info){};
 
 		virtual bool IsFailed();
 		virtual bool IsReadyToSend(){
@@ -113,8 +123,10 @@ namespace tgvoip {
 		};
 
 		static NetworkSocket* Create(NetworkProtocol protocol);
+		// answers are cached process-wide for dns_cache_ttl seconds, the caller owns the result
 		static IPv4Address* ResolveDomainName(std::string name);
-		static bool Select(std::vector<NetworkSocket*>& readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*>& errorFds, SocketSelectCanceller* canceller);
+		// timeout in seconds, 0 waits until a socket is ready or the select is canceled
+		static bool Select(std::vector<NetworkSocket*>& readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*>& errorFds, SocketSelectCanceller* canceller, double timeout=0);
 
 	protected:
 		virtual uint16_t GenerateLocalPort();
@@ -183,6 +195,9 @@ namespace tgvoip {
 		virtual bool OnReadyToReceive();
 		
 		bool NeedSelectForSending();
+		// UDP associations are requested for 0.0.0.0:0, so an established one can be handed to any local socket
+		void SetUdpSocket(NetworkSocket* udp);
+		NetworkSocket* GetControlSocket();
 
 	private:
 		void SendConnectionCommand();
@@ -19,6 +19,12 @@
 #include "VoIPController.h"
 
 #define PACKET_SIZE (960*2)
+// playback keeps at most two frames decoded ahead (see HandleCallback), plus one 60 ms frame being split
+#ifdef TGVOIP_GATEWAY_PROFILE
+#define DECODED_BUFFER_COUNT 8
+#else
+#define DECODED_BUFFER_COUNT 32
+#endif
 
 using namespace tgvoip;
 
@@ -40,9 +46,9 @@ tgvoip::OpusDecoder::OpusDecoder(MediaStreamItf* dst, bool isAsync, bool needEC)
 void tgvoip::OpusDecoder::Initialize(bool isAsync, bool needEC){
 	async=isAsync;
 	if(async){
-		decodedQueue=new BlockingQueue<unsigned char*>(33);
-		bufferPool=new BufferPool(PACKET_SIZE, 32);
-		semaphore=new Semaphore(32, 0);
+		decodedQueue=new BlockingQueue<unsigned char*>(DECODED_BUFFER_COUNT+1);
+		bufferPool=new BufferPool(PACKET_SIZE, DECODED_BUFFER_COUNT);
+		semaphore=new Semaphore(DECODED_BUFFER_COUNT, 0);
 	}else{
 		decodedQueue=NULL;
 		bufferPool=NULL;
@@ -214,6 +220,7 @@ int tgvoip::OpusDecoder::DecodeNextFrame(){
 		//if(len)
 		//	LOGV("Trying FEC...");
 	}
+	ScopedStageTimer timer(stageTimers, MEDIA_STAGE_DECODE);
 	int size;
 	if(len){
 		size=opus_decode(isEC ? ecDec : dec, buffer, len, (opus_int16 *) decodeBuffer, packetsPerFrame*960, fec ? 1 : 0);
@@ -257,6 +264,8 @@ int tgvoip::OpusDecoder::DecodeNextFrame(){
 	}else{
 		processedBuffer=decodeBuffer;
 	}
+	if(capture)
+		capture->RecordDecoded(playbackDuration, reinterpret_cast<int16_t*>(processedBuffer), size>0 ? (size_t)(playbackDuration/20*960) : 0);
 	return playbackDuration;
 }
 
@@ -279,6 +288,14 @@ void tgvoip::OpusDecoder::SetLevelMeter(AudioLevelMeter *levelMeter){
 	this->levelMeter=levelMeter;
 }
 
+void tgvoip::OpusDecoder::SetStageTimers(StageTimers *timers){
+	stageTimers=timers;
+}
+
+void tgvoip::OpusDecoder::SetCapture(CallCapture *capture){
+	this->capture=capture;
+}
+
 void tgvoip::OpusDecoder::AddAudioEffect(effects::AudioEffect *effect){
 	postProcEffects.push_back(effect);
 }
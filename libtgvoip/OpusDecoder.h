@@ -15,6 +15,8 @@
 #include "EchoCanceller.h"
 #include "JitterBuffer.h"
 #include "utils.h"
+#include "StageTimers.h"
+#include "CallCapture.h"
 #include <stdio.h>
 #include <vector>
 #include <memory>
@@ -22,6 +24,10 @@
 struct OpusDecoder;
 
 namespace tgvoip{
+namespace test{
+class CaptureReplay;
+}
+
 class OpusDecoder {
 public:
 	TGVOIP_DISALLOW_COPY_AND_ASSIGN(OpusDecoder);
@@ -39,10 +45,13 @@ public:
 	void SetJitterBuffer(std::shared_ptr<JitterBuffer> jitterBuffer);
 	void SetDTX(bool enable);
 	void SetLevelMeter(AudioLevelMeter* levelMeter);
+	void SetStageTimers(StageTimers* timers);
+	void SetCapture(CallCapture* capture);
 	void AddAudioEffect(effects::AudioEffect* effect);
 	void RemoveAudioEffect(effects::AudioEffect* effect);
 
 private:
+	friend class test::CaptureReplay; // drives DecodeNextFrame directly
 	void Initialize(bool isAsync, bool needEC);
 	static size_t Callback(unsigned char* data, size_t len, void* param);
 	void RunThread();
@@ -62,6 +71,8 @@ private:
 	EchoCanceller* echoCanceller;
 	std::shared_ptr<JitterBuffer> jitterBuffer;
 	AudioLevelMeter* levelMeter;
+	StageTimers* stageTimers=NULL;
+	CallCapture* capture=NULL;
 	int consecutiveLostPackets;
 	bool enableDTX;
 	size_t silentPacketCount;
@@ -9,6 +9,7 @@
 #include <algorithm>
 #include "logging.h"
 #include "VoIPServerConfig.h"
+#include "EncoderGovernor.h"
 #ifdef HAVE_CONFIG_H
 #include <opus/opus.h>
 #else
@@ -19,7 +20,9 @@ tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source, bool needSecondary):que
 	this->source=source;
 	source->SetCallback(tgvoip::OpusEncoder::Callback, this);
 	enc=opus_encoder_create(48000, 1, OPUS_APPLICATION_VOIP, NULL);
-	opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(10));
+	complexity=EncoderGovernor::GetSharedInstance()->GetComplexity();
+	EncoderGovernor::GetSharedInstance()->Register(&encodeStats);
+	opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(complexity));
 	opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(15));
 	opus_encoder_ctl(enc, OPUS_SET_INBAND_FEC(1));
 	opus_encoder_ctl(enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
@@ -28,7 +31,6 @@ tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source, bool needSecondary):que
 	currentBitrate=0;
 	running=false;
 	echoCanceller=NULL;
-	complexity=10;
 	frameDuration=20;
 	levelMeter=NULL;
 	mediumCorrectionBitrate=static_cast<uint32_t>(ServerConfig::GetSharedInstance()->GetInt("audio_medium_fec_bitrate", 10000));
@@ -40,7 +42,7 @@ tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source, bool needSecondary):que
 
 	if(needSecondary){
 		secondaryEncoder=opus_encoder_create(48000, 1, OPUS_APPLICATION_VOIP, NULL);
-		opus_encoder_ctl(secondaryEncoder, OPUS_SET_COMPLEXITY(10));
+		opus_encoder_ctl(secondaryEncoder, OPUS_SET_COMPLEXITY(complexity));
 		opus_encoder_ctl(secondaryEncoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
 		//opus_encoder_ctl(secondaryEncoder, OPUS_SET_VBR(0));
 		opus_encoder_ctl(secondaryEncoder, OPUS_SET_BITRATE(8000));
@@ -53,6 +55,7 @@ tgvoip::OpusEncoder::OpusEncoder(MediaStreamItf *source, bool needSecondary):que
 }
 
 tgvoip::OpusEncoder::~OpusEncoder(){
+	EncoderGovernor::GetSharedInstance()->Unregister(&encodeStats);
 	opus_encoder_destroy(enc);
 	if(secondaryEncoder)
 		opus_encoder_destroy(secondaryEncoder);
@@ -88,8 +91,17 @@ void tgvoip::OpusEncoder::Encode(int16_t* data, size_t len){
 		currentBitrate=requestedBitrate;
 		LOGV("opus_encoder: setting bitrate to %u", currentBitrate);
 	}
+	EncoderGovernor* governor=EncoderGovernor::GetSharedInstance();
+	int governorComplexity=governor->GetComplexity();
+	if(governorComplexity!=complexity){
+		complexity=governorComplexity;
+		opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(complexity));
+		if(secondaryEncoder)
+			opus_encoder_ctl(secondaryEncoder, OPUS_SET_COMPLEXITY(complexity));
+	}
 	if(levelMeter)
 		levelMeter->Update(data, len);
+	uint64_t encodeStart=ReadTimestampCounter();
 	int32_t r=opus_encode(enc, data, static_cast<int>(len), buffer, 4096);
 	if(r<=0){
 		LOGE("Error encoding: %d", r);
@@ -99,10 +111,12 @@ void tgvoip::OpusEncoder::Encode(int16_t* data, size_t len){
 		//LOGV("Packet size = %d", r);
 		int32_t secondaryLen=0;
 		unsigned char secondaryBuffer[128];
-		if(secondaryEncoderEnabled && secondaryEncoder){
+		if(secondaryEncoderEnabled && secondaryEncoder && governor->IsSecondaryEncoderAllowed()){
 			secondaryLen=opus_encode(secondaryEncoder, data, static_cast<int>(len), secondaryBuffer, sizeof(secondaryBuffer));
 			//LOGV("secondaryLen %d", secondaryLen);
 		}
+		encodeStats.Add(TimestampCounterToNanoseconds(ReadTimestampCounter()-encodeStart), static_cast<unsigned int>(len/960));
+		governor->Update();
 		InvokeCallback(buffer, (size_t)r, secondaryBuffer, (size_t)secondaryLen);
 	}
 }
@@ -116,15 +130,20 @@ size_t tgvoip::OpusEncoder::Callback(unsigned char *data, size_t len, void* para
 		e->queue.Put(buf);
 	}else{
 		LOGW("opus_encoder: no buffer slots left");
-		if(e->complexity>1){
-			e->complexity--;
-			opus_encoder_ctl(e->enc, OPUS_SET_COMPLEXITY(e->complexity));
-		}
+		e->overrunPackets++;
+		// complexity is changed on the encoder thread, for all calls at once
+		EncoderGovernor::GetSharedInstance()->ReportOverrun();
 	}
 	return 0;
 }
 
 
+void tgvoip::OpusEncoder::GetQueueStats(uint32_t& processed, uint32_t& backlog, uint32_t& overruns){
+	processed=processedPackets;
+	backlog=backlogPackets;
+	overruns=overrunPackets;
+}
+
 uint32_t tgvoip::OpusEncoder::GetBitrate(){
 	return requestedBitrate;
 }
@@ -147,6 +166,10 @@ void tgvoip::OpusEncoder::RunThread(){
 	while(running){
 		int16_t* packet=(int16_t*)queue.GetBlocking();
 		if(packet){
+			processedPackets++;
+			backlogPackets+=queue.Size();
+			// includes echo canceller and effects, they run in the same thread per packet
+			ScopedStageTimer timer(stageTimers, MEDIA_STAGE_ENCODE);
 			bool hasVoice=true;
 			if(echoCanceller)
 				echoCanceller->ProcessInput(packet, 960, hasVoice);
@@ -228,6 +251,10 @@ void tgvoip::OpusEncoder::SetLevelMeter(tgvoip::AudioLevelMeter *levelMeter){
 	this->levelMeter=levelMeter;
 }
 
+void tgvoip::OpusEncoder::SetStageTimers(StageTimers *timers){
+	stageTimers=timers;
+}
+
 void tgvoip::OpusEncoder::SetCallback(void (*f)(unsigned char *, size_t, unsigned char *, size_t, void *), void *param){
 	callback=f;
 	callbackParam=param;
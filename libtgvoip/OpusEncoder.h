@@ -14,8 +14,11 @@
 #include "Buffers.h"
 #include "EchoCanceller.h"
 #include "utils.h"
+#include "StageTimers.h"
+#include "EncoderGovernor.h"
 
 #include <stdint.h>
+#include <atomic>
 
 struct OpusEncoder;
 
@@ -35,6 +38,7 @@ public:
 	uint32_t GetBitrate();
 	void SetDTX(bool enable);
 	void SetLevelMeter(AudioLevelMeter* levelMeter);
+	void SetStageTimers(StageTimers* timers);
 	void SetCallback(void (*f)(unsigned char*, size_t, unsigned char*, size_t, void*), void* param);
 	void SetSecondaryEncoderEnabled(bool enabled);
 	void SetVadMode(bool vad);
@@ -43,6 +47,11 @@ public:
 	int GetComplexity(){
 		return complexity;
 	}
+	/**
+	 * Cumulative input queue counters: 20 ms packets encoded, packets found still waiting
+	 * behind each of them (summed), and packets dropped because the queue was full.
+	 */
+	void GetQueueStats(uint32_t& processed, uint32_t& backlog, uint32_t& overruns);
 
 private:
 	static size_t Callback(unsigned char* data, size_t len, void* param);
@@ -68,6 +77,11 @@ private:
 	double mediumCorrectionMultiplier;
 	double strongCorrectionMultiplier;
 	AudioLevelMeter* levelMeter;
+	StageTimers* stageTimers=NULL;
+	std::atomic<uint32_t> processedPackets{0};
+	std::atomic<uint32_t> backlogPackets{0};
+	std::atomic<uint32_t> overrunPackets{0};
+	EncoderGovernor::Stats encodeStats;
 	bool secondaryEncoderEnabled;
 	bool vadMode=false;
 	uint32_t vadNoVoiceBitrate;
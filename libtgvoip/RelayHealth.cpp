@@ -0,0 +1,126 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "RelayHealth.h"
+#include "VoIPController.h"
+#include "VoIPServerConfig.h"
+
+using namespace tgvoip;
+
+// reflectors of all recent calls fit easily, the limit only guards against unbounded growth
+#define MAX_RECORDS 256
+
+RelayHealth* RelayHealth::GetSharedInstance(){
+	static RelayHealth* sharedInstance=new RelayHealth();
+	return sharedInstance;
+}
+
+std::string RelayHealth::GetKey(const Endpoint& endpoint){
+	return endpoint.GetAddress().ToString()+":"+std::to_string(endpoint.port);
+}
+
+void RelayHealth::RequestSent(const Endpoint& endpoint, double time){
+	std::string key=GetKey(endpoint);
+	MutexGuard m(mutex);
+	if(records.size()>=MAX_RECORDS && records.find(key)==records.end()){
+		double ttl=ServerConfig::GetSharedInstance()->GetDouble("relay_health_ttl", 30.0);
+		for(std::map<std::string, Record>::iterator r=records.begin();r!=records.end();){
+			if(time-r->second.lastAnswer>ttl && time-r->second.lastClaim>ttl)
+				r=records.erase(r);
+			else
+				++r;
+		}
+		if(records.size()>=MAX_RECORDS)
+			return;
+	}
+	Record& r=records[key];
+	// halve the counters now and then so that loss follows recent behaviour
+	if(r.sent>=20){
+		r.sent/=2;
+		r.answered/=2;
+	}
+	r.sent++;
+}
+
+void RelayHealth::ResponseReceived(const Endpoint& endpoint, double rtt, double time){
+	std::string key=GetKey(endpoint);
+	MutexGuard m(mutex);
+	std::map<std::string, Record>::iterator r=records.find(key);
+	if(r==records.end())
+		return;
+	Record& record=r->second;
+	record.rtt=record.rtt==0 ? rtt : record.rtt*0.75+rtt*0.25;
+	if(record.answered<record.sent)
+		record.answered++;
+	record.lastAnswer=time;
+}
+
+bool RelayHealth::GetStats(const Endpoint& endpoint, double time, Stats& stats){
+	double ttl=ServerConfig::GetSharedInstance()->GetDouble("relay_health_ttl", 30.0);
+	std::string key=GetKey(endpoint);
+	MutexGuard m(mutex);
+	std::map<std::string, Record>::iterator r=records.find(key);
+	if(r==records.end() || r->second.lastAnswer==0 || time-r->second.lastAnswer>ttl)
+		return false;
+	Record& record=r->second;
+	stats.rtt=record.rtt;
+	// requests still in flight count as lost here, which is fine for ranking
+	stats.loss=record.sent>0 ? 1.0-record.answered/record.sent : 0;
+	stats.age=time-record.lastAnswer;
+	return true;
+}
+
+bool RelayHealth::ClaimRefresh(const Endpoint& endpoint, double time){
+	double interval=ServerConfig::GetSharedInstance()->GetDouble("relay_health_ttl", 30.0)/3;
+	std::string key=GetKey(endpoint);
+	MutexGuard m(mutex);
+	if(records.size()>=MAX_RECORDS && records.find(key)==records.end())
+		return true;
+	Record& record=records[key];
+	if(time-record.lastAnswer<interval || time-record.lastClaim<interval)
+		return false;
+	record.lastClaim=time;
+	return true;
+}
+
+json11::Json RelayHealth::GetPersistentState(double time){
+	double ttl=ServerConfig::GetSharedInstance()->GetDouble("relay_health_ttl", 30.0);
+	json11::Json::array relays;
+	MutexGuard m(mutex);
+	for(std::pair<const std::string, Record>& r:records){
+		if(r.second.lastAnswer==0 || time-r.second.lastAnswer>ttl)
+			continue;
+		relays.push_back(json11::Json::object{
+			{"addr", r.first},
+			{"rtt", r.second.rtt},
+			{"sent", r.second.sent},
+			{"answered", r.second.answered},
+			{"age", time-r.second.lastAnswer}
+		});
+	}
+	return relays;
+}
+
+void RelayHealth::SetPersistentState(const json11::Json& state, double time, double savedAgo){
+	double ttl=ServerConfig::GetSharedInstance()->GetDouble("relay_health_ttl", 30.0);
+	MutexGuard m(mutex);
+	for(const json11::Json& relay:state.array_items()){
+		std::string key=relay["addr"].string_value();
+		double lastAnswer=time-relay["age"].number_value()-savedAgo;
+		if(key.empty() || relay["rtt"].number_value()<=0 || time-lastAnswer>ttl)
+			continue;
+		std::map<std::string, Record>::iterator existing=records.find(key);
+		if(existing!=records.end() && existing->second.lastAnswer>=lastAnswer)
+			continue;
+		if(existing==records.end() && records.size()>=MAX_RECORDS)
+			continue;
+		Record& record=records[key];
+		record.rtt=relay["rtt"].number_value();
+		record.sent=relay["sent"].number_value();
+		record.answered=relay["answered"].number_value();
+		record.lastAnswer=lastAnswer;
+	}
+}
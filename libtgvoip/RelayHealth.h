@@ -0,0 +1,62 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_RELAYHEALTH_H
+#define LIBTGVOIP_RELAYHEALTH_H
+
+#include <map>
+#include <string>
+#include "threading.h"
+#include "json11.hpp"
+
+namespace tgvoip{
+
+	class Endpoint;
+
+	/**
+	 * Process-wide round trip time and loss of UDP reflectors, keyed by address and port.
+	 *
+	 * Samples come from reflector self-info requests, which the reflector answers itself,
+	 * so they measure only our side of the path and are valid for every call using the
+	 * reflector. Controllers use them to pick the relay to start with and to skip probing
+	 * relays that cannot become better than the current one.
+	 */
+	class RelayHealth{
+	public:
+		struct Stats{
+			double rtt; // seconds
+			double loss; // share of unanswered requests, 0..1
+			double age; // seconds since the last answer
+		};
+
+		static RelayHealth* GetSharedInstance();
+		void RequestSent(const Endpoint& endpoint, double time);
+		void ResponseReceived(const Endpoint& endpoint, double rtt, double time);
+		// false when nothing was heard from the relay within relay_health_ttl
+		bool GetStats(const Endpoint& endpoint, double time, Stats& stats);
+		// true for at most one caller per relay and ttl, that caller is expected to send a request
+		bool ClaimRefresh(const Endpoint& endpoint, double time);
+		// fresh entries for VoIPController persistent state, ages are kept relative so a restart doesn't skew them
+		json11::Json GetPersistentState(double time);
+		// savedAgo is how long ago the state was written, entries we already know better are kept
+		void SetPersistentState(const json11::Json& state, double time, double savedAgo);
+
+	private:
+		struct Record{
+			double rtt=0;
+			double sent=0;
+			double answered=0;
+			double lastAnswer=0;
+			double lastClaim=0;
+		};
+		static std::string GetKey(const Endpoint& endpoint);
+
+		std::map<std::string, Record> records;
+		Mutex mutex;
+	};
+}
+
+#endif //LIBTGVOIP_RELAYHEALTH_H
@@ -0,0 +1,168 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "ResourceUsage.h"
+#include <stdlib.h>
+#include <new>
+
+using namespace tgvoip;
+
+thread_local std::shared_ptr<ResourceUsage> ResourceUsage::current;
+thread_local ResourceUsage::ThreadRecord* ResourceUsage::currentRecord=NULL;
+
+ResourceUsage::Scope::Scope(std::shared_ptr<ResourceUsage> usage) : prev(current){
+	current=usage;
+}
+
+ResourceUsage::Scope::~Scope(){
+	current=prev;
+}
+
+std::shared_ptr<ResourceUsage> ResourceUsage::Current(){
+	return current;
+}
+
+void ResourceUsage::ThreadStarted(std::shared_ptr<ResourceUsage> usage, const char* name){
+	current=usage;
+	if(!usage)
+		return;
+	std::unique_ptr<ThreadRecord> record(new ThreadRecord());
+	record->name=name ? name : "";
+#if defined(__linux__)
+	if(pthread_getcpuclockid(pthread_self(), &record->clock)!=0)
+		record->clock=CLOCK_THREAD_CPUTIME_ID;
+#endif
+	ThreadRecord* r=record.get();
+	{
+		std::lock_guard<std::mutex> lock(usage->mutex);
+		usage->threads.push_back(std::move(record));
+	}
+	currentRecord=r;
+}
+
+void ResourceUsage::ThreadFinished(){
+	ThreadRecord* r=currentRecord;
+	currentRecord=NULL;
+	if(r){
+		uint64_t ns=0;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+		timespec ts;
+		if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)==0)
+			ns=(uint64_t)ts.tv_sec*1000000000ULL+(uint64_t)ts.tv_nsec;
+#endif
+		r->cpuTimeNs.store(ns);
+		r->running.store(false);
+	}
+	current.reset();
+}
+
+void ResourceUsage::RecordAllocation(size_t size){
+	ThreadRecord* r=currentRecord;
+	if(!r)
+		return;
+	// only the owning thread writes its counters, so plain load and store are enough
+	r->allocatedBytes.store(r->allocatedBytes.load(std::memory_order_relaxed)+size, std::memory_order_relaxed);
+	r->allocationCount.store(r->allocationCount.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+}
+
+uint64_t ResourceUsage::ReadCpuTime(ThreadRecord& record){
+#if defined(__linux__)
+	if(record.running.load()){
+		timespec ts;
+		if(clock_gettime(record.clock, &ts)==0)
+			return (uint64_t)ts.tv_sec*1000000000ULL+(uint64_t)ts.tv_nsec;
+	}
+#endif
+	return record.cpuTimeNs.load();
+}
+
+double ResourceUsage::GetCpuTime(){
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t ns=0;
+	for(std::unique_ptr<ThreadRecord>& r:threads)
+		ns+=ReadCpuTime(*r);
+	return ns/1e9;
+}
+
+uint64_t ResourceUsage::GetAllocatedBytes(){
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t bytes=0;
+	for(std::unique_ptr<ThreadRecord>& r:threads)
+		bytes+=r->allocatedBytes.load(std::memory_order_relaxed);
+	return bytes;
+}
+
+uint64_t ResourceUsage::GetAllocationCount(){
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t count=0;
+	for(std::unique_ptr<ThreadRecord>& r:threads)
+		count+=r->allocationCount.load(std::memory_order_relaxed);
+	return count;
+}
+
+unsigned int ResourceUsage::GetRunningThreadCount(){
+	std::lock_guard<std::mutex> lock(mutex);
+	unsigned int count=0;
+	for(std::unique_ptr<ThreadRecord>& r:threads){
+		if(r->running.load())
+			count++;
+	}
+	return count;
+}
+
+std::vector<ResourceUsage::ThreadStats> ResourceUsage::GetThreadStats(){
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<ThreadStats> stats;
+	for(std::unique_ptr<ThreadRecord>& r:threads){
+		stats.push_back(ThreadStats{
+				r->name,
+				ReadCpuTime(*r)/1e9,
+				r->allocatedBytes.load(std::memory_order_relaxed),
+				r->allocationCount.load(std::memory_order_relaxed),
+				r->running.load()
+		});
+	}
+	return stats;
+}
+
+#ifdef TGVOIP_ALLOCATION_ACCOUNTING
+void* operator new(size_t size){
+	ResourceUsage::RecordAllocation(size);
+	void* p=malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size){
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept{
+	ResourceUsage::RecordAllocation(size);
+	return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) noexcept{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept{
+	free(p);
+}
+#endif
@@ -0,0 +1,91 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_RESOURCEUSAGE_H
+#define LIBTGVOIP_RESOURCEUSAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+
+namespace tgvoip{
+
+	/**
+	 * CPU time and heap allocations of the threads working for one call.
+	 *
+	 * A thread is accounted to the ResourceUsage that was current on the thread that started it:
+	 * VoIPController makes its own usage current while starting its threads, and everything those
+	 * threads start in turn (encoder, decoder, echo canceller, audio feeders) inherits it.
+	 * CPU time of running threads is read from their CPU clocks on Linux, elsewhere it is only
+	 * known once the thread has exited. Allocations are counted only when the library is built
+	 * with TGVOIP_ALLOCATION_ACCOUNTING, which replaces the global operator new.
+	 */
+	class ResourceUsage{
+	public:
+		struct ThreadStats{
+			std::string name;
+			double cpuTime; // seconds
+			uint64_t allocatedBytes;
+			uint64_t allocationCount;
+			bool running;
+		};
+
+		/**
+		 * Makes usage current on this thread for as long as the scope lives,
+		 * threads started meanwhile are accounted to it.
+		 */
+		class Scope{
+		public:
+			Scope(std::shared_ptr<ResourceUsage> usage);
+			~Scope();
+			Scope(const Scope&)=delete;
+			Scope& operator=(const Scope&)=delete;
+		private:
+			std::shared_ptr<ResourceUsage> prev;
+		};
+
+		double GetCpuTime();
+		uint64_t GetAllocatedBytes();
+		uint64_t GetAllocationCount();
+		unsigned int GetRunningThreadCount();
+		std::vector<ThreadStats> GetThreadStats();
+
+		static std::shared_ptr<ResourceUsage> Current();
+		// called by Thread on the new thread around its entry point
+		static void ThreadStarted(std::shared_ptr<ResourceUsage> usage, const char* name);
+		static void ThreadFinished();
+		static void RecordAllocation(size_t size);
+
+	private:
+		struct ThreadRecord{
+			std::string name;
+#if defined(__linux__)
+			clockid_t clock;
+#endif
+			std::atomic<bool> running{true};
+			std::atomic<uint64_t> cpuTimeNs{0}; // valid once the thread has finished
+			std::atomic<uint64_t> allocatedBytes{0};
+			std::atomic<uint64_t> allocationCount{0};
+		};
+		static uint64_t ReadCpuTime(ThreadRecord& record);
+
+		static thread_local std::shared_ptr<ResourceUsage> current;
+		static thread_local ThreadRecord* currentRecord;
+
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadRecord>> threads;
+	};
+}
+
+#endif //LIBTGVOIP_RESOURCEUSAGE_H
@@ -0,0 +1,221 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#include "Socks5Pool.h"
+#include "NetworkSocket.h"
+#include "VoIPController.h"
+#include "VoIPServerConfig.h"
+#include "logging.h"
+#include <algorithm>
+
+using namespace tgvoip;
+
+Socks5Pool* Socks5Pool::GetSharedInstance(){
+	static Socks5Pool* sharedInstance=new Socks5Pool();
+	return sharedInstance;
+}
+
+Socks5Pool::Socks5Pool(){
+	placeholderUdp=NetworkSocket::Create(PROTO_UDP);
+	canceller=NULL;
+	idleCanceller=SocketSelectCanceller::Create();
+}
+
+void Socks5Pool::Configure(std::string address, uint16_t port, std::string username, std::string password, unsigned int size){
+	Thread* oldThread;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		oldThread=thread;
+		thread=NULL;
+		running=false;
+		if(canceller)
+			canceller->CancelSelect();
+		idleCanceller->CancelSelect();
+	}
+	if(oldThread){
+		oldThread->Join();
+		delete oldThread;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for(Session& s:sessions){
+		s.proxy->Close();
+		delete s.proxy;
+	}
+	sessions.clear();
+	// a cancel that came after the handshake finished would still be pending in the old canceller
+	delete canceller;
+	canceller=NULL;
+	this->address=address;
+	this->port=port;
+	this->username=username;
+	this->password=password;
+	this->size=size;
+	retryAfter=0;
+	if(size==0 || address.empty())
+		return;
+	canceller=SocketSelectCanceller::Create();
+	running=true;
+	thread=new Thread(std::bind(&Socks5Pool::Run, this));
+	thread->SetName("VoipSocks5Pool");
+	thread->Start();
+}
+
+NetworkSocketSOCKS5Proxy* Socks5Pool::Acquire(const std::string& address, uint16_t port, const std::string& username, const std::string& password, NetworkSocket* udp){
+	NetworkSocketSOCKS5Proxy* proxy=NULL;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!running || address!=this->address || port!=this->port || username!=this->username || password!=this->password)
+			return NULL;
+		DropExpired(VoIPController::GetCurrentTime());
+		if(sessions.empty())
+			return NULL;
+		proxy=sessions.front().proxy;
+		sessions.erase(sessions.begin());
+		// the thread stops watching it and starts a replacement
+		idleCanceller->CancelSelect();
+	}
+	proxy->SetUdpSocket(udp);
+	return proxy;
+}
+
+void Socks5Pool::DropExpired(double time){
+	double maxAge=ServerConfig::GetSharedInstance()->GetDouble("socks5_pool_max_age", 60.0);
+	for(std::vector<Session>::iterator s=sessions.begin();s!=sessions.end();){
+		if(time-s->created>maxAge || s->proxy->IsFailed()){
+			s->proxy->Close();
+			delete s->proxy;
+			s=sessions.erase(s);
+		}else{
+			++s;
+		}
+	}
+}
+
+void Socks5Pool::Run(){
+	LOGI("SOCKS5 pool thread starting");
+	std::unique_lock<std::mutex> lock(mutex);
+	while(running){
+		double time=VoIPController::GetCurrentTime();
+		DropExpired(time);
+		if(sessions.size()<size && time>=retryAfter){
+			lock.unlock();
+			NetworkSocketSOCKS5Proxy* proxy=Connect();
+			lock.lock();
+			if(proxy && running){
+				sessions.push_back(Session{proxy, VoIPController::GetCurrentTime()});
+			}else if(proxy){
+				proxy->Close();
+				delete proxy;
+			}else if(running){
+				retryAfter=VoIPController::GetCurrentTime()+ServerConfig::GetSharedInstance()->GetDouble("socks5_pool_retry_interval", 30.0);
+			}
+			continue;
+		}
+		// proxies close idle control connections, and with them the association, so watch
+		// them rather than find out in Acquire; wakes up at least once a second for the timers
+		std::vector<NetworkSocket*> readSockets;
+		std::vector<NetworkSocket*> writeSockets;
+		std::vector<NetworkSocket*> errorSockets;
+		for(Session& s:sessions){
+			readSockets.push_back(s.proxy->GetControlSocket());
+			errorSockets.push_back(s.proxy->GetControlSocket());
+		}
+		lock.unlock();
+		if(!NetworkSocket::Select(readSockets, writeSockets, errorSockets, idleCanceller, 1.0)){
+			readSockets.clear();
+			errorSockets.clear();
+		}
+		lock.lock();
+		DropClosed(readSockets, errorSockets);
+	}
+	LOGI("SOCKS5 pool thread exiting");
+}
+
+void Socks5Pool::DropClosed(std::vector<NetworkSocket*>& readable, std::vector<NetworkSocket*>& failed){
+	for(std::vector<Session>::iterator s=sessions.begin();s!=sessions.end();){
+		// sessions taken by Acquire during the select are gone from the list and left alone
+		NetworkSocket* tcp=s->proxy->GetControlSocket();
+		bool closed=std::find(failed.begin(), failed.end(), tcp)!=failed.end();
+		if(!closed && std::find(readable.begin(), readable.end(), tcp)!=readable.end()){
+			// nothing is expected on an associated control connection, readable means EOF or garbage
+			unsigned char buf[256];
+			tcp->Receive(buf, sizeof(buf));
+			closed=tcp->IsFailed();
+		}
+		if(closed){
+			LOGI("SOCKS5 pool: proxy closed an idle UDP association");
+			s->proxy->Close();
+			delete s->proxy;
+			s=sessions.erase(s);
+		}else{
+			++s;
+		}
+	}
+}
+
+NetworkSocketSOCKS5Proxy* Socks5Pool::Connect(){
+	std::string address, username, password;
+	uint16_t port;
+	SocketSelectCanceller* canceller;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		address=this->address;
+		port=this->port;
+		username=this->username;
+		password=this->password;
+		canceller=this->canceller;
+	}
+
+	IPv4Address* resolved=NetworkSocket::ResolveDomainName(address);
+	if(!resolved){
+		LOGW("SOCKS5 pool: error resolving proxy address %s", address.c_str());
+		return NULL;
+	}
+	NetworkSocket* tcp=NetworkSocket::Create(PROTO_TCP);
+	tcp->Connect(resolved, port);
+	delete resolved;
+
+	std::vector<NetworkSocket*> writeSockets;
+	std::vector<NetworkSocket*> readSockets;
+	std::vector<NetworkSocket*> errorSockets;
+
+	while(!tcp->IsFailed() && !tcp->IsReadyToSend()){
+		writeSockets.push_back(tcp);
+		if(!NetworkSocket::Select(readSockets, writeSockets, errorSockets, canceller)){
+			delete tcp;
+			return NULL;
+		}
+	}
+	if(tcp->IsFailed()){
+		LOGW("SOCKS5 pool: error connecting to proxy %s:%u", address.c_str(), port);
+		delete tcp;
+		return NULL;
+	}
+	NetworkSocketSOCKS5Proxy* proxy=new NetworkSocketSOCKS5Proxy(tcp, placeholderUdp, username, password);
+	proxy->OnReadyToSend();
+	writeSockets.clear();
+	while(!proxy->IsFailed() && !proxy->IsReadyToSend()){
+		readSockets.clear();
+		errorSockets.clear();
+		readSockets.push_back(tcp);
+		errorSockets.push_back(tcp);
+		if(!NetworkSocket::Select(readSockets, writeSockets, errorSockets, canceller)){
+			delete proxy;
+			return NULL;
+		}
+		if(!readSockets.empty())
+			proxy->OnReadyToReceive();
+	}
+	if(proxy->IsFailed()){
+		LOGW("SOCKS5 pool: proxy %s:%u refused UDP association", address.c_str(), port);
+		proxy->Close();
+		delete proxy;
+		return NULL;
+	}
+	LOGV("SOCKS5 pool: UDP association with %s:%u ready", address.c_str(), port);
+	return proxy;
+}
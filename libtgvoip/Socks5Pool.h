@@ -0,0 +1,75 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+#ifndef LIBTGVOIP_SOCKS5POOL_H
+#define LIBTGVOIP_SOCKS5POOL_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "threading.h"
+
+namespace tgvoip{
+
+	class NetworkSocket;
+	class NetworkSocketSOCKS5Proxy;
+	class SocketSelectCanceller;
+
+	/**
+	 * Process-wide set of SOCKS5 UDP associations made ahead of time with one proxy.
+	 *
+	 * A background thread keeps the configured number of control connections connected,
+	 * authenticated and past UDP ASSOCIATE, so a call in proxy mode starts relaying right
+	 * away instead of spending several round trips to the proxy. Associations older than
+	 * socks5_pool_max_age are replaced, because proxies and middleboxes drop idle TCP
+	 * connections silently; ones the proxy closes are dropped as soon as the thread sees
+	 * the control connection end. When the proxy refuses UDP the pool backs off for
+	 * socks5_pool_retry_interval and calls do their own handshake, which detects it.
+	 */
+	class Socks5Pool{
+	public:
+		static Socks5Pool* GetSharedInstance();
+		// size 0 stops the pool and closes the associations it holds
+		void Configure(std::string address, uint16_t port, std::string username, std::string password, unsigned int size);
+		/**
+		 * Ready association with the given proxy, or NULL if there is none.
+		 * Packets will be relayed through udp, the caller owns the returned socket.
+		 */
+		NetworkSocketSOCKS5Proxy* Acquire(const std::string& address, uint16_t port, const std::string& username, const std::string& password, NetworkSocket* udp);
+
+	private:
+		struct Session{
+			NetworkSocketSOCKS5Proxy* proxy;
+			double created;
+		};
+		Socks5Pool();
+		void Run();
+		// blocking handshake on the pool thread, NULL on failure or when stopped
+		NetworkSocketSOCKS5Proxy* Connect();
+		void DropExpired(double time);
+		// drops sessions whose control connection got EOF or an error while idle
+		void DropClosed(std::vector<NetworkSocket*>& readable, std::vector<NetworkSocket*>& failed);
+
+		std::string address;
+		uint16_t port=0;
+		std::string username;
+		std::string password;
+		unsigned int size=0;
+		double retryAfter=0;
+		std::vector<Session> sessions;
+		// associations are made before anyone needs them, this stands in for the caller's socket until Acquire
+		NetworkSocket* placeholderUdp;
+		SocketSelectCanceller* canceller;
+		// wakes the thread from watching idle sessions, kept apart so that it never aborts a handshake
+		SocketSelectCanceller* idleCanceller;
+		Thread* thread=NULL;
+		bool running=false;
+		std::mutex mutex;
+	};
+}
+
+#endif //LIBTGVOIP_SOCKS5POOL_H
@@ -0,0 +1,186 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+
+#include "StageTimers.h"
+#include <string.h>
+
+using namespace tgvoip;
+
+namespace{
+	// Reference point for TSC frequency estimation. The longer the process runs,
+	// the more precise the estimate gets, so nothing has to be calibrated upfront.
+	struct CounterReference{
+		uint64_t ticks;
+		std::chrono::steady_clock::time_point time;
+		CounterReference() : ticks(ReadTimestampCounter()), time(std::chrono::steady_clock::now()){
+		}
+	};
+	const CounterReference counterReference;
+}
+
+double tgvoip::TimestampCounterToNanoseconds(uint64_t ticks){
+#ifdef TGVOIP_HAS_RDTSC
+	uint64_t elapsedTicks=ReadTimestampCounter()-counterReference.ticks;
+	double elapsedNs=(double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-counterReference.time).count();
+	if(elapsedTicks==0 || elapsedNs<=0)
+		return 0;
+	return (double)ticks*elapsedNs/(double)elapsedTicks;
+#else
+	return (double)ticks;
+#endif
+}
+
+HdrHistogram::HdrHistogram(){
+	Reset();
+}
+
+size_t HdrHistogram::IndexOf(uint64_t value){
+	if(value<SUB_BUCKETS)
+		return (size_t)value;
+#if defined(__GNUC__)
+	int msb=63-__builtin_clzll(value);
+#else
+	int msb=0;
+	for(uint64_t v=value;v>1;v>>=1)
+		msb++;
+#endif
+	int shift=msb-SUB_BUCKET_BITS+1;
+	if(shift>MAX_SHIFT)
+		return BUCKET_COUNT-1;
+	// top SUB_BUCKET_BITS bits below the leading one select the sub-bucket
+	size_t sub=(size_t)((value >> (shift-1)) & (SUB_BUCKETS-1));
+	return (size_t)shift*SUB_BUCKETS+sub;
+}
+
+uint64_t HdrHistogram::ValueAt(size_t index){
+	if(index<SUB_BUCKETS)
+		return index;
+	uint64_t shift=index/SUB_BUCKETS;
+	uint64_t sub=index%SUB_BUCKETS;
+	// middle of the bucket
+	return ((SUB_BUCKETS+sub) << (shift-1))+((1ULL << (shift-1)) >> 1);
+}
+
+void HdrHistogram::Record(uint64_t value){
+	buckets[IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+	uint64_t prevMax=max.load(std::memory_order_relaxed);
+	while(value>prevMax && !max.compare_exchange_weak(prevMax, value, std::memory_order_relaxed)){
+	}
+}
+
+void HdrHistogram::Add(const HdrHistogram &other){
+	for(int i=0;i<BUCKET_COUNT;i++){
+		uint64_t c=other.buckets[i].load(std::memory_order_relaxed);
+		if(c)
+			buckets[i].fetch_add(c, std::memory_order_relaxed);
+	}
+	count.fetch_add(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	uint64_t otherMax=other.max.load(std::memory_order_relaxed);
+	uint64_t prevMax=max.load(std::memory_order_relaxed);
+	while(otherMax>prevMax && !max.compare_exchange_weak(prevMax, otherMax, std::memory_order_relaxed)){
+	}
+}
+
+void HdrHistogram::Reset(){
+	for(int i=0;i<BUCKET_COUNT;i++)
+		buckets[i].store(0, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t HdrHistogram::GetCount() const{
+	return count.load(std::memory_order_relaxed);
+}
+
+uint64_t HdrHistogram::GetMax() const{
+	return max.load(std::memory_order_relaxed);
+}
+
+double HdrHistogram::GetMean() const{
+	uint64_t c=GetCount();
+	return c ? (double)sum.load(std::memory_order_relaxed)/(double)c : 0.0;
+}
+
+uint64_t HdrHistogram::GetValueAtPercentile(double percentile) const{
+	uint64_t total=GetCount();
+	if(!total)
+		return 0;
+	uint64_t target=(uint64_t)(percentile/100.0*(double)total+0.5);
+	if(target<1)
+		target=1;
+	uint64_t seen=0;
+	for(int i=0;i<BUCKET_COUNT;i++){
+		seen+=buckets[i].load(std::memory_order_relaxed);
+		if(seen>=target){
+			uint64_t value=ValueAt((size_t)i);
+			uint64_t maxValue=GetMax();
+			return value<maxValue ? value : maxValue;
+		}
+	}
+	return GetMax();
+}
+
+StageTimers::StageTimers(bool keepOwn){
+	if(keepOwn)
+		stages.reset(new HdrHistogram[MEDIA_STAGE_COUNT]);
+}
+
+void StageTimers::Record(int stage, uint64_t ticks){
+	if(stages)
+		stages[stage].Record(ticks);
+	if(this!=&Aggregated())
+		Aggregated().stages[stage].Record(ticks);
+}
+
+void StageTimers::GetStats(Stats *stats) const{
+	for(int i=0;i<MEDIA_STAGE_COUNT;i++){
+		Stats& s=stats[i];
+		s.stage=GetStageName(i);
+		if(!stages){
+			s.count=0;
+			s.mean=s.p50=s.p90=s.p99=s.max=0;
+			continue;
+		}
+		const HdrHistogram& h=stages[i];
+		s.count=h.GetCount();
+		s.mean=TimestampCounterToNanoseconds((uint64_t)h.GetMean())/1000.0;
+		s.p50=TimestampCounterToNanoseconds(h.GetValueAtPercentile(50))/1000.0;
+		s.p90=TimestampCounterToNanoseconds(h.GetValueAtPercentile(90))/1000.0;
+		s.p99=TimestampCounterToNanoseconds(h.GetValueAtPercentile(99))/1000.0;
+		s.max=TimestampCounterToNanoseconds(h.GetMax())/1000.0;
+	}
+}
+
+StageTimers& StageTimers::Aggregated(){
+	static StageTimers aggregated(true);
+	return aggregated;
+}
+
+const char* StageTimers::GetStageName(int stage){
+	switch(stage){
+		case MEDIA_STAGE_CAPTURE:
+			return "capture";
+		case MEDIA_STAGE_ENCODE:
+			return "encode";
+		case MEDIA_STAGE_SEND:
+			return "send";
+		case MEDIA_STAGE_RECEIVE:
+			return "receive";
+		case MEDIA_STAGE_JITTER:
+			return "jitter";
+		case MEDIA_STAGE_DECODE:
+			return "decode";
+		case MEDIA_STAGE_PLAYOUT:
+			return "playout";
+		default:
+			return "unknown";
+	}
+}
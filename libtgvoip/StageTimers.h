@@ -0,0 +1,126 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+
+#ifndef LIBTGVOIP_STAGETIMERS_H
+#define LIBTGVOIP_STAGETIMERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TGVOIP_HAS_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TGVOIP_HAS_RDTSC 1
+#endif
+
+namespace tgvoip{
+
+	enum{
+		MEDIA_STAGE_CAPTURE=0,
+		MEDIA_STAGE_ENCODE,
+		MEDIA_STAGE_SEND,
+		MEDIA_STAGE_RECEIVE,
+		MEDIA_STAGE_JITTER,
+		MEDIA_STAGE_DECODE,
+		MEDIA_STAGE_PLAYOUT,
+
+		MEDIA_STAGE_COUNT
+	};
+
+	/**
+	 * Raw timestamp counter: TSC on x86, nanoseconds of steady clock elsewhere.
+	 * Only differences are meaningful, see TimestampCounterToNanoseconds.
+	 */
+	inline uint64_t ReadTimestampCounter(){
+#ifdef TGVOIP_HAS_RDTSC
+		return __rdtsc();
+#else
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	double TimestampCounterToNanoseconds(uint64_t ticks);
+
+	/**
+	 * Log-linear histogram in the spirit of HdrHistogram: 16 linear sub-buckets per power of two,
+	 * so any recorded value is reported within ~6% of its true value. Recording is lock-free.
+	 */
+	class HdrHistogram{
+	public:
+		HdrHistogram();
+		void Record(uint64_t value);
+		void Add(const HdrHistogram& other);
+		void Reset();
+		uint64_t GetCount() const;
+		uint64_t GetMax() const;
+		double GetMean() const;
+		uint64_t GetValueAtPercentile(double percentile) const;
+
+		static constexpr int SUB_BUCKET_BITS=4;
+		static constexpr int SUB_BUCKETS=1 << SUB_BUCKET_BITS;
+		static constexpr int MAX_SHIFT=40;
+		static constexpr int BUCKET_COUNT=(MAX_SHIFT+1)*SUB_BUCKETS;
+	private:
+		static size_t IndexOf(uint64_t value);
+		static uint64_t ValueAt(size_t index);
+
+		std::atomic<uint64_t> buckets[BUCKET_COUNT];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> max;
+	};
+
+	/**
+	 * Processing time of each media path stage, in timestamp counter ticks.
+	 * Every recorded value goes to the process-wide aggregate. Histograms of the instance itself
+	 * take ~36 KB, so they are only kept when asked for (stage_timers_per_call for calls).
+	 */
+	class StageTimers{
+	public:
+		struct Stats{
+			const char* stage;
+			uint64_t count;
+			// microseconds
+			double mean;
+			double p50;
+			double p90;
+			double p99;
+			double max;
+		};
+
+		explicit StageTimers(bool keepOwn=false);
+		void Record(int stage, uint64_t ticks);
+		// counts are all zero unless own histograms are kept
+		void GetStats(Stats* stats) const;
+		static StageTimers& Aggregated();
+		static const char* GetStageName(int stage);
+	private:
+		std::unique_ptr<HdrHistogram[]> stages;
+	};
+
+	class ScopedStageTimer{
+	public:
+		ScopedStageTimer(StageTimers* timers, int stage) : timers(timers), stage(stage), start(timers ? ReadTimestampCounter() : 0){
+		}
+		~ScopedStageTimer(){
+			if(timers)
+				timers->Record(stage, ReadTimestampCounter()-start);
+		}
+		ScopedStageTimer(const ScopedStageTimer&)=delete;
+		ScopedStageTimer& operator=(const ScopedStageTimer&)=delete;
+	private:
+		StageTimers* timers;
+		int stage;
+		uint64_t start;
+	};
+}
+
+#endif //LIBTGVOIP_STAGETIMERS_H
@@ -18,6 +18,8 @@
 #include "OpusEncoder.h"
 #include "OpusDecoder.h"
 #include "VoIPServerConfig.h"
+#include "RelayHealth.h"
+#include "Socks5Pool.h"
 #include "PrivateDefines.h"
 #include "json11.hpp"
 #include <assert.h>
@@ -139,14 +141,17 @@ extern std::shared_ptr<spdlog::logger> _voip_logger;
 
 #pragma mark - Public API
 
-VoIPController::VoIPController() : activeNetItfName(""),
+VoIPController::VoIPController() : stageTimers(ServerConfig::GetSharedInstance()->GetBoolean("stage_timers_per_call", false)),
+								   activeNetItfName(""),
 								   currentAudioInput("default"),
 								   currentAudioOutput("default"),
 								   proxyAddress(""),
 								   proxyUsername(""),
 								   proxyPassword(""){
 #ifdef TGVOIP_USE_SPDLOG
-    _voip_logger = spdlog::get("tgvoip");
+    // set once, log calls read it from every thread without locking
+    if (!_voip_logger)
+        _voip_logger = spdlog::get("tgvoip");
 #endif
     seq=1;
 	lastRemoteSeq=0;
@@ -252,7 +257,15 @@ VoIPController::VoIPController() : activeNetItfName(""),
 	stm->frameDuration=60;
 	outgoingStreams.push_back(stm);
 
-	#if defined(TGVOIP_USE_SOFTWARE_AUDIO)
+#if defined(TGVOIP_USE_SOFTWARE_AUDIO)
+    softwareMediaInput = nullptr;
+    softwareMediaOutput = nullptr;
+    CreateSoftwareAudio(true, 48000);
+#endif
+}
+
+#if defined(TGVOIP_USE_SOFTWARE_AUDIO)
+void VoIPController::CreateSoftwareAudio(bool registerPorts, unsigned int clockRate) {
     pj_thread_t *tmp_thread = nullptr;
     pj_thread_desc tmp_thread_desc;
     if (!pj_thread_is_registered()) {
@@ -264,14 +277,20 @@ VoIPController::VoIPController() : activeNetItfName(""),
         }
     }
 
-    softwareMediaInput = new tgvoip::audio::SoftwareAudioInput();
-    softwareMediaOutput = new tgvoip::audio::SoftwareAudioOutput();
+    delete softwareMediaInput;
+    delete softwareMediaOutput;
+    softwareMediaInput = new tgvoip::audio::SoftwareAudioInput(registerPorts, clockRate);
+    softwareMediaOutput = new tgvoip::audio::SoftwareAudioOutput(registerPorts, clockRate);
+    softwareMediaInput->SetStageTimers(&stageTimers);
+    softwareMediaOutput->SetStageTimers(&stageTimers);
+    audioPortsRegistered = registerPorts;
+    audioPortClockRate = clockRate;
 
     if (tmp_thread) {
         pj_thread_destroy(tmp_thread);
     }
-#endif
 }
+#endif
 
 VoIPController::~VoIPController(){
 	LOGD("Entered VoIPController::~VoIPController");
@@ -316,6 +335,10 @@ VoIPController::~VoIPController(){
 	}
 #if defined(TGVOIP_USE_SOFTWARE_AUDIO)
     delete softwareMediaInput;
+    if(softwareMediaOutput){
+        LOGI("Audio output: %llu underruns, %llu overruns, ring delay %.1f ms, port clock drift %.0f ppm", (unsigned long long)softwareMediaOutput->GetUnderrunCount(),
+             (unsigned long long)softwareMediaOutput->GetOverrunCount(), softwareMediaOutput->GetRingDelay(), softwareMediaOutput->GetClockDrift());
+    }
     delete softwareMediaOutput;
 
     if(tmp_thread) {
@@ -324,12 +347,16 @@ VoIPController::~VoIPController(){
 #endif
 	LOGD("before delete echo canceller");
 	if(echoCanceller){
+		LOGI("Echo canceller skipped %llu of %llu capture frames as silence (%.1f%%)", (unsigned long long)echoCanceller->GetSkippedFrameCount(),
+			 (unsigned long long)(echoCanceller->GetSkippedFrameCount()+echoCanceller->GetProcessedFrameCount()), echoCanceller->GetSkippedFrameRatio()*100.0);
 		echoCanceller->Stop();
 		delete echoCanceller;
 	}
 	delete conctl;
 	if(statsDump)
 		fclose(statsDump);
+	if(capture)
+		delete capture;
 	if(resolvedProxyAddress)
 		delete resolvedProxyAddress;
 	delete selectCanceller;
@@ -407,6 +434,7 @@ void VoIPController::SetRemoteEndpoints(vector<Endpoint> endpoints, bool allowP2
 		}
 	}
 	preferredRelay=currentEndpoint;
+	SelectInitialRelay();
 	this->allowP2p=allowP2p;
 	this->connectionMaxLayer=connectionMaxLayer;
 	if(connectionMaxLayer>=74){
@@ -425,6 +453,8 @@ void VoIPController::Start(){
 
 	//SendPacket(NULL, 0, currentEndpoint);
 
+	// threads of the call are started here, in Connect() or by the threads started there
+	ResourceUsage::Scope usageScope(resourceUsage);
 	runReceiver=true;
 	recvThread=new Thread(bind(&VoIPController::RunRecvThread, this));
 	recvThread->SetName("VoipRecv");
@@ -444,6 +474,7 @@ void VoIPController::Connect(){
 
 	//InitializeTimers();
 	//SendInit();
+	ResourceUsage::Scope usageScope(resourceUsage);
 	sendThread=new Thread(bind(&VoIPController::RunSendThread, this));
 	sendThread->SetName("VoipSend");
 	sendThread->Start();
@@ -637,6 +668,17 @@ string VoIPController::GetDebugString(){
 		snprintf(buffer, sizeof(buffer), "ShittyInternetMode: level %d\n", extraEcLevel);
 		r+=buffer;
 	}
+	if(echoCanceller){
+		snprintf(buffer, sizeof(buffer), "APM skipped frames: %.1f%%\n", echoCanceller->GetSkippedFrameRatio()*100.0);
+		r+=buffer;
+	}
+#if defined(TGVOIP_USE_SOFTWARE_AUDIO)
+	if(softwareMediaOutput){
+		snprintf(buffer, sizeof(buffer), "Audio output underruns: %llu, overruns: %llu, ring delay: %.1f ms, port clock drift: %.0f ppm\n", (unsigned long long)softwareMediaOutput->GetUnderrunCount(),
+				 (unsigned long long)softwareMediaOutput->GetOverrunCount(), softwareMediaOutput->GetRingDelay(), softwareMediaOutput->GetClockDrift());
+		r+=buffer;
+	}
+#endif
 	double avgLate[3];
 	shared_ptr<Stream> stm=GetStreamByType(STREAM_TYPE_AUDIO, false);
 	shared_ptr<JitterBuffer> jitterBuffer;
@@ -696,6 +738,40 @@ void VoIPController::GetStats(TrafficStats *stats){
 	memcpy(stats, &this->stats, sizeof(TrafficStats));
 }
 
+void VoIPController::GetStats(ResourceStats *stats){
+	stats->cpuTime=resourceUsage->GetCpuTime();
+	stats->allocatedBytes=resourceUsage->GetAllocatedBytes();
+	stats->allocationCount=resourceUsage->GetAllocationCount();
+	stats->threadCount=resourceUsage->GetRunningThreadCount();
+}
+
+vector<ResourceUsage::ThreadStats> VoIPController::GetThreadResourceStats(){
+	return resourceUsage->GetThreadStats();
+}
+
+void VoIPController::GetStageTimerStats(StageTimers::Stats *stats){
+	stageTimers.GetStats(stats);
+}
+
+void VoIPController::GetAggregatedStageTimerStats(StageTimers::Stats *stats){
+	StageTimers::Aggregated().GetStats(stats);
+}
+
+void VoIPController::GetMediaStats(MediaStats *stats){
+	stats->rtt=GetAverageRTT();
+	shared_ptr<Stream> stm=GetStreamByType(STREAM_TYPE_AUDIO, false);
+	stats->jitter=stm && stm->jitterBuffer ? stm->jitterBuffer->GetLastMeasuredJitter() : 0.0;
+	stats->packetsSent=seq;
+	stats->packetsRecvd=packetsReceived;
+	stats->sendLossCount=conctl->GetSendLossCount();
+	stats->recvLossCount=recvLossCount;
+	if(encoder){
+		encoder->GetQueueStats(stats->encoderPackets, stats->encoderBacklog, stats->encoderOverruns);
+	}else{
+		stats->encoderPackets=stats->encoderBacklog=stats->encoderOverruns=0;
+	}
+}
+
 string VoIPController::GetDebugLog(){
 	map<string, json11::Json> network{
 			{"type", NetworkTypeToString(networkType)}
@@ -780,7 +856,8 @@ string VoIPController::GetDebugLog(){
 					{"lost_in", (int)recvLossCount}
 			}},
 			{"problems", problems},
-			{"pref_relay", prefRelay.str()}
+			{"pref_relay", prefRelay.str()},
+			{"apm_skipped_ratio", echoCanceller ? echoCanceller->GetSkippedFrameRatio() : 0.0}
 	}).dump();
 }
 
@@ -896,6 +973,10 @@ int VoIPController::GetConnectionState(){
 	return state;
 }
 
+bool VoIPController::WasEstablished(){
+	return wasEstablished;
+}
+
 void VoIPController::SetConfig(const Config& cfg){
 	config=cfg;
 	if(tgvoipLogFile){
@@ -933,6 +1014,31 @@ void VoIPController::SetConfig(const Config& cfg){
 	}else{
 		statsDump=NULL;
 	}
+	// the jitter buffer and decoder keep a pointer to the capture, so it's never replaced once open
+	if(!capture && !config.captureFilePath.empty()){
+		FILE* captureFile;
+#ifndef _WIN32
+		captureFile=fopen(config.captureFilePath.c_str(), "wb");
+#else
+		if(_wfopen_s(&captureFile, config.captureFilePath.c_str(), L"wb")!=0){
+			captureFile=NULL;
+		}
+#endif
+		if(captureFile)
+			capture=new CallCapture(captureFile);
+		else
+			LOGW("Failed to open capture file for writing");
+	}
+#if defined(TGVOIP_USE_SOFTWARE_AUDIO)
+	unsigned int clockRate=config.softwareAudioClockRate;
+	if(clockRate!=8000 && clockRate!=16000 && clockRate!=48000){
+		LOGW("Unsupported software audio clock rate %u, using 48000", clockRate);
+		clockRate=48000;
+	}
+	// the ports are only connected after the config is set, so it's safe to replace them here
+	if(config.registerSoftwareAudioPorts!=audioPortsRegistered || clockRate!=audioPortClockRate)
+		CreateSoftwareAudio(config.registerSoftwareAudioPorts, clockRate);
+#endif
 	UpdateDataSavingState();
 	UpdateAudioBitrateLimit();
 }
@@ -956,6 +1062,28 @@ void VoIPController::SetPersistentState(vector<uint8_t> state){
 		proxySupportsUDP=proxy["udp"].bool_value();
 		proxySupportsTCP=proxy["tcp"].bool_value();
 	}
+	bool haveTime=obj.find("time")!=obj.end();
+	double savedAgo=haveTime ? std::max(0.0, (double)time(NULL)-obj["time"].number_value()) : 0;
+	Json::object net=obj["net"].object_items();
+	// carried over from an older state by MergePersistentState
+	bool haveNetTime=net.find("time")!=net.end();
+	double netSavedAgo=haveNetTime ? std::max(0.0, (double)time(NULL)-net["time"].number_value()) : savedAgo;
+	// the host may have moved to another network since, so old or undated knowledge is not used
+	if(obj.find("net")!=obj.end() && (haveTime || haveNetTime) && netSavedAgo<=ServerConfig::GetSharedInstance()->GetDouble("net_state_ttl", 3600.0)){
+		NetworkSocket::AddressFamilyInfo info;
+		info.v4Available=net["v4"].bool_value();
+		string prefix=net["nat64"].string_value();
+		if(!info.v4Available && prefix.length()==24){
+			for(int i=0;i<12;i++)
+				info.nat64Prefix[i]=(unsigned char)strtoul(prefix.substr(i*2, 2).c_str(), NULL, 16);
+			info.nat64Present=true;
+		}
+		// applied when the socket is opened in Start()
+		realUdpSocket->SetAddressFamilyInfo(info);
+	}
+	if(obj.find("relays")!=obj.end()){
+		RelayHealth::GetSharedInstance()->SetPersistentState(obj["relays"], GetCurrentTime(), savedAgo);
+	}
 }
 
 vector<uint8_t> VoIPController::GetPersistentState(){
@@ -973,11 +1101,51 @@ vector<uint8_t> VoIPController::GetPersistentState(){
 			{"tcp", proxySupportsTCP}
     	}});
 	}
+	NetworkSocket::AddressFamilyInfo info=realUdpSocket->GetAddressFamilyInfo();
+	if(info.v4Available || info.nat64Present){
+		char prefix[25]={0};
+		if(info.nat64Present){
+			for(int i=0;i<12;i++)
+				snprintf(prefix+i*2, 3, "%02x", info.nat64Prefix[i]);
+		}
+		obj.insert({"net", Json::object{
+			{"v4", info.v4Available},
+			{"nat64", string(prefix)}
+		}});
+	}
+	obj.insert({"relays", RelayHealth::GetSharedInstance()->GetPersistentState(GetCurrentTime())});
+	obj.insert({"time", (double)time(NULL)});
 	string _jstr=Json(obj).dump();
 	const char* jstr=_jstr.c_str();
 	return vector<uint8_t>(jstr, jstr+strlen(jstr));
 }
 
+vector<uint8_t> VoIPController::MergePersistentState(const vector<uint8_t>& older, const vector<uint8_t>& newer){
+	using namespace json11;
+
+	string jsonErr;
+	Json::object olderObj=Json::parse(string(older.begin(), older.end()), jsonErr).object_items();
+	if(!jsonErr.empty() || olderObj.empty())
+		return newer;
+	Json::object newerObj=Json::parse(string(newer.begin(), newer.end()), jsonErr).object_items();
+	if(!jsonErr.empty() || newerObj.empty())
+		return older;
+
+	// "time" dates "net", which keeps its own date when it outlives the state it came with
+	if(newerObj.find("net")==newerObj.end() && olderObj.find("net")!=olderObj.end()){
+		Json::object net=olderObj["net"].object_items();
+		if(net.find("time")==net.end() && olderObj.find("time")!=olderObj.end())
+			net["time"]=olderObj["time"];
+		olderObj["net"]=net;
+	}
+	for(const std::pair<const string, Json>& item:newerObj){
+		olderObj[item.first]=item.second;
+	}
+	string _jstr=Json(olderObj).dump();
+	const char* jstr=_jstr.c_str();
+	return vector<uint8_t>(jstr, jstr+strlen(jstr));
+}
+
 void VoIPController::SetOutputVolume(float level){
 	outputVolume.SetLevel(level);
 }
@@ -1170,6 +1338,8 @@ void VoIPController::HandleAudioInput(unsigned char *data, size_t len, unsigned
 	};
 
 	conctl->PacketSent(p.seq, p.len);
+	if(capture)
+		capture->RecordOutgoing(data, len, p.seq, audioTimestampOut);
 
 	SendOrEnqueuePacket(move(p));
 	if(peerVersion<7 && secondaryData && secondaryLen && shittyInternetMode){
@@ -1235,6 +1405,7 @@ void VoIPController::InitializeAudio(){
 	encoder->SetOutputFrameDuration(outgoingAudioStream->frameDuration);
 	encoder->SetEchoCanceller(echoCanceller);
 	encoder->SetSecondaryEncoderEnabled(false);
+	encoder->SetStageTimers(&stageTimers);
 	if(config.enableVolumeControl){
 		encoder->AddAudioEffect(&inputVolume);
 	}
@@ -1280,6 +1451,11 @@ void VoIPController::OnAudioOutputReady(){
 		stm->decoder->AddAudioEffect(&outputVolume);
 	}
 	stm->decoder->SetJitterBuffer(stm->jitterBuffer);
+	stm->decoder->SetStageTimers(&stageTimers);
+	if(capture){
+		capture->RecordDecoder(peerVersion>=6, stm->frameDuration);
+		stm->decoder->SetCapture(capture);
+	}
 	stm->decoder->SetFrameDuration(stm->frameDuration);
 	stm->decoder->Start();
 }
@@ -1553,6 +1729,14 @@ void VoIPController::InitUDPProxy(){
 		return;
 	}
 
+	NetworkSocketSOCKS5Proxy* pooledProxy=Socks5Pool::GetSharedInstance()->Acquire(proxyAddress, proxyPort, proxyUsername, proxyPassword, realUdpSocket);
+	if(pooledProxy){
+		LOGV("Using pre-established UDP proxy association");
+		udpSocket=pooledProxy;
+		ResetUdpAvailability();
+		return;
+	}
+
 	NetworkSocket* tcp=NetworkSocket::Create(PROTO_TCP);
 	tcp->Connect(resolvedProxyAddress, proxyPort);
 
@@ -1787,6 +1971,7 @@ bool VoIPController::WasOutgoingPacketAcknowledged(uint32_t seq){
 }
 
 void VoIPController::ProcessIncomingPacket(NetworkPacket &packet, Endpoint& srcEndpoint){
+	ScopedStageTimer timer(&stageTimers, MEDIA_STAGE_RECEIVE);
 	unsigned char *buffer=packet.data;
 	size_t len=packet.length;
 	BufferInputStream in(buffer, (size_t) len);
@@ -1815,6 +2000,11 @@ void VoIPController::ProcessIncomingPacket(NetworkPacket &packet, Endpoint& srcE
 				//udpConnectivityState=UDP_AVAILABLE;
 				LOGV("Received UDP ping reply from %s:%d: date=%d, queryID=%ld, my IP=%s, my port=%d", srcEndpoint.address.ToString().c_str(), srcEndpoint.port, date, (long int) queryID, IPv4Address(*reinterpret_cast<uint32_t *>(myIP+12)).ToString().c_str(), myPort);
 				srcEndpoint.udpPongCount++;
+				if(queryID==srcEndpoint.udpPingID && srcEndpoint.udpPingTime>0){
+					double now=GetCurrentTime();
+					RelayHealth::GetSharedInstance()->ResponseReceived(srcEndpoint, now-srcEndpoint.udpPingTime, now);
+					srcEndpoint.udpPingTime=0;
+				}
 				if(srcEndpoint.IsIPv6Only() && !didSendIPv6Endpoint){
 					IPv6Address realAddr(myIP);
 					if(realAddr==myIPv6){
@@ -2070,6 +2260,8 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 			return;
 		}
 	}
+	if(capture)
+		capture->SetIncomingPacket(type, pseq);
 	packetsReceived++;
 	if(seqgt(pseq, lastRemoteSeq)){
 		uint32_t diff=pseq-lastRemoteSeq;
@@ -2388,6 +2580,11 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 				stm->enabled=in.ReadByte()==1;
 				if(stm->type==STREAM_TYPE_AUDIO){
 					stm->jitterBuffer=make_shared<JitterBuffer>(nullptr, stm->frameDuration);
+					stm->jitterBuffer->SetStageTimers(&stageTimers);
+					if(capture && !incomingAudioStream){
+						capture->RecordStream(stm->id, stm->frameDuration);
+						stm->jitterBuffer->SetCapture(capture);
+					}
 					if(stm->frameDuration>50)
 						stm->jitterBuffer->SetMinPacketCount((uint32_t) ServerConfig::GetSharedInstance()->GetInt("jitter_initial_delay_60", 2));
 					else if(stm->frameDuration>30)
@@ -2396,7 +2593,8 @@ simpleAudioBlock random_id:long random_bytes:string raw_data:string = DecryptedA
 						stm->jitterBuffer->SetMinPacketCount((uint32_t) ServerConfig::GetSharedInstance()->GetInt("jitter_initial_delay_20", 6));
 					stm->decoder=NULL;
 				}else if(stm->type==STREAM_TYPE_VIDEO){
-					if(!stm->packetReassembler){
+					// fragments of a stream nobody renders are dropped in ProcessIncomingPacket
+					if(!stm->packetReassembler && config.enableVideoReceive){
 						stm->packetReassembler=make_shared<PacketReassembler>();
 						stm->packetReassembler->SetCallback(bind(&VoIPController::ProcessIncomingVideoFrame, this, placeholders::_1, placeholders::_2, placeholders::_3));
 					}
@@ -2828,6 +3026,7 @@ bool VoIPController::SendOrEnqueuePacket(PendingOutgoingPacket pkt, bool enqueue
 void VoIPController::SendPacket(unsigned char *data, size_t len, Endpoint& ep, PendingOutgoingPacket& srcPacket){
 	if(stopping)
 		return;
+	ScopedStageTimer timer(&stageTimers, MEDIA_STAGE_SEND);
 	if(ep.type==Endpoint::Type::TCP_RELAY && !useTCP)
 		return;
 	BufferOutputStream out(len+128);
@@ -3251,6 +3450,9 @@ void VoIPController::SendUdpPing(Endpoint& endpoint){
 	pkt.data=p.GetBuffer();
 	pkt.length=p.GetLength();
 	udpSocket->Send(&pkt);
+	endpoint.udpPingID=id;
+	endpoint.udpPingTime=GetCurrentTime();
+	RelayHealth::GetSharedInstance()->RequestSent(endpoint, endpoint.udpPingTime);
 	LOGV("Sending UDP ping to %s:%d, id %" PRId64, endpoint.GetAddress().ToString().c_str(), endpoint.port, id);
 }
 
@@ -3271,6 +3473,34 @@ void VoIPController::ResetUdpAvailability(){
 	udpPingTimeoutID=messageThread.Post(std::bind(&VoIPController::SendUdpPings, this), 0.0, 0.5);
 }
 
+void VoIPController::SelectInitialRelay(){
+	MutexGuard m(endpointsMutex);
+	if(currentEndpoint!=preferredRelay)
+		return;
+	double now=GetCurrentTime();
+	double maxLoss=ServerConfig::GetSharedInstance()->GetDouble("relay_health_max_loss", 0.5);
+	RelayHealth* relayHealth=RelayHealth::GetSharedInstance();
+	Endpoint* best=NULL;
+	double bestRTT=0;
+	for(pair<const int64_t, Endpoint>& _e:endpoints){
+		Endpoint& e=_e.second;
+		if(e.type!=Endpoint::Type::UDP_RELAY)
+			continue;
+		RelayHealth::Stats health;
+		if(!relayHealth->GetStats(e, now, health) || health.loss>maxLoss)
+			continue;
+		if(!best || health.rtt<bestRTT){
+			best=&e;
+			bestRTT=health.rtt;
+		}
+	}
+	if(best && best->id!=preferredRelay){
+		LOGI("Starting with relay %s:%u, %.0f ms away by shared stats", best->GetAddress().ToString().c_str(), best->port, bestRTT*1000);
+		preferredRelay=best->id;
+		currentEndpoint=best->id;
+	}
+}
+
 void VoIPController::ResetEndpointPingStats(){
 	MutexGuard m(endpointsMutex);
 	for(pair<const int64_t, Endpoint>& e:endpoints){
@@ -3538,12 +3768,29 @@ void VoIPController::SendRelayPings(){
 		double minPing=_preferredRelay->averageRTT*(_preferredRelay->type==Endpoint::Type::TCP_RELAY ? 2 : 1);
 		if(minPing==0.0) // force the switch to an available relay, if any
 			minPing=DBL_MAX;
+		RelayHealth* relayHealth=RelayHealth::GetSharedInstance();
 		for(pair<const int64_t, Endpoint>& _endpoint:endpoints){
 			Endpoint& endpoint=_endpoint.second;
 			if(endpoint.type==Endpoint::Type::TCP_RELAY && !useTCP)
 				continue;
 			if(endpoint.type==Endpoint::Type::UDP_RELAY && !useUDP)
 				continue;
+			if(endpoint.type==Endpoint::Type::UDP_RELAY){
+				// one call in the process keeps the shared stats of each reflector fresh
+				if(relayHealth->ClaimRefresh(endpoint, GetCurrentTime()))
+					SendUdpPing(endpoint);
+				// the ping goes through the relay to the peer and back, so its round trip can't be
+				// shorter than our own leg; skip relays that lose to the preferred one on that alone
+				RelayHealth::Stats health;
+				if(endpoint.id!=preferredRelay && endpoint.id!=currentEndpoint && minPing!=DBL_MAX
+				   && relayHealth->GetStats(endpoint, GetCurrentTime(), health) && health.rtt>=minPing*relaySwitchThreshold){
+					if(GetCurrentTime()-endpoint.lastPingTime>=10){
+						LOGV("Not pinging %s, its own leg is %.0f ms", endpoint.GetAddress().ToString().c_str(), health.rtt*1000);
+						endpoint.lastPingTime=GetCurrentTime();
+					}
+					continue;
+				}
+			}
 			if(GetCurrentTime()-endpoint.lastPingTime>=10){
 				LOGV("Sending ping to %s", endpoint.GetAddress().ToString().c_str());
 				SendOrEnqueuePacket(PendingOutgoingPacket{
@@ -3891,6 +4138,8 @@ Endpoint::Endpoint(int64_t id, uint16_t port, IPv4Address& _address, IPv6Address
 	averageRTT=0;
 	socket=NULL;
 	udpPongCount=0;
+	udpPingID=0;
+	udpPingTime=0;
 }
 
 Endpoint::Endpoint() : address(0), v6address(string("::0")) {
@@ -3899,6 +4148,8 @@ Endpoint::Endpoint() : address(0), v6address(string("::0")) {
 	averageRTT=0;
 	socket=NULL;
 	udpPongCount=0;
+	udpPingID=0;
+	udpPingTime=0;
 }
 
 const NetworkAddress &Endpoint::GetAddress() const{
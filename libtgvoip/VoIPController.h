@@ -34,6 +34,8 @@
 #include "audio/AudioOutput.h"
 #include "audio/AudioIO.h"
 #include "JitterBuffer.h"
+#include "StageTimers.h"
+#include "CallCapture.h"
 #include "OpusDecoder.h"
 #include "OpusEncoder.h"
 #include "EchoCanceller.h"
@@ -150,6 +152,8 @@ namespace tgvoip{
 		double averageRTT;
 		NetworkSocket* socket;
 		int udpPongCount;
+		int64_t udpPingID;
+		double udpPingTime;
 	};
 
 	class AudioDevice{
@@ -183,8 +187,13 @@ namespace tgvoip{
 		std::string deviceID;
 	};
 
+	namespace test{
+		class Microbenchmarks;
+	}
+
 	class VoIPController{
 		friend class VoIPGroupController;
+		friend class test::Microbenchmarks; // KDF and KDF2 timing
 	public:
 		TGVOIP_DISALLOW_COPY_AND_ASSIGN(VoIPController);
 		struct Config{
@@ -204,9 +213,11 @@ namespace tgvoip{
 #ifndef _WIN32
 			std::string logFilePath="";
 			std::string statsDumpFilePath="";
+			std::string captureFilePath=""; // incoming audio capture for offline replay, see CallCapture
 #else
 			std::wstring logFilePath=L"";
 			std::wstring statsDumpFilePath=L"";
+			std::wstring captureFilePath=L""; // incoming audio capture for offline replay, see CallCapture
 #endif
 
 			bool enableAEC;
@@ -220,6 +231,17 @@ namespace tgvoip{
 
 			bool enableVideoSend=false;
 			bool enableVideoReceive=false;
+
+			/**
+			 * Register software audio ports in pjsua conference bridge.
+			 * Not needed when the ports are connected to SIP stream directly.
+			 */
+			bool registerSoftwareAudioPorts=true;
+			/**
+			 * Clock rate of software audio ports. Audio is resampled to and from 48 kHz inside the ports,
+			 * so 8000 and 16000 allow narrowband and wideband SIP codecs.
+			 */
+			unsigned int softwareAudioClockRate=48000;
 		};
 
 		struct TrafficStats{
@@ -229,6 +251,27 @@ namespace tgvoip{
 			uint64_t bytesRecvdMobile;
 		};
 
+		struct ResourceStats{
+			double cpuTime; // seconds, summed over all threads of the call
+			// only counted when built with TGVOIP_ALLOCATION_ACCOUNTING
+			uint64_t allocatedBytes;
+			uint64_t allocationCount;
+			unsigned int threadCount; // currently running
+		};
+
+		struct MediaStats{
+			double rtt;
+			double jitter;
+			uint32_t packetsSent;
+			uint32_t packetsRecvd;
+			uint32_t sendLossCount;
+			uint32_t recvLossCount;
+			// cumulative, see OpusEncoder::GetQueueStats; backlog/packets*20 ms is how far encoding lags behind capture
+			uint32_t encoderPackets;
+			uint32_t encoderBacklog;
+			uint32_t encoderOverruns;
+		};
+
 
 		VoIPController();
 		virtual ~VoIPController();
@@ -295,6 +338,31 @@ namespace tgvoip{
 		 * @param stats
 		 */
 		void GetStats(TrafficStats* stats);
+		/**
+		 * CPU time and heap allocations of the threads working for this call
+		 * @param stats
+		 */
+		void GetStats(ResourceStats* stats);
+		/**
+		 * Same as GetStats(ResourceStats*), broken down by thread
+		 */
+		std::vector<ResourceUsage::ThreadStats> GetThreadResourceStats();
+		/**
+		 * Network quality snapshot of the current call, RTT and jitter are in seconds
+		 * @param stats
+		 */
+		void GetMediaStats(MediaStats* stats);
+		/**
+		 * Processing time of media path stages of this call, all zero unless
+		 * stage_timers_per_call is set in server config
+		 * @param stats array of MEDIA_STAGE_COUNT elements
+		 */
+		void GetStageTimerStats(StageTimers::Stats* stats);
+		/**
+		 * Same as GetStageTimerStats, but over all calls since process start
+		 * @param stats array of MEDIA_STAGE_COUNT elements
+		 */
+		static void GetAggregatedStageTimerStats(StageTimers::Stats* stats);
 		/**
 		 *
 		 * @return
@@ -387,6 +455,10 @@ namespace tgvoip{
 		void RequestCallUpgrade();
 		void SetEchoCancellationStrength(int strength);
 		int GetConnectionState();
+		/**
+		 * Whether the call ever reached STATE_ESTABLISHED. Only such calls probed enough of the network for their persistent state to be worth keeping.
+		 */
+		bool WasEstablished();
 		bool NeedRate();
 		/**
 		 * Get the maximum connection layer supported by this libtgvoip version.
@@ -396,7 +468,8 @@ namespace tgvoip{
 			return 92;
 		};
 		/**
-		 * Get the persistable state of the library, like proxy capabilities, to save somewhere on the disk. Call this at the end of the call.
+		 * Get the persistable state of the library, like proxy capabilities, IPv4/NAT64 detection results and
+		 * shared relay statistics, to save somewhere on the disk. Call this at the end of the call.
 		 * Using this will speed up the connection establishment in some cases.
 		 */
 		std::vector<uint8_t> GetPersistentState();
@@ -404,6 +477,11 @@ namespace tgvoip{
 		 * Load the persistable state. Call this before starting the call.
 		 */
 		void SetPersistentState(std::vector<uint8_t> state);
+		/**
+		 * Combine two persistable states key by key, what newer has replaces what older has and the rest of older is kept.
+		 * Use it when several calls end in turn and one of them may have learned less than the others.
+		 */
+		static std::vector<uint8_t> MergePersistentState(const std::vector<uint8_t>& older, const std::vector<uint8_t>& newer);
 
 #if defined(TGVOIP_USE_CALLBACK_AUDIO_IO)
 		void SetAudioDataCallbacks(std::function<void(int16_t*, size_t)> input, std::function<void(int16_t*, size_t)> output);
@@ -435,6 +513,8 @@ namespace tgvoip{
 #if defined(TGVOIP_USE_SOFTWARE_AUDIO)
         pj::AudioMedia * AudioMediaInput() {return softwareMediaInput;};
         pj::AudioMedia * AudioMediaOutput() {return softwareMediaOutput;};
+        pjmedia_port * AudioPortInput() {return softwareMediaInput->GetMediaPort();};
+        pjmedia_port * AudioPortOutput() {return softwareMediaOutput->GetMediaPort();};
 #endif
 
 	private:
@@ -517,6 +597,7 @@ namespace tgvoip{
 		void SendStreamCSD(Stream& stream);
 		void InitializeTimers();
 		void ResetEndpointPingStats();
+		void SelectInitialRelay();
 		void SendVideoFrame(const Buffer& frame, uint32_t flags);
 		void ProcessIncomingVideoFrame(Buffer frame, uint32_t pts, bool keyframe);
 		std::shared_ptr<Stream> GetStreamByType(int type, bool outgoing);
@@ -637,6 +718,8 @@ namespace tgvoip{
 		OpusEncoder* encoder;
 		std::vector<PendingOutgoingPacket> sendQueue;
 		EchoCanceller* echoCanceller;
+		StageTimers stageTimers;
+		std::shared_ptr<ResourceUsage> resourceUsage=std::make_shared<ResourceUsage>();
 		Mutex sendBufferMutex;
 		Mutex endpointsMutex;
 		Mutex socketSelectMutex;
@@ -682,6 +765,7 @@ namespace tgvoip{
 		NetworkSocket* udpSocket;
 		NetworkSocket* realUdpSocket;
 		FILE* statsDump;
+		CallCapture* capture=NULL;
 		std::string currentAudioInput;
 		std::string currentAudioOutput;
 		bool useTCP;
@@ -797,6 +881,9 @@ namespace tgvoip{
 #if defined(TGVOIP_USE_SOFTWARE_AUDIO)
         tgvoip::audio::SoftwareAudioInput* softwareMediaInput;
         tgvoip::audio::SoftwareAudioOutput* softwareMediaOutput;
+        bool audioPortsRegistered=true;
+        unsigned int audioPortClockRate=48000;
+        void CreateSoftwareAudio(bool registerPorts, unsigned int clockRate);
 #endif
 
 	public:
@@ -64,6 +64,11 @@ void ServerConfig::Update(std::string jsonString){
 		LOGE("Error parsing server config: %s", jsonError.c_str());
 }
 
+std::string ServerConfig::GetJsonString(){
+	MutexGuard sync(mutex);
+	return config.dump();
+}
+
 
 bool ServerConfig::ContainsKey(std::string key){
 	return config.object_items().find(key)!=config.object_items().end();
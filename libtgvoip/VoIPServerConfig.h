@@ -25,6 +25,7 @@ public:
 	std::string GetString(std::string name, std::string fallback);
 	bool GetBoolean(std::string name, bool fallback);
 	void Update(std::string jsonString);
+	std::string GetJsonString();
 
 private:
 	static ServerConfig* sharedInstance;
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <cstring>
+#include "PCMRingBuffer.h"
+
+using namespace tgvoip::audio;
+
+PCMRingBuffer::PCMRingBuffer(size_t capacity) {
+    this->capacity = 1;
+    while (this->capacity < capacity) {
+        this->capacity <<= 1;
+    }
+    mask = this->capacity - 1;
+    buffer = new int16_t[this->capacity];
+}
+
+PCMRingBuffer::~PCMRingBuffer() {
+    delete[] buffer;
+}
+
+size_t PCMRingBuffer::Write(const int16_t *samples, size_t count) {
+    size_t write = writePos.load(std::memory_order_relaxed);
+    size_t read = readPos.load(std::memory_order_acquire);
+
+    count = std::min(count, capacity - (write - read));
+
+    size_t offset = write & mask;
+    size_t first = std::min(count, capacity - offset);
+    memcpy(buffer + offset, samples, first * sizeof(int16_t));
+    memcpy(buffer, samples + first, (count - first) * sizeof(int16_t));
+
+    writePos.store(write + count, std::memory_order_release);
+    return count;
+}
+
+size_t PCMRingBuffer::Read(int16_t *samples, size_t count) {
+    size_t read = readPos.load(std::memory_order_relaxed);
+    size_t write = writePos.load(std::memory_order_acquire);
+
+    count = std::min(count, write - read);
+
+    size_t offset = read & mask;
+    size_t first = std::min(count, capacity - offset);
+    memcpy(samples, buffer + offset, first * sizeof(int16_t));
+    memcpy(samples + first, buffer, (count - first) * sizeof(int16_t));
+
+    readPos.store(read + count, std::memory_order_release);
+    return count;
+}
+
+size_t PCMRingBuffer::Skip(size_t count) {
+    size_t read = readPos.load(std::memory_order_relaxed);
+    size_t write = writePos.load(std::memory_order_acquire);
+
+    count = std::min(count, write - read);
+
+    readPos.store(read + count, std::memory_order_release);
+    return count;
+}
+
+size_t PCMRingBuffer::Available() const {
+    // read position first, so that it can never get ahead of the write position we compare it with
+    size_t read = readPos.load(std::memory_order_acquire);
+    return writePos.load(std::memory_order_acquire) - read;
+}
+
+size_t PCMRingBuffer::Free() const {
+    return capacity - Available();
+}
@@ -0,0 +1,47 @@
+#ifndef TG2SIP_PCMRINGBUFFER_H
+#define TG2SIP_PCMRINGBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace tgvoip {
+    namespace audio {
+        // Lock-free single producer / single consumer ring of 16-bit samples
+        class PCMRingBuffer {
+        public:
+            // capacity is rounded up to power of two
+            explicit PCMRingBuffer(size_t capacity);
+
+            ~PCMRingBuffer();
+
+            PCMRingBuffer(const PCMRingBuffer &) = delete;
+
+            PCMRingBuffer &operator=(const PCMRingBuffer &) = delete;
+
+            // producer side, returns number of samples actually written
+            size_t Write(const int16_t *samples, size_t count);
+
+            // consumer side, returns number of samples actually read
+            size_t Read(int16_t *samples, size_t count);
+
+            // consumer side, drops up to count samples
+            size_t Skip(size_t count);
+
+            size_t Available() const;
+
+            size_t Free() const;
+
+            size_t Capacity() const { return capacity; };
+
+        private:
+            int16_t *buffer;
+            size_t capacity;
+            size_t mask;
+            std::atomic<size_t> readPos{0};
+            std::atomic<size_t> writePos{0};
+        };
+    }
+}
+
+#endif //TG2SIP_PCMRINGBUFFER_H
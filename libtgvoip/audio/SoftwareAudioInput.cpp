@@ -1,10 +1,14 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include "SoftwareAudioInput.h"
+#include "../webrtc_dsp/common_audio/resampler/push_sinc_resampler.h"
 
 using namespace tgvoip::audio;
 
-SoftwareAudioInput::SoftwareAudioInput() {
+SoftwareAudioInput::SoftwareAudioInput(bool registerPort, unsigned clockRate) {
     isActive = false;
+    this->clockRate = clockRate;
 
     pj_pool = pjsua_pool_create("input%p", 2048, 512);
     media_port = PJ_POOL_ZALLOC_T(pj_pool, pjmedia_port);
@@ -15,14 +19,20 @@ SoftwareAudioInput::SoftwareAudioInput() {
     status = pjmedia_port_info_init(&media_port->info,
                                     &name,
                                     PJMEDIA_SIG_CLASS_PORT_AUD('S', 'I'), // Software Input SIG
-                                    48000, 1, 16, 960);
+                                    clockRate, 1, 16, clockRate / 100);
     assert(status == PJ_SUCCESS);
 
     media_port->port_data.pdata = this;
     media_port->put_frame = &PutFrameCallback;
     media_port->get_frame = &GetFrameCallback;
 
-    registerMediaPort(media_port);
+    if (clockRate != 48000) {
+        resampler.reset(new webrtc::PushSincResampler(clockRate / 100, 480));
+    }
+
+    if (registerPort) {
+        registerMediaPort(media_port);
+    }
 }
 
 SoftwareAudioInput::~SoftwareAudioInput() {
@@ -41,20 +51,45 @@ void SoftwareAudioInput::Stop() {
 
 pj_status_t SoftwareAudioInput::PutFrameCallback(pjmedia_port *port, pjmedia_frame *frame) {
 
+    // runs on the pjmedia clock thread, which is part of the audio path
+    Thread::AdoptCurrentThread(true);
+    auto input = (SoftwareAudioInput *) port->port_data.pdata;
+    ScopedStageTimer timer(input->stageTimers, MEDIA_STAGE_CAPTURE);
+
     // skip heartbeat frame
     if (frame->type != PJMEDIA_FRAME_TYPE_AUDIO) {
         return PJ_SUCCESS;
     }
 
-    assert(frame->size == 960 * 2);
-
-    auto input = (SoftwareAudioInput *) port->port_data.pdata;
-
     if (!input->isActive) {
+        input->buffered = 0;
         return PJ_SUCCESS;
     }
 
-    input->InvokeCallback((unsigned char *) frame->buf, frame->size);
+    auto data = (const unsigned char *) frame->buf;
+    size_t left = frame->size;
+
+    if (input->resampler) {
+        if (frame->size != input->clockRate / 100 * 2) {
+            return PJ_SUCCESS;
+        }
+        input->resampler->Resample((const int16_t *) frame->buf, input->clockRate / 100,
+                                   input->resampleBuffer, 480);
+        data = (const unsigned char *) input->resampleBuffer;
+        left = sizeof(input->resampleBuffer);
+    }
+    while (left > 0) {
+        size_t chunk = std::min(left, sizeof(input->buffer) - input->buffered);
+        memcpy(input->buffer + input->buffered, data, chunk);
+        input->buffered += chunk;
+        data += chunk;
+        left -= chunk;
+
+        if (input->buffered == sizeof(input->buffer)) {
+            input->InvokeCallback(input->buffer, sizeof(input->buffer));
+            input->buffered = 0;
+        }
+    }
 
     return PJ_SUCCESS;
 }
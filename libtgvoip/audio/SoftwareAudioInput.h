@@ -2,14 +2,21 @@
 #define TG2SIP_SOFTWAREAUDIOINPUT_H
 
 #include <pjsua2.hpp>
+#include <memory>
 #include "AudioInput.h"
 #include "../threading.h"
+#include "../StageTimers.h"
+
+namespace webrtc {
+    class PushSincResampler;
+}
 
 namespace tgvoip {
     namespace audio {
         class SoftwareAudioInput : public AudioInput, public pj::AudioMedia {
         public:
-            explicit SoftwareAudioInput();
+            // clockRate other than 48000 makes the port resample PCM to (from) libtgvoip 48kHz
+            explicit SoftwareAudioInput(bool registerPort = true, unsigned clockRate = 48000);
 
             virtual ~SoftwareAudioInput();
 
@@ -17,6 +24,11 @@ namespace tgvoip {
 
             void Stop() override;
 
+            // raw port for connecting without conference bridge
+            pjmedia_port *GetMediaPort() const { return media_port; };
+
+            void SetStageTimers(StageTimers *timers) { stageTimers = timers; };
+
         private:
             static pj_status_t PutFrameCallback(pjmedia_port *port, pjmedia_frame *frame);
 
@@ -24,8 +36,18 @@ namespace tgvoip {
 
             bool isActive;
 
+            StageTimers *stageTimers{nullptr};
+
             pj_pool_t *pj_pool;
             pjmedia_port *media_port;
+
+            unsigned clockRate;
+            std::unique_ptr<webrtc::PushSincResampler> resampler;
+            int16_t resampleBuffer[480];
+
+            // pjmedia delivers 10ms frames, libtgvoip encoder expects 20ms ones
+            unsigned char buffer[960 * 2];
+            size_t buffered{0};
         };
     }
 }
@@ -1,10 +1,27 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <functional>
 #include "SoftwareAudioOutput.h"
+#include "../VoIPServerConfig.h"
+#include "../webrtc_dsp/common_audio/resampler/push_sinc_resampler.h"
+
+// pjmedia port frame, 10ms
+#define PORT_FRAME_SAMPLES 480
+// libtgvoip decoder frame, 20ms
+#define DECODER_FRAME_SAMPLES 960
+
+// ring capacity, prefill leaves at least a frame of room for clock drift and scheduling jitter
+#define RING_FRAMES 4
+// port frames per drift estimate, 10 seconds
+#define DRIFT_WINDOW_FRAMES 1000
 
 using namespace tgvoip::audio;
 
-SoftwareAudioOutput::SoftwareAudioOutput() {
+SoftwareAudioOutput::SoftwareAudioOutput(bool registerPort, unsigned clockRate)
+        : ring(DECODER_FRAME_SAMPLES * RING_FRAMES) {
     isActive = false;
+    this->clockRate = clockRate;
 
     pj_pool = pjsua_pool_create("output%p", 2048, 512);
     media_port = PJ_POOL_ZALLOC_T(pj_pool, pjmedia_port);
@@ -12,38 +29,79 @@ SoftwareAudioOutput::SoftwareAudioOutput() {
     pj_status_t status;
     pj_str_t name = pj_str((char *) "output");
 
-    // ptime = 10ms -> 480 samples per frame
+    // ptime = 10ms, resampled to 48kHz 480 samples frames when needed
     status = pjmedia_port_info_init(&media_port->info,
                                     &name,
                                     PJMEDIA_SIG_CLASS_PORT_AUD('S', 'O'), // Software Output SIG
-                                    48000, 1, 16, 480);
+                                    clockRate, 1, 16, clockRate / 100);
     assert(status == PJ_SUCCESS);
 
     media_port->port_data.pdata = this;
     media_port->put_frame = &PutFrameCallback;
     media_port->get_frame = &GetFrameCallback;
 
-    registerMediaPort(media_port);
+    if (clockRate != 48000) {
+        resampler.reset(new webrtc::PushSincResampler(480, clockRate / 100));
+    }
+
+    if (registerPort) {
+        registerMediaPort(media_port);
+    }
 
     // 48kHz * 20 ms * 16 bits per sample
     buffer = new unsigned char[1920];
 }
 
 SoftwareAudioOutput::~SoftwareAudioOutput() {
+    Stop();
     unregisterMediaPort();
     pjmedia_port_destroy(media_port);
     pj_pool_release(pj_pool);
     if (buffer) {
-        delete buffer;
+        delete[] buffer;
     }
 }
 
 void SoftwareAudioOutput::Start() {
+    if (isActive) {
+        return;
+    }
+
+    // Decoded before the port starts taking samples out. Every frame is 20ms of delay, one
+    // is enough when the feeder and the port clock threads get scheduled on time.
+    long prefillFrames = ServerConfig::GetSharedInstance()->GetInt("audio_output_prefill_frames", 1);
+    ringPrefill = DECODER_FRAME_SAMPLES * (size_t) std::max(1L, std::min((long) RING_FRAMES - 1, prefillFrames));
+    // With both clocks at the same rate the fill seen by the port swings by a port frame around
+    // this, depending on how the feeder and port ticks are phased.
+    ringTargetFill = ringPrefill - PORT_FRAME_SAMPLES / 2;
+
+    // drop whatever was left from the previous run
+    ring.Skip(ring.Available());
+    averageFill = ringTargetFill;
+    driftFrames = 0;
+
+    feederRunning = true;
+    feederThread = new Thread(std::bind(&SoftwareAudioOutput::RunFeederThread, this));
+    feederThread->SetName("audio_output");
+    feederThread->Start();
+    feederThread->SetMaxPriority();
+
     isActive = true;
 }
 
 void SoftwareAudioOutput::Stop() {
     isActive = false;
+
+    if (feederThread) {
+        {
+            std::lock_guard<std::mutex> lock(feederMutex);
+            feederRunning = false;
+        }
+        feederCondition.notify_one();
+        feederThread->Join();
+        delete feederThread;
+        feederThread = nullptr;
+    }
 }
 
 bool SoftwareAudioOutput::IsPlaying() {
@@ -59,7 +117,10 @@ pj_status_t SoftwareAudioOutput::PutFrameCallback(pjmedia_port *port, pjmedia_fr
 
 pj_status_t SoftwareAudioOutput::GetFrameCallback(pjmedia_port *port, pjmedia_frame *frame) {
 
+    // runs on the pjmedia clock thread, which is part of the audio path
+    Thread::AdoptCurrentThread(true);
     auto output = (SoftwareAudioOutput *) port->port_data.pdata;
+    ScopedStageTimer timer(output->stageTimers, MEDIA_STAGE_PLAYOUT);
 
     if (!output->isActive) {
         frame->type = PJMEDIA_FRAME_TYPE_NONE;
@@ -67,15 +128,111 @@ pj_status_t SoftwareAudioOutput::GetFrameCallback(pjmedia_port *port, pjmedia_fr
         return PJ_SUCCESS;
     }
 
-    // libtgvoip ptime = 20ms
-    if (output->read_buffer) {
-        output->InvokeCallback(output->buffer, 1920);
-        memcpy(frame->buf, output->buffer, 960);
+    frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+
+    if (output->resampler) {
+        assert(frame->size == output->clockRate / 100 * 2);
+        output->GetPCMFrame(output->resampleBuffer);
+        output->resampler->Resample(output->resampleBuffer, PORT_FRAME_SAMPLES,
+                                    (int16_t *) frame->buf, output->clockRate / 100);
     } else {
-        memcpy(frame->buf, output->buffer + 960, 960);
+        assert(frame->size == PORT_FRAME_SAMPLES * 2);
+        output->GetPCMFrame((int16_t *) frame->buf);
     }
 
-    output->read_buffer = !output->read_buffer;
-
     return PJ_SUCCESS;
 }
+
+void SoftwareAudioOutput::GetPCMFrame(int16_t *samples) {
+    EstimateDrift();
+
+    size_t available = ring.Available();
+    averageFill = averageFill * 0.95 + available * 0.05;
+
+    // Feeder decodes on its own 20ms clock, so the fill level moves away from the target
+    // when the port clock runs faster or slower than that. Slight resampling brings it back
+    // without the clicks that dropping or inserting whole frames would cause.
+    // smoothed ring fill out of target +/- a port frame makes the port side
+    // consume one sample more or less per frame, which is 0.2% resampling
+    size_t consume = PORT_FRAME_SAMPLES;
+    if (averageFill > ringTargetFill + PORT_FRAME_SAMPLES) {
+        consume = PORT_FRAME_SAMPLES + 1;
+    } else if (averageFill + PORT_FRAME_SAMPLES < ringTargetFill) {
+        consume = PORT_FRAME_SAMPLES - 1;
+    }
+
+    if (available < consume) {
+        underruns++;
+        memset(samples, 0, PORT_FRAME_SAMPLES * 2);
+    } else if (consume == PORT_FRAME_SAMPLES) {
+        ring.Read(samples, PORT_FRAME_SAMPLES);
+    } else {
+        ring.Read(stretchBuffer, consume);
+        Stretch(stretchBuffer, consume, samples, PORT_FRAME_SAMPLES);
+    }
+}
+
+void SoftwareAudioOutput::EstimateDrift() {
+    // every port frame is 10ms of port clock, compare that with the monotonic clock feeder runs on
+    auto now = std::chrono::steady_clock::now();
+    if (driftFrames == 0) {
+        driftWindowStart = now;
+    } else if (driftFrames == DRIFT_WINDOW_FRAMES) {
+        double elapsed = std::chrono::duration<double>(now - driftWindowStart).count();
+        // a stalled or restarted port clock says nothing about its rate
+        if (elapsed > DRIFT_WINDOW_FRAMES * 0.01 * 0.9 && elapsed < DRIFT_WINDOW_FRAMES * 0.01 * 1.1) {
+            clockDrift = (DRIFT_WINDOW_FRAMES * 0.01 - elapsed) / elapsed * 1e6;
+        }
+        driftFrames = 0;
+        driftWindowStart = now;
+    }
+    driftFrames++;
+}
+
+void SoftwareAudioOutput::Stretch(const int16_t *in, size_t inCount, int16_t *out, size_t outCount) {
+    // linear interpolation is good enough for a single sample difference
+    double step = (double) (inCount - 1) / (double) (outCount - 1);
+    for (size_t i = 0; i < outCount; i++) {
+        double pos = i * step;
+        auto index = (size_t) pos;
+        double frac = pos - index;
+        if (index + 1 < inCount) {
+            out[i] = (int16_t) (in[index] * (1.0 - frac) + in[index + 1] * frac);
+        } else {
+            out[i] = in[inCount - 1];
+        }
+    }
+}
+
+void SoftwareAudioOutput::RunFeederThread() {
+    auto frame = reinterpret_cast<int16_t *>(buffer);
+    const auto period = std::chrono::milliseconds(DECODER_FRAME_SAMPLES / 48);
+
+    // Decoding is paced by the monotonic clock the jitter buffer works with rather than by the port,
+    // so the difference between the two clocks ends up in the ring, where GetPCMFrame evens it out.
+    auto next = std::chrono::steady_clock::now();
+    // the first frame of the loop below completes the prefill
+    for (size_t i = 0; i < ringPrefill / DECODER_FRAME_SAMPLES - 1; i++) {
+        InvokeCallback(buffer, DECODER_FRAME_SAMPLES * 2);
+        ring.Write(frame, DECODER_FRAME_SAMPLES);
+    }
+
+    std::unique_lock<std::mutex> lock(feederMutex);
+    while (feederRunning) {
+        lock.unlock();
+        InvokeCallback(buffer, DECODER_FRAME_SAMPLES * 2);
+        // the port stopped taking samples, newest audio is dropped
+        if (ring.Write(frame, DECODER_FRAME_SAMPLES) < DECODER_FRAME_SAMPLES) {
+            overruns++;
+        }
+        lock.lock();
+
+        next += period;
+        auto now = std::chrono::steady_clock::now();
+        if (next < now - period * 5) {
+            // the thread was held up, catching up in a burst would only overrun the ring
+            next = now;
+        }
+        feederCondition.wait_until(lock, next, [this] { return !feederRunning; });
+    }
+}
@@ -2,14 +2,26 @@
 #define TG2SIP_SOFTWAREAUDIOOUTPUT_H
 
 #include <pjsua2.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include "AudioOutput.h"
+#include "PCMRingBuffer.h"
 #include "../threading.h"
+#include "../StageTimers.h"
+
+namespace webrtc {
+    class PushSincResampler;
+}
 
 namespace tgvoip {
     namespace audio {
         class SoftwareAudioOutput : public AudioOutput, public pj::AudioMedia {
         public:
-            explicit SoftwareAudioOutput();
+            // clockRate other than 48000 makes the port resample PCM to (from) libtgvoip 48kHz
+            explicit SoftwareAudioOutput(bool registerPort = true, unsigned clockRate = 48000);
 
             virtual ~SoftwareAudioOutput();
 
@@ -19,18 +31,70 @@ namespace tgvoip {
 
             virtual bool IsPlaying();
 
+            // raw port for connecting without conference bridge
+            pjmedia_port *GetMediaPort() const { return media_port; };
+
+            void SetStageTimers(StageTimers *timers) { stageTimers = timers; };
+
+            // times pjmedia clock found no decoded audio and played silence
+            uint64_t GetUnderrunCount() const { return underruns; };
+
+            // times decoded audio had to be thrown away because the port stopped taking it and the ring filled up
+            uint64_t GetOverrunCount() const { return overruns; };
+
+            // how much faster the port clock runs than the monotonic clock decoding is paced by, ppm
+            double GetClockDrift() const { return clockDrift; };
+
+            // playout delay the ring adds on average, ms
+            double GetRingDelay() const { return averageFill * 1000.0 / 48000.0; };
+
         private:
             static pj_status_t PutFrameCallback(pjmedia_port *port, pjmedia_frame *frame);
 
             static pj_status_t GetFrameCallback(pjmedia_port *port, pjmedia_frame *frame);
 
+            static void Stretch(const int16_t *in, size_t inCount, int16_t *out, size_t outCount);
+
+            void RunFeederThread();
+
+            void GetPCMFrame(int16_t *samples);
+
+            void EstimateDrift();
+
             bool isActive;
 
+            StageTimers *stageTimers{nullptr};
+
             pj_pool_t *pj_pool;
             pjmedia_port *media_port;
 
-            bool read_buffer{true};
+            unsigned clockRate;
+            std::unique_ptr<webrtc::PushSincResampler> resampler;
+            int16_t resampleBuffer[480];
+
             unsigned char *buffer;
+
+            // Decoding runs on the feeder thread every 20ms, pjmedia clock thread
+            // only takes samples out of the ring and never waits for the decoder
+            PCMRingBuffer ring;
+            Thread *feederThread{nullptr};
+            std::mutex feederMutex;
+            std::condition_variable feederCondition;
+            bool feederRunning{false};
+
+            // decoder frames in the ring before the port starts, audio_output_prefill_frames
+            size_t ringPrefill{0};
+            size_t ringTargetFill{0};
+            std::atomic<double> averageFill{0};
+            int16_t stretchBuffer[482];
+
+            // port clock side only
+            unsigned int driftFrames{0};
+            std::chrono::steady_clock::time_point driftWindowStart;
+            std::atomic<double> clockDrift{0};
+
+            std::atomic<uint64_t> underruns{0};
+            std::atomic<uint64_t> overruns{0};
         };
     }
 }
@@ -31,10 +31,14 @@
           '<(tgvoip_src_loc)/BlockingQueue.h',
           '<(tgvoip_src_loc)/Buffers.cpp',
           '<(tgvoip_src_loc)/Buffers.h',
+          '<(tgvoip_src_loc)/CallCapture.cpp',
+          '<(tgvoip_src_loc)/CallCapture.h',
           '<(tgvoip_src_loc)/CongestionControl.cpp',
           '<(tgvoip_src_loc)/CongestionControl.h',
           '<(tgvoip_src_loc)/EchoCanceller.cpp',
           '<(tgvoip_src_loc)/EchoCanceller.h',
+          '<(tgvoip_src_loc)/EncoderGovernor.cpp',
+          '<(tgvoip_src_loc)/EncoderGovernor.h',
           '<(tgvoip_src_loc)/JitterBuffer.cpp',
           '<(tgvoip_src_loc)/JitterBuffer.h',
           '<(tgvoip_src_loc)/logging.cpp',
@@ -45,11 +49,19 @@
           '<(tgvoip_src_loc)/OpusDecoder.h',
           '<(tgvoip_src_loc)/OpusEncoder.cpp',
           '<(tgvoip_src_loc)/OpusEncoder.h',
+          '<(tgvoip_src_loc)/StageTimers.cpp',
+          '<(tgvoip_src_loc)/StageTimers.h',
           '<(tgvoip_src_loc)/threading.h',
           '<(tgvoip_src_loc)/VoIPController.cpp',
           '<(tgvoip_src_loc)/VoIPGroupController.cpp',
           '<(tgvoip_src_loc)/VoIPController.h',
           '<(tgvoip_src_loc)/PrivateDefines.h',
+          '<(tgvoip_src_loc)/RelayHealth.cpp',
+          '<(tgvoip_src_loc)/RelayHealth.h',
+          '<(tgvoip_src_loc)/ResourceUsage.cpp',
+          '<(tgvoip_src_loc)/ResourceUsage.h',
+          '<(tgvoip_src_loc)/Socks5Pool.cpp',
+          '<(tgvoip_src_loc)/Socks5Pool.h',
           '<(tgvoip_src_loc)/VoIPServerConfig.cpp',
           '<(tgvoip_src_loc)/VoIPServerConfig.h',
           '<(tgvoip_src_loc)/audio/AudioInput.cpp',
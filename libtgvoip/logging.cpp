@@ -10,6 +10,7 @@
 #include <time.h>
 
 #include "VoIPController.h"
+#include "logging.h"
 
 #ifdef __ANDROID__
 #include <sys/system_properties.h>
@@ -24,6 +25,12 @@
 
 #ifdef TGVOIP_USE_SPDLOG
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <string.h>
 #include "spdlog/spdlog.h"
 #endif
 
@@ -31,36 +38,129 @@ FILE* tgvoipLogFile=NULL;
 #ifdef TGVOIP_USE_SPDLOG
 std::shared_ptr<spdlog::logger> _voip_logger;
 
+namespace{
+	const size_t ASYNC_LOG_QUEUE_SIZE=1024; // must be a power of two
+	const size_t ASYNC_LOG_LINE_SIZE=1024;
+
+	/**
+	 * Bounded lock-free queue of formatted lines (Vyukov's MPMC ring, used with a single consumer).
+	 * Producers never take a lock or do I/O, the writer thread hands lines over to spdlog.
+	 */
+	class AsyncLogQueue{
+	public:
+		AsyncLogQueue(){
+			for(size_t i=0;i<ASYNC_LOG_QUEUE_SIZE;i++)
+				entries[i].sequence.store(i, std::memory_order_relaxed);
+			std::thread(&AsyncLogQueue::Run, this).detach();
+		}
+
+		void Push(spdlog::logger* logger, spdlog::level::level_enum level, const char* text, size_t length){
+			size_t pos=enqueuePos.load(std::memory_order_relaxed);
+			Entry* entry;
+			for(;;){
+				entry=&entries[pos & (ASYNC_LOG_QUEUE_SIZE-1)];
+				size_t seq=entry->sequence.load(std::memory_order_acquire);
+				intptr_t diff=(intptr_t)seq-(intptr_t)pos;
+				if(diff==0){
+					if(enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+						break;
+				}else if(diff<0){
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}else{
+					pos=enqueuePos.load(std::memory_order_relaxed);
+				}
+			}
+			entry->logger=logger;
+			entry->level=level;
+			length=length<ASYNC_LOG_LINE_SIZE ? length : ASYNC_LOG_LINE_SIZE-1;
+			memcpy(entry->text, text, length);
+			entry->text[length]=0;
+			entry->sequence.store(pos+1, std::memory_order_release);
+			if(writerWaiting.load(std::memory_order_relaxed))
+				cond.notify_one();
+		}
+
+		void Flush(){
+			size_t target=enqueuePos.load(std::memory_order_acquire);
+			while(dequeuePos.load(std::memory_order_acquire)<target){
+				cond.notify_one();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+	private:
+		struct Entry{
+			std::atomic<size_t> sequence;
+			spdlog::logger* logger;
+			spdlog::level::level_enum level;
+			char text[ASYNC_LOG_LINE_SIZE];
+		};
+
+		bool WriteOne(){
+			size_t pos=dequeuePos.load(std::memory_order_relaxed);
+			Entry& entry=entries[pos & (ASYNC_LOG_QUEUE_SIZE-1)];
+			if(entry.sequence.load(std::memory_order_acquire)!=pos+1)
+				return false;
+			uint64_t lost=dropped.exchange(0, std::memory_order_relaxed);
+			if(lost)
+				entry.logger->warn("{} log lines were dropped because the log queue was full", lost);
+			entry.logger->log(entry.level, "{}", entry.text);
+			entry.sequence.store(pos+ASYNC_LOG_QUEUE_SIZE, std::memory_order_release);
+			dequeuePos.store(pos+1, std::memory_order_release);
+			return true;
+		}
+
+		void Run(){
+			for(;;){
+				if(WriteOne())
+					continue;
+				// producers only signal when the writer is about to sleep, the timeout covers a missed signal
+				std::unique_lock<std::mutex> lock(mutex);
+				writerWaiting.store(true);
+				cond.wait_for(lock, std::chrono::milliseconds(20));
+				writerWaiting.store(false);
+			}
+		}
+
+		Entry entries[ASYNC_LOG_QUEUE_SIZE];
+		std::atomic<size_t> enqueuePos{0};
+		std::atomic<size_t> dequeuePos{0};
+		std::atomic<uint64_t> dropped{0};
+		std::atomic<bool> writerWaiting{false};
+		std::mutex mutex;
+		std::condition_variable cond;
+	};
+
+	// never destroyed, the writer thread runs until exit
+	AsyncLogQueue& GetAsyncLogQueue(){
+		static AsyncLogQueue* queue=new AsyncLogQueue();
+		return *queue;
+	}
+}
+
+void tgvoip_log_async(spdlog::logger* logger, spdlog::level::level_enum level, const char* text, size_t length){
+	GetAsyncLogQueue().Push(logger, level, text, length);
+}
+
+void tgvoip_log_async_flush(){
+	GetAsyncLogQueue().Flush();
+}
+
 void tgvoip_log_spdlog(char level, const char* msg, ...) {
-    if (_voip_logger) {
-        spdlog::level::level_enum lvl;
-        switch (level) {
-            case 'V':
-                lvl = spdlog::level::level_enum::trace;
-                break;
-            case 'D':
-                lvl = spdlog::level::level_enum::debug;
-                break;
-            case 'I':
-                lvl = spdlog::level::level_enum::info;
-                break;
-            case 'W':
-                lvl = spdlog::level::level_enum::warn;
-                break;
-            case 'E':
-                lvl = spdlog::level::level_enum::err;
-                break;
-            default:
-                return;
-        }
-
-        va_list argptr;
-        va_start(argptr, msg);
-
-        char buf[1024];
-        vsprintf(buf, msg, argptr);
-		_voip_logger->log(lvl, buf);
-    }
+	spdlog::logger* logger=_voip_logger.get();
+	spdlog::level::level_enum lvl=tgvoip_log_spdlog_level(level);
+	if(!logger || !logger->should_log(lvl))
+		return;
+
+	va_list argptr;
+	va_start(argptr, msg);
+	char buf[ASYNC_LOG_LINE_SIZE];
+	int len=vsnprintf(buf, sizeof(buf), msg, argptr);
+	va_end(argptr);
+	if(len<0)
+		return;
+	tgvoip_log_async(logger, lvl, buf, (size_t)len<sizeof(buf) ? (size_t)len : sizeof(buf)-1);
 }
 
 #endif
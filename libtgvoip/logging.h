@@ -23,7 +23,40 @@ void tgvoip_log_file_printf(char level, const char* msg, ...);
 void tgvoip_log_file_write_header(FILE* file);
 
 #ifdef TGVOIP_USE_SPDLOG
+extern std::shared_ptr<spdlog::logger> _voip_logger;
+
+inline spdlog::level::level_enum tgvoip_log_spdlog_level(char level){
+	switch(level){
+		case 'V':
+			return spdlog::level::trace;
+		case 'D':
+			return spdlog::level::debug;
+		case 'I':
+			return spdlog::level::info;
+		case 'W':
+			return spdlog::level::warn;
+		case 'E':
+			return spdlog::level::err;
+		default:
+			return spdlog::level::off;
+	}
+}
+
+// checked before the arguments are evaluated and formatted
+inline bool tgvoip_log_spdlog_enabled(char level){
+	return _voip_logger && _voip_logger->should_log(tgvoip_log_spdlog_level(level));
+}
+
 void tgvoip_log_spdlog(char level, const char* msg, ...);
+
+/**
+ * Queues an already formatted line to be written to logger by a background thread.
+ * Never blocks: lines are dropped (and the drop is reported later) when the queue is full.
+ * Loggers passed here must stay alive until tgvoip_log_async_flush() is called.
+ */
+void tgvoip_log_async(spdlog::logger* logger, spdlog::level::level_enum level, const char* text, size_t length);
+// writes out everything queued so far, call before dropping the loggers
+void tgvoip_log_async_flush();
 #endif
 
 #if defined(__ANDROID__)
@@ -67,7 +100,7 @@ void tgvoip_log_spdlog(char level, const char* msg, ...);
 #include <stdio.h>
 
 #ifdef TGVOIP_USE_SPDLOG
-#define _TGVOIP_LOG_PRINT(verb, msg, ...) {tgvoip_log_spdlog(verb, msg, ##__VA_ARGS__);}
+#define _TGVOIP_LOG_PRINT(verb, msg, ...) {if(tgvoip_log_spdlog_enabled(verb)) tgvoip_log_spdlog(verb, msg, ##__VA_ARGS__);}
 #else
 #define _TGVOIP_LOG_PRINT(verb, msg, ...) {printf("%c/tgvoip: " msg "\n", verb, ##__VA_ARGS__); tgvoip_log_file_printf(verb, msg, ##__VA_ARGS__);}
 #endif
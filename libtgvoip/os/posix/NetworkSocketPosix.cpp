@@ -95,6 +95,10 @@ void NetworkSocketPosix::Send(NetworkPacket *packet){
 		sockaddr_in6 addr;
 		IPv4Address *v4addr=dynamic_cast<IPv4Address *>(packet->address);
 		if(v4addr){
+			if(usingKnownAddressFamilies && !observedV4 && !observedNat64 && VoIPController::GetCurrentTime()>knownCheckAt){
+				LOGI("No replies with known address families, detecting them again");
+				DropKnownAddressFamilies();
+			}
 			if(needUpdateNat64Prefix && !isV4Available && VoIPController::GetCurrentTime()>switchToV6at && switchToV6at!=0){
 				LOGV("Updating NAT64 prefix");
 				nat64Present=false;
@@ -164,7 +168,10 @@ void NetworkSocketPosix::Send(NetworkPacket *packet){
 			}
 		}else{
     		LOGE("error sending: %d / %s", errno, strerror(errno));
-    		if(errno==ENETUNREACH && !isV4Available && VoIPController::GetCurrentTime()<switchToV6at){
+    		if(errno==ENETUNREACH && usingKnownAddressFamilies && !observedV4 && !observedNat64){
+    			LOGI("Network unreachable with known address families, detecting them again");
+    			DropKnownAddressFamilies();
+    		}else if(errno==ENETUNREACH && !isV4Available && VoIPController::GetCurrentTime()<switchToV6at){
     			switchToV6at=VoIPController::GetCurrentTime();
     			LOGI("Network unreachable, trying NAT64");
     		}
@@ -213,9 +220,14 @@ void NetworkSocketPosix::Receive(NetworkPacket *packet){
 			return;
 		}
 		//LOGV("Received %d bytes from %s:%d at %.5lf", len, inet_ntoa(srcAddr.sin_addr), ntohs(srcAddr.sin_port), GetCurrentTime());
-		if(!isV4Available && IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr)){
-			isV4Available=true;
-			LOGI("Detected IPv4 connectivity, will not try IPv6");
+		if(IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr)){
+			observedV4=true;
+			if(!isV4Available){
+				isV4Available=true;
+				LOGI("Detected IPv4 connectivity, will not try IPv6");
+			}
+		}else if(nat64Present && memcmp(nat64Prefix, srcAddr.sin6_addr.s6_addr, 12)==0){
+			observedNat64=true;
 		}
 		if(IN6_IS_ADDR_V4MAPPED(&srcAddr.sin6_addr) || (nat64Present && memcmp(nat64Prefix, srcAddr.sin6_addr.s6_addr, 12)==0)){
 			in_addr v4addr=*((in_addr *) &srcAddr.sin6_addr.s6_addr[12]);
@@ -294,7 +306,23 @@ void NetworkSocketPosix::Open(){
 
 	needUpdateNat64Prefix=true;
 	isV4Available=false;
+	observedV4=false;
+	observedNat64=false;
+	usingKnownAddressFamilies=false;
 	switchToV6at=VoIPController::GetCurrentTime()+ipv6Timeout;
+	if(haveKnownAddressFamilies){
+		usingKnownAddressFamilies=true;
+		knownCheckAt=VoIPController::GetCurrentTime()+ipv6Timeout;
+		if(knownAddressFamilies.v4Available){
+			isV4Available=true;
+		}else if(knownAddressFamilies.nat64Present){
+			LOGI("Using known NAT64 prefix");
+			nat64Present=true;
+			memcpy(nat64Prefix, knownAddressFamilies.nat64Prefix, 12);
+			needUpdateNat64Prefix=false;
+			switchToV6at=VoIPController::GetCurrentTime();
+		}
+	}
 }
 
 void NetworkSocketPosix::Close(){
@@ -362,11 +390,41 @@ void NetworkSocketPosix::Connect(const NetworkAddress *address, uint16_t port){
 }
 
 void NetworkSocketPosix::OnActiveInterfaceChanged(){
+	// whatever was known applied to the previous network
+	haveKnownAddressFamilies=false;
+	usingKnownAddressFamilies=false;
 	needUpdateNat64Prefix=true;
 	isV4Available=false;
+	observedV4=false;
+	observedNat64=false;
 	switchToV6at=VoIPController::GetCurrentTime()+ipv6Timeout;
 }
 
+void NetworkSocketPosix::DropKnownAddressFamilies(){
+	// the network changed since they were saved, probe as if nothing was known;
+	// nat64_fallback_timeout has passed already, so the NAT64 lookup is due right away
+	usingKnownAddressFamilies=false;
+	isV4Available=false;
+	nat64Present=false;
+	needUpdateNat64Prefix=true;
+	switchToV6at=VoIPController::GetCurrentTime();
+}
+
+NetworkSocket::AddressFamilyInfo NetworkSocketPosix::GetAddressFamilyInfo(){
+	// only what this socket saw, a guess from the saved state must not be saved again
+	AddressFamilyInfo info;
+	info.v4Available=observedV4;
+	info.nat64Present=!observedV4 && observedNat64;
+	if(info.nat64Present)
+		memcpy(info.nat64Prefix, nat64Prefix, 12);
+	return info;
+}
+
+void NetworkSocketPosix::SetAddressFamilyInfo(const AddressFamilyInfo& info){
+	knownAddressFamilies=info;
+	haveKnownAddressFamilies=info.v4Available || info.nat64Present;
+}
+
 std::string NetworkSocketPosix::GetLocalInterfaceInfo(IPv4Address *v4addr, IPv6Address *v6addr){
 	std::string name="";
 	// Android doesn't support ifaddrs
@@ -479,7 +537,7 @@ IPv4Address *NetworkSocketPosix::ResolveDomainName(std::string name){
 	IPv4Address* ret=NULL;
 	int res=getaddrinfo(name.c_str(), NULL, NULL, &addr0);
 	if(res!=0){
-		LOGW("Error updating NAT64 prefix: %d / %s", res, gai_strerror(res));
+		LOGW("Error resolving %s: %d / %s", name.c_str(), res, gai_strerror(res));
 	}else{
 		addrinfo* addrPtr;
 		for(addrPtr=addr0;addrPtr;addrPtr=addrPtr->ai_next){
@@ -511,7 +569,7 @@ void NetworkSocketPosix::SetTimeouts(int sendTimeout, int recvTimeout){
 	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 }
 
-bool NetworkSocketPosix::Select(std::vector<NetworkSocket *> &readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket *> &errorFds, SocketSelectCanceller* _canceller){
+bool NetworkSocketPosix::Select(std::vector<NetworkSocket *> &readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket *> &errorFds, SocketSelectCanceller* _canceller, double timeout){
 	fd_set readSet;
 	fd_set writeSet;
 	fd_set errorSet;
@@ -564,7 +622,12 @@ bool NetworkSocketPosix::Select(std::vector<NetworkSocket *> &readFds, std::vect
 			maxfd=sfd;
 	}
 
-	select(maxfd+1, &readSet, &writeSet, &errorSet, NULL);
+	timeval tv;
+	if(timeout>0){
+		tv.tv_sec=(time_t)timeout;
+		tv.tv_usec=(suseconds_t)((timeout-tv.tv_sec)*1000000.0);
+	}
+	select(maxfd+1, &readSet, &writeSet, &errorSet, timeout>0 ? &tv : NULL);
 
 	if(canceller && FD_ISSET(canceller->pipeRead, &readSet) && !anyFailed){
 		char c;
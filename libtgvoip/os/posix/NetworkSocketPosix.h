@@ -38,13 +38,15 @@ public:
 	virtual std::string GetLocalInterfaceInfo(IPv4Address* v4addr, IPv6Address* v6addr) override;
 	virtual void OnActiveInterfaceChanged() override;
 	virtual uint16_t GetLocalPort() override;
+	virtual AddressFamilyInfo GetAddressFamilyInfo() override;
+	virtual void SetAddressFamilyInfo(const AddressFamilyInfo& info) override;
 
 	static std::string V4AddressToString(uint32_t address);
 	static std::string V6AddressToString(const unsigned char address[16]);
 	static uint32_t StringToV4Address(std::string address);
 	static void StringToV6Address(std::string address, unsigned char* out);
 	static IPv4Address* ResolveDomainName(std::string name);
-	static bool Select(std::vector<NetworkSocket*>& readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*>& errorFds, SocketSelectCanceller* canceller);
+	static bool Select(std::vector<NetworkSocket*>& readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*>& errorFds, SocketSelectCanceller* canceller, double timeout);
 
 	virtual NetworkAddress *GetConnectedAddress() override;
 
@@ -63,6 +65,15 @@ private:
 	bool nat64Present;
 	double switchToV6at;
 	bool isV4Available;
+	// replies actually received since Open(), only these are reported by GetAddressFamilyInfo
+	bool observedV4=false;
+	bool observedNat64=false;
+	bool haveKnownAddressFamilies=false;
+	AddressFamilyInfo knownAddressFamilies;
+	// known address families are a guess until a reply confirms them, dropped at knownCheckAt otherwise
+	bool usingKnownAddressFamilies=false;
+	double knownCheckAt=0;
+	void DropKnownAddressFamilies();
 	bool useTCP;
 	bool closing;
 	IPv4Address lastRecvdV4;
@@ -595,7 +595,7 @@ void NetworkSocketWinsock::SetTimeouts(int sendTimeout, int recvTimeout){
 	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
 }
 
-bool NetworkSocketWinsock::Select(std::vector<NetworkSocket*> &readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*> &errorFds, SocketSelectCanceller* _canceller){
+bool NetworkSocketWinsock::Select(std::vector<NetworkSocket*> &readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*> &errorFds, SocketSelectCanceller* _canceller, double _timeout){
 	fd_set readSet;
 	fd_set errorSet;
 	fd_set writeSet;
@@ -603,6 +603,7 @@ bool NetworkSocketWinsock::Select(std::vector<NetworkSocket*> &readFds, std::vec
 	timeval timeout={0, 10000};
 	bool anyFailed=false;
 	int res=0;
+	double deadline=_timeout>0 ? VoIPController::GetCurrentTime()+_timeout : 0;
 
 	do{
 		FD_ZERO(&readSet);
@@ -646,6 +647,8 @@ bool NetworkSocketWinsock::Select(std::vector<NetworkSocket*> &readFds, std::vec
 		//LOGV("select result %d", res);
 		if(res==SOCKET_ERROR)
 			LOGE("SELECT ERROR %d", WSAGetLastError());
+		if(res==0 && deadline>0 && VoIPController::GetCurrentTime()>=deadline)
+			break;
 	}while(res==0);
 
 
@@ -42,7 +42,7 @@ public:
 	static uint32_t StringToV4Address(std::string address);
 	static void StringToV6Address(std::string address, unsigned char* out);
 	static IPv4Address* ResolveDomainName(std::string name);
-	static bool Select(std::vector<NetworkSocket*>& readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*>& errorFds, SocketSelectCanceller* canceller);
+	static bool Select(std::vector<NetworkSocket*>& readFds, std::vector<NetworkSocket*>& writeFds, std::vector<NetworkSocket*>& errorFds, SocketSelectCanceller* canceller, double timeout);
 	virtual NetworkAddress *GetConnectedAddress();
 	virtual uint16_t GetConnectedPort();
 	virtual void SetTimeouts(int sendTimeout, int recvTimeout);
@@ -0,0 +1,281 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+// Offline replay of a capture written by CallCapture (VoIPController::Config::captureFilePath).
+// Incoming packets, jitter buffer ticks and decoder pulls are fed to a fresh JitterBuffer and
+// OpusDecoder in the recorded order with the recorded clock, as fast as possible. Every decoded
+// frame is checked against the checksum taken during the call, so any difference in jitter
+// buffer or decoder behaviour shows up as a mismatch.
+
+#include "../VoIPController.h"
+#include "../CallCapture.h"
+#include "../JitterBuffer.h"
+#include "../OpusDecoder.h"
+#include "../VoIPServerConfig.h"
+#include "../Buffers.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+using namespace tgvoip;
+
+namespace tgvoip{
+	namespace test{
+		class CaptureReplay{
+		public:
+			struct Result{
+				uint64_t incomingPackets=0;
+				uint64_t outgoingFrames=0;
+				uint64_t ticks=0;
+				uint64_t decodedFrames=0;
+				uint64_t checkedFrames=0;
+				uint64_t mismatches=0;
+				double callDuration=0;  // seconds between first and last timed record
+				double replayDuration=0; // wall clock seconds
+				uint32_t outputChecksum=0; // combined checksum of all replayed PCM, equal for equal output
+			};
+
+			bool Load(std::string path){
+				FILE* f=fopen(path.c_str(), "rb");
+				if(!f){
+					fprintf(stderr, "Can't open %s\n", path.c_str());
+					return false;
+				}
+				unsigned char chunk[64*1024];
+				size_t len;
+				while((len=fread(chunk, 1, sizeof(chunk), f))>0)
+					data.insert(data.end(), chunk, chunk+len);
+				fclose(f);
+				if(data.size()<10){
+					fprintf(stderr, "%s is too short to be a capture\n", path.c_str());
+					return false;
+				}
+				BufferInputStream in(data.data(), data.size());
+				if((uint32_t)in.ReadInt32()!=CALL_CAPTURE_MAGIC){
+					fprintf(stderr, "%s is not a capture file\n", path.c_str());
+					return false;
+				}
+				int version=in.ReadInt16();
+				if(version!=CALL_CAPTURE_VERSION){
+					fprintf(stderr, "Unsupported capture version %d\n", version);
+					return false;
+				}
+				size_t configLen=(size_t)in.ReadInt32();
+				if(in.Remaining()<configLen){
+					fprintf(stderr, "Truncated capture header\n");
+					return false;
+				}
+				serverConfig.assign(reinterpret_cast<const char*>(data.data()+in.GetOffset()), configLen);
+				recordsOffset=in.GetOffset()+configLen;
+				return true;
+			}
+
+			Result Run(FILE* pcmOut){
+				Result res;
+				ServerConfig::GetSharedInstance()->Update(serverConfig);
+				std::shared_ptr<JitterBuffer> jitterBuffer;
+				std::unique_ptr<OpusDecoder> decoder;
+				NullOutput sink;
+				int lastDuration=0;
+				uint32_t lastChecksum=0;
+				size_t lastCount=0;
+				bool haveDecoded=false;
+				double firstTime=0, lastTime=0;
+				uint32_t outputChecksum=2166136261;
+				unsigned char outBuf[8192];
+
+				std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+				BufferInputStream in(data.data(), data.size());
+				in.Seek(recordsOffset);
+				while(in.Remaining()>=3){
+					unsigned char type=in.ReadByte();
+					size_t len=(uint16_t)in.ReadInt16();
+					if(in.Remaining()<len){
+						fprintf(stderr, "Capture is truncated, stopping\n");
+						break;
+					}
+					BufferInputStream rec=in.GetPartBuffer(len, true);
+					switch(type){
+						case CallCapture::RECORD_STREAM:{
+							rec.ReadByte(); // stream id
+							uint32_t frameDuration=(uint32_t)rec.ReadInt32();
+							jitterBuffer=std::make_shared<JitterBuffer>(nullptr, frameDuration);
+							break;
+						}
+						case CallCapture::RECORD_MIN_PACKET_COUNT:
+							if(jitterBuffer)
+								jitterBuffer->SetMinPacketCount((uint32_t)rec.ReadInt32());
+							break;
+						case CallCapture::RECORD_DECODER:{
+							bool needEC=rec.ReadByte()!=0;
+							uint32_t frameDuration=(uint32_t)rec.ReadInt32();
+							decoder.reset(new OpusDecoder(&sink, false, needEC));
+							decoder->SetJitterBuffer(jitterBuffer);
+							decoder->SetFrameDuration(frameDuration);
+							break;
+						}
+						case CallCapture::RECORD_INCOMING:{
+							double time=ReadDouble(rec);
+							rec.ReadByte(); // packet type
+							rec.ReadInt32(); // seq
+							uint32_t pts=(uint32_t)rec.ReadInt32();
+							bool isEC=rec.ReadByte()!=0;
+							UpdateTime(time, firstTime, lastTime);
+							if(jitterBuffer && rec.Remaining()<=sizeof(outBuf)){
+								size_t dataLen=rec.Remaining();
+								rec.ReadBytes(outBuf, dataLen);
+								jitterBuffer->HandleInput(outBuf, dataLen, pts, isEC, time);
+							}
+							res.incomingPackets++;
+							break;
+						}
+						case CallCapture::RECORD_OUTGOING:
+							UpdateTime(ReadDouble(rec), firstTime, lastTime);
+							res.outgoingFrames++;
+							break;
+						case CallCapture::RECORD_JITTER_TICK:
+							UpdateTime(ReadDouble(rec), firstTime, lastTime);
+							if(jitterBuffer)
+								jitterBuffer->Tick();
+							res.ticks++;
+							break;
+						case CallCapture::RECORD_JITTER_OUTPUT:{
+							UpdateTime(ReadDouble(rec), firstTime, lastTime);
+							int offset=rec.ReadInt32();
+							bool advance=rec.ReadByte()!=0;
+							if(!jitterBuffer)
+								break;
+							if(!decoder){
+								// no decoder in the capture, replay the jitter buffer output alone
+								int playbackDuration=0;
+								bool isEC=false;
+								jitterBuffer->HandleOutput(outBuf, sizeof(outBuf), offset, advance, playbackDuration, isEC);
+								break;
+							}
+							// the non-advancing FEC lookup is done by DecodeNextFrame itself
+							if(!advance)
+								break;
+							lastDuration=decoder->DecodeNextFrame();
+							lastCount=decoder->remainingDataLen>0 ? (size_t)(lastDuration/20*960) : 0;
+							lastChecksum=CallCapture::Checksum(reinterpret_cast<int16_t*>(decoder->processedBuffer), lastCount);
+							haveDecoded=true;
+							res.decodedFrames++;
+							size_t frameLen=(size_t)(lastDuration/20*960)*2;
+							const unsigned char* pcm=lastCount ? decoder->processedBuffer : NULL;
+							if(!pcm){
+								memset(outBuf, 0, frameLen);
+								pcm=outBuf;
+							}
+							outputChecksum=outputChecksum*16777619 ^ CallCapture::Checksum(reinterpret_cast<const int16_t*>(pcm), frameLen/2);
+							if(pcmOut)
+								fwrite(pcm, 1, frameLen, pcmOut);
+							break;
+						}
+						case CallCapture::RECORD_DECODED:{
+							UpdateTime(ReadDouble(rec), firstTime, lastTime);
+							int playbackDuration=rec.ReadInt32();
+							size_t count=(size_t)rec.ReadInt32();
+							uint32_t checksum=(uint32_t)rec.ReadInt32();
+							if(!haveDecoded)
+								break;
+							haveDecoded=false;
+							res.checkedFrames++;
+							if(playbackDuration!=lastDuration || count!=lastCount || checksum!=lastChecksum){
+								if(res.mismatches<10)
+									fprintf(stderr, "Frame %llu differs: duration %d/%d, samples %u/%u, checksum %08X/%08X\n", (unsigned long long)res.decodedFrames,
+											playbackDuration, lastDuration, (unsigned int)count, (unsigned int)lastCount, checksum, lastChecksum);
+								res.mismatches++;
+							}
+							break;
+						}
+						default:
+							// unknown records are skipped so that newer captures can still be replayed
+							break;
+					}
+				}
+				res.replayDuration=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+				res.callDuration=lastTime-firstTime;
+				res.outputChecksum=outputChecksum;
+				return res;
+			}
+
+		private:
+			class NullOutput : public MediaStreamItf{
+			public:
+				virtual void Start(){}
+				virtual void Stop(){}
+			};
+
+			static double ReadDouble(BufferInputStream& in){
+				int64_t bits=in.ReadInt64();
+				double d;
+				memcpy(&d, &bits, sizeof(d));
+				return d;
+			}
+
+			static void UpdateTime(double time, double& firstTime, double& lastTime){
+				if(firstTime==0)
+					firstTime=time;
+				lastTime=time;
+			}
+
+			std::vector<unsigned char> data;
+			std::string serverConfig;
+			size_t recordsOffset=0;
+		};
+	}
+}
+
+using namespace tgvoip::test;
+
+int main(int argc, char** argv){
+	std::string capturePath;
+	std::string pcmPath;
+	for(int i=1;i<argc;i++){
+		if(i+1<argc && !strcmp(argv[i], "--pcm")){
+			pcmPath=argv[++i];
+		}else if(argv[i][0]!='-' && capturePath.empty()){
+			capturePath=argv[i];
+		}else{
+			capturePath.clear();
+			break;
+		}
+	}
+	if(capturePath.empty()){
+		fprintf(stderr, "Usage: %s [--pcm OUTPUT.raw] CAPTURE_FILE\n", argv[0]);
+		fprintf(stderr, "Decoded audio is written as signed 16-bit little-endian mono at 48 kHz\n");
+		return 1;
+	}
+
+	CaptureReplay replay;
+	if(!replay.Load(capturePath))
+		return 1;
+	FILE* pcmOut=NULL;
+	if(!pcmPath.empty()){
+		pcmOut=fopen(pcmPath.c_str(), "wb");
+		if(!pcmOut){
+			fprintf(stderr, "Can't open %s for writing\n", pcmPath.c_str());
+			return 1;
+		}
+	}
+	CaptureReplay::Result res=replay.Run(pcmOut);
+	if(pcmOut)
+		fclose(pcmOut);
+
+	printf("incoming packets:  %llu\n", (unsigned long long)res.incomingPackets);
+	printf("outgoing frames:   %llu\n", (unsigned long long)res.outgoingFrames);
+	printf("jitter ticks:      %llu\n", (unsigned long long)res.ticks);
+	printf("decoded frames:    %llu (%llu checked, %llu mismatched)\n", (unsigned long long)res.decodedFrames,
+		   (unsigned long long)res.checkedFrames, (unsigned long long)res.mismatches);
+	printf("output checksum:   %08X\n", res.outputChecksum);
+	printf("call duration:     %.3f s\n", res.callDuration);
+	printf("replay duration:   %.3f s (%.0fx real time)\n", res.replayDuration,
+		   res.replayDuration>0 ? res.callDuration/res.replayDuration : 0.0);
+	return res.mismatches ? 2 : 0;
+}
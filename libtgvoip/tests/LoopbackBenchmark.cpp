@@ -0,0 +1,404 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+// Loopback load benchmark: N pairs of VoIPControllers talk to each other through
+// a local MockReflector while synthetic PCM is pushed through software audio ports.
+// Number of pairs is ramped up step by step, every step reports CPU per call,
+// packet rate, allocation rate, end-to-end audio latency and memory per call.
+
+#include "MockReflector.h"
+#include "../VoIPController.h"
+#include "../StageTimers.h"
+#include "../VoIPServerConfig.h"
+#include "../threading.h"
+#include <pjsua2.hpp>
+#include <openssl/rand.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace tgvoip;
+
+// with TGVOIP_ALLOCATION_ACCOUNTING the library owns operator new and counts allocations per call
+#ifndef TGVOIP_ALLOCATION_ACCOUNTING
+namespace{
+	std::atomic<uint64_t> allocationCount(0);
+}
+
+void* operator new(size_t size){
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	void* p=malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+	free(p);
+}
+#endif
+
+namespace{
+	// 10ms at 48kHz, same as software audio ports frame
+	const size_t FRAME_SAMPLES=480;
+	// one 10ms 1kHz tone burst per second, everything else is silence
+	const int PULSE_INTERVAL_FRAMES=100;
+	const int16_t PULSE_AMPLITUDE=16000;
+	const double DETECT_LEVEL=3000;
+
+	double Now(){
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	double CpuTime(){
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec+usage.ru_stime.tv_sec+(usage.ru_utime.tv_usec+usage.ru_stime.tv_usec)/1000000.0;
+	}
+
+	struct MemoryUsage{
+		double heap=0; // bytes in use by malloc, 0 where glibc can't tell
+		double rss=0;
+		double vm=0; // address space, includes reserved thread stacks
+	};
+
+	MemoryUsage ReadMemoryUsage(){
+		MemoryUsage usage;
+#if defined(__GLIBC__) && (__GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=33))
+		struct mallinfo2 info=mallinfo2();
+		usage.heap=(double)(info.uordblks+info.hblkhd);
+#endif
+		FILE* f=fopen("/proc/self/statm", "r");
+		if(f){
+			unsigned long size, resident;
+			if(fscanf(f, "%lu %lu", &size, &resident)==2){
+				long pageSize=sysconf(_SC_PAGESIZE);
+				usage.vm=(double)size*pageSize;
+				usage.rss=(double)resident*pageSize;
+			}
+			fclose(f);
+		}
+		return usage;
+	}
+
+	struct CallPair{
+		std::shared_ptr<VoIPController> caller;
+		std::shared_ptr<VoIPController> callee;
+		int frameCounter=0;
+		double pulseSentAt=0;
+	};
+
+	struct Benchmark{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<CallPair>> pairs;
+		HdrHistogram latency; // microseconds
+		pjmedia_clock* clock=NULL;
+		int16_t pulse[FRAME_SAMPLES];
+		int16_t silence[FRAME_SAMPLES];
+		int16_t output[FRAME_SAMPLES];
+
+		Benchmark(){
+			for(size_t i=0;i<FRAME_SAMPLES;i++)
+				pulse[i]=(int16_t)(PULSE_AMPLITUDE*sin(2*M_PI*1000.0*i/48000.0));
+			memset(silence, 0, sizeof(silence));
+		}
+
+		static void PutFrame(pjmedia_port* port, int16_t* samples){
+			pjmedia_frame frame;
+			memset(&frame, 0, sizeof(frame));
+			frame.type=PJMEDIA_FRAME_TYPE_AUDIO;
+			frame.buf=samples;
+			frame.size=FRAME_SAMPLES*2;
+			pjmedia_port_put_frame(port, &frame);
+		}
+
+		static bool GetFrame(pjmedia_port* port, int16_t* samples){
+			pjmedia_frame frame;
+			memset(&frame, 0, sizeof(frame));
+			frame.type=PJMEDIA_FRAME_TYPE_AUDIO;
+			frame.buf=samples;
+			frame.size=FRAME_SAMPLES*2;
+			return pjmedia_port_get_frame(port, &frame)==PJ_SUCCESS && frame.type==PJMEDIA_FRAME_TYPE_AUDIO;
+		}
+
+		static double Level(const int16_t* samples){
+			double sum=0;
+			for(size_t i=0;i<FRAME_SAMPLES;i++)
+				sum+=abs(samples[i]);
+			return sum/FRAME_SAMPLES;
+		}
+
+		void Tick(){
+			std::lock_guard<std::mutex> lock(mutex);
+			double now=Now();
+			for(std::unique_ptr<CallPair>& pair:pairs){
+				bool sendPulse=pair->frameCounter++%PULSE_INTERVAL_FRAMES==0;
+				if(sendPulse && pair->caller->GetConnectionState()==STATE_ESTABLISHED && pair->pulseSentAt==0)
+					pair->pulseSentAt=now;
+				else
+					sendPulse=false;
+				PutFrame(pair->caller->AudioPortInput(), sendPulse ? pulse : silence);
+				PutFrame(pair->callee->AudioPortInput(), silence);
+
+				GetFrame(pair->caller->AudioPortOutput(), output);
+				if(GetFrame(pair->callee->AudioPortOutput(), output) && pair->pulseSentAt>0){
+					if(Level(output)>DETECT_LEVEL){
+						latency.Record((uint64_t)((now-pair->pulseSentAt)*1000000.0));
+						pair->pulseSentAt=0;
+					}else if(now-pair->pulseSentAt>2.0){
+						// pulse was lost
+						pair->pulseSentAt=0;
+					}
+				}
+			}
+		}
+
+		static void OnClock(const pj_timestamp*, void* userData){
+			reinterpret_cast<Benchmark*>(userData)->Tick();
+		}
+	};
+
+	std::shared_ptr<VoIPController> CreateController(const VoIPController::Config& config, uint16_t port, const uint8_t* peerTag, char* key, bool outgoing){
+		std::shared_ptr<VoIPController> controller=std::make_shared<VoIPController>();
+		controller->SetConfig(config);
+		std::vector<Endpoint> endpoints;
+		endpoints.push_back(Endpoint(1, port, IPv4Address("127.0.0.1"), IPv6Address(), Endpoint::Type::UDP_RELAY, (unsigned char*)peerTag));
+		controller->SetRemoteEndpoints(endpoints, false, VoIPController::GetConnectionMaxLayer());
+		controller->SetEncryptionKey(key, outgoing);
+		controller->Start();
+		controller->Connect();
+		return controller;
+	}
+
+	uint64_t CountPackets(std::vector<std::unique_ptr<CallPair>>& pairs){
+		uint64_t total=0;
+		for(std::unique_ptr<CallPair>& pair:pairs){
+			VoIPController::MediaStats stats;
+			pair->caller->GetMediaStats(&stats);
+			total+=stats.packetsSent+stats.packetsRecvd;
+			pair->callee->GetMediaStats(&stats);
+			total+=stats.packetsSent+stats.packetsRecvd;
+		}
+		return total;
+	}
+
+	uint64_t CountAllocations(std::vector<std::unique_ptr<CallPair>>& pairs){
+#ifdef TGVOIP_ALLOCATION_ACCOUNTING
+		uint64_t total=0;
+		for(std::unique_ptr<CallPair>& pair:pairs){
+			VoIPController::ResourceStats stats;
+			pair->caller->GetStats(&stats);
+			total+=stats.allocationCount;
+			pair->callee->GetStats(&stats);
+			total+=stats.allocationCount;
+		}
+		return total;
+#else
+		return allocationCount.load();
+#endif
+	}
+
+	void Usage(const char* name){
+		fprintf(stderr, "Usage: %s [--max-pairs N] [--step N] [--duration SECONDS] [--port PORT]\n"
+				"       [--reflector-threads N] [--network good|3g|lossy|TRACE_FILE] [--stack-report]\n", name);
+	}
+}
+
+int main(int argc, char** argv){
+	int maxPairs=50;
+	int step=10;
+	int duration=10;
+	uint16_t port=1033;
+	unsigned int reflectorThreads=1;
+	std::string network;
+	bool stackReport=false;
+	for(int i=1;i<argc;i++){
+		if(i+1<argc && !strcmp(argv[i], "--max-pairs")){
+			maxPairs=atoi(argv[++i]);
+		}else if(i+1<argc && !strcmp(argv[i], "--step")){
+			step=atoi(argv[++i]);
+		}else if(i+1<argc && !strcmp(argv[i], "--duration")){
+			duration=atoi(argv[++i]);
+		}else if(i+1<argc && !strcmp(argv[i], "--port")){
+			port=(uint16_t)atoi(argv[++i]);
+		}else if(i+1<argc && !strcmp(argv[i], "--reflector-threads")){
+			reflectorThreads=(unsigned int)atoi(argv[++i]);
+		}else if(i+1<argc && !strcmp(argv[i], "--network")){
+			network=argv[++i];
+		}else if(!strcmp(argv[i], "--stack-report")){
+			stackReport=true;
+		}else{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+	if(maxPairs<=0 || step<=0 || duration<=0){
+		Usage(argv[0]);
+		return 1;
+	}
+	if(stackReport){
+		// worst case for the stack: full DSP and Opus kept at complexity 10. Painting commits
+		// the probed memory, so the rss column is inflated by about 1 MB per thread in this mode.
+		ThreadPolicy policy;
+		policy.stackProbeDepth=1024*1024;
+		Thread::SetPolicy(policy);
+		ServerConfig::GetSharedInstance()->Update("{\"encoder_governor_high_load\":1000}");
+	}
+
+	pj::Endpoint ep;
+	ep.libCreate();
+	pj::EpConfig epConfig;
+	epConfig.logConfig.level=1;
+	epConfig.medConfig.clockRate=48000;
+	epConfig.medConfig.audioFramePtime=10;
+	ep.libInit(epConfig);
+	ep.audDevManager().setNullDev();
+	ep.libStart();
+
+	test::MockReflector reflector("127.0.0.1", port, reflectorThreads);
+	if(network=="good"){
+		reflector.SetDefaultImpairmentProfile(test::ImpairmentProfile::Good());
+	}else if(network=="3g"){
+		reflector.SetDefaultImpairmentProfile(test::ImpairmentProfile::Mobile3G());
+	}else if(network=="lossy"){
+		reflector.SetDefaultImpairmentProfile(test::ImpairmentProfile::Lossy(0.05, 3));
+	}else if(!network.empty()){
+		test::ImpairmentProfile profile;
+		profile.trace=test::ImpairmentProfile::LoadTrace(network);
+		if(profile.trace.empty()){
+			fprintf(stderr, "Can't load network trace from %s\n", network.c_str());
+			return 1;
+		}
+		reflector.SetDefaultImpairmentProfile(profile);
+	}
+	reflector.Start();
+
+	VoIPController::Config config(5.0, 10.0);
+	config.enableAEC=config.enableNS=config.enableAGC=stackReport;
+	config.enableCallUpgrade=false;
+	// ports are driven by the benchmark clock, not by conference bridge
+	config.registerSoftwareAudioPorts=false;
+
+	Benchmark bench;
+	pj_pool_t* pool=pjsua_pool_create("bench", 512, 512);
+	pjmedia_clock_create(pool, 48000, 1, FRAME_SAMPLES, 0, &Benchmark::OnClock, &bench, &bench.clock);
+	pjmedia_clock_start(bench.clock);
+
+	// everything the process holds beyond this is accounted to the calls
+	MemoryUsage baseline=ReadMemoryUsage();
+
+	printf("%6s %10s %12s %12s %10s %10s %10s %12s %12s %12s\n", "pairs", "cpu/call%", "packets/s", "allocs/s", "lat p50ms", "lat p99ms", "lat max",
+		   "heapKB/call", "rssKB/call", "vmKB/call");
+
+	for(int target=step;target<=maxPairs;target+=step){
+		{
+			std::lock_guard<std::mutex> lock(bench.mutex);
+			while((int)bench.pairs.size()<target){
+				std::array<std::array<uint8_t, 16>, 2> peerTags=test::MockReflector::GeneratePeerTags();
+				char key[256];
+				RAND_bytes((uint8_t*)key, sizeof(key));
+				std::unique_ptr<CallPair> pair(new CallPair());
+				pair->caller=CreateController(config, port, peerTags[0].data(), key, true);
+				pair->callee=CreateController(config, port, peerTags[1].data(), key, false);
+				bench.pairs.push_back(std::move(pair));
+			}
+		}
+		// let new calls finish handshake before measuring
+		std::this_thread::sleep_for(std::chrono::seconds(2));
+
+		uint64_t packetsBefore, allocsBefore;
+		{
+			std::lock_guard<std::mutex> lock(bench.mutex);
+			packetsBefore=CountPackets(bench.pairs);
+			allocsBefore=CountAllocations(bench.pairs);
+			bench.latency.Reset();
+		}
+		double cpuBefore=CpuTime();
+		double start=Now();
+
+		std::this_thread::sleep_for(std::chrono::seconds(duration));
+
+		double elapsed=Now()-start;
+		double cpu=CpuTime()-cpuBefore;
+		uint64_t allocs;
+		uint64_t packets;
+		int established=0;
+		{
+			std::lock_guard<std::mutex> lock(bench.mutex);
+			packets=CountPackets(bench.pairs)-packetsBefore;
+			allocs=CountAllocations(bench.pairs)-allocsBefore;
+			for(std::unique_ptr<CallPair>& pair:bench.pairs){
+				if(pair->caller->GetConnectionState()==STATE_ESTABLISHED && pair->callee->GetConnectionState()==STATE_ESTABLISHED)
+					established++;
+			}
+		}
+		if(established<target)
+			fprintf(stderr, "warning: only %d of %d pairs established\n", established, target);
+		MemoryUsage memory=ReadMemoryUsage();
+		double calls=target*2*1024.0;
+
+		printf("%6d %10.2f %12.0f %12.0f %10.1f %10.1f %10.1f %12.1f %12.1f %12.1f\n", target,
+			   cpu/elapsed*100.0/(target*2),
+			   packets/elapsed,
+			   allocs/elapsed,
+			   bench.latency.GetValueAtPercentile(50)/1000.0,
+			   bench.latency.GetValueAtPercentile(99)/1000.0,
+			   bench.latency.GetMax()/1000.0,
+			   (memory.heap-baseline.heap)/calls,
+			   (memory.rss-baseline.rss)/calls,
+			   (memory.vm-baseline.vm)/calls);
+		fflush(stdout);
+	}
+
+	pjmedia_clock_destroy(bench.clock);
+	pj_pool_release(pool);
+
+	StageTimers::Stats stats[MEDIA_STAGE_COUNT];
+	VoIPController::GetAggregatedStageTimerStats(stats);
+	printf("\n%8s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p99 us", "max us");
+	for(int i=0;i<MEDIA_STAGE_COUNT;i++){
+		printf("%8s %10llu %10.1f %10.1f %10.1f\n", stats[i].stage, (unsigned long long)stats[i].count, stats[i].mean, stats[i].p99, stats[i].max);
+	}
+
+	test::MockReflector::Stats reflectorStats=reflector.GetStats();
+	printf("\nreflector: %llu received, %llu forwarded, %llu lost, %llu tail dropped, %llu reordered\n",
+		   (unsigned long long)reflectorStats.received, (unsigned long long)reflectorStats.forwarded,
+		   (unsigned long long)reflectorStats.lost, (unsigned long long)reflectorStats.tailDropped,
+		   (unsigned long long)reflectorStats.reordered);
+
+	for(std::unique_ptr<CallPair>& pair:bench.pairs){
+		pair->caller->Stop();
+		pair->callee->Stop();
+	}
+	bench.pairs.clear();
+	reflector.Stop();
+	ep.libDestroy();
+
+	if(stackReport){
+		// peaks of threads that have exited by now, i.e. everything the pairs started
+		printf("\n%24s %12s\n", "thread", "stack KB");
+		for(const std::pair<std::string, size_t>& peak:Thread::GetStackPeaks()){
+			printf("%24s %12.1f%s\n", peak.first.c_str(), peak.second/1024.0, peak.second>=1024*1024 ? " (probe full)" : "");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,556 @@
+//
+// libtgvoip is free and unencumbered public domain software.
+// For more information, see http://unlicense.org or the UNLICENSE file
+// you should have received with this source code distribution.
+//
+
+// Microbenchmarks for libtgvoip building blocks. Every benchmark body runs a given number of
+// iterations, the runner picks the count so that one run takes at least --min-time seconds
+// and reports the median of --repetitions runs. Results are printed as a table and,
+// with --json, written in the same layout as Google Benchmark JSON output so that existing
+// comparison tools can be used on them.
+
+#include "../VoIPController.h"
+#include "../Buffers.h"
+#include "../BlockingQueue.h"
+#include "../JitterBuffer.h"
+#include "../CongestionControl.h"
+#include "../EchoCanceller.h"
+#include "../audio/Resampler.h"
+#include "../json11.hpp"
+#ifdef HAVE_CONFIG_H
+#include <opus/opus.h>
+#else
+#include "opus.h"
+#endif
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace tgvoip;
+
+namespace tgvoip{
+	namespace test{
+		class Microbenchmarks{
+		public:
+			// runs the measured operation the given number of times
+			typedef std::function<void(uint64_t)> Body;
+
+			struct Result{
+				std::string name;
+				uint64_t iterations;
+				double realTime; // ns per iteration
+				double cpuTime;  // ns per iteration
+				double bytesPerSecond;
+			};
+
+			void Add(std::string name, size_t bytesPerIteration, Body body){
+				benchmarks.push_back(Benchmark{name, bytesPerIteration, body});
+			}
+
+			void RegisterAll();
+			void Run(const std::string& filter, double minTime, int repetitions);
+			std::string ToJSON();
+
+		private:
+			struct Benchmark{
+				std::string name;
+				size_t bytesPerIteration;
+				Body body;
+			};
+			std::vector<Benchmark> benchmarks;
+			std::vector<Result> results;
+
+			static double CpuNow(){
+				timespec ts;
+				clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+				return ts.tv_sec*1e9+ts.tv_nsec;
+			}
+
+			static double RealNow(){
+				return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			}
+
+			static void GenerateSpeech(int16_t* samples, size_t count, uint32_t seed);
+
+			void RegisterBuffers();
+			void RegisterJitterBuffer();
+			void RegisterCongestionControl();
+			void RegisterCrypto();
+			void RegisterOpus();
+			void RegisterEchoCanceller();
+			void RegisterResampler();
+		};
+	}
+}
+
+using namespace tgvoip::test;
+
+void Microbenchmarks::GenerateSpeech(int16_t* samples, size_t count, uint32_t seed){
+	// voiced-like signal: a few harmonics with slow amplitude modulation plus some noise,
+	// loud enough not to be skipped as silence by the APM gate
+	std::minstd_rand rng(seed);
+	std::normal_distribution<double> noise(0.0, 300.0);
+	for(size_t i=0;i<count;i++){
+		double t=i/48000.0;
+		double envelope=0.6+0.4*sin(2*M_PI*3.0*t);
+		double v=envelope*(6000*sin(2*M_PI*180*t)+3000*sin(2*M_PI*360*t)+1500*sin(2*M_PI*720*t))+noise(rng);
+		samples[i]=(int16_t)std::max(-32768.0, std::min(32767.0, v));
+	}
+}
+
+void Microbenchmarks::RegisterAll(){
+	RegisterBuffers();
+	RegisterJitterBuffer();
+	RegisterCongestionControl();
+	RegisterCrypto();
+	RegisterOpus();
+	RegisterEchoCanceller();
+	RegisterResampler();
+}
+
+void Microbenchmarks::RegisterBuffers(){
+	std::shared_ptr<std::array<unsigned char, 1024>> payload=std::make_shared<std::array<unsigned char, 1024>>();
+	std::fill(payload->begin(), payload->end(), 0x5A);
+
+	// roughly what WritePacketHeader and stream data serialization do for one packet
+	Add("BufferOutputStream/WritePacket", 0, [payload](uint64_t n){
+		BufferOutputStream out(1500);
+		for(uint64_t i=0;i<n;i++){
+			out.Reset();
+			out.WriteInt32(0x1234);
+			out.WriteInt32((int32_t)i);
+			out.WriteInt32((int32_t)i-1);
+			out.WriteInt32(0xFFFFFFFF);
+			out.WriteByte(1);
+			out.WriteInt16(120);
+			out.WriteInt32((int32_t)(i*60));
+			out.WriteBytes(payload->data(), 120);
+		}
+	});
+	Add("BufferOutputStream/WriteBytes1K", 1024, [payload](uint64_t n){
+		BufferOutputStream out(1500);
+		for(uint64_t i=0;i<n;i++){
+			out.Reset();
+			out.WriteBytes(payload->data(), payload->size());
+		}
+	});
+	Add("BufferOutputStream/Expand", 0, [payload](uint64_t n){
+		for(uint64_t i=0;i<n;i++){
+			BufferOutputStream out(64);
+			for(int j=0;j<8;j++)
+				out.WriteBytes(payload->data(), 128);
+		}
+	});
+	Add("Buffer/CopyOf1K", 1024, [](uint64_t n){
+		Buffer src(1024);
+		memset(*src, 1, 1024);
+		for(uint64_t i=0;i<n;i++){
+			Buffer copy=Buffer::CopyOf(src);
+			if(copy[0]!=1)
+				abort();
+		}
+	});
+	Add("BufferPool/GetReuse", 0, [](uint64_t n){
+		BufferPool pool(1024, 10);
+		for(uint64_t i=0;i<n;i++){
+			unsigned char* a=pool.Get();
+			unsigned char* b=pool.Get();
+			pool.Reuse(a);
+			pool.Reuse(b);
+		}
+	});
+	Add("BlockingQueue/PutGet", 0, [](uint64_t n){
+		BlockingQueue<unsigned char*> queue(11);
+		unsigned char dummy;
+		for(uint64_t i=0;i<n;i++){
+			queue.Put(&dummy);
+			queue.GetBlocking();
+		}
+	});
+}
+
+void Microbenchmarks::RegisterJitterBuffer(){
+	struct LossPattern{
+		const char* name;
+		double lossRate;
+		double burstLength;
+	};
+	static const LossPattern patterns[]={
+		{"NoLoss", 0, 1},
+		{"Random5", 0.05, 1},
+		{"Random20", 0.2, 1},
+		{"Burst10", 0.1, 4},
+	};
+	for(const LossPattern& pattern:patterns){
+		Add(std::string("JitterBuffer/PutGet/")+pattern.name, 0, [pattern](uint64_t n){
+			// 60ms frames as with TGVoIP default settings, one packet in and one frame out per iteration,
+			// losses follow Gilbert-Elliott model with given mean burst length
+			JitterBuffer jb(NULL, 60);
+			std::minstd_rand rng(1);
+			std::uniform_real_distribution<double> uniform(0, 1);
+			double toBad=pattern.lossRate*(1.0/pattern.burstLength)/(1-pattern.lossRate);
+			double toGood=1.0/pattern.burstLength;
+			bool bad=false;
+			unsigned char packet[120];
+			memset(packet, 0x11, sizeof(packet));
+			unsigned char out[8192];
+			for(uint64_t i=0;i<n;i++){
+				bad=bad ? uniform(rng)>=toGood : uniform(rng)<toBad;
+				if(!bad)
+					jb.HandleInput(packet, sizeof(packet), (uint32_t)(i*60), false);
+				int playbackDuration=0;
+				bool isEC=false;
+				jb.HandleOutput(out, sizeof(out), 0, true, playbackDuration, isEC);
+				if(i%2==0)
+					jb.Tick();
+			}
+		});
+	}
+}
+
+void Microbenchmarks::RegisterCongestionControl(){
+	Add("CongestionControl/SentAcked", 0, [](uint64_t n){
+		CongestionControl cc;
+		for(uint64_t i=0;i<n;i++){
+			uint32_t seq=(uint32_t)i;
+			cc.PacketSent(seq, 120);
+			// acks arrive a few packets later
+			if(seq>=4)
+				cc.PacketAcknowledged(seq-4);
+			if(i%5==0){
+				cc.Tick();
+				cc.GetBandwidthControlAction();
+			}
+		}
+	});
+	Add("CongestionControl/SentAckedWithLoss", 0, [](uint64_t n){
+		CongestionControl cc;
+		for(uint64_t i=0;i<n;i++){
+			uint32_t seq=(uint32_t)i;
+			cc.PacketSent(seq, 120);
+			if(seq>=4 && (seq-4)%10!=0)
+				cc.PacketAcknowledged(seq-4);
+			if(i%5==0){
+				cc.Tick();
+				cc.GetBandwidthControlAction();
+			}
+		}
+	});
+}
+
+void Microbenchmarks::RegisterCrypto(){
+	std::shared_ptr<VoIPController> controller=std::make_shared<VoIPController>();
+	char key[256];
+	for(int i=0;i<256;i++)
+		key[i]=(char)(i*7);
+	controller->SetEncryptionKey(key, true);
+
+	Add("Crypto/KDF", 0, [controller](uint64_t n){
+		unsigned char msgKey[16], aesKey[32], aesIv[32];
+		memset(msgKey, 3, sizeof(msgKey));
+		for(uint64_t i=0;i<n;i++){
+			msgKey[0]=(unsigned char)i;
+			controller->KDF(msgKey, 0, aesKey, aesIv);
+		}
+	});
+	Add("Crypto/KDF2", 0, [controller](uint64_t n){
+		unsigned char msgKey[16], aesKey[32], aesIv[32];
+		memset(msgKey, 3, sizeof(msgKey));
+		for(uint64_t i=0;i<n;i++){
+			msgKey[0]=(unsigned char)i;
+			controller->KDF2(msgKey, 0, aesKey, aesIv);
+		}
+	});
+	static const size_t sizes[]={128, 1024};
+	for(size_t size:sizes){
+		Add("Crypto/AesIgeEncrypt/"+std::to_string(size), size, [size](uint64_t n){
+			std::vector<uint8_t> in(size, 0x33), out(size);
+			uint8_t key[32], iv[32];
+			memset(key, 1, sizeof(key));
+			for(uint64_t i=0;i<n;i++){
+				memset(iv, 2, sizeof(iv)); // aes_ige_encrypt updates IV in place
+				VoIPController::crypto.aes_ige_encrypt(in.data(), out.data(), size, key, iv);
+			}
+		});
+		Add("Crypto/AesIgeDecrypt/"+std::to_string(size), size, [size](uint64_t n){
+			std::vector<uint8_t> in(size, 0x33), out(size);
+			uint8_t key[32], iv[32];
+			memset(key, 1, sizeof(key));
+			for(uint64_t i=0;i<n;i++){
+				memset(iv, 2, sizeof(iv));
+				VoIPController::crypto.aes_ige_decrypt(in.data(), out.data(), size, key, iv);
+			}
+		});
+	}
+	Add("Crypto/SHA256Packet", 0, [](uint64_t n){
+		uint8_t msg[32+160], hash[32];
+		memset(msg, 9, sizeof(msg));
+		for(uint64_t i=0;i<n;i++){
+			msg[0]=(uint8_t)i;
+			VoIPController::crypto.sha256(msg, sizeof(msg), hash);
+		}
+	});
+}
+
+void Microbenchmarks::RegisterOpus(){
+	// one second of input, frames are taken from it round robin
+	std::shared_ptr<std::vector<int16_t>> pcm=std::make_shared<std::vector<int16_t>>(48000);
+	GenerateSpeech(pcm->data(), pcm->size(), 1);
+
+	// same settings as tgvoip::OpusEncoder, 60ms frames as negotiated by default
+	auto createEncoder=[](int complexity){
+		int error;
+		::OpusEncoder* enc=opus_encoder_create(48000, 1, OPUS_APPLICATION_VOIP, &error);
+		opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(complexity));
+		opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(15));
+		opus_encoder_ctl(enc, OPUS_SET_INBAND_FEC(1));
+		opus_encoder_ctl(enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+		opus_encoder_ctl(enc, OPUS_SET_BANDWIDTH(OPUS_BANDWIDTH_FULLBAND));
+		opus_encoder_ctl(enc, OPUS_SET_BITRATE(20000));
+		return enc;
+	};
+	const size_t frameSize=2880;
+	const size_t frameCount=pcm->size()/frameSize;
+
+	for(int complexity=0;complexity<=10;complexity++){
+		Add("Opus/Encode60ms/Complexity"+std::to_string(complexity), 0, [=](uint64_t n){
+			::OpusEncoder* enc=createEncoder(complexity);
+			unsigned char packet[1500];
+			for(uint64_t i=0;i<n;i++){
+				opus_encode(enc, pcm->data()+(i%frameCount)*frameSize, (int)frameSize, packet, sizeof(packet));
+			}
+			opus_encoder_destroy(enc);
+		});
+	}
+
+	// decoder cost depends on what encoder produced, decode streams of a few complexities
+	static const int decodeComplexities[]={0, 5, 10};
+	for(int complexity:decodeComplexities){
+		std::shared_ptr<std::vector<std::vector<unsigned char>>> packets=std::make_shared<std::vector<std::vector<unsigned char>>>();
+		::OpusEncoder* enc=createEncoder(complexity);
+		for(size_t f=0;f<frameCount;f++){
+			std::vector<unsigned char> packet(1500);
+			int len=opus_encode(enc, pcm->data()+f*frameSize, (int)frameSize, packet.data(), (int)packet.size());
+			packet.resize((size_t)std::max(len, 0));
+			packets->push_back(std::move(packet));
+		}
+		opus_encoder_destroy(enc);
+
+		Add("Opus/Decode60ms/Complexity"+std::to_string(complexity), 0, [=](uint64_t n){
+			::OpusDecoder* dec=opus_decoder_create(48000, 1, NULL);
+			int16_t out[5760];
+			for(uint64_t i=0;i<n;i++){
+				const std::vector<unsigned char>& packet=(*packets)[i%packets->size()];
+				opus_decode(dec, packet.data(), (opus_int32)packet.size(), out, (int)frameSize, 0);
+			}
+			opus_decoder_destroy(dec);
+		});
+		if(complexity==10){
+			Add("Opus/DecodeFEC60ms", 0, [=](uint64_t n){
+				::OpusDecoder* dec=opus_decoder_create(48000, 1, NULL);
+				int16_t out[5760];
+				for(uint64_t i=0;i<n;i++){
+					const std::vector<unsigned char>& packet=(*packets)[i%packets->size()];
+					opus_decode(dec, packet.data(), (opus_int32)packet.size(), out, (int)frameSize, 1);
+				}
+				opus_decoder_destroy(dec);
+			});
+			Add("Opus/DecodePLC60ms", 0, [=](uint64_t n){
+				::OpusDecoder* dec=opus_decoder_create(48000, 1, NULL);
+				int16_t out[5760];
+				opus_decode(dec, (*packets)[0].data(), (opus_int32)(*packets)[0].size(), out, (int)frameSize, 0);
+				for(uint64_t i=0;i<n;i++){
+					opus_decode(dec, NULL, 0, out, (int)frameSize, 0);
+				}
+				opus_decoder_destroy(dec);
+			});
+		}
+	}
+}
+
+void Microbenchmarks::RegisterEchoCanceller(){
+	std::shared_ptr<std::vector<int16_t>> pcm=std::make_shared<std::vector<int16_t>>(48000);
+	GenerateSpeech(pcm->data(), pcm->size(), 2);
+
+	struct Flags{
+		const char* name;
+		bool aec;
+		bool ns;
+		bool agc;
+	};
+	static const Flags flags[]={
+		{"Off", false, false, false},
+		{"AEC", true, false, false},
+		{"NS", false, true, false},
+		{"AGC", false, false, true},
+		{"All", true, true, true},
+	};
+	for(const Flags& f:flags){
+		// 20ms, the size encoder thread hands to the APM
+		Add(std::string("EchoCanceller/ProcessInput/")+f.name, 0, [pcm, f](uint64_t n){
+			EchoCanceller ec(f.aec, f.ns, f.agc);
+			int16_t frame[960];
+			const size_t frameCount=pcm->size()/960;
+			for(uint64_t i=0;i<n;i++){
+				memcpy(frame, pcm->data()+(i%frameCount)*960, sizeof(frame));
+				if(f.aec)
+					ec.SpeakerOutCallback(reinterpret_cast<unsigned char*>(frame), sizeof(frame));
+				bool hasVoice=false;
+				ec.ProcessInput(frame, 960, hasVoice);
+			}
+		});
+	}
+}
+
+void Microbenchmarks::RegisterResampler(){
+	std::shared_ptr<std::vector<int16_t>> pcm=std::make_shared<std::vector<int16_t>>(960);
+	GenerateSpeech(pcm->data(), pcm->size(), 3);
+
+	Add("Resampler/Convert48To44", 960*2, [pcm](uint64_t n){
+		int16_t out[882];
+		for(uint64_t i=0;i<n;i++)
+			audio::Resampler::Convert48To44(pcm->data(), out, 960, 882);
+	});
+	Add("Resampler/Convert44To48", 882*2, [pcm](uint64_t n){
+		int16_t out[960];
+		for(uint64_t i=0;i<n;i++)
+			audio::Resampler::Convert44To48(pcm->data(), out, 882, 960);
+	});
+	Add("Resampler/Convert48To16", 960*2, [pcm](uint64_t n){
+		int16_t out[320];
+		for(uint64_t i=0;i<n;i++)
+			audio::Resampler::Convert(pcm->data(), out, 960, 320, 1, 3);
+	});
+	Add("Resampler/Rescale60To40", 0, [](uint64_t n){
+		std::vector<int16_t> in(2880), out(1920);
+		GenerateSpeech(in.data(), in.size(), 4);
+		for(uint64_t i=0;i<n;i++)
+			audio::Resampler::Rescale60To40(in.data(), out.data());
+	});
+}
+
+void Microbenchmarks::Run(const std::string& filter, double minTime, int repetitions){
+	fprintf(stderr, "%-46s %14s %14s %12s %12s\n", "benchmark", "time ns", "cpu ns", "iterations", "MB/s");
+	for(Benchmark& b:benchmarks){
+		if(!filter.empty() && b.name.find(filter)==std::string::npos)
+			continue;
+
+		// grow iteration count until one run is long enough to be measured reliably
+		uint64_t iterations=1;
+		while(true){
+			double start=RealNow();
+			b.body(iterations);
+			double elapsed=(RealNow()-start)/1e9;
+			if(elapsed>=minTime || iterations>=(1ULL << 40))
+				break;
+			double multiplier=elapsed>0 ? std::min(10.0, minTime*1.4/elapsed) : 10.0;
+			iterations=std::max(iterations+1, (uint64_t)(iterations*multiplier));
+		}
+
+		std::vector<Result> runs;
+		for(int r=0;r<repetitions;r++){
+			double realStart=RealNow();
+			double cpuStart=CpuNow();
+			b.body(iterations);
+			double cpu=CpuNow()-cpuStart;
+			double real=RealNow()-realStart;
+			Result res;
+			res.name=b.name;
+			res.iterations=iterations;
+			res.realTime=real/iterations;
+			res.cpuTime=cpu/iterations;
+			res.bytesPerSecond=b.bytesPerIteration>0 ? b.bytesPerIteration*1e9/res.realTime : 0;
+			runs.push_back(res);
+		}
+		std::sort(runs.begin(), runs.end(), [](const Result& a, const Result& b){
+			return a.realTime<b.realTime;
+		});
+		Result& median=runs[runs.size()/2];
+		results.push_back(median);
+		fprintf(stderr, "%-46s %14.1f %14.1f %12llu %12.1f\n", median.name.c_str(), median.realTime, median.cpuTime,
+				(unsigned long long)median.iterations, median.bytesPerSecond/1048576.0);
+	}
+}
+
+std::string Microbenchmarks::ToJSON(){
+	char date[64];
+	time_t now=time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	char host[256]={0};
+	gethostname(host, sizeof(host)-1);
+
+	std::vector<json11::Json> items;
+	for(Result& r:results){
+		std::map<std::string, json11::Json> item{
+			{"name", r.name},
+			{"run_name", r.name},
+			{"run_type", "iteration"},
+			{"iterations", (double)r.iterations},
+			{"real_time", r.realTime},
+			{"cpu_time", r.cpuTime},
+			{"time_unit", "ns"}
+		};
+		if(r.bytesPerSecond>0)
+			item["bytes_per_second"]=r.bytesPerSecond;
+		items.push_back(item);
+	}
+	json11::Json doc=json11::Json::object{
+		{"context", json11::Json::object{
+			{"date", date},
+			{"host_name", host},
+			{"executable", "tgvoip_bench"},
+			{"num_cpus", (int)sysconf(_SC_NPROCESSORS_ONLN)},
+			{"library_version", VoIPController::GetVersion()}
+		}},
+		{"benchmarks", items}
+	};
+	return doc.dump();
+}
+
+int main(int argc, char** argv){
+	std::string filter;
+	std::string jsonPath;
+	double minTime=0.5;
+	int repetitions=3;
+	for(int i=1;i<argc;i++){
+		if(i+1<argc && !strcmp(argv[i], "--filter")){
+			filter=argv[++i];
+		}else if(i+1<argc && !strcmp(argv[i], "--json")){
+			jsonPath=argv[++i];
+		}else if(i+1<argc && !strcmp(argv[i], "--min-time")){
+			minTime=atof(argv[++i]);
+		}else if(i+1<argc && !strcmp(argv[i], "--repetitions")){
+			repetitions=std::max(1, atoi(argv[++i]));
+		}else{
+			fprintf(stderr, "Usage: %s [--filter SUBSTRING] [--json FILE|-] [--min-time SECONDS] [--repetitions N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	Microbenchmarks bench;
+	bench.RegisterAll();
+	bench.Run(filter, minTime, repetitions);
+
+	if(jsonPath=="-"){
+		printf("%s\n", bench.ToJSON().c_str());
+	}else if(!jsonPath.empty()){
+		std::ofstream out(jsonPath);
+		out << bench.ToJSON() << std::endl;
+		if(!out){
+			fprintf(stderr, "Failed to write %s\n", jsonPath.c_str());
+			return 1;
+		}
+	}
+	return 0;
+}
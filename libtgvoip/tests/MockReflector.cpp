@@ -8,10 +8,20 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 
 using namespace tgvoip;
 using namespace tgvoip::test;
 
+// packets received or sent with one syscall
+#define REFLECTOR_BATCH_SIZE 32
+
 struct UdpReflectorSelfInfo{
 	uint8_t peerTag[16];
 	uint64_t _id1=0xFFFFFFFFFFFFFFFFLL;
@@ -25,7 +35,59 @@ struct UdpReflectorSelfInfo{
 	uint32_t my_port;
 } __attribute__((packed));
 
-MockReflector::MockReflector(std::string bindAddress, uint16_t bindPort){
+bool ImpairmentProfile::IsTransparent() const{
+	return lossInGood==0 && (lossInBad==0 || lossGoodToBad==0) && delay==0 && jitter==0
+		   && reorderProbability==0 && bandwidth==0 && trace.empty();
+}
+
+std::vector<double> ImpairmentProfile::LoadTrace(std::string path){
+	std::vector<double> result;
+	std::ifstream file(path);
+	std::string line;
+	while(std::getline(file, line)){
+		size_t comment=line.find('#');
+		if(comment!=std::string::npos)
+			line.resize(comment);
+		char* end;
+		double value=strtod(line.c_str(), &end);
+		if(end!=line.c_str())
+			result.push_back(value);
+	}
+	return result;
+}
+
+ImpairmentProfile ImpairmentProfile::Good(){
+	ImpairmentProfile p;
+	p.delay=20;
+	p.jitter=2;
+	return p;
+}
+
+ImpairmentProfile ImpairmentProfile::Mobile3G(){
+	ImpairmentProfile p;
+	p.lossGoodToBad=0.01;
+	p.lossBadToGood=0.3;
+	p.lossInGood=0.005;
+	p.lossInBad=0.5;
+	p.delay=80;
+	p.jitter=30;
+	p.jitterDistribution=Jitter::PARETO;
+	p.reorderProbability=0.01;
+	p.reorderDelay=40;
+	p.bandwidth=48000;
+	return p;
+}
+
+ImpairmentProfile ImpairmentProfile::Lossy(double lossRate, double burstLength){
+	// all losses happen in the bad state, burstLength is mean bad state duration in packets
+	ImpairmentProfile p;
+	p.lossInBad=1;
+	p.lossBadToGood=1.0/std::max(burstLength, 1.0);
+	p.lossGoodToBad=lossRate<1 ? lossRate*p.lossBadToGood/(1-lossRate) : 1;
+	return p;
+}
+
+MockReflector::MockReflector(std::string bindAddress, uint16_t bindPort, unsigned int threadCount) : threadCount(std::max(threadCount, 1u)){
 	sfd=socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	assert(sfd!=-1);
 	sockaddr_in bindAddr={0};
@@ -34,10 +96,19 @@ MockReflector::MockReflector(std::string bindAddress, uint16_t bindPort){
 	inet_aton(bindAddress.c_str(), &bindAddr.sin_addr);
 	int res=bind(sfd, (struct sockaddr*)&bindAddr, sizeof(bindAddr));
 	assert(res==0);
+	// hundreds of calls may go through one socket
+	int bufSize=8*1024*1024;
+	setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+	setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+	// not every platform wakes up blocked receivers on shutdown
+	timeval timeout={0, 100000};
+	setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	for(Shard& shard:shards)
+		shard.clients.reserve(256);
 }
 
 MockReflector::~MockReflector(){
-	
+
 }
 
 std::array<std::array<uint8_t, 16>, 2> MockReflector::GeneratePeerTags(){
@@ -57,73 +128,339 @@ void MockReflector::Start(){
 	if(running)
 		return;
 	running=true;
-	pthread_create(&thread, NULL, [](void* arg) -> void* {
-		reinterpret_cast<MockReflector*>(arg)->RunThread();
+	threads.resize(threadCount);
+	for(pthread_t& thread:threads){
+		pthread_create(&thread, NULL, [](void* arg) -> void* {
+			reinterpret_cast<MockReflector*>(arg)->RunThread();
+			return NULL;
+		}, this);
+	}
+	pthread_create(&deliveryThread, NULL, [](void* arg) -> void* {
+		reinterpret_cast<MockReflector*>(arg)->RunDeliveryThread();
 		return NULL;
 	}, this);
 }
 
 void MockReflector::Stop(){
+	if(!running)
+		return;
 	running=false;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		queueCond.notify_all();
+	}
 	shutdown(sfd, SHUT_RDWR);
+	for(pthread_t& thread:threads)
+		pthread_join(thread, NULL);
+	pthread_join(deliveryThread, NULL);
+	threads.clear();
 	close(sfd);
-	pthread_join(thread, NULL);
 }
 
 void MockReflector::SetDropAllPackets(bool drop){
 	dropAllPackets=drop;
 }
 
+void MockReflector::SetDefaultImpairmentProfile(const ImpairmentProfile& profile){
+	{
+		std::lock_guard<std::mutex> lock(profileMutex);
+		defaultProfile=profile;
+	}
+	for(Shard& shard:shards){
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for(std::pair<const uint64_t, ClientPair>& c:shard.clients){
+			for(Direction& dir:c.second.dir){
+				if(!dir.hasProfile)
+					InitDirection(dir, profile, false);
+			}
+		}
+	}
+}
+
+void MockReflector::SetImpairmentProfile(const std::array<uint8_t, 16>& peerTag, const ImpairmentProfile& profile){
+	uint64_t tagID=*reinterpret_cast<const uint64_t*>(peerTag.data());
+	Shard& shard=ShardFor(tagID);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	ClientPair& c=GetPair(shard, tagID);
+	InitDirection(c.dir[peerTag[15] & 1], profile, true);
+}
+
+MockReflector::Stats MockReflector::GetStats(){
+	Stats stats;
+	stats.received=statReceived;
+	stats.forwarded=statForwarded;
+	stats.lost=statLost;
+	stats.tailDropped=statTailDropped;
+	stats.reordered=statReordered;
+	return stats;
+}
+
+double MockReflector::Now(){
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void MockReflector::InitDirection(Direction& dir, const ImpairmentProfile& profile, bool hasProfile){
+	dir.profile=profile;
+	dir.hasProfile=hasProfile;
+	dir.badState=false;
+	dir.linkFreeAt=0;
+	dir.traceIndex=0;
+	dir.rng.seed(profile.seed);
+}
+
+MockReflector::Shard& MockReflector::ShardFor(uint64_t tagID){
+	return shards[(tagID ^ (tagID >> 32)) % SHARD_COUNT];
+}
+
+MockReflector::ClientPair& MockReflector::GetPair(Shard& shard, uint64_t tagID){
+	ClientPair& c=shard.clients[tagID];
+	if(!c.initialized){
+		std::lock_guard<std::mutex> lock(profileMutex);
+		InitDirection(c.dir[0], defaultProfile, false);
+		InitDirection(c.dir[1], defaultProfile, false);
+		c.initialized=true;
+	}
+	return c;
+}
+
+double MockReflector::Impair(Direction& dir, size_t length, double now){
+	const ImpairmentProfile& p=dir.profile;
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	double delay;
+	if(!p.trace.empty()){
+		delay=p.trace[dir.traceIndex];
+		dir.traceIndex=(dir.traceIndex+1)%p.trace.size();
+		if(delay<0){
+			statLost++;
+			return -1;
+		}
+	}else{
+		if(dir.badState){
+			if(uniform(dir.rng)<p.lossBadToGood)
+				dir.badState=false;
+		}else{
+			if(uniform(dir.rng)<p.lossGoodToBad)
+				dir.badState=true;
+		}
+		if(uniform(dir.rng)<(dir.badState ? p.lossInBad : p.lossInGood)){
+			statLost++;
+			return -1;
+		}
+		delay=p.delay;
+		if(p.jitter>0){
+			switch(p.jitterDistribution){
+				case ImpairmentProfile::Jitter::UNIFORM:
+					delay+=std::uniform_real_distribution<double>(-p.jitter, p.jitter)(dir.rng);
+					break;
+				case ImpairmentProfile::Jitter::NORMAL:
+					delay+=std::normal_distribution<double>(0.0, p.jitter)(dir.rng);
+					break;
+				case ImpairmentProfile::Jitter::PARETO:
+					// shape 3 Pareto shifted to start at 0, scaled to have mean of jitter
+					delay+=2.0*p.jitter*(pow(1.0-uniform(dir.rng), -1.0/3.0)-1.0);
+					break;
+			}
+		}
+		delay=std::max(delay, 0.0);
+	}
+	if(p.reorderProbability>0 && uniform(dir.rng)<p.reorderProbability){
+		delay+=p.reorderDelay;
+		statReordered++;
+	}
+	double departure=now;
+	if(p.bandwidth>0){
+		double start=std::max(dir.linkFreeAt, now);
+		if(start-now>p.queueLimit){
+			statTailDropped++;
+			return -1;
+		}
+		dir.linkFreeAt=start+length*1000.0/p.bandwidth;
+		departure=dir.linkFreeAt;
+	}
+	return departure+delay;
+}
+
+bool MockReflector::HandlePacket(uint8_t* buf, size_t len, const sockaddr_in& addr, sockaddr_in& dest, double& sendTime, double now){
+	statReceived++;
+	if(len<32)
+		return false;
+	std::array<uint8_t, 16> peerTag;
+	int32_t specialID[4];
+	std::copy(buf, buf+16, peerTag.begin());
+	memcpy(specialID, buf+16, 16);
+	uint64_t tagID=*reinterpret_cast<uint64_t*>(peerTag.data());
+	int from=peerTag[15] & 1;
+
+	Shard& shard=ShardFor(tagID);
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		ClientPair& c=GetPair(shard, tagID);
+		if(from){
+			c.addr1=addr;
+			dest=c.addr0;
+		}else{
+			c.addr0=addr;
+			dest=c.addr1;
+		}
+
+		if(specialID[0]==-1 && specialID[1]==-1 && specialID[2]==-1){
+			if(specialID[3]==-1){
+				return false;
+			}else if(specialID[3]==-2){
+				UdpReflectorSelfInfo response;
+				memcpy(response.peerTag, peerTag.data(), 16);
+				response.date=(int32_t)time(NULL);
+				response.query_id=*reinterpret_cast<uint64_t*>(buf+32);
+				response.my_ip_padding1=0;
+				response.my_ip_padding2=0xFFFF0000;
+				response.my_ip=(uint32_t)addr.sin_addr.s_addr;
+				response.my_port=ntohs(addr.sin_port);
+				sendto(sfd, &response, sizeof(response), 0, (struct sockaddr*)&addr, sizeof(addr));
+				return false;
+			}
+		}
+
+		if(dest.sin_family!=AF_INET || dropAllPackets)
+			return false;
+
+		Direction& dir=c.dir[from];
+		if(dir.profile.IsTransparent()){
+			sendTime=now;
+		}else{
+			sendTime=Impair(dir, len, now);
+			if(sendTime<0)
+				return false;
+		}
+	}
+
+	if(from)
+		buf[15] &= 0xFE;
+	else
+		buf[15] |= 1;
+	return true;
+}
+
+bool MockReflector::PacketLater(const std::unique_ptr<Packet>& a, const std::unique_ptr<Packet>& b){
+	return a->sendTime==b->sendTime ? a->seq>b->seq : a->sendTime>b->sendTime;
+}
+
+void MockReflector::EnqueueDelayed(const uint8_t* buf, size_t len, const sockaddr_in& dest, double sendTime){
+	std::unique_ptr<Packet> packet(new Packet());
+	packet->sendTime=sendTime;
+	packet->dest=dest;
+	packet->length=(uint16_t)len;
+	memcpy(packet->data.data(), buf, len);
+	std::lock_guard<std::mutex> lock(queueMutex);
+	packet->seq=nextSeq++;
+	bool wakeUp=delayed.empty() || sendTime<delayed.front()->sendTime;
+	delayed.push_back(std::move(packet));
+	std::push_heap(delayed.begin(), delayed.end(), &MockReflector::PacketLater);
+	if(wakeUp)
+		queueCond.notify_one();
+}
+
+void MockReflector::RunDeliveryThread(){
+	std::unique_lock<std::mutex> lock(queueMutex);
+	while(running){
+		if(delayed.empty()){
+			queueCond.wait(lock);
+			continue;
+		}
+		double wait=delayed.front()->sendTime-Now();
+		if(wait>0){
+			queueCond.wait_for(lock, std::chrono::duration<double, std::milli>(wait));
+			continue;
+		}
+		std::pop_heap(delayed.begin(), delayed.end(), &MockReflector::PacketLater);
+		std::unique_ptr<Packet> packet=std::move(delayed.back());
+		delayed.pop_back();
+		lock.unlock();
+		sendto(sfd, packet->data.data(), packet->length, 0, (struct sockaddr*)&packet->dest, sizeof(sockaddr_in));
+		statForwarded++;
+		lock.lock();
+	}
+	delayed.clear();
+}
+
+#ifdef __linux__
+void MockReflector::RunThread(){
+	std::vector<std::array<uint8_t, 1500>> bufs(REFLECTOR_BATCH_SIZE);
+	sockaddr_in addrs[REFLECTOR_BATCH_SIZE];
+	iovec iovs[REFLECTOR_BATCH_SIZE];
+	mmsghdr msgs[REFLECTOR_BATCH_SIZE];
+	sockaddr_in dests[REFLECTOR_BATCH_SIZE];
+	iovec outIovs[REFLECTOR_BATCH_SIZE];
+	mmsghdr outMsgs[REFLECTOR_BATCH_SIZE];
+	while(running){
+		for(int i=0;i<REFLECTOR_BATCH_SIZE;i++){
+			iovs[i].iov_base=bufs[i].data();
+			iovs[i].iov_len=bufs[i].size();
+			memset(&msgs[i], 0, sizeof(mmsghdr));
+			msgs[i].msg_hdr.msg_iov=&iovs[i];
+			msgs[i].msg_hdr.msg_iovlen=1;
+			msgs[i].msg_hdr.msg_name=&addrs[i];
+			msgs[i].msg_hdr.msg_namelen=sizeof(sockaddr_in);
+		}
+		int count=recvmmsg(sfd, msgs, REFLECTOR_BATCH_SIZE, MSG_WAITFORONE, NULL);
+		if(count<0){
+			if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)
+				continue;
+			return;
+		}
+		if(count==0)
+			return;
+		double now=Now();
+		int outCount=0;
+		for(int i=0;i<count;i++){
+			size_t len=msgs[i].msg_len;
+			double sendTime;
+			if(!HandlePacket(bufs[i].data(), len, addrs[i], dests[outCount], sendTime, now))
+				continue;
+			if(sendTime>now){
+				EnqueueDelayed(bufs[i].data(), len, dests[outCount], sendTime);
+				continue;
+			}
+			outIovs[outCount].iov_base=bufs[i].data();
+			outIovs[outCount].iov_len=len;
+			memset(&outMsgs[outCount], 0, sizeof(mmsghdr));
+			outMsgs[outCount].msg_hdr.msg_iov=&outIovs[outCount];
+			outMsgs[outCount].msg_hdr.msg_iovlen=1;
+			outMsgs[outCount].msg_hdr.msg_name=&dests[outCount];
+			outMsgs[outCount].msg_hdr.msg_namelen=sizeof(sockaddr_in);
+			outCount++;
+		}
+		int sent=0;
+		while(sent<outCount){
+			int res=sendmmsg(sfd, outMsgs+sent, outCount-sent, 0);
+			if(res<=0)
+				break;
+			sent+=res;
+		}
+		statForwarded+=sent;
+	}
+}
+#else
 void MockReflector::RunThread(){
+	std::array<uint8_t, 1500> buf;
 	while(running){
-		std::array<uint8_t, 1500> buf;
 		sockaddr_in addr;
 		socklen_t addrlen=sizeof(addr);
 		ssize_t len=recvfrom(sfd, buf.data(), sizeof(buf), 0, (struct sockaddr*)&addr, &addrlen);
+		if(len<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+			continue;
 		if(len<=0)
 			return;
-		if(len>=32){
-			std::array<uint8_t, 16> peerTag;
-			int32_t specialID[4];
-			std::copy(buf.begin(), buf.begin()+16, peerTag.begin());
-			memcpy(specialID, buf.data()+16, 16);
-			uint64_t tagID=*reinterpret_cast<uint64_t*>(peerTag.data());
-			ClientPair c=clients[tagID];
-			sockaddr_in* dest;
-			if(peerTag[15] & 1){
-				c.addr1=addr;
-				dest=&c.addr0;
-			}else{
-				c.addr0=addr;
-				dest=&c.addr1;
-			}
-			clients[tagID]=c;
-			
-			if(specialID[0]==-1 && specialID[1]==-1 && specialID[2]==-1){
-				if(specialID[3]==-1){
-					continue;
-				}else if(specialID[3]==-2){
-					UdpReflectorSelfInfo response;
-					memcpy(response.peerTag, peerTag.data(), 16);
-					response.date=(int32_t)time(NULL);
-					response.query_id=*reinterpret_cast<uint64_t*>(buf.data()+32);
-					response.my_ip_padding1=0;
-					response.my_ip_padding2=0xFFFF0000;
-					response.my_ip=(uint32_t)addr.sin_addr.s_addr;
-					response.my_port=ntohs(addr.sin_port);
-					sendto(sfd, &response, sizeof(response), 0, (struct sockaddr*)&addr, sizeof(addr));
-					continue;
-				}
-			}
-			
-			if(dest->sin_family==AF_INET && !dropAllPackets){
-				if(peerTag[15] & 1)
-					buf[15] &= 0xFE;
-				else
-					buf[15] |= 1;
-				
-				sendto(sfd, buf.data(), len, 0, (struct sockaddr*)dest, sizeof(sockaddr_in));
-			}
+		double now=Now();
+		sockaddr_in dest;
+		double sendTime;
+		if(!HandlePacket(buf.data(), (size_t)len, addr, dest, sendTime, now))
+			continue;
+		if(sendTime>now){
+			EnqueueDelayed(buf.data(), (size_t)len, dest, sendTime);
+			continue;
 		}
+		sendto(sfd, buf.data(), len, 0, (struct sockaddr*)&dest, sizeof(sockaddr_in));
+		statForwarded++;
 	}
 }
+#endif
@@ -9,6 +9,12 @@
 #include <string>
 #include <unordered_map>
 #include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <random>
 #include <stdint.h>
 #include <pthread.h>
 
@@ -20,29 +26,132 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <netinet/in.h>
 
 namespace tgvoip{
 	namespace test{
+		// Network conditions applied to packets going through the reflector in one direction.
+		// Default constructed profile forwards everything immediately.
+		struct ImpairmentProfile{
+			enum class Jitter{
+				UNIFORM,  // delay+[-jitter, jitter]
+				NORMAL,   // delay+N(0, jitter)
+				PARETO    // delay+heavy-tailed extra with mean of jitter
+			};
+			// Gilbert-Elliott two-state loss model
+			double lossGoodToBad=0;  // per-packet probability to switch to bad state
+			double lossBadToGood=1;  // per-packet probability to switch back
+			double lossInGood=0;     // loss probability in good state
+			double lossInBad=0;      // loss probability in bad state
+			// one-way delay in ms
+			double delay=0;
+			double jitter=0;
+			Jitter jitterDistribution=Jitter::UNIFORM;
+			// probability that packet is held back for an extra reorderDelay ms
+			double reorderProbability=0;
+			double reorderDelay=0;
+			// bytes per second, 0 means unlimited. Packets are queued behind previous ones,
+			// queueLimit is max queueing delay in ms before tail drop
+			uint32_t bandwidth=0;
+			double queueLimit=500;
+			// per-packet delays in ms replayed cyclically, negative value means the packet is lost.
+			// When set, overrides loss, delay and jitter settings above
+			std::vector<double> trace;
+			// seed for the random generator, same seed gives same sequence of decisions
+			uint32_t seed=1;
+
+			bool IsTransparent() const;
+			// text file, one delay value per line, '#' starts a comment
+			static std::vector<double> LoadTrace(std::string path);
+			static ImpairmentProfile Good();
+			static ImpairmentProfile Mobile3G();
+			static ImpairmentProfile Lossy(double lossRate, double burstLength);
+		};
+
 		class MockReflector{
 		public:
-			MockReflector(std::string bindAddress, uint16_t bindPort);
+			MockReflector(std::string bindAddress, uint16_t bindPort, unsigned int threadCount=1);
 			~MockReflector();
 			void Start();
 			void Stop();
 			void SetDropAllPackets(bool drop);
+			// applies to pairs that have no profile of their own
+			void SetDefaultImpairmentProfile(const ImpairmentProfile& profile);
+			// applies to packets sent by the client identified by peerTag, i.e. one direction of the pair
+			void SetImpairmentProfile(const std::array<uint8_t, 16>& peerTag, const ImpairmentProfile& profile);
 			static std::array<std::array<uint8_t, 16>, 2> GeneratePeerTags();
-			
+
+			struct Stats{
+				uint64_t received;
+				uint64_t forwarded;
+				uint64_t lost;      // dropped by loss model or trace
+				uint64_t tailDropped; // dropped by bandwidth cap queue
+				uint64_t reordered;
+			};
+			Stats GetStats();
+
 		private:
-			void RunThread();
+			struct Packet{
+				double sendTime;
+				uint64_t seq;
+				sockaddr_in dest;
+				uint16_t length;
+				std::array<uint8_t, 1500> data;
+			};
+			struct Direction{
+				ImpairmentProfile profile;
+				bool hasProfile=false;
+				bool badState=false;
+				double linkFreeAt=0;
+				size_t traceIndex=0;
+				std::minstd_rand rng;
+			};
 			struct ClientPair{
 				sockaddr_in addr0={0};
 				sockaddr_in addr1={0};
+				Direction dir[2];
+				bool initialized=false;
+			};
+			struct Shard{
+				std::mutex mutex;
+				std::unordered_map<uint64_t, ClientPair> clients; // clients are identified by the first half of their peer_tag
 			};
-			std::unordered_map<uint64_t, ClientPair> clients; // clients are identified by the first half of their peer_tag
+			static const unsigned int SHARD_COUNT=16;
+
+			void RunThread();
+			void RunDeliveryThread();
+			// returns time to send the packet at, negative if it is dropped
+			double Impair(Direction& dir, size_t length, double now);
+			void InitDirection(Direction& dir, const ImpairmentProfile& profile, bool hasProfile);
+			Shard& ShardFor(uint64_t tagID);
+			ClientPair& GetPair(Shard& shard, uint64_t tagID);
+			// returns true if packet must be forwarded to dest at sendTime
+			bool HandlePacket(uint8_t* buf, size_t len, const sockaddr_in& addr, sockaddr_in& dest, double& sendTime, double now);
+			void EnqueueDelayed(const uint8_t* buf, size_t len, const sockaddr_in& dest, double sendTime);
+			static bool PacketLater(const std::unique_ptr<Packet>& a, const std::unique_ptr<Packet>& b);
+			static double Now();
+
+			Shard shards[SHARD_COUNT];
+			std::mutex profileMutex;
+			ImpairmentProfile defaultProfile;
+
+			std::mutex queueMutex;
+			std::condition_variable queueCond;
+			std::vector<std::unique_ptr<Packet>> delayed; // min-heap by send time
+			uint64_t nextSeq=0;
+
 			int sfd;
-			pthread_t thread;
-			bool running=false;
-			bool dropAllPackets=false;
+			unsigned int threadCount;
+			std::vector<pthread_t> threads;
+			pthread_t deliveryThread;
+			std::atomic<bool> running{false};
+			std::atomic<bool> dropAllPackets{false};
+
+			std::atomic<uint64_t> statReceived{0};
+			std::atomic<uint64_t> statForwarded{0};
+			std::atomic<uint64_t> statLost{0};
+			std::atomic<uint64_t> statTailDropped{0};
+			std::atomic<uint64_t> statReordered{0};
 		};
 	}
 }
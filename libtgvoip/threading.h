@@ -8,6 +8,31 @@
 #define __THREADING_H
 
 #include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include "ResourceUsage.h"
+
+namespace tgvoip{
+	/**
+	 * How the library starts its threads, for dedicated media hosts.
+	 * Set once with Thread::SetPolicy before the first call is created.
+	 */
+	struct ThreadPolicy{
+		// bytes, 0 keeps the system default (8 MB of address space per thread on Linux).
+		// Pick it from the peaks tgvoip_loopback_bench --stack-report measures, with headroom.
+		size_t stackSize=0;
+		// bytes of stack painted below each thread's entry point to find its peak use, see
+		// Thread::GetStackPeaks; 0 turns it off. Painting commits the memory, benchmarks only.
+		size_t stackProbeDepth=0;
+		// CPUs library threads are pinned to, empty keeps the affinity they inherit (Linux only)
+		std::vector<int> cpus;
+		// SCHED_FIFO or SCHED_RR for the audio clock path threads (SetMaxPriority), 0 leaves them at normal priority
+		int realtimePolicy=0;
+		int realtimePriority=1;
+	};
+}
 
 #if defined(_POSIX_THREADS) || defined(_POSIX_VERSION) || defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
 
@@ -15,6 +40,10 @@
 #include <semaphore.h>
 #include <sched.h>
 #include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include "logging.h"
 #ifdef __APPLE__
 #include "os/darwin/DarwinSpecific.h"
 #endif
@@ -59,9 +88,34 @@ namespace tgvoip{
 		}
 
 		void Start(){
-			if(pthread_create(&thread, NULL, Thread::ActualEntryPoint, this)==0){
+			usage=ResourceUsage::Current();
+			const ThreadPolicy& policy=Policy();
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			if(policy.stackSize)
+				pthread_attr_setstacksize(&attr, std::max(policy.stackSize, (size_t)PTHREAD_STACK_MIN));
+			bool pinned=false;
+#ifdef __linux__
+			cpu_set_t cpus;
+			if(FillCpuSet(cpus))
+				pinned=pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus)==0;
+#endif
+			int err=pthread_create(&thread, &attr, Thread::ActualEntryPoint, this);
+			if(err!=0 && pinned){
+				// an affinity mask with no CPU the process may use fails the create with EINVAL
+				LOGE("Can't start thread %s pinned to media CPUs: %s, starting it unpinned", name ? name : "", strerror(err));
+				pthread_attr_destroy(&attr);
+				pthread_attr_init(&attr);
+				if(policy.stackSize)
+					pthread_attr_setstacksize(&attr, std::max(policy.stackSize, (size_t)PTHREAD_STACK_MIN));
+				err=pthread_create(&thread, &attr, Thread::ActualEntryPoint, this);
+			}
+			if(err==0){
 				valid=true;
+			}else{
+				LOGE("Can't start thread %s: %s", name ? name : "", strerror(err));
 			}
+			pthread_attr_destroy(&attr);
 		}
 
 		void Join(){
@@ -77,9 +131,35 @@ namespace tgvoip{
 		void SetMaxPriority(){
 #ifdef __APPLE__
 			maxPriority=true;
+#else
+			// threads are started before they are marked, so the priority is changed from outside
+			if(valid)
+				ApplyRealtimePriority(thread);
 #endif
 		}
 
+		static void SetPolicy(const ThreadPolicy& policy){
+			Policy()=policy;
+		}
+
+		/**
+		 * Applies the policy to the calling thread, which the library didn't start itself,
+		 * e.g. the pjmedia clock thread driving software audio ports. Cheap after the first call.
+		 */
+		static void AdoptCurrentThread(bool realtime){
+			static thread_local bool adopted=false;
+			if(adopted)
+				return;
+			adopted=true;
+#ifdef __linux__
+			cpu_set_t cpus;
+			if(FillCpuSet(cpus))
+				pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+			if(realtime)
+				ApplyRealtimePriority(pthread_self());
+		}
+
 		static void Sleep(double seconds){
 			usleep((useconds_t)(seconds*1000000.0));
 		}
@@ -88,7 +168,111 @@ namespace tgvoip{
 			return pthread_equal(thread, pthread_self())!=0;
 		}
 
+		/**
+		 * Peak stack use per thread name over all threads that finished while
+		 * ThreadPolicy::stackProbeDepth was set, in bytes. A peak equal to the probe depth
+		 * means the thread went at least that deep.
+		 */
+		static std::vector<std::pair<std::string, size_t>> GetStackPeaks(){
+			StackPeaks& peaks=GetStackPeakRecords();
+			peaks.mutex.Lock();
+			std::vector<std::pair<std::string, size_t>> result=peaks.peaks;
+			peaks.mutex.Unlock();
+			return result;
+		}
+
 	private:
+		static ThreadPolicy& Policy(){
+			static ThreadPolicy policy;
+			return policy;
+		}
+
+		struct StackPeaks{
+			Mutex mutex;
+			std::vector<std::pair<std::string, size_t>> peaks;
+		};
+
+		static StackPeaks& GetStackPeakRecords(){
+			static StackPeaks peaks;
+			return peaks;
+		}
+
+		static const unsigned char STACK_PAINT=0xA5;
+
+		/**
+		 * Fills up to depth bytes of the unused stack below the caller's frame with STACK_PAINT
+		 * and returns where painting starts, NULL if the stack bounds are unknown.
+		 */
+		__attribute__((noinline)) static unsigned char* PaintStack(size_t depth, unsigned char*& top){
+#ifdef __linux__
+			pthread_attr_t attr;
+			if(pthread_getattr_np(pthread_self(), &attr)!=0)
+				return NULL;
+			void* stackAddr;
+			size_t stackSize;
+			size_t guardSize=0;
+			pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+			pthread_attr_getguardsize(&attr, &guardSize);
+			pthread_attr_destroy(&attr);
+			// a little room below this frame for the loop itself, the rest of the stack is unused
+			top=reinterpret_cast<unsigned char*>(__builtin_frame_address(0))-256;
+			unsigned char* lowest=reinterpret_cast<unsigned char*>(stackAddr)+guardSize+4096;
+			if(top<=lowest)
+				return NULL;
+			unsigned char* bottom=(size_t)(top-lowest)>depth ? top-depth : lowest;
+			for(volatile unsigned char* p=bottom;p<top;p++)
+				*p=STACK_PAINT;
+			return bottom;
+#else
+			return NULL;
+#endif
+		}
+
+		static void RecordStackPeak(const char* name, unsigned char* bottom, unsigned char* top){
+			unsigned char* p=bottom;
+			while(p<top && *p==STACK_PAINT)
+				p++;
+			size_t used=(size_t)(top-p);
+			std::string key=name ? name : "unnamed";
+			StackPeaks& peaks=GetStackPeakRecords();
+			peaks.mutex.Lock();
+			bool found=false;
+			for(std::pair<std::string, size_t>& peak:peaks.peaks){
+				if(peak.first==key){
+					peak.second=std::max(peak.second, used);
+					found=true;
+					break;
+				}
+			}
+			if(!found)
+				peaks.peaks.push_back(std::make_pair(key, used));
+			peaks.mutex.Unlock();
+		}
+
+#ifdef __linux__
+		static bool FillCpuSet(cpu_set_t& set){
+			const std::vector<int>& cpus=Policy().cpus;
+			if(cpus.empty())
+				return false;
+			CPU_ZERO(&set);
+			for(int cpu:cpus){
+				if(cpu>=0 && cpu<CPU_SETSIZE)
+					CPU_SET(cpu, &set);
+			}
+			return true;
+		}
+#endif
+
+		// fails without CAP_SYS_NICE or a high enough RLIMIT_RTPRIO, the thread then keeps its priority
+		static bool ApplyRealtimePriority(pthread_t thread){
+			const ThreadPolicy& policy=Policy();
+			if(!policy.realtimePolicy)
+				return false;
+			sched_param param={0};
+			param.sched_priority=policy.realtimePriority;
+			return pthread_setschedparam(thread, policy.realtimePolicy, &param)==0;
+		}
+
 		static void* ActualEntryPoint(void* arg){
 			Thread* self=reinterpret_cast<Thread*>(arg);
 			if(self->name){
@@ -101,10 +285,20 @@ namespace tgvoip{
 				}
 #endif
 			}
+			ResourceUsage::ThreadStarted(self->usage, self->name);
+			unsigned char* stackTop=NULL;
+			unsigned char* stackBottom=NULL;
+			size_t probeDepth=Policy().stackProbeDepth;
+			if(probeDepth)
+				stackBottom=PaintStack(probeDepth, stackTop);
 			self->entry();
+			if(stackBottom)
+				RecordStackPeak(self->name, stackBottom, stackTop);
+			ResourceUsage::ThreadFinished();
 			return NULL;
 		}
 		std::function<void()> entry;
+		std::shared_ptr<ResourceUsage> usage;
 		pthread_t thread;
 		const char* name;
 		bool maxPriority=false;
@@ -229,7 +423,8 @@ namespace tgvoip{
 		}
 
 		void Start(){
-			thread=CreateThread(NULL, 0, Thread::ActualEntryPoint, this, 0, &id);
+			usage=ResourceUsage::Current();
+			thread=CreateThread(NULL, Policy().stackSize, Thread::ActualEntryPoint, this, Policy().stackSize ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, &id);
 		}
 
 		void Join(){
@@ -251,6 +446,14 @@ namespace tgvoip{
 			SetThreadPriority(thread, THREAD_PRIORITY_HIGHEST);
 		}
 
+		// only the stack size is applied on Windows
+		static void SetPolicy(const ThreadPolicy& policy){
+			Policy()=policy;
+		}
+
+		static void AdoptCurrentThread(bool realtime){
+		}
+
 		static void Sleep(double seconds){
 			::Sleep((DWORD)(seconds*1000));
 		}
@@ -260,6 +463,11 @@ namespace tgvoip{
 		}
 
 	private:
+		static ThreadPolicy& Policy(){
+			static ThreadPolicy policy;
+			return policy;
+		}
+
 		static const DWORD MS_VC_EXCEPTION=0x406D1388;
 
 		#pragma pack(push,8)
@@ -284,10 +492,13 @@ namespace tgvoip{
 					RaiseException(MS_VC_EXCEPTION, 0, sizeof(info)/sizeof(ULONG_PTR), (ULONG_PTR*)&info);
 				}__except(EXCEPTION_EXECUTE_HANDLER){}
 			}
+			ResourceUsage::ThreadStarted(self->usage, self->name);
 			self->entry();
+			ResourceUsage::ThreadFinished();
 			return 0;
 		}
 		std::function<void()> entry;
+		std::shared_ptr<ResourceUsage> usage;
 		HANDLE thread;
 		DWORD id;
 		const char* name;
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "accounts.h"
+
+namespace {
+    const std::chrono::hours DIAL_WINDOW{1};
+}
+
+Account::Account(std::string name, tg::Client &client, OptionalQueue<tg::Client::Object> &events)
+        : name(std::move(name)), client(client), events(events),
+          calls_gauge(metrics::registry().gauge("tg2sip_account_calls", "Calls in progress per Telegram account",
+                                                {{"account", this->name}})),
+          blocked_gauge(metrics::registry().gauge("tg2sip_account_blocked_seconds",
+                                                  "Seconds until Telegram lets the account place calls again",
+                                                  {{"account", this->name}})),
+          inbound_counter(metrics::registry().counter("tg2sip_account_calls_total", "Calls per Telegram account",
+                                                      {{"account", this->name}, {"direction", "inbound"}})),
+          outbound_counter(metrics::registry().counter("tg2sip_account_calls_total", "Calls per Telegram account",
+                                                       {{"account", this->name}, {"direction", "outbound"}})) {}
+
+Accounts::Accounts(const Settings &settings, std::shared_ptr<spdlog::logger> logger)
+        : logger_(std::move(logger)), dial_limit_(settings.account_dial_limit()) {}
+
+Account &Accounts::add(tg::Client &client, OptionalQueue<tg::Client::Object> &events) {
+    accounts_.emplace_back(std::make_unique<Account>(std::to_string(accounts_.size()), client, events));
+    return *accounts_.back();
+}
+
+void Accounts::expire_dials(Account &account, std::chrono::steady_clock::time_point now) {
+    while (!account.recent_dials.empty() && now - account.recent_dials.front() >= DIAL_WINDOW) {
+        account.recent_dials.pop_front();
+    }
+}
+
+Account *Accounts::pick_outbound(std::chrono::seconds &wait) {
+    auto now = std::chrono::steady_clock::now();
+    Account *best = nullptr;
+    // a FLOOD_WAIT block can outlast the dial window, so nothing caps this
+    auto first_available = std::chrono::steady_clock::time_point::max();
+
+    for (auto &account : accounts_) {
+        expire_dials(*account, now);
+
+        auto available_at = now;
+        if (account->block_until > available_at) {
+            available_at = account->block_until;
+        }
+        if (dial_limit_ > 0 && account->recent_dials.size() >= dial_limit_) {
+            // the oldest dial leaving the window frees budget for one more
+            auto budget_at = account->recent_dials[account->recent_dials.size() - dial_limit_] + DIAL_WINDOW;
+            if (budget_at > available_at) {
+                available_at = budget_at;
+            }
+        }
+        if (available_at > now) {
+            first_available = std::min(first_available, available_at);
+            continue;
+        }
+
+        if (!best || account->active_calls < best->active_calls ||
+            (account->active_calls == best->active_calls &&
+             account->recent_dials.size() < best->recent_dials.size())) {
+            best = account.get();
+        }
+    }
+
+    if (!best) {
+        if (first_available == std::chrono::steady_clock::time_point::max()) {
+            // no accounts at all
+            wait = DIAL_WINDOW;
+        } else {
+            wait = std::chrono::duration_cast<std::chrono::seconds>(first_available - now) + std::chrono::seconds(1);
+        }
+    }
+    return best;
+}
+
+void Accounts::call_started(Account &account) {
+    account.active_calls++;
+    account.calls_gauge.set(account.active_calls);
+}
+
+void Accounts::call_ended(Account &account) {
+    if (account.active_calls > 0) {
+        account.active_calls--;
+    }
+    account.calls_gauge.set(account.active_calls);
+}
+
+void Accounts::received(Account &account) {
+    account.inbound_counter.inc();
+}
+
+void Accounts::dialed(Account &account) {
+    account.recent_dials.push_back(std::chrono::steady_clock::now());
+    account.outbound_counter.inc();
+}
+
+void Accounts::discard(Account &account, int32_t tg_call_id, const std::string &ctx_id) {
+    (*pending_discards_)++;
+    account.client.send_query(td::td_api::make_object<td::td_api::discardCall>(
+            tg_call_id, /* call_id_ */
+            false, /* is_disconnected_ */
+            0, /* duration_ */
+            false, /* is_video_ */
+            tg_call_id /*connection_id */
+    ), [pending = pending_discards_, logger = logger_, ctx_id](tg::Client::Object result) {
+        if (result->get_id() == td::td_api::error::ID) {
+            logger->error("[{}] TG call discard failure:\n{}", ctx_id, to_string(result));
+        }
+        (*pending)--;
+    });
+}
+
+void Accounts::update_metrics() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto &account : accounts_) {
+        expire_dials(*account, now);
+        auto blocked = account->block_until > now
+                       ? std::chrono::duration<double>(account->block_until - now).count() : 0.0;
+        account->blocked_gauge.set(blocked);
+    }
+}
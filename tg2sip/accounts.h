@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TG2SIP_ACCOUNTS_H
+#define TG2SIP_ACCOUNTS_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "tg.h"
+#include "queue.h"
+#include "settings.h"
+#include "metrics.h"
+
+struct Cache {
+    std::map<std::string, int64_t> username_cache;
+    std::map<std::string, int64_t> phone_cache;
+};
+
+/*
+ * One authorized Telegram account. Call ids, contacts and the users an account may call
+ * are its own, so a call stays on the account it was placed or received with.
+ */
+struct Account {
+    Account(std::string name, tg::Client &client, OptionalQueue<tg::Client::Object> &events);
+
+    // index in the order accounts are configured, used in logs and as metrics label
+    const std::string name;
+    tg::Client &client;
+    OptionalQueue<tg::Client::Object> &events;
+
+    Cache cache;
+    // set by FLOOD_WAIT and PEER_FLOOD errors, no outbound calls until then
+    std::chrono::steady_clock::time_point block_until{std::chrono::steady_clock::now()};
+    unsigned int active_calls{0};
+    // outbound calls placed within the last hour, oldest first
+    std::deque<std::chrono::steady_clock::time_point> recent_dials;
+
+    metrics::Gauge &calls_gauge;
+    metrics::Gauge &blocked_gauge;
+    metrics::Counter &inbound_counter;
+    metrics::Counter &outbound_counter;
+};
+
+/*
+ * Telegram accounts the gateway works with.
+ *
+ * Incoming calls are taken on whichever account they arrive at. Outbound calls go to
+ * the account with the fewest calls in progress among those that Telegram doesn't
+ * block at the moment and that are below account_dial_limit, ties go to the one that
+ * dialed least within the last hour. Flood limits are per account, so every account
+ * added raises the outbound call rate the gateway can sustain. Gateway thread only.
+ */
+class Accounts {
+public:
+    Accounts(const Settings &settings, std::shared_ptr<spdlog::logger> logger);
+
+    Accounts(const Accounts &) = delete;
+
+    Accounts &operator=(const Accounts &) = delete;
+
+    // client must be authorized and its updates must go to events
+    Account &add(tg::Client &client, OptionalQueue<tg::Client::Object> &events);
+
+    const std::vector<std::unique_ptr<Account>> &all() const { return accounts_; };
+
+    /*
+     * Account to place a new outbound call with, nullptr if none can take it now.
+     * In that case wait is how long until the first one can.
+     */
+    Account *pick_outbound(std::chrono::seconds &wait);
+
+    // bracket every bridge that uses the account
+    void call_started(Account &account);
+
+    void call_ended(Account &account);
+
+    // a TG call came in
+    void received(Account &account);
+
+    // an outbound TG call is placed, it counts against the hourly limit
+    void dialed(Account &account);
+
+    // declines or hangs up a TG call without waiting for TDLib to answer
+    void discard(Account &account, int32_t tg_call_id, const std::string &ctx_id);
+
+    // discards TDLib has not answered yet
+    unsigned int pending_discards() const { return *pending_discards_; };
+
+    // refreshes per account gauges, called once a second
+    void update_metrics();
+
+private:
+    std::shared_ptr<spdlog::logger> logger_;
+    const unsigned int dial_limit_;
+    std::vector<std::unique_ptr<Account>> accounts_;
+    // shared with the answer handlers, they run on TDLib threads and may outlive the gateway
+    std::shared_ptr<std::atomic<unsigned int>> pending_discards_{std::make_shared<std::atomic<unsigned int>>(0)};
+
+    static void expire_dials(Account &account, std::chrono::steady_clock::time_point now);
+};
+
+#endif //TG2SIP_ACCOUNTS_H
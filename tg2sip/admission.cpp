@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include "admission.h"
+#include "metrics.h"
+
+Admission::Admission(const Settings &settings, std::shared_ptr<spdlog::logger> logger)
+        : logger_(std::move(logger)),
+          max_calls_(settings.max_calls()),
+          max_cpu_load_(settings.max_cpu_load() / 100.0),
+          max_media_lag_(settings.max_media_lag() / 1000.0),
+          retry_after_(settings.overload_retry_after()) {
+    read_cpu_times(cpu_busy_, cpu_total_);
+}
+
+bool Admission::read_cpu_times(uint64_t &busy, uint64_t &total) {
+    std::ifstream stat("/proc/stat");
+    std::string cpu;
+    uint64_t user, nice, system, idle, iowait{0}, irq{0}, softirq{0}, steal{0};
+    if (!(stat >> cpu >> user >> nice >> system >> idle) || cpu != "cpu") {
+        return false;
+    }
+    // older kernels have fewer columns
+    stat >> iowait >> irq >> softirq >> steal;
+    total = user + nice + system + idle + iowait + irq + softirq + steal;
+    busy = total - idle - iowait;
+    return true;
+}
+
+void Admission::update(double media_lag) {
+    auto &registry = metrics::registry();
+    static auto &cpu_gauge = registry.gauge("tg2sip_cpu_load", "System CPU load, share of all cores");
+    static auto &lag_gauge = registry.gauge("tg2sip_media_lag_seconds",
+                                            "How far audio encoding of the busiest call lags behind capture");
+    static auto &overloaded_gauge = registry.gauge("tg2sip_overloaded", "1 while new calls are refused for load");
+
+    uint64_t busy, total;
+    if (read_cpu_times(busy, total) && total > cpu_total_) {
+        cpu_load_ = busy > cpu_busy_ ? static_cast<double>(busy - cpu_busy_) / (total - cpu_total_) : 0.0;
+        cpu_busy_ = busy;
+        cpu_total_ = total;
+    }
+    media_lag_ = media_lag;
+    cpu_gauge.set(cpu_load_);
+    lag_gauge.set(media_lag_);
+
+    const char *overload = nullptr;
+    if (max_cpu_load_ > 0 && cpu_load_ >= max_cpu_load_) {
+        overload = "cpu";
+    } else if (max_media_lag_ > 0 && media_lag_ >= max_media_lag_) {
+        overload = "media_lag";
+    }
+
+    if (overload && !overload_) {
+        logger_->warn("overloaded ({}): cpu load {:.0f}%, media lag {:.0f}ms, new calls are refused",
+                      overload, cpu_load_ * 100, media_lag_ * 1000);
+    } else if (!overload && overload_) {
+        logger_->info("load is back to normal: cpu load {:.0f}%, media lag {:.0f}ms",
+                      cpu_load_ * 100, media_lag_ * 1000);
+    }
+    overload_ = overload;
+    overloaded_gauge.set(overload_ ? 1 : 0);
+}
+
+const char *Admission::check() const {
+    if (is_draining_) {
+        return "draining";
+    }
+    if (max_calls_ > 0 && active_calls_ >= max_calls_) {
+        return "calls";
+    }
+    return overload_;
+}
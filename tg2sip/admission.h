@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TG2SIP_ADMISSION_H
+#define TG2SIP_ADMISSION_H
+
+#include <cstdint>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include "settings.h"
+
+/*
+ * Decides whether the gateway may take one more call.
+ *
+ * Calls are refused while the number of bridges, system CPU load or the audio lag of
+ * the busiest call reach the configured limits, so that an overloaded box sheds new
+ * calls instead of degrading the ones in progress. Load is sampled once a second by
+ * the gateway, checks are cheap and run on every incoming call. Once the gateway
+ * starts draining for shutdown every call is refused. Gateway thread only.
+ */
+class Admission {
+public:
+    Admission(const Settings &settings, std::shared_ptr<spdlog::logger> logger);
+
+    // media_lag is how far audio encoding of the busiest call lags behind capture, seconds
+    void update(double media_lag);
+
+    // calls in progress, not counting the one being checked
+    void set_active_calls(size_t calls) { active_calls_ = calls; };
+
+    // refuse everything from now on
+    void drain() { is_draining_ = true; };
+
+    // nullptr when a new call may be taken, otherwise the limit that was hit
+    const char *check() const;
+
+    unsigned int retry_after() const { return retry_after_; };
+
+private:
+    std::shared_ptr<spdlog::logger> logger_;
+    const unsigned int max_calls_;
+    const double max_cpu_load_;
+    const double max_media_lag_;
+    const unsigned int retry_after_;
+
+    size_t active_calls_{0};
+    double cpu_load_{0};
+    double media_lag_{0};
+    const char *overload_{nullptr};
+    bool is_draining_{false};
+
+    uint64_t cpu_busy_{0};
+    uint64_t cpu_total_{0};
+
+    // jiffies since boot from /proc/stat, false where it is not available
+    static bool read_cpu_times(uint64_t &busy, uint64_t &total);
+};
+
+#endif //TG2SIP_ADMISSION_H
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fake_clients.h"
+
+using namespace bench;
+namespace td_api = td::td_api;
+
+Scheduler::Scheduler() {
+    thread_ = std::thread(&Scheduler::loop, this);
+    pthread_setname_np(thread_.native_handle(), "scheduler");
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void Scheduler::post(std::chrono::microseconds delay, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push(Task{std::chrono::steady_clock::now() + delay, next_seq_++, std::move(task)});
+    }
+    cv_.notify_one();
+}
+
+void Scheduler::loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_) {
+        if (tasks_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        auto at = tasks_.top().at;
+        if (at > std::chrono::steady_clock::now()) {
+            cv_.wait_until(lock, at);
+            continue;
+        }
+        auto fn = tasks_.top().fn;
+        tasks_.pop();
+        lock.unlock();
+        fn();
+        lock.lock();
+    }
+}
+
+FakeTgClient::FakeTgClient(OptionalQueue<Object> &events, Scheduler &scheduler, std::chrono::microseconds latency)
+        : events_(events), scheduler_(scheduler), latency_(latency) {}
+
+void FakeTgClient::send_query(td_api::object_ptr<td_api::Function> f, std::function<void(Object)> handler) {
+    auto response = std::make_shared<Object>(respond(*f));
+    if (!handler) {
+        return;
+    }
+    scheduler_.post(latency_, [response, handler = std::move(handler)] {
+        handler(std::move(*response));
+    });
+}
+
+std::future<tg::Client::Object> FakeTgClient::send_query_async(td_api::object_ptr<td_api::Function> f) {
+    auto promise = std::make_shared<std::promise<Object>>();
+    auto future = promise->get_future();
+    send_query(std::move(f), [promise](Object object) {
+        promise->set_value(std::move(object));
+    });
+    return future;
+}
+
+int32_t FakeTgClient::incoming_call(int64_t user_id) {
+    auto call_id = next_call_id_++;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        calls_.emplace(call_id, Call{user_id, false});
+    }
+    auto state = td_api::make_object<td_api::callStatePending>();
+    state->is_created_ = true;
+    state->is_received_ = true;
+    push_update(call_id, std::move(state));
+    return call_id;
+}
+
+void FakeTgClient::remote_hangup(int32_t call_id) {
+    auto state = td_api::make_object<td_api::callStateDiscarded>();
+    state->reason_ = td_api::make_object<td_api::callDiscardReasonHungUp>();
+    push_update(call_id, std::move(state));
+    std::lock_guard<std::mutex> lock(mutex_);
+    calls_.erase(call_id);
+}
+
+tg::Client::Object FakeTgClient::respond(td_api::Function &f) {
+    switch (f.get_id()) {
+        case td_api::getUser::ID: {
+            auto user = td_api::make_object<td_api::user>();
+            user->id_ = static_cast<td_api::getUser &>(f).user_id_;
+            user->first_name_ = "Bench";
+            user->last_name_ = std::to_string(user->id_);
+            user->phone_number_ = std::to_string(user->id_);
+            user->have_access_ = true;
+            return user;
+        }
+        case td_api::searchContacts::ID:
+            return td_api::make_object<td_api::users>();
+        case td_api::createCall::ID: {
+            auto user_id = static_cast<td_api::createCall &>(f).user_id_;
+            auto call_id = next_call_id_++;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                calls_.emplace(call_id, Call{user_id, true});
+            }
+            // updates must not overtake createCall response
+            scheduler_.post(latency_, [this, call_id] {
+                push_update(call_id, td_api::make_object<td_api::callStatePending>());
+            });
+            // remote user picks up
+            scheduler_.post(2 * latency_, [this, call_id] {
+                push_update(call_id, td_api::make_object<td_api::callStateExchangingKeys>());
+            });
+            scheduler_.post(3 * latency_, [this, call_id] {
+                auto state = td_api::make_object<td_api::callStateReady>();
+                state->encryption_key_ = std::string(256, '\x42');
+                push_update(call_id, std::move(state));
+            });
+            auto response = td_api::make_object<td_api::callId>();
+            response->id_ = call_id;
+            return response;
+        }
+        case td_api::acceptCall::ID: {
+            auto call_id = static_cast<td_api::acceptCall &>(f).call_id_;
+            scheduler_.post(2 * latency_, [this, call_id] {
+                auto state = td_api::make_object<td_api::callStateReady>();
+                state->encryption_key_ = std::string(256, '\x42');
+                push_update(call_id, std::move(state));
+            });
+            return td_api::make_object<td_api::ok>();
+        }
+        case td_api::discardCall::ID: {
+            auto call_id = static_cast<td_api::discardCall &>(f).call_id_;
+            if (on_discard_) {
+                int64_t user_id = 0;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = calls_.find(call_id);
+                    if (it != calls_.end()) {
+                        user_id = it->second.user_id;
+                    }
+                }
+                on_discard_(call_id, user_id);
+            }
+            scheduler_.post(latency_, [this, call_id] {
+                auto state = td_api::make_object<td_api::callStateDiscarded>();
+                state->reason_ = td_api::make_object<td_api::callDiscardReasonHungUp>();
+                push_update(call_id, std::move(state));
+                std::lock_guard<std::mutex> lock(mutex_);
+                calls_.erase(call_id);
+            });
+            return td_api::make_object<td_api::ok>();
+        }
+        default:
+            return td_api::make_object<td_api::ok>();
+    }
+}
+
+void FakeTgClient::push_update(int32_t call_id, td_api::object_ptr<td_api::CallState> state) {
+    auto call = td_api::make_object<td_api::call>();
+    call->id_ = call_id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = calls_.find(call_id);
+        if (it != calls_.end()) {
+            call->user_id_ = it->second.user_id;
+            call->is_outgoing_ = it->second.is_outgoing;
+        }
+    }
+    call->state_ = std::move(state);
+
+    auto update = td_api::make_object<td_api::updateCall>();
+    update->call_ = std::move(call);
+    events_.emplace(std::move(update));
+}
+
+FakeSipClient::FakeSipClient(OptionalQueue<sip::events::Event> &events, Scheduler &scheduler,
+                             std::chrono::microseconds latency)
+        : events_(events), scheduler_(scheduler), latency_(latency) {}
+
+pjsua_call_id FakeSipClient::Dial(const std::string &uri, const pj::CallOpParam &prm) {
+    auto call_id = next_call_id_++;
+    if (on_dial_) {
+        on_dial_(call_id, prm);
+    }
+    scheduler_.post(latency_, [this, call_id] { push_state(call_id, PJSIP_INV_STATE_EARLY); });
+    // remote party answers
+    scheduler_.post(2 * latency_, [this, call_id] {
+        push_state(call_id, PJSIP_INV_STATE_CONNECTING);
+        push_media(call_id);
+        push_state(call_id, PJSIP_INV_STATE_CONFIRMED);
+    });
+    return call_id;
+}
+
+void FakeSipClient::Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) {
+    if (prm.statusCode / 100 == 1) {
+        scheduler_.post(std::chrono::microseconds::zero(), [this, call_id] {
+            push_state(call_id, PJSIP_INV_STATE_EARLY);
+        });
+    } else if (prm.statusCode / 100 == 2) {
+        // waiting for ACK
+        scheduler_.post(latency_, [this, call_id] {
+            push_state(call_id, PJSIP_INV_STATE_CONNECTING);
+            push_media(call_id);
+            push_state(call_id, PJSIP_INV_STATE_CONFIRMED);
+        });
+    } else {
+        Hangup(call_id, prm);
+    }
+}
+
+void FakeSipClient::Hangup(pjsua_call_id call_id, const pj::CallOpParam &prm) {
+    if (on_hangup_) {
+        on_hangup_(call_id);
+    }
+    scheduler_.post(latency_, [this, call_id] { push_state(call_id, PJSIP_INV_STATE_DISCONNECTED); });
+}
+
+void FakeSipClient::BridgeAudio(pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output) {
+    if (on_bridged_) {
+        on_bridged_(call_id);
+    }
+}
+
+void FakeSipClient::ConnectAudio(pjsua_call_id call_id, pjmedia_port *input, pjmedia_port *output) {
+    if (on_bridged_) {
+        on_bridged_(call_id);
+    }
+}
+
+pjsua_call_id FakeSipClient::incoming_call(const std::string &extension) {
+    auto call_id = next_call_id_++;
+    events_.emplace(sip::events::IncomingCall{call_id, extension});
+    return call_id;
+}
+
+void FakeSipClient::remote_hangup(pjsua_call_id call_id) {
+    push_state(call_id, PJSIP_INV_STATE_DISCONNECTED);
+}
+
+void FakeSipClient::push_state(pjsua_call_id call_id, pjsip_inv_state state) {
+    events_.emplace(sip::events::CallStateUpdate{call_id, state});
+}
+
+void FakeSipClient::push_media(pjsua_call_id call_id) {
+    events_.emplace(sip::events::CallMediaStateUpdate{call_id, true});
+}
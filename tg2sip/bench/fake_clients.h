@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TG2SIP_FAKE_CLIENTS_H
+#define TG2SIP_FAKE_CLIENTS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include "../tg.h"
+#include "../sip.h"
+
+namespace bench {
+
+    // Runs tasks after a delay on its own thread, fakes use it to emulate remote side latency
+    class Scheduler {
+    public:
+        Scheduler();
+
+        Scheduler(const Scheduler &) = delete;
+
+        Scheduler &operator=(const Scheduler &) = delete;
+
+        ~Scheduler();
+
+        void post(std::chrono::microseconds delay, std::function<void()> task);
+
+    private:
+        struct Task {
+            std::chrono::steady_clock::time_point at;
+            uint64_t seq;
+            std::function<void()> fn;
+
+            bool operator>(const Task &other) const {
+                return at == other.at ? seq > other.seq : at > other.at;
+            }
+        };
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::priority_queue<Task, std::vector<Task>, std::greater<>> tasks_;
+        uint64_t next_seq_{0};
+        bool stopped_{false};
+        std::thread thread_;
+
+        void loop();
+    };
+
+    // TDLib replacement answering every query after fixed latency.
+    // Calls created by gateway are picked up by remote side after another latency period.
+    class FakeTgClient : public tg::Client {
+    public:
+        using DiscardHandler = std::function<void(int32_t call_id, int64_t user_id)>;
+
+        FakeTgClient(OptionalQueue<Object> &events, Scheduler &scheduler, std::chrono::microseconds latency);
+
+        void send_query(td::td_api::object_ptr<td::td_api::Function> f,
+                        std::function<void(Object)> handler = nullptr) override;
+
+        std::future<Object> send_query_async(td::td_api::object_ptr<td::td_api::Function> f) override;
+
+        // remote user calls gateway, returns TG call id
+        int32_t incoming_call(int64_t user_id);
+
+        // remote user drops the call
+        void remote_hangup(int32_t call_id);
+
+        // called from gateway thread when gateway discards a call
+        void on_discard(DiscardHandler handler) { on_discard_ = std::move(handler); };
+
+    private:
+        struct Call {
+            int64_t user_id;
+            bool is_outgoing;
+        };
+
+        OptionalQueue<Object> &events_;
+        Scheduler &scheduler_;
+        const std::chrono::microseconds latency_;
+
+        std::mutex mutex_;
+        std::map<int32_t, Call> calls_;
+        std::atomic<int32_t> next_call_id_{1};
+
+        DiscardHandler on_discard_;
+
+        Object respond(td::td_api::Function &f);
+
+        void push_update(int32_t call_id, td::td_api::object_ptr<td::td_api::CallState> state);
+    };
+
+    // pjsua replacement, remote SIP party answers and sets up media after fixed latency
+    class FakeSipClient : public sip::Client {
+    public:
+        using DialHandler = std::function<void(pjsua_call_id, const pj::CallOpParam &)>;
+        using CallHandler = std::function<void(pjsua_call_id)>;
+
+        FakeSipClient(OptionalQueue<sip::events::Event> &events, Scheduler &scheduler,
+                      std::chrono::microseconds latency);
+
+        pjsua_call_id Dial(const std::string &uri, const pj::CallOpParam &prm) override;
+
+        void Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) override;
+
+        void Hangup(pjsua_call_id call_id, const pj::CallOpParam &prm) override;
+
+        void DialDtmf(pjsua_call_id call_id, const string &dtmf_digits) override {};
+
+        void BridgeAudio(pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output) override;
+
+        void ConnectAudio(pjsua_call_id call_id, pjmedia_port *input, pjmedia_port *output) override;
+
+        // remote party calls extension, returns SIP call id
+        pjsua_call_id incoming_call(const std::string &extension);
+
+        // remote party drops the call
+        void remote_hangup(pjsua_call_id call_id);
+
+        // handlers are called from gateway thread
+        void on_dial(DialHandler handler) { on_dial_ = std::move(handler); };
+
+        void on_bridged(CallHandler handler) { on_bridged_ = std::move(handler); };
+
+        void on_hangup(CallHandler handler) { on_hangup_ = std::move(handler); };
+
+    private:
+        OptionalQueue<sip::events::Event> &events_;
+        Scheduler &scheduler_;
+        const std::chrono::microseconds latency_;
+
+        std::atomic<pjsua_call_id> next_call_id_{0};
+
+        DialHandler on_dial_;
+        CallHandler on_bridged_;
+        CallHandler on_hangup_;
+
+        void push_state(pjsua_call_id call_id, pjsip_inv_state state);
+
+        void push_media(pjsua_call_id call_id);
+    };
+}
+
+#endif //TG2SIP_FAKE_CLIENTS_H
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Offline call control benchmark: gateway state machines driven by fake TDLib and SIP clients.
+// Reports setup rate, setup latency and memory per bridge for a scripted call load.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <spdlog/spdlog.h>
+#include "../gateway.h"
+#include "fake_clients.h"
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        unsigned int calls{1000};
+        double rate{50};
+        double hold{30};
+        unsigned int latency_ms{20};
+        std::string direction{"mixed"};
+    };
+
+    struct CallRecord {
+        Clock::time_point started;
+        Clock::time_point bridged;
+        bool is_bridged{false};
+        bool is_ended{false};
+        bool from_tg{false};
+        int32_t tg_call_id{0};
+        pjsua_call_id sip_call_id{PJSUA_INVALID_ID};
+    };
+
+    void usage(const char *name) {
+        std::cerr << "Usage: " << name << " [--calls N] [--rate CALLS_PER_SECOND] [--hold SECONDS]\n"
+                  << "       [--latency MS] [--direction tg|sip|mixed]\n";
+    }
+
+    bool parse_options(int argc, char **argv, Options &options) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                return false;
+            }
+            std::string value = argv[++i];
+            if (arg == "--calls") {
+                options.calls = std::stoul(value);
+            } else if (arg == "--rate") {
+                options.rate = std::stod(value);
+            } else if (arg == "--hold") {
+                options.hold = std::stod(value);
+            } else if (arg == "--latency") {
+                options.latency_ms = std::stoul(value);
+            } else if (arg == "--direction") {
+                options.direction = value;
+            } else {
+                return false;
+            }
+        }
+        return options.calls > 0 && options.rate > 0 &&
+               (options.direction == "tg" || options.direction == "sip" || options.direction == "mixed");
+    }
+
+    size_t resident_bytes() {
+        size_t pages = 0, resident = 0;
+        std::ifstream statm("/proc/self/statm");
+        statm >> pages >> resident;
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    double percentile(std::vector<double> &sorted, double p) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        auto index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+
+    std::string write_settings() {
+        char path[] = "/tmp/tg2sip_bench_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            return "";
+        }
+        close(fd);
+        std::ofstream ini(path);
+        ini << "[logging]\ncore=6\ntgvoip=6\npjsip=0\n"
+            << "[sip]\ncallback_uri=sip:bench@127.0.0.1\ndirect_media=true\n"
+            << "[telegram]\napi_id=1\napi_hash=bench\n"
+            // the benchmark loads the box on purpose, admission control would refuse its calls
+            << "[other]\nmax_cpu_load=0\nmax_media_lag=0\n";
+        return path;
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        if (!parse_options(argc, argv, options)) {
+            usage(argv[0]);
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // every bridge owns a tgvoip socket
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    auto settings_path = write_settings();
+    auto reader = INIReader(settings_path);
+    Settings settings(reader);
+    unlink(settings_path.c_str());
+    if (!settings.is_loaded()) {
+        return 1;
+    }
+
+    auto logger = spdlog::stdout_color_mt("core");
+    logger->set_level(spdlog::level::off);
+
+    // tgvoip audio ports allocate from pjsua pools
+    pj::Endpoint ep;
+    ep.libCreate();
+    pj::EpConfig ep_cfg;
+    ep_cfg.logConfig.level = 0;
+    ep_cfg.logConfig.consoleLevel = 0;
+    ep.libInit(ep_cfg);
+    ep.audDevManager().setNullDev();
+    ep.libStart();
+
+    auto latency = std::chrono::microseconds(options.latency_ms * 1000);
+    bench::Scheduler scheduler;
+    OptionalQueue<sip::events::Event> sip_events;
+    OptionalQueue<tg::Client::Object> tg_events;
+    bench::FakeSipClient sip_client(sip_events, scheduler, latency);
+    bench::FakeTgClient tg_client(tg_events, scheduler, latency);
+
+    std::mutex mutex;
+    std::vector<CallRecord> records(options.calls);
+    // TG user id of calls from TG side equals to record index + USER_ID_BASE
+    const int64_t USER_ID_BASE = 1000000;
+    std::map<pjsua_call_id, size_t> by_sip_id;
+    std::atomic<unsigned int> bridged{0};
+    std::atomic<unsigned int> ended{0};
+    auto end_call = [&](size_t index) {
+        if (index < records.size() && !records[index].is_ended) {
+            records[index].is_ended = true;
+            ++ended;
+        }
+    };
+
+    auto hold = std::chrono::microseconds(static_cast<int64_t>(options.hold * 1e6));
+
+    sip_client.on_dial([&](pjsua_call_id call_id, const pj::CallOpParam &prm) {
+        for (const auto &header : prm.txOption.headers) {
+            if (header.hName == "X-TG-ID") {
+                std::lock_guard<std::mutex> lock(mutex);
+                by_sip_id[call_id] = static_cast<size_t>(std::stoll(header.hValue) - USER_ID_BASE);
+            }
+        }
+    });
+    sip_client.on_bridged([&](pjsua_call_id call_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_sip_id.find(call_id);
+        if (it == by_sip_id.end()) {
+            return;
+        }
+        auto &record = records[it->second];
+        record.bridged = Clock::now();
+        record.is_bridged = true;
+        ++bridged;
+
+        if (record.from_tg) {
+            auto tg_call_id = record.tg_call_id;
+            scheduler.post(hold, [&tg_client, tg_call_id] { tg_client.remote_hangup(tg_call_id); });
+        } else {
+            scheduler.post(hold, [&sip_client, call_id] { sip_client.remote_hangup(call_id); });
+        }
+    });
+
+    // gateway hangs up the other leg once one side of the call is gone
+    sip_client.on_hangup([&](pjsua_call_id call_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = by_sip_id.find(call_id);
+        if (it != by_sip_id.end()) {
+            end_call(it->second);
+        }
+    });
+    tg_client.on_discard([&](int32_t call_id, int64_t user_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        end_call(static_cast<size_t>(user_id - USER_ID_BASE));
+    });
+
+    Accounts accounts(settings, logger);
+    accounts.add(tg_client, tg_events);
+    Gateway gateway(sip_client, accounts, sip_events, logger, settings);
+    std::thread gateway_thread([&gateway] { gateway.start(); });
+
+    auto baseline_rss = resident_bytes();
+    size_t peak_rss = baseline_rss;
+    unsigned int peak_active = 0;
+    size_t rss_at_peak = baseline_rss;
+
+    auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / options.rate));
+    auto bench_start = Clock::now();
+    auto next_call = bench_start;
+    auto next_sample = bench_start;
+    unsigned int started = 0;
+
+    std::printf("%8s %8s %8s %8s %8s %10s\n", "time", "started", "bridged", "ended", "active", "rss MB");
+    while (true) {
+        auto now = Clock::now();
+
+        while (started < options.calls && now >= next_call) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto &record = records[started];
+            record.started = now;
+            auto from_tg = options.direction == "tg" || (options.direction == "mixed" && started % 2 == 0);
+            record.from_tg = from_tg;
+            if (from_tg) {
+                record.tg_call_id = tg_client.incoming_call(USER_ID_BASE + started);
+            } else {
+                record.sip_call_id = sip_client.incoming_call(std::to_string(USER_ID_BASE + started));
+                by_sip_id[record.sip_call_id] = started;
+            }
+            ++started;
+            next_call += interval;
+        }
+
+        if (now >= next_sample) {
+            unsigned int active = bridged - std::min(bridged.load(), ended.load());
+            auto rss = resident_bytes();
+            peak_rss = std::max(peak_rss, rss);
+            if (active >= peak_active) {
+                peak_active = active;
+                rss_at_peak = rss;
+            }
+            std::printf("%8.1f %8u %8u %8u %8u %10.1f\n",
+                        std::chrono::duration<double>(now - bench_start).count(),
+                        started, bridged.load(), ended.load(), active, rss / 1048576.0);
+            std::fflush(stdout);
+            next_sample = now + std::chrono::seconds(1);
+        }
+
+        // all calls done or setup hopelessly stuck
+        auto deadline = bench_start + interval * options.calls + hold + std::chrono::seconds(60);
+        if ((started == options.calls && ended == started) || now > deadline) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    gateway.stop();
+    gateway_thread.join();
+
+    std::vector<double> setup;
+    Clock::time_point first_start = records.front().started, last_bridge = first_start;
+    for (const auto &record : records) {
+        if (record.is_bridged) {
+            setup.push_back(std::chrono::duration<double, std::milli>(record.bridged - record.started).count());
+            last_bridge = std::max(last_bridge, record.bridged);
+        }
+    }
+    std::sort(setup.begin(), setup.end());
+    auto setup_window = std::chrono::duration<double>(last_bridge - first_start).count();
+
+    std::printf("\ncalls: %u offered at %.1f/s, %zu bridged\n", options.calls, options.rate, setup.size());
+    std::printf("setup rate: %.1f calls/s\n", setup_window > 0 ? setup.size() / setup_window : 0.0);
+    std::printf("setup latency ms: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+                percentile(setup, 50), percentile(setup, 90), percentile(setup, 99),
+                setup.empty() ? 0.0 : setup.back());
+    std::printf("peak concurrent bridges: %u, rss %.1f MB (baseline %.1f MB, peak %.1f MB)\n",
+                peak_active, rss_at_peak / 1048576.0, baseline_rss / 1048576.0, peak_rss / 1048576.0);
+    if (peak_active > 0) {
+        std::printf("memory per bridge: %.1f KB\n",
+                    (static_cast<double>(rss_at_peak) - baseline_rss) / peak_active / 1024.0);
+    }
+
+    ep.libDestroy();
+    return 0;
+}
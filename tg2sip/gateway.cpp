@@ -16,6 +16,7 @@
  */
 
 #include <regex>
+#include <libtgvoip/EncoderGovernor.h>
 #include "gateway.h"
 
 namespace sml = boost::sml;
@@ -24,6 +25,7 @@ namespace td_api = td::td_api;
 #define CALL_PROTO_MIN_LAYER 65
 
 volatile sig_atomic_t e_flag = 0;
+volatile sig_atomic_t trace_flag = 0;
 
 namespace {
     vector<string> voip_library_versions() {
@@ -32,6 +34,99 @@ namespace {
         // but telegram servers accepts only this one
         return vector<string>{"2.4.4"};
     }
+
+    const char *voip_state_name(int state) {
+        switch (state) {
+            case tgvoip::STATE_WAIT_INIT:
+                return "STATE_WAIT_INIT";
+            case tgvoip::STATE_WAIT_INIT_ACK:
+                return "STATE_WAIT_INIT_ACK";
+            case tgvoip::STATE_ESTABLISHED:
+                return "STATE_ESTABLISHED";
+            case tgvoip::STATE_FAILED:
+                return "STATE_FAILED";
+            case tgvoip::STATE_RECONNECTING:
+                return "STATE_RECONNECTING";
+            default:
+                return "STATE_UNKNOWN";
+        }
+    }
+
+    // accounts controller statistics gathered since the previous call
+    // returns how far audio encoding lagged behind capture since the previous report, seconds
+    double report_voip_stats(tgvoip::VoIPController &controller,
+                             tgvoip::VoIPController::TrafficStats &prev_traffic,
+                             tgvoip::VoIPController::MediaStats &prev_media,
+                             tgvoip::VoIPController::ResourceStats &prev_resources) {
+        tgvoip::VoIPController::TrafficStats traffic{};
+        controller.GetStats(&traffic);
+        tgvoip::VoIPController::MediaStats media{};
+        controller.GetMediaStats(&media);
+        tgvoip::VoIPController::ResourceStats resources{};
+        controller.GetStats(&resources);
+
+        auto &registry = metrics::registry();
+        static auto &bytes_sent = registry.counter("tg2sip_voip_bytes_total", "Telegram VoIP traffic",
+                                                   {{"direction", "sent"}});
+        static auto &bytes_recvd = registry.counter("tg2sip_voip_bytes_total", "Telegram VoIP traffic",
+                                                    {{"direction", "received"}});
+        static auto &packets_sent = registry.counter("tg2sip_voip_packets_total", "Telegram VoIP packets",
+                                                     {{"direction", "sent"}});
+        static auto &packets_recvd = registry.counter("tg2sip_voip_packets_total", "Telegram VoIP packets",
+                                                      {{"direction", "received"}});
+        static auto &lost_sent = registry.counter("tg2sip_voip_packets_lost_total", "Telegram VoIP packets lost",
+                                                  {{"direction", "sent"}});
+        static auto &lost_recvd = registry.counter("tg2sip_voip_packets_lost_total", "Telegram VoIP packets lost",
+                                                   {{"direction", "received"}});
+        static auto &cpu_time = registry.counter("tg2sip_voip_cpu_seconds_total",
+                                                 "CPU time spent by Telegram VoIP threads");
+        static auto &allocated_bytes = registry.counter("tg2sip_voip_allocated_bytes_total",
+                                                        "Heap bytes allocated by Telegram VoIP threads "
+                                                        "(needs TGVOIP_ALLOCATION_ACCOUNTING build)");
+        static auto &allocations = registry.counter("tg2sip_voip_allocations_total",
+                                                    "Heap allocations made by Telegram VoIP threads "
+                                                    "(needs TGVOIP_ALLOCATION_ACCOUNTING build)");
+
+        auto delta = [](uint64_t current, uint64_t reported) {
+            return current > reported ? static_cast<double>(current - reported) : 0.0;
+        };
+
+        bytes_sent.inc(delta(traffic.bytesSentWifi + traffic.bytesSentMobile,
+                             prev_traffic.bytesSentWifi + prev_traffic.bytesSentMobile));
+        bytes_recvd.inc(delta(traffic.bytesRecvdWifi + traffic.bytesRecvdMobile,
+                              prev_traffic.bytesRecvdWifi + prev_traffic.bytesRecvdMobile));
+
+        packets_sent.inc(delta(media.packetsSent, prev_media.packetsSent));
+        packets_recvd.inc(delta(media.packetsRecvd, prev_media.packetsRecvd));
+        lost_sent.inc(delta(media.sendLossCount, prev_media.sendLossCount));
+        lost_recvd.inc(delta(media.recvLossCount, prev_media.recvLossCount));
+
+        if (resources.cpuTime > prev_resources.cpuTime) {
+            cpu_time.inc(resources.cpuTime - prev_resources.cpuTime);
+        }
+        allocated_bytes.inc(delta(resources.allocatedBytes, prev_resources.allocatedBytes));
+        allocations.inc(delta(resources.allocationCount, prev_resources.allocationCount));
+
+        // every packet still queued ahead of an encoded one is 20 ms of delay
+        auto encoded = delta(media.encoderPackets, prev_media.encoderPackets);
+        auto media_lag = encoded > 0 ? delta(media.encoderBacklog, prev_media.encoderBacklog) / encoded * 0.02 : 0.0;
+        // dropped input means the whole encoder queue (10 packets) was waiting
+        if (media.encoderOverruns > prev_media.encoderOverruns) {
+            media_lag = std::max(media_lag, 0.2);
+        }
+
+        prev_traffic = traffic;
+        prev_media = media;
+        prev_resources = resources;
+        return media_lag;
+    }
+
+    double report_voip_stats(Context &ctx) {
+        if (!ctx.controller) {
+            return 0;
+        }
+        return report_voip_stats(*ctx.controller, ctx.reported_traffic, ctx.reported_media, ctx.reported_resources);
+    }
 }
 
 namespace state_machine::guards {
@@ -43,6 +138,10 @@ namespace state_machine::guards {
         return event->call_->state_->get_id() == id_;
     }
 
+    bool IsOverloaded::operator()(const Admission &admission) const {
+        return admission.check() != nullptr;
+    }
+
     bool CallbackUriIsSet::operator()(const Settings &settings) const {
         return !settings.callback_uri().empty();
     }
@@ -82,9 +181,10 @@ namespace state_machine::actions {
     }
 
     void StoreTgId::operator()(Context &ctx, const td::td_api::object_ptr<td::td_api::updateCall> &event,
-                               std::shared_ptr<spdlog::logger> logger) const {
+                               Accounts &accounts, std::shared_ptr<spdlog::logger> logger) const {
         ctx.tg_call_id = event->call_->id_;
-        DEBUG(logger, "[{}] associated with TG#{}", ctx.id(), ctx.tg_call_id);
+        accounts.received(*ctx.account);
+        DEBUG(logger, "[{}] associated with TG#{} of account {}", ctx.id(), ctx.tg_call_id, ctx.account->name);
     }
 
     void StoreTgUserId::operator()(Context &ctx, const td::td_api::object_ptr<td::td_api::updateCall> &event,
@@ -102,29 +202,17 @@ namespace state_machine::actions {
     }
 
 
-    void CleanUp::operator()(Context &ctx, sip::Client &sip_client, tg::Client &tg_client,
+    void CleanUp::operator()(Context &ctx, sip::Client &sip_client, Accounts &accounts, VoipPool &voip_pool,
                              std::shared_ptr<spdlog::logger> logger) const {
         TRACE(logger, "[{}] cleanup start", ctx.id());
 
-        if (ctx.controller) {
-            ctx.controller->Stop();
-        }
+        static auto &finished = metrics::registry().counter("tg2sip_calls_finished_total", "Finished calls");
+        finished.inc();
 
         if (ctx.tg_call_id != 0) {
             DEBUG(logger, "[{}] hangup TG #{}", ctx.id(), ctx.tg_call_id);
-
-            auto result = tg_client.send_query_async(td_api::make_object<td_api::discardCall>(
-                    ctx.tg_call_id, /* call_id_ */
-                    false, /* is_disconnected_ */
-                    0, /* duration_ */
-                    false, /* is_video_ */
-                    ctx.tg_call_id /*connection_id */
-            )).get();
-
-            if (result->get_id() == td_api::error::ID) {
-                logger->error("[{}] TG call discard failure:\n{}", ctx.id(), to_string(result));
-            }
-
+            // the answer is only logged, so the gateway doesn't wait for it
+            accounts.discard(*ctx.account, ctx.tg_call_id, ctx.id());
             ctx.tg_call_id = 0;
         }
 
@@ -137,16 +225,42 @@ namespace state_machine::actions {
             ctx.sip_call_id = PJSUA_INVALID_ID;
         }
 
+        if (ctx.account) {
+            accounts.call_ended(*ctx.account);
+        }
+
+        // audio is unbridged by now, Stop() and destructor run on a reaper thread
+        voip_pool.release(std::move(ctx.controller), [id = ctx.id(), created_at = ctx.created_at,
+                traffic = ctx.reported_traffic, media = ctx.reported_media, resources = ctx.reported_resources,
+                logger](tgvoip::VoIPController &controller) mutable {
+            report_voip_stats(controller, traffic, media, resources);
+
+            // all controller threads are joined by now, so the totals are final
+            static auto &call_cpu = metrics::registry().histogram(
+                    "tg2sip_voip_call_cpu_seconds", "CPU time spent by Telegram VoIP threads per call",
+                    {0.1, 0.5, 1, 5, 10, 30, 60, 300, 900});
+            call_cpu.observe(resources.cpuTime);
+            auto call_duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - created_at).count();
+            logger->info("[{}] voip resources: cpu {:.3f}s ({:.1f}% of a core), {} allocations, {} bytes",
+                         id, resources.cpuTime, call_duration > 0 ? resources.cpuTime / call_duration * 100 : 0.0,
+                         resources.allocationCount, resources.allocatedBytes);
+            for (const auto &thread : controller.GetThreadResourceStats()) {
+                DEBUG(logger, "[{}] voip thread {}: cpu {:.3f}s, {} allocations, {} bytes", id,
+                      thread.name.empty() ? "unnamed" : thread.name, thread.cpuTime,
+                      thread.allocationCount, thread.allocatedBytes);
+            }
+        });
+
         TRACE(logger, "[{}] cleanup end");
     }
 
-    void DialSip::operator()(Context &ctx, tg::Client &tg_client, sip::Client &sip_client,
+    void DialSip::operator()(Context &ctx, sip::Client &sip_client,
                              const td_api::object_ptr<td_api::updateCall> &event,
                              OptionalQueue<state_machine::events::Event> &internal_events,
                              const Settings &settings, std::shared_ptr<spdlog::logger> logger) const {
 
         auto tg_user_id = event->call_->user_id_;
-        auto response = tg_client.send_query_async(td_api::make_object<td_api::getUser>(tg_user_id)).get();
+        auto response = ctx.account->client.send_query_async(td_api::make_object<td_api::getUser>(tg_user_id)).get();
 
         if (response->get_id() == td_api::error::ID) {
             logger->error("[{}] get user info of id {} failed\n{}", ctx.id(), tg_user_id, to_string(response));
@@ -173,6 +287,13 @@ namespace state_machine::actions {
             headers.push_back(header);
         }
 
+        {
+            // lets SIP side tell which gateway account the user called
+            header.hName = "X-TG-Account";
+            header.hValue = ctx.account->name;
+            headers.push_back(header);
+        }
+
         if (!user->first_name_.empty()) {
             header.hName = "X-TG-FirstName";
             header.hValue = user->first_name_;
@@ -212,11 +333,11 @@ namespace state_machine::actions {
         DEBUG(logger, "[{}] associated with SIP#{}", ctx.id(), ctx.sip_call_id);
     }
 
-    void AnswerTg::operator()(Context &ctx, tg::Client &tg_client, const Settings &settings,
+    void AnswerTg::operator()(Context &ctx, const Settings &settings,
                               OptionalQueue<state_machine::events::Event> &internal_events,
                               std::shared_ptr<spdlog::logger> logger) const {
 
-        auto response = tg_client.send_query_async(td_api::make_object<td_api::acceptCall>(
+        auto response = ctx.account->client.send_query_async(td_api::make_object<td_api::acceptCall>(
                 ctx.tg_call_id,
                 td_api::make_object<td_api::callProtocol>(settings.udp_p2p(),
                                                           settings.udp_reflector(),
@@ -312,7 +433,7 @@ namespace state_machine::actions {
         }
     }
 
-    void state_machine::actions::CreateTgVoip::operator()(Context &ctx, const Settings &settings,
+    void state_machine::actions::CreateTgVoip::operator()(Context &ctx, const Settings &settings, VoipPool &voip_pool,
                                                           const td::td_api::object_ptr<td::td_api::updateCall> &event,
                                                           std::shared_ptr<spdlog::logger> logger) const {
 
@@ -321,26 +442,14 @@ namespace state_machine::actions {
         using namespace tgvoip;
 
         const auto &state = static_cast<const td_api::callStateReady &>(*event->call_->state_);
-        auto voip_controller = std::make_shared<VoIPController>();
-
-        static auto config = VoIPController::Config(
-                3000,   /*init_timeout*/
-                3000,   /*recv_timeout*/
-                DATA_SAVING_NEVER, /*data_saving*/
-                settings.aec_enabled(),   /*enableAEC*/
-                settings.ns_enabled(),  /*enableNS*/
-                settings.agc_enabled(),  /*enableAGC*/
-                false   /*enableCallUpgrade*/
-        );
-        voip_controller->SetConfig(config);
-        if (settings.voip_proxy_enabled()) {
-            voip_controller->SetProxy(
-                    PROXY_SOCKS5,
-                    settings.voip_proxy_address(),
-                    settings.voip_proxy_port(),
-                    settings.voip_proxy_username(),
-                    settings.voip_proxy_password()
-            );
+        // comes configured, proxy included
+        auto voip_controller = voip_pool.acquire();
+        if (!settings.capture_folder().empty()) {
+            auto call_config = voip_pool.config();
+            // TG call ids repeat across accounts and restarts, context id is unique per process
+            call_config.captureFilePath = settings.capture_folder() + "/call_" + ctx.account->name + "_" + ctx.id() +
+                                          "_" + std::to_string(ctx.tg_call_id) + ".tgvc";
+            voip_controller->SetConfig(call_config);
         }
 
         char encryption_key[256];
@@ -366,21 +475,41 @@ namespace state_machine::actions {
                                             peer_tag));
         }
         voip_controller->SetRemoteEndpoints(endpoints, settings.udp_p2p(), VoIPController::GetConnectionMaxLayer());
+        // tgvoip handshake progress goes to the call setup trace
+        voip_controller->implData = reinterpret_cast<void *>(static_cast<intptr_t>(ctx.seq()));
+        VoIPController::Callbacks callbacks{};
+        callbacks.connectionStateChanged = [](VoIPController *controller, int state) {
+            trace::instant("tgvoip", voip_state_name(state), reinterpret_cast<intptr_t>(controller->implData));
+        };
+        voip_controller->SetCallbacks(callbacks);
+
         voip_controller->Start();
         voip_controller->Connect();
 
         ctx.controller = std::move(voip_controller);
     }
 
-    void state_machine::actions::BridgeAudio::operator()(Context &ctx, sip::Client &sip_client,
+    void state_machine::actions::BridgeAudio::operator()(Context &ctx, sip::Client &sip_client, const Settings &settings,
                                                          OptionalQueue<state_machine::events::Event> &internal_events,
                                                          std::shared_ptr<spdlog::logger> logger) const {
         DEBUG(logger, "[{}] bridging tgvoip audio with SIP#{}", ctx.id(), ctx.sip_call_id);
 
         try {
-            sip_client.BridgeAudio(ctx.sip_call_id,
-                                   ctx.controller->AudioMediaInput(),
-                                   ctx.controller->AudioMediaOutput());
+            if (settings.direct_media()) {
+                sip_client.ConnectAudio(ctx.sip_call_id,
+                                        ctx.controller->AudioPortInput(),
+                                        ctx.controller->AudioPortOutput());
+            } else {
+                sip_client.BridgeAudio(ctx.sip_call_id,
+                                       ctx.controller->AudioMediaInput(),
+                                       ctx.controller->AudioMediaOutput());
+            }
+
+            static auto &setup_latency = metrics::registry().histogram(
+                    "tg2sip_call_setup_seconds", "Time from the first call event to audio bridging",
+                    {0.25, 0.5, 1, 2, 3, 5, 10, 20, 30, 60});
+            setup_latency.observe(
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - ctx.created_at).count());
         } catch (const pj::Error &error) {
             pj::CallOpParam hangup_prm;
             hangup_prm.statusCode = PJSIP_SC_INTERNAL_SERVER_ERROR;
@@ -398,34 +527,52 @@ namespace state_machine::actions {
         ctx.hangup_prm = event.prm;
     }
 
-    void DialTg::operator()(Context &ctx, tg::Client &tg_client, const Settings &settings, Cache &cache,
-                            std::chrono::steady_clock::time_point &block_until,
+    void RejectOverload::operator()(Context &ctx, const Admission &admission,
+                                    std::shared_ptr<spdlog::logger> logger) const {
+        auto reason = admission.check();
+        logger->warn("[{}] refusing new call, {} limit reached", ctx.id(), reason);
+        metrics::registry().counter("tg2sip_calls_rejected_total", "Calls refused by admission control",
+                                    {{"reason", reason}}).inc();
+
+        ctx.hangup_prm.statusCode = PJSIP_SC_SERVICE_UNAVAILABLE;
+        ctx.hangup_prm.reason = std::string(reason) == "draining" ? "Shutting down" : "Overloaded";
+        if (admission.retry_after() > 0) {
+            pj::SipHeader header;
+            header.hName = "Retry-After";
+            header.hValue = std::to_string(admission.retry_after());
+            ctx.hangup_prm.txOption.headers.push_back(header);
+        }
+    }
+
+    void DialTg::operator()(Context &ctx, const Settings &settings, Accounts &accounts,
                             OptionalQueue<state_machine::events::Event> &internal_events,
                             std::shared_ptr<spdlog::logger> logger) {
 
         DEBUG(logger, "[{}] dialing tg", ctx.id());
 
         ctx_ = &ctx;
-        tg_client_ = &tg_client;
         settings_ = &settings;
-        cache_ = &cache;
-        block_until_ = &block_until;
         internal_events_ = &internal_events;
         logger_ = logger;
 
-        if (block_until > std::chrono::steady_clock::now()) {
-            auto seconds_left = std::chrono::duration_cast<std::chrono::seconds>(
-                    block_until - std::chrono::steady_clock::now()).count();
-
-            DEBUG(logger, "[{}] dropping call cause of temp TG block for {} seconds", ctx.id(), seconds_left);
+        std::chrono::seconds wait{0};
+        account_ = accounts.pick_outbound(wait);
+        if (!account_) {
+            DEBUG(logger, "[{}] dropping call, every TG account is held back for {} seconds at least",
+                  ctx.id(), wait.count());
 
             pj::CallOpParam prm;
             prm.statusCode = PJSIP_SC_INTERNAL_SERVER_ERROR;
-            prm.reason = "FLOOD_WAIT " + std::to_string(seconds_left);
+            prm.reason = "FLOOD_WAIT " + std::to_string(wait.count());
             internal_events.emplace(state_machine::events::InternalError{ctx.id(), prm});
             return;
         }
 
+        DEBUG(logger, "[{}] dialing with account {}", ctx.id(), account_->name);
+        ctx.account = account_;
+        accounts.call_started(*account_);
+        accounts.dialed(*account_);
+
         if (!ctx.ext_username.empty()) {
             dial_by_username();
         } else if (!ctx.ext_phone.empty()) {
@@ -436,7 +583,7 @@ namespace state_machine::actions {
     }
 
     void DialTg::dial_by_id(int64_t id) {
-        auto response = tg_client_->send_query_async(td_api::make_object<td_api::createCall>(
+        auto response = account_->client.send_query_async(td_api::make_object<td_api::createCall>(
                 id /* id */,
                 td_api::make_object<td_api::callProtocol>(settings_->udp_p2p(), settings_->udp_reflector(),
                                                           CALL_PROTO_MIN_LAYER,
@@ -468,8 +615,9 @@ namespace state_machine::actions {
 
     void DialTg::dial_by_phone() {
 
-        auto it = cache_->phone_cache.find(ctx_->ext_phone);
-        if (it != cache_->phone_cache.end()) {
+        auto &cache = account_->cache;
+        auto it = cache.phone_cache.find(ctx_->ext_phone);
+        if (it != cache.phone_cache.end()) {
             DEBUG(logger_, "[{}] found id {} for {} in phone cache", ctx_->id(), it->second, ctx_->ext_phone);
             dial_by_id(it->second);
             return;
@@ -481,7 +629,7 @@ namespace state_machine::actions {
         auto contacts = std::vector<td_api::object_ptr<td_api::contact>>();
         contacts.emplace_back(std::move(contact));
 
-        auto response = tg_client_->send_query_async(
+        auto response = account_->client.send_query_async(
                 td_api::make_object<td_api::importContacts>(std::move(contacts))).get();
 
         if (response->get_id() == td_api::error::ID) {
@@ -512,19 +660,20 @@ namespace state_machine::actions {
         }
 
         DEBUG(logger_, "[{}] adding id {} for {} to phone cache", ctx_->id(), user_id_, ctx_->ext_phone);
-        cache_->phone_cache.emplace(ctx_->ext_phone, user_id_);
+        cache.phone_cache.emplace(ctx_->ext_phone, user_id_);
         dial_by_id(user_id_);
     }
 
     void DialTg::dial_by_username() {
-        auto it = cache_->username_cache.find(ctx_->ext_username);
-        if (it != cache_->username_cache.end()) {
+        auto &cache = account_->cache;
+        auto it = cache.username_cache.find(ctx_->ext_username);
+        if (it != cache.username_cache.end()) {
             DEBUG(logger_, "[{}] found id {} for {} in username cache", ctx_->id(), it->second, ctx_->ext_username);
             dial_by_id(it->second);
             return;
         }
 
-        auto response = tg_client_->send_query_async(
+        auto response = account_->client.send_query_async(
                 td_api::make_object<td_api::searchPublicChat>(ctx_->ext_username)).get();
 
         if (response->get_id() == td_api::error::ID) {
@@ -555,7 +704,7 @@ namespace state_machine::actions {
 
         auto id = chat->id_;
         DEBUG(logger_, "[{}] adding id {} for {} to username cache", ctx_->id(), id, ctx_->ext_username);
-        cache_->username_cache.emplace(ctx_->ext_username, id);
+        cache.username_cache.emplace(ctx_->ext_username, id);
         dial_by_id(id);
     }
 
@@ -564,15 +713,17 @@ namespace state_machine::actions {
 
         const std::regex delay_regex("Too Many Requests: retry after (\\d+)");
         if (std::regex_search(error->message_, match, delay_regex)) {
-            auto seconds = std::stoi(match[1]);
-            *block_until_ = std::chrono::steady_clock::now() +
-                            std::chrono::seconds(seconds + settings_->extra_wait_time());
+            auto seconds = std::stoi(match[1]) + settings_->extra_wait_time();
+            account_->block_until = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+            logger_->warn("[{}] TG account {} may not place calls for {} seconds", ctx_->id(), account_->name, seconds);
             return;
         }
 
         const std::regex flood_regex("PEER_FLOOD");
         if (std::regex_search(error->message_, match, flood_regex)) {
-            *block_until_ = std::chrono::steady_clock::now() + std::chrono::seconds(settings_->peer_flood_time());
+            account_->block_until = std::chrono::steady_clock::now() + std::chrono::seconds(settings_->peer_flood_time());
+            logger_->warn("[{}] TG account {} may not place calls for {} seconds", ctx_->id(), account_->name,
+                          settings_->peer_flood_time());
             return;
         }
     }
@@ -593,28 +744,72 @@ namespace state_machine::actions {
 
 namespace state_machine {
 
-    Logger::Logger(std::string context_id, shared_ptr<spdlog::logger> logger) : logger_(std::move(logger)),
-                                                                                context_id_(std::move(context_id)) {
+    namespace {
+        const char *call_state_name(int32_t id) {
+            using namespace td::td_api;
+            switch (id) {
+                case callStatePending::ID:
+                    return "callStatePending";
+                case callStateExchangingKeys::ID:
+                    return "callStateExchangingKeys";
+                case callStateReady::ID:
+                    return "callStateReady";
+                case callStateHangingUp::ID:
+                    return "callStateHangingUp";
+                case callStateDiscarded::ID:
+                    return "callStateDiscarded";
+                case callStateError::ID:
+                    return "callStateError";
+                default:
+                    return "updateCall";
+            }
+        }
+    }
+
+    Logger::Logger(std::string context_id, int64_t trace_id, shared_ptr<spdlog::logger> logger)
+            : logger_(std::move(logger)), context_id_(std::move(context_id)), trace_id_(trace_id) {
         TRACE(logger_, "[{}] logger created", context_id_);
     }
 
     Logger::~Logger() {
+        event_processed();
         TRACE(logger_, "[{}] ~logger", context_id_);
     };
 
+    void Logger::begin_event_span(const char *name) {
+        // sub state machines report the same event once more, nest them
+        if (action_open_) {
+            trace::end("action", nullptr, trace_id_);
+            action_open_ = false;
+            --open_spans_;
+        }
+        trace::begin("event", name, trace_id_);
+        ++open_spans_;
+    }
+
+    void Logger::event_processed() {
+        for (; open_spans_ > 0; --open_spans_) {
+            trace::end("event", nullptr, trace_id_);
+        }
+        action_open_ = false;
+    }
+
     template<class SM>
     void Logger::log_process_event(const td::td_api::object_ptr<td::td_api::updateCall> &event) {
         TRACE(logger_, "[{}] [process_event]\n{}", context_id_, td::td_api::to_string(event));
+        begin_event_span(call_state_name(event->call_->state_->get_id()));
     };
 
     template<class SM>
     void Logger::log_process_event(const sip::events::Event &event) {
         TRACE(logger_, "[{}] [process_event] sip", context_id_);
+        begin_event_span("sip");
     };
 
     template<class SM, class TEvent>
     void Logger::log_process_event(const TEvent &) {
         TRACE(logger_, "[{}] [process_event] {}", context_id_, sml::aux::get_type_name<TEvent>());
+        begin_event_span(sml::aux::get_type_name<TEvent>());
     }
 
     template<class SM, class TGuard, class TEvent>
@@ -626,11 +821,21 @@ namespace state_machine {
     template<class SM, class TAction, class TEvent>
     void Logger::log_action(const TAction &, const TEvent &event) {
         TRACE(logger_, "[{}] [action] {} {}", context_id_, sml::aux::get_type_name<TAction>(), "event");
+        // previous action of the same transition is over once the next one starts
+        if (action_open_) {
+            trace::end("action", nullptr, trace_id_);
+        } else {
+            ++open_spans_;
+        }
+        trace::begin("action", sml::aux::get_type_name<TAction>(), trace_id_);
+        action_open_ = true;
     };
 
     template<class SmLogger, class TSrcState, class TDstState>
     void Logger::log_state_change(const TSrcState &src, const TDstState &dst) {
         TRACE(logger_, "[{}] [transition] {} -> {}", context_id_, src.c_str(), dst.c_str());
+        state_ = dst.c_str();
+        trace::instant("state", dst.c_str(), trace_id_);
     }
 
     struct from_tg {
@@ -678,12 +883,17 @@ namespace state_machine {
             using namespace events;
             return make_transition_table(
                     *"init"_s + event<object_ptr<updateCall>>
-                                [IsIncoming{} && IsInState{callStatePending::ID} && CallbackUriIsSet{}]
-                                / (StoreTgId{}, StoreTgUserId{}, DialSip{}) = state<from_tg>,
+                                [IsIncoming{} && IsInState{callStatePending::ID} && IsOverloaded{}]
+                                / (StoreTgId{}, RejectOverload{}) = X,
+                    "init"_s + event<object_ptr<updateCall>>
+                               [IsIncoming{} && IsInState{callStatePending::ID} && CallbackUriIsSet{}]
+                               / (StoreTgId{}, StoreTgUserId{}, DialSip{}) = state<from_tg>,
                     "init"_s + event<object_ptr<updateCall>>
                                [IsIncoming{} && IsInState{callStatePending::ID} && !CallbackUriIsSet{}]
                                / StoreTgId{} = X,
                     "init"_s + event<object_ptr<updateCall>> = X,
+                    "init"_s + event<sip::events::IncomingCall>[IsOverloaded{}]
+                               / (StoreSipId{}, RejectOverload{}) = X,
                     "init"_s + event<sip::events::IncomingCall> / (StoreSipId{}, AcceptIncomingSip{}) = state<from_sip>,
                     "init"_s + event<sip::events::CallStateUpdate> = X,
                     "init"_s + event<sip::events::CallMediaStateUpdate> = X,
@@ -708,52 +918,64 @@ namespace state_machine {
     };
 }
 
-Context::Context() : id_(next_ctx_id()) {}
+Context::Context() : seq_(next_ctx_seq()), id_(std::to_string(getpid()) + "-" + std::to_string(seq_)) {}
 
 const std::string Context::id() const { return id_; };
 
-std::string Context::next_ctx_id() {
+int64_t Context::next_ctx_seq() {
     static int64_t ctx_counter{0};
-    static std::string id_prefix = std::to_string(getpid()) + "-";
-    return id_prefix + std::to_string(++ctx_counter);
+    return ++ctx_counter;
 }
 
-Gateway::Gateway(sip::Client &sip_client_, tg::Client &tg_client_,
+Gateway::Gateway(sip::Client &sip_client_, Accounts &accounts_,
                  OptionalQueue<sip::events::Event> &sip_events_,
-                 OptionalQueue<tg::Client::Object> &tg_events_,
                  std::shared_ptr<spdlog::logger> logger_,
                  Settings &settings)
-        : sip_client_(sip_client_), tg_client_(tg_client_), logger_(std::move(logger_)),
-          sip_events_(sip_events_), tg_events_(tg_events_), settings_(settings) {}
+        : sip_client_(sip_client_), accounts_(accounts_), logger_(std::move(logger_)),
+          sip_events_(sip_events_), settings_(settings), voip_pool_(settings, this->logger_),
+          admission_(settings, this->logger_) {}
 
 void Gateway::start() {
 
-    load_cache();
+    for (auto &account : accounts_.all()) {
+        load_cache(*account);
+    }
 
-    signal(SIGINT, [](int) { e_flag = 1; });
-    signal(SIGTERM, [](int) { e_flag = 1; });
+    // first signal drains, second one exits at once
+    signal(SIGINT, [](int) { e_flag = e_flag + 1; });
+    signal(SIGTERM, [](int) { e_flag = e_flag + 1; });
+    signal(SIGUSR1, [](int) { trace_flag = 1; });
 
-    while (!e_flag) {
+    while (!stopped_ && e_flag < 2) {
         auto tick_start = std::chrono::steady_clock::now();
 
+        if ((e_flag || drain_requested_) && !is_draining_) {
+            start_drain();
+        }
+        if (is_draining_ && is_drained(tick_start)) {
+            break;
+        }
+
         if (auto event = internal_events_.pop(); event) {
             std::visit([this](auto &&casted_event) {
                 process_event(casted_event);
             }, event.value());
         }
 
-        if (auto event = tg_events_.pop(); event) {
-            using namespace td::td_api;
-            auto &&object = event.value();
-            switch (object->get_id()) {
-                case updateCall::ID:
-                    process_event(move_object_as<updateCall>(object));
-                    break;
-                case updateNewMessage::ID:
-                    process_event(move_object_as<updateNewMessage>(object));
-                    break;
-                default:
-                    break;
+        for (auto &account : accounts_.all()) {
+            if (auto event = account->events.pop(); event) {
+                using namespace td::td_api;
+                auto &&object = event.value();
+                switch (object->get_id()) {
+                    case updateCall::ID:
+                        process_event(*account, move_object_as<updateCall>(object));
+                        break;
+                    case updateNewMessage::ID:
+                        process_event(*account, move_object_as<updateNewMessage>(object));
+                        break;
+                    default:
+                        break;
+                }
             }
         }
 
@@ -763,6 +985,25 @@ void Gateway::start() {
             }, event.value());
         }
 
+        if (is_draining_) {
+            hangup_some();
+        }
+
+        if (trace_flag) {
+            trace_flag = 0;
+            auto path = settings_.trace_file();
+            if (trace::dump(path)) {
+                logger_->info("call setup trace written to {}", path);
+            } else {
+                logger_->error("failed to write call setup trace to {}", path);
+            }
+        }
+
+        if (tick_start >= next_metrics_update) {
+            update_metrics();
+            next_metrics_update = tick_start + std::chrono::seconds(1);
+        }
+
         auto tick_end = std::chrono::steady_clock::now();
         auto duration = tick_end - tick_start;
         auto sleep_time = std::chrono::milliseconds(10) - duration;
@@ -773,10 +1014,114 @@ void Gateway::start() {
 
 }
 
-void Gateway::load_cache() {
-    logger_->info("Loading contacts cache");
+void Gateway::start_drain() {
+    is_draining_ = true;
+    drain_deadline_ = std::chrono::steady_clock::now() + std::chrono::seconds(settings_.drain_timeout());
+    admission_.drain();
+    metrics::registry().gauge("tg2sip_draining", "1 while calls are hung up for shutdown").set(1);
+    logger_->info("draining: refusing new calls, hanging up {} calls in progress", bridges.size());
+}
+
+bool Gateway::is_drained(std::chrono::steady_clock::time_point now) {
+    auto discards = accounts_.pending_discards();
+    auto reaping = voip_pool_.reaping();
+    if (bridges.empty() && discards == 0 && reaping == 0) {
+        logger_->info("drained, all calls are hung up");
+        return true;
+    }
+    if (now >= drain_deadline_) {
+        logger_->warn("drain timed out with {} calls left, {} TG discards unanswered, {} VoIP controllers stopping",
+                      bridges.size(), discards, reaping);
+        return true;
+    }
+    return false;
+}
+
+void Gateway::hangup_some() {
+    // every hangup is one TG discard and one controller to stop, at most
+    size_t in_flight = accounts_.pending_discards() + voip_pool_.reaping();
+    if (in_flight >= settings_.drain_concurrency() || bridges.empty()) {
+        return;
+    }
+
+    std::vector<std::string> ids;
+    for (auto bridge : bridges) {
+        if (in_flight + ids.size() >= settings_.drain_concurrency()) {
+            break;
+        }
+        ids.emplace_back(bridge->ctx->id());
+    }
+
+    for (const auto &id : ids) {
+        pj::CallOpParam prm;
+        prm.statusCode = PJSIP_SC_SERVICE_UNAVAILABLE;
+        prm.reason = "Shutting down";
+        state_machine::events::InternalError event{id, prm};
+        process_event(event);
+    }
+}
+
+void Gateway::update_metrics() {
+    auto &registry = metrics::registry();
+
+    static auto &internal_depth = registry.gauge("tg2sip_queue_depth", "Events waiting in gateway queues",
+                                                 {{"queue", "internal"}});
+    static auto &tg_depth = registry.gauge("tg2sip_queue_depth", "Events waiting in gateway queues",
+                                           {{"queue", "tg"}});
+    static auto &sip_depth = registry.gauge("tg2sip_queue_depth", "Events waiting in gateway queues",
+                                            {{"queue", "sip"}});
+    internal_depth.set(internal_events_.size());
+    size_t tg_events = 0;
+    for (auto &account : accounts_.all()) {
+        tg_events += account->events.size();
+    }
+    tg_depth.set(tg_events);
+    sip_depth.set(sip_events_.size());
 
-    auto search_response = tg_client_.send_query_async(
+    static auto &rtt = registry.histogram("tg2sip_voip_rtt_seconds", "Telegram VoIP round trip time, sampled every second",
+                                          {0.025, 0.05, 0.1, 0.15, 0.2, 0.3, 0.5, 1, 2});
+    static auto &jitter = registry.histogram("tg2sip_voip_jitter_seconds", "Telegram VoIP jitter, sampled every second",
+                                             {0.005, 0.01, 0.02, 0.04, 0.06, 0.1, 0.2});
+
+    std::map<std::string, int> states;
+    double media_lag = 0;
+    for (auto bridge : bridges) {
+        states[bridge->logger->state()]++;
+
+        auto &ctx = *bridge->ctx;
+        if (ctx.controller) {
+            media_lag = std::max(media_lag, report_voip_stats(ctx));
+            if (ctx.controller->GetConnectionState() == tgvoip::STATE_ESTABLISHED) {
+                rtt.observe(ctx.reported_media.rtt);
+                jitter.observe(ctx.reported_media.jitter);
+            }
+        }
+    }
+
+    // states with no bridges left must drop to zero instead of keeping last value
+    for (auto const &state : reported_states_) {
+        states.emplace(state, 0);
+    }
+    for (auto const &item : states) {
+        registry.gauge("tg2sip_bridges", "Active bridges by state machine state", {{"state", item.first}})
+                .set(item.second);
+        reported_states_.insert(item.first);
+    }
+
+    admission_.update(media_lag);
+    accounts_.update_metrics();
+
+    static auto &complexity = registry.gauge("tg2sip_voip_encoder_complexity",
+                                             "Opus complexity all calls currently encode with");
+    complexity.set(tgvoip::EncoderGovernor::GetSharedInstance()->GetComplexity());
+}
+
+void Gateway::load_cache(Account &account) {
+    logger_->info("Loading contacts cache of account {}", account.name);
+
+    auto &tg_client = account.client;
+    auto &cache = account.cache;
+    auto search_response = tg_client.send_query_async(
             td::td_api::make_object<td::td_api::searchContacts>("", INT32_MAX)).get();
     if (search_response->get_id() == td::td_api::error::ID) {
         logger_->error("offline contacts search failed during cache fill\n{}", to_string(search_response));
@@ -786,7 +1131,7 @@ void Gateway::load_cache() {
     auto users = td::td_api::move_object_as<td::td_api::users>(search_response);
     std::vector<std::future<tg::Client::Object>> responses;
     for (auto user_id : users->user_ids_) {
-        responses.emplace_back(tg_client_.send_query_async(td::td_api::make_object<td::td_api::getUser>(user_id)));
+        responses.emplace_back(tg_client.send_query_async(td::td_api::make_object<td::td_api::getUser>(user_id)));
     }
     for (auto &future : responses) {
         auto response = future.get();
@@ -803,27 +1148,30 @@ void Gateway::load_cache() {
         }
 
         if (!user->username_.empty()) {
-            cache_.username_cache.emplace(user->username_, user->id_);
+            cache.username_cache.emplace(user->username_, user->id_);
         }
 
         if (!user->phone_number_.empty()) {
-            cache_.phone_cache.emplace(user->phone_number_, user->id_);
+            cache.phone_cache.emplace(user->phone_number_, user->id_);
         }
     }
 
-    logger_->info("Loaded {} usernames and {} phones into contacts cache",
-                  cache_.username_cache.size(),
-                  cache_.phone_cache.size());
+    logger_->info("Loaded {} usernames and {} phones into contacts cache of account {}",
+                  cache.username_cache.size(),
+                  cache.phone_cache.size(),
+                  account.name);
 }
 
 std::vector<Bridge *>::iterator Gateway::search_call(const std::function<bool(const Bridge *)> &predicate) {
     auto iter = std::find_if(bridges.begin(), bridges.end(), predicate);
 
     if (iter == bridges.end()) {
+        admission_.set_active_calls(bridges.size());
+
         auto ctx = std::make_unique<Context>();
-        auto sm_logger = std::make_unique<state_machine::Logger>(ctx->id(), logger_);
-        auto sm = std::make_unique<state_machine::sm_t>(*sm_logger, sip_client_, tg_client_, settings_, logger_,
-                                                        *ctx, cache_, internal_events_, block_until);
+        auto sm_logger = std::make_unique<state_machine::Logger>(ctx->id(), ctx->seq(), logger_);
+        auto sm = std::make_unique<state_machine::sm_t>(*sm_logger, sip_client_, accounts_, settings_, logger_,
+                                                        *ctx, voip_pool_, admission_, internal_events_);
 
         auto bridge = new Bridge;
         bridge->ctx = std::move(ctx);
@@ -837,13 +1185,21 @@ std::vector<Bridge *>::iterator Gateway::search_call(const std::function<bool(co
     return iter;
 }
 
-void Gateway::process_event(td::td_api::object_ptr<td::td_api::updateCall> update_call) {
+void Gateway::process_event(Account &account, td::td_api::object_ptr<td::td_api::updateCall> update_call) {
 
-    auto iter = search_call([id = update_call->call_->id_](const Bridge *bridge) {
-        return bridge->ctx->tg_call_id == id;
+    auto iter = search_call([&account, id = update_call->call_->id_](const Bridge *bridge) {
+        return bridge->ctx->account == &account && bridge->ctx->tg_call_id == id;
     });
 
+    auto &ctx = *(*iter)->ctx;
+    if (!ctx.account) {
+        // new bridge, TG side of it lives on the account the update came from
+        ctx.account = &account;
+        accounts_.call_started(account);
+    }
+
     (*iter)->sm->process_event(update_call);
+    (*iter)->logger->event_processed();
 
     if ((*iter)->sm->is(sml::X)) {
         delete *iter;
@@ -851,7 +1207,7 @@ void Gateway::process_event(td::td_api::object_ptr<td::td_api::updateCall> updat
     }
 }
 
-void Gateway::process_event(td::td_api::object_ptr<td::td_api::updateNewMessage> update_message) {
+void Gateway::process_event(Account &account, td::td_api::object_ptr<td::td_api::updateNewMessage> update_message) {
 
     auto &sender = update_message->message_->sender_id_;
     if (sender->get_id() == td_api::messageSenderUser::ID)
@@ -860,7 +1216,7 @@ void Gateway::process_event(td::td_api::object_ptr<td::td_api::updateNewMessage>
 
     std::vector<Bridge *> matches;
     for (auto bridge : bridges) {
-        if (bridge->ctx->user_id == user->user_id_) {
+        if (bridge->ctx->account == &account && bridge->ctx->user_id == user->user_id_) {
             matches.emplace_back(bridge);
         }
     }
@@ -871,6 +1227,7 @@ void Gateway::process_event(td::td_api::object_ptr<td::td_api::updateNewMessage>
     } else if (matches.size() == 1) {
         TRACE(logger_, "routing message to ctx {}", matches[0]->ctx->id());
         matches[0]->sm->process_event(update_message);
+        matches[0]->logger->event_processed();
     }
 
 }
@@ -885,6 +1242,7 @@ void Gateway::process_event(state_machine::events::InternalError &event) {
     }
 
     (*iter)->sm->process_event(event);
+    (*iter)->logger->event_processed();
 
     if ((*iter)->sm->is(sml::X)) {
         delete *iter;
@@ -901,6 +1259,7 @@ void Gateway::process_event(const TSipEvent &event) {
     });
 
     (*iter)->sm->process_event(event);
+    (*iter)->logger->event_processed();
 
     if ((*iter)->sm->is(sml::X)) {
         delete *iter;
@@ -23,17 +23,22 @@
 #include <libtgvoip/VoIPController.h>
 #include <boost/sml.hpp>
 #include <csignal>
+#include <atomic>
+#include <set>
 #include "sip.h"
 #include "tg.h"
 #include "utils.h"
 #include "queue.h"
+#include "metrics.h"
+#include "trace.h"
+#include "voip_pool.h"
+#include "admission.h"
+#include "accounts.h"
 
 namespace sml = boost::sml;
 
 class Context;
 
-struct Cache;
-
 namespace state_machine::events {
 
     struct InternalError {
@@ -73,6 +78,10 @@ namespace state_machine::guards {
         bool operator()(const Settings &settings) const;
     };
 
+    struct IsOverloaded {
+        bool operator()(const Admission &admission) const;
+    };
+
     struct IsMediaReady {
         bool operator()(const sip::events::CallMediaStateUpdate &event) const;
     };
@@ -90,7 +99,7 @@ namespace state_machine::actions {
 
     struct StoreTgId {
         void operator()(Context &ctx, const td::td_api::object_ptr<td::td_api::updateCall> &event,
-                        std::shared_ptr<spdlog::logger> logger) const;
+                        Accounts &accounts, std::shared_ptr<spdlog::logger> logger) const;
     };
 
     struct StoreTgUserId {
@@ -112,14 +121,14 @@ namespace state_machine::actions {
     };
 
     struct DialSip {
-        void operator()(Context &ctx, tg::Client &tg_client, sip::Client &sip_client,
+        void operator()(Context &ctx, sip::Client &sip_client,
                         const td::td_api::object_ptr<td::td_api::updateCall> &event,
                         OptionalQueue<state_machine::events::Event> &internal_events,
                         const Settings &settings, std::shared_ptr<spdlog::logger> logger) const;
     };
 
     struct AnswerTg {
-        void operator()(Context &ctx, tg::Client &tg_client, const Settings &settings,
+        void operator()(Context &ctx, const Settings &settings,
                         OptionalQueue<state_machine::events::Event> &internal_events,
                         std::shared_ptr<spdlog::logger> logger) const;
     };
@@ -138,22 +147,27 @@ namespace state_machine::actions {
     };
 
     struct BridgeAudio {
-        void operator()(Context &ctx, sip::Client &sip_client,
+        void operator()(Context &ctx, sip::Client &sip_client, const Settings &settings,
                         OptionalQueue<state_machine::events::Event> &internal_events,
                         std::shared_ptr<spdlog::logger> logger) const;
     };
 
     struct CreateTgVoip {
-        void operator()(Context &ctx, const Settings &settings,
+        void operator()(Context &ctx, const Settings &settings, VoipPool &voip_pool,
                         const td::td_api::object_ptr<td::td_api::updateCall> &event,
                         std::shared_ptr<spdlog::logger> logger) const;
     };
 
     struct CleanUp {
-        void operator()(Context &ctx, sip::Client &sip_client, tg::Client &tg_client,
+        void operator()(Context &ctx, sip::Client &sip_client, Accounts &accounts, VoipPool &voip_pool,
                         std::shared_ptr<spdlog::logger> logger) const;
     };
 
+    // SIP side gets 503 with Retry-After from CleanUp, TG side is declined there
+    struct RejectOverload {
+        void operator()(Context &ctx, const Admission &admission, std::shared_ptr<spdlog::logger> logger) const;
+    };
+
     struct SetHangupPrm {
         void operator()(Context &ctx, const state_machine::events::InternalError &event) const;
     };
@@ -161,10 +175,8 @@ namespace state_machine::actions {
     class DialTg {
     private:
         Context *ctx_;
-        tg::Client *tg_client_;
+        Account *account_;
         Settings const *settings_;
-        Cache *cache_;
-        std::chrono::steady_clock::time_point *block_until_;
         OptionalQueue<state_machine::events::Event> *internal_events_;
         std::shared_ptr<spdlog::logger> logger_;
 
@@ -177,8 +189,7 @@ namespace state_machine::actions {
         void dial_by_username();
 
     public:
-        void operator()(Context &ctx, tg::Client &tg_client, const Settings &settings, Cache &cache,
-                        std::chrono::steady_clock::time_point &block_until,
+        void operator()(Context &ctx, const Settings &settings, Accounts &accounts,
                         OptionalQueue<state_machine::events::Event> &internal_events,
                         std::shared_ptr<spdlog::logger> logger);
     };
@@ -193,7 +204,7 @@ namespace state_machine::actions {
 namespace state_machine {
     class Logger {
     public:
-        Logger(std::string context_id, shared_ptr<spdlog::logger> logger);
+        Logger(std::string context_id, int64_t trace_id, shared_ptr<spdlog::logger> logger);
 
         virtual ~Logger();
 
@@ -215,9 +226,22 @@ namespace state_machine {
         template<class SmLogger, class TSrcState, class TDstState>
         void log_state_change(const TSrcState &src, const TDstState &dst);
 
+        // name of the most recently entered state
+        const std::string &state() const { return state_; };
+
+        // sml has no hook after actions, so gateway closes trace spans once event is processed
+        void event_processed();
+
     private:
         const std::string context_id_;
+        const int64_t trace_id_;
         std::shared_ptr<spdlog::logger> logger_;
+        std::string state_{"init"};
+
+        int open_spans_{0};
+        bool action_open_{false};
+
+        void begin_event_span(const char *name);
     };
 
     struct StateMachine;
@@ -225,18 +249,18 @@ namespace state_machine {
     typedef sml::sm<StateMachine, sml::logger<Logger>, sml::thread_safe<std::recursive_mutex>> sm_t;
 }
 
-struct Cache {
-    std::map<std::string, int64_t> username_cache;
-    std::map<std::string, int64_t> phone_cache;
-};
-
 class Context {
 public:
     Context();
 
     const std::string id() const;
 
+    // numeric part of id, used as trace thread id
+    int64_t seq() const { return seq_; };
+
     pjsua_call_id sip_call_id{PJSUA_INVALID_ID};
+    // TG call ids are only unique within the account
+    Account *account{nullptr};
     int32_t tg_call_id{0};
     std::shared_ptr<tgvoip::VoIPController> controller{nullptr};
 
@@ -246,10 +270,17 @@ public:
 
     pj::CallOpParam hangup_prm;
 
+    const std::chrono::steady_clock::time_point created_at{std::chrono::steady_clock::now()};
+    // controller statistics already accounted in metrics
+    tgvoip::VoIPController::TrafficStats reported_traffic{};
+    tgvoip::VoIPController::MediaStats reported_media{};
+    tgvoip::VoIPController::ResourceStats reported_resources{};
+
 private:
+    const int64_t seq_;
     const std::string id_;
 
-    std::string next_ctx_id();
+    static int64_t next_ctx_seq();
 };
 
 struct Bridge {
@@ -260,9 +291,8 @@ struct Bridge {
 
 class Gateway {
 public:
-    Gateway(sip::Client &sip_client_, tg::Client &tg_client_,
+    Gateway(sip::Client &sip_client_, Accounts &accounts_,
             OptionalQueue<sip::events::Event> &sip_events_,
-            OptionalQueue<tg::Client::Object> &tg_events_,
             std::shared_ptr<spdlog::logger> logger_,
             Settings &settings);
 
@@ -272,35 +302,62 @@ public:
 
     void start();
 
+    // makes start() return after current tick, may be called from any thread
+    void stop() { stopped_ = true; };
+
+    /*
+     * Graceful shutdown, same as SIGTERM: new calls are refused, calls in progress are hung up
+     * drain_concurrency at a time and start() returns once they are gone or drain_timeout passes.
+     * May be called from any thread.
+     */
+    void drain() { drain_requested_ = true; };
+
 private:
     std::shared_ptr<spdlog::logger> logger_;
 
     sip::Client &sip_client_;
-    tg::Client &tg_client_;
+    Accounts &accounts_;
     const Settings &settings_;
 
     OptionalQueue<sip::events::Event> &sip_events_;
-    OptionalQueue<tg::Client::Object> &tg_events_;
     OptionalQueue<state_machine::events::Event> internal_events_;
 
-    std::chrono::steady_clock::time_point block_until{std::chrono::steady_clock::now()};
-    Cache cache_;
+    VoipPool voip_pool_;
+    Admission admission_;
     // Would be better to use smart pointer here,
     // but it is not allowed by sm_t forward declaration
     std::vector<Bridge *> bridges;
 
+    std::atomic<bool> stopped_{false};
+    std::atomic<bool> drain_requested_{false};
+    bool is_draining_{false};
+    std::chrono::steady_clock::time_point drain_deadline_;
+
+    std::chrono::steady_clock::time_point next_metrics_update{std::chrono::steady_clock::now()};
+    std::set<std::string> reported_states_;
+
     std::vector<Bridge *>::iterator search_call(const std::function<bool(const Bridge *)> &predicate);
 
-    void process_event(td::td_api::object_ptr<td::td_api::updateCall> update_call);
+    void update_metrics();
+
+    void start_drain();
+
+    // whether start() may return
+    bool is_drained(std::chrono::steady_clock::time_point now);
+
+    // hangs up calls up to drain_concurrency hangups in flight
+    void hangup_some();
+
+    void process_event(Account &account, td::td_api::object_ptr<td::td_api::updateCall> update_call);
 
-    void process_event(td::td_api::object_ptr<td::td_api::updateNewMessage> update_message);
+    void process_event(Account &account, td::td_api::object_ptr<td::td_api::updateNewMessage> update_message);
 
     void process_event(state_machine::events::InternalError &event);
 
     template<typename TSipEvent>
     void process_event(const TSipEvent &event);
 
-    void load_cache();
+    void load_cache(Account &account);
 };
 
 #endif //TG2SIP_GATEWAY_H
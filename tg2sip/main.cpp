@@ -19,12 +19,91 @@
 #include <iostream>
 #include <csignal>
 #include <variant>
+#include <algorithm>
+#include <sched.h>
+#include <unistd.h>
 #include "logging.h"
+#include <libtgvoip/logging.h>
+#include <libtgvoip/threading.h>
 #include "queue.h"
 #include "utils.h"
 #include "tg.h"
 #include "sip.h"
 #include "gateway.h"
+#include "accounts.h"
+#include "metrics.h"
+
+namespace {
+    // a CPU outside the process mask would make libtgvoip drop the affinity of every media thread
+    bool cpus_allowed(const std::vector<int> &cpus) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return true;
+        }
+        for (auto cpu : cpus) {
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Pins the calling thread, threads started afterwards inherit its affinity.
+     * Must run before TDLib, pjsip and logging start theirs.
+     */
+    bool pin_non_media_threads(const Settings &settings) {
+        auto media_cpus = settings.media_cpus();
+        auto other_cpus = settings.other_cpus();
+        if (media_cpus.empty() && other_cpus.empty()) {
+            return true;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (other_cpus.empty()) {
+            auto count = static_cast<int>(sysconf(_SC_NPROCESSORS_CONF));
+            for (int cpu = 0; cpu < count && cpu < CPU_SETSIZE; cpu++) {
+                if (std::find(media_cpus.begin(), media_cpus.end(), cpu) == media_cpus.end()) {
+                    CPU_SET(cpu, &set);
+                }
+            }
+        } else {
+            for (auto cpu : other_cpus) {
+                if (cpu < CPU_SETSIZE) {
+                    CPU_SET(cpu, &set);
+                }
+            }
+        }
+
+        if (CPU_COUNT(&set) == 0) {
+            return false;
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    int sched_policy(const std::string &name) {
+        if (name == "fifo") {
+            return SCHED_FIFO;
+        } else if (name == "rr") {
+            return SCHED_RR;
+        }
+        return 0;
+    }
+
+    // libtgvoip applies the policy silently, so find out up front whether real-time priority is permitted
+    bool realtime_permitted(int policy, int priority) {
+        bool permitted = false;
+        std::thread probe([&]() {
+            sched_param param{};
+            param.sched_priority = priority;
+            permitted = pthread_setschedparam(pthread_self(), policy, &param) == 0;
+        });
+        probe.join();
+        return permitted;
+    }
+}
 
 int main() {
     pthread_setname_np(pthread_self(), "main");
@@ -36,7 +115,35 @@ int main() {
         return 1;
     }
 
+    if (!cpus_allowed(settings.media_cpus()) || !cpus_allowed(settings.other_cpus())) {
+        std::cerr << "media_cpus or other_cpus lists a CPU this process may not run on!\n";
+        return 1;
+    }
+
+    tgvoip::ThreadPolicy thread_policy;
+    if (settings.media_thread_stack() > 0) {
+        thread_policy.stackSize = static_cast<size_t>(settings.media_thread_stack()) * 1024;
+    }
+    thread_policy.cpus = settings.media_cpus();
+    thread_policy.realtimePolicy = sched_policy(settings.media_sched_policy());
+    thread_policy.realtimePriority = settings.media_sched_priority();
+    tgvoip::Thread::SetPolicy(thread_policy);
+
+    auto pinned = pin_non_media_threads(settings);
+
     init_logging(settings);
+    // starts the libtgvoip log writer here, otherwise it would be started by the first call
+    // and inherit media thread affinity
+    tgvoip_log_async_flush();
+
+    if (!pinned) {
+        spdlog::get("core")->warn("failed to pin threads to other_cpus, running on all CPUs");
+    }
+    if (thread_policy.realtimePolicy &&
+        !realtime_permitted(thread_policy.realtimePolicy, thread_policy.realtimePriority)) {
+        spdlog::get("core")->warn("real-time scheduling is not permitted (needs CAP_SYS_NICE or RLIMIT_RTPRIO), "
+                                  "media threads will run at normal priority");
+    }
 
     std::set_terminate([]() {
         auto exc = std::current_exception();
@@ -45,6 +152,7 @@ int main() {
         } catch (std::exception &e) {
             spdlog::get("core")->critical("Unhandled exception: {}", e.what());
         }
+        tgvoip_log_async_flush();
         spdlog::drop_all();
         std::abort();
     });
@@ -56,7 +164,7 @@ int main() {
     auto sip_log_writer = new sip::LogWriter(spdlog::get("pjsip"));
     auto sip_account = std::make_unique<sip::Account>(logger);
     auto sip_account_cfg = std::make_unique<sip::AccountConfig>(settings);
-    auto sip_client = std::make_unique<sip::Client>(
+    auto sip_client = std::make_unique<sip::PjClient>(
             std::move(sip_account),
             std::move(sip_account_cfg),
             sip_events,
@@ -66,21 +174,50 @@ int main() {
     );
     sip_client->start();
 
-    OptionalQueue<tg::Client::Object> tg_events;
-    auto tg_client = std::make_unique<tg::Client>(settings, logger, tg_events);
-    tg_client->start();
-    auto tg_is_ready_future = tg_client->is_ready();
-    auto tg_status = tg_is_ready_future.wait_for(std::chrono::seconds(5));
-    if (tg_status != std::future_status::ready || !tg_is_ready_future.get()) {
-        logger->critical("failed to start TG client");
-        return 1;
+    auto db_folders = settings.extra_db_folders();
+    db_folders.insert(db_folders.begin(), settings.db_folder());
+
+    // one TDLib client with its own update queue per account, all of them sign in at once
+    std::vector<std::unique_ptr<OptionalQueue<tg::Client::Object>>> tg_events;
+    std::vector<std::unique_ptr<tg::TdClient>> tg_clients;
+    std::vector<std::future<bool>> tg_ready;
+    for (const auto &db_folder : db_folders) {
+        tg_events.emplace_back(std::make_unique<OptionalQueue<tg::Client::Object>>());
+        tg_clients.emplace_back(std::make_unique<tg::TdClient>(settings, db_folder, logger, *tg_events.back()));
+        tg_clients.back()->start();
+        tg_ready.emplace_back(tg_clients.back()->is_ready());
+    }
+
+    Accounts accounts(settings, logger);
+    for (size_t i = 0; i < tg_clients.size(); i++) {
+        auto tg_status = tg_ready[i].wait_for(std::chrono::seconds(5));
+        if (tg_status != std::future_status::ready || !tg_ready[i].get()) {
+            logger->critical("failed to start TG client with database '{}'", db_folders[i]);
+            return 1;
+        }
+        accounts.add(*tg_clients[i], *tg_events[i]);
+    }
+    if (accounts.all().size() > 1) {
+        logger->info("calling with {} TG accounts", accounts.all().size());
+    }
+
+    std::unique_ptr<metrics::Server> metrics_server;
+    if (!settings.metrics_listen().empty()) {
+        try {
+            metrics_server = std::make_unique<metrics::Server>(settings.metrics_listen(), logger);
+        } catch (const std::runtime_error &error) {
+            logger->critical(error.what());
+            return 1;
+        }
+        metrics_server->start();
     }
 
-    auto gateway = std::make_unique<Gateway>(*sip_client, *tg_client, sip_events, tg_events, logger, settings);
+    auto gateway = std::make_unique<Gateway>(*sip_client, accounts, sip_events, logger, settings);
 
     gateway->start();
 
     logger->info("performing a graceful shutdown...");
+    tgvoip_log_async_flush();
     spdlog::drop_all();
 
     return 0;
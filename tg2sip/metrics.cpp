@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "trace.h"
+
+namespace {
+    void atomic_add(std::atomic<double> &target, double value) {
+        auto current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+    }
+
+    std::string escape(const std::string &value) {
+        std::string result;
+        result.reserve(value.size());
+        for (auto c : value) {
+            switch (c) {
+                case '\\':
+                    result += "\\\\";
+                    break;
+                case '"':
+                    result += "\\\"";
+                    break;
+                case '\n':
+                    result += "\\n";
+                    break;
+                default:
+                    result += c;
+            }
+        }
+        return result;
+    }
+
+    // label pairs without braces, so that histogram "le" can be appended
+    std::string labels_key(const metrics::Labels &labels) {
+        std::string key;
+        for (auto const &label : labels) {
+            if (!key.empty()) {
+                key += ',';
+            }
+            key += label.first + "=\"" + escape(label.second) + "\"";
+        }
+        return key;
+    }
+
+    std::string format_value(double value) {
+        if (std::isinf(value)) {
+            return value > 0 ? "+Inf" : "-Inf";
+        }
+        std::ostringstream ss;
+        ss.precision(17);
+        ss << value;
+        return ss.str();
+    }
+
+    std::string series(const std::string &name, const std::string &labels) {
+        return labels.empty() ? name : name + "{" + labels + "}";
+    }
+}
+
+namespace metrics {
+
+    void Counter::inc(double value) {
+        atomic_add(value_, value);
+    }
+
+    void Gauge::inc(double value) {
+        atomic_add(value_, value);
+    }
+
+    Histogram::Histogram(std::vector<double> bounds)
+            : bounds_(std::move(bounds)),
+              buckets_(new std::atomic<uint64_t>[bounds_.size()]) {
+        for (size_t i = 0; i < bounds_.size(); ++i) {
+            buckets_[i] = 0;
+        }
+    }
+
+    void Histogram::observe(double value) {
+        // buckets are stored non-cumulative to keep observe() a single increment
+        auto it = std::lower_bound(bounds_.begin(), bounds_.end(), value);
+        if (it != bounds_.end()) {
+            buckets_[it - bounds_.begin()].fetch_add(1, std::memory_order_relaxed);
+        }
+        count_.fetch_add(1, std::memory_order_relaxed);
+        atomic_add(sum_, value);
+    }
+
+    uint64_t Histogram::bucket(size_t i) const {
+        uint64_t result = 0;
+        for (size_t j = 0; j <= i; ++j) {
+            result += buckets_[j].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    Registry::Family &Registry::family(const std::string &name, const std::string &help, const std::string &type) {
+        auto &family = families_[name];
+        if (family.type.empty()) {
+            family.help = help;
+            family.type = type;
+        } else if (family.type != type) {
+            throw std::logic_error{"metric " + name + " already registered as " + family.type};
+        }
+        return family;
+    }
+
+    Counter &Registry::counter(const std::string &name, const std::string &help, const Labels &labels) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &ptr = family(name, help, "counter").counters[labels_key(labels)];
+        if (!ptr) {
+            ptr = std::make_unique<Counter>();
+        }
+        return *ptr;
+    }
+
+    Gauge &Registry::gauge(const std::string &name, const std::string &help, const Labels &labels) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &ptr = family(name, help, "gauge").gauges[labels_key(labels)];
+        if (!ptr) {
+            ptr = std::make_unique<Gauge>();
+        }
+        return *ptr;
+    }
+
+    Histogram &Registry::histogram(const std::string &name, const std::string &help,
+                                   const std::vector<double> &bounds, const Labels &labels) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &ptr = family(name, help, "histogram").histograms[labels_key(labels)];
+        if (!ptr) {
+            ptr = std::make_unique<Histogram>(bounds);
+        }
+        return *ptr;
+    }
+
+    std::string Registry::serialize() const {
+        std::ostringstream out;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto const &item : families_) {
+            auto const &name = item.first;
+            auto const &family = item.second;
+
+            out << "# HELP " << name << " " << family.help << "\n";
+            out << "# TYPE " << name << " " << family.type << "\n";
+
+            for (auto const &counter : family.counters) {
+                out << series(name, counter.first) << " " << format_value(counter.second->value()) << "\n";
+            }
+
+            for (auto const &gauge : family.gauges) {
+                out << series(name, gauge.first) << " " << format_value(gauge.second->value()) << "\n";
+            }
+
+            for (auto const &histogram : family.histograms) {
+                auto const &labels = histogram.first;
+                auto const &h = *histogram.second;
+                auto prefix = labels.empty() ? std::string() : labels + ",";
+
+                // read count first, so that +Inf bucket is never below the last finite one
+                auto count = h.count();
+                for (size_t i = 0; i < h.bounds().size(); ++i) {
+                    out << series(name + "_bucket", prefix + "le=\"" + format_value(h.bounds()[i]) + "\"")
+                        << " " << std::min(h.bucket(i), count) << "\n";
+                }
+                out << series(name + "_bucket", prefix + "le=\"+Inf\"") << " " << count << "\n";
+                out << series(name + "_sum", labels) << " " << format_value(h.sum()) << "\n";
+                out << series(name + "_count", labels) << " " << count << "\n";
+            }
+        }
+
+        return out.str();
+    }
+
+    Registry &registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    Server::Server(std::string listen, std::shared_ptr<spdlog::logger> logger)
+            : listen_(std::move(listen)), logger_(std::move(logger)) {
+
+        const std::string unix_prefix = "unix:";
+
+        if (listen_.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+            unix_path_ = listen_.substr(unix_prefix.size());
+
+            sockaddr_un addr{};
+            if (unix_path_.empty() || unix_path_.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error{"invalid metrics socket path " + unix_path_};
+            }
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, unix_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+            fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            // stale socket from previous run
+            unlink(unix_path_.c_str());
+            if (fd_ < 0 || bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+                auto error = std::string(strerror(errno));
+                if (fd_ >= 0) {
+                    close(fd_);
+                }
+                throw std::runtime_error{"failed to bind metrics socket " + listen_ + ": " + error};
+            }
+        } else {
+            auto pos = listen_.rfind(':');
+            if (pos == std::string::npos) {
+                throw std::runtime_error{"invalid metrics listen address " + listen_};
+            }
+            auto host = listen_.substr(0, pos);
+            auto port = listen_.substr(pos + 1);
+
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo *result = nullptr;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+                throw std::runtime_error{"failed to resolve metrics listen address " + listen_};
+            }
+
+            fd_ = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+            int reuse = 1;
+            if (fd_ >= 0) {
+                setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            }
+            if (fd_ < 0 || bind(fd_, result->ai_addr, result->ai_addrlen) != 0) {
+                auto error = std::string(strerror(errno));
+                freeaddrinfo(result);
+                if (fd_ >= 0) {
+                    close(fd_);
+                }
+                throw std::runtime_error{"failed to bind metrics socket " + listen_ + ": " + error};
+            }
+            freeaddrinfo(result);
+        }
+
+        if (::listen(fd_, 8) != 0) {
+            close(fd_);
+            throw std::runtime_error{"failed to listen on metrics socket " + listen_};
+        }
+    }
+
+    Server::~Server() {
+        is_closed_ = true;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        close(fd_);
+        if (!unix_path_.empty()) {
+            unlink(unix_path_.c_str());
+        }
+    }
+
+    void Server::start() {
+        thread_ = std::thread(&Server::loop, this);
+        pthread_setname_np(thread_.native_handle(), "metrics");
+        logger_->info("Serving metrics on {}", listen_);
+    }
+
+    void Server::loop() {
+        pollfd pfd{fd_, POLLIN, 0};
+
+        while (!is_closed_) {
+            // wake up periodically to check for shutdown
+            if (poll(&pfd, 1, 500) <= 0) {
+                continue;
+            }
+
+            int client_fd = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                continue;
+            }
+
+            serve(client_fd);
+            close(client_fd);
+        }
+    }
+
+    void Server::serve(int client_fd) {
+        // Only /trace is special, every other path returns metrics.
+        // Read until the end of headers so that client doesn't get RST.
+        char request[1024];
+        std::string headers;
+
+        // scrapes are served one by one on the metrics thread, so a slow or stuck client
+        // must give up its turn quickly and never hold up shutdown join
+        timeval timeout{1, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        auto expired = [this, &deadline] {
+            return is_closed_ || std::chrono::steady_clock::now() > deadline;
+        };
+
+        pollfd pfd{client_fd, POLLIN, 0};
+        while (headers.find("\r\n\r\n") == std::string::npos && headers.size() < 8192) {
+            if (expired() || poll(&pfd, 1, 1000) <= 0) {
+                return;
+            }
+            auto len = recv(client_fd, request, sizeof(request), 0);
+            if (len <= 0) {
+                return;
+            }
+            headers.append(request, static_cast<size_t>(len));
+        }
+
+        bool is_trace = headers.compare(0, 11, "GET /trace ") == 0;
+        auto body = is_trace ? trace::ring().to_json() : registry().serialize();
+        auto response = std::string("HTTP/1.0 200 OK\r\n") +
+                        (is_trace ? "Content-Type: application/json\r\n"
+                                  : "Content-Type: text/plain; version=0.0.4\r\n") +
+                        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                        "Connection: close\r\n\r\n" + body;
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            if (expired()) {
+                logger_->warn("metrics client too slow, dropping response");
+                return;
+            }
+            auto len = send(client_fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (len <= 0) {
+                logger_->warn("failed to send metrics response: {}", strerror(errno));
+                return;
+            }
+            sent += static_cast<size_t>(len);
+        }
+    }
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TG2SIP_METRICS_H
+#define TG2SIP_METRICS_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <spdlog/spdlog.h>
+
+namespace metrics {
+
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    class Counter {
+    public:
+        void inc(double value = 1);
+
+        double value() const { return value_.load(std::memory_order_relaxed); };
+
+    private:
+        std::atomic<double> value_{0};
+    };
+
+    class Gauge {
+    public:
+        void set(double value) { value_.store(value, std::memory_order_relaxed); };
+
+        void inc(double value = 1);
+
+        void dec(double value = 1) { inc(-value); };
+
+        double value() const { return value_.load(std::memory_order_relaxed); };
+
+    private:
+        std::atomic<double> value_{0};
+    };
+
+    class Histogram {
+    public:
+        // upper bounds of buckets in ascending order, +Inf is implied
+        explicit Histogram(std::vector<double> bounds);
+
+        void observe(double value);
+
+        const std::vector<double> &bounds() const { return bounds_; };
+
+        // cumulative count of observations less or equal to bounds()[i]
+        uint64_t bucket(size_t i) const;
+
+        uint64_t count() const { return count_.load(std::memory_order_relaxed); };
+
+        double sum() const { return sum_.load(std::memory_order_relaxed); };
+
+    private:
+        const std::vector<double> bounds_;
+        std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+        std::atomic<uint64_t> count_{0};
+        std::atomic<double> sum_{0};
+    };
+
+    // Metrics are created on first access and live until exit,
+    // so callers are free to keep returned references.
+    class Registry {
+    public:
+        Registry() = default;
+
+        Registry(const Registry &) = delete;
+
+        Registry &operator=(const Registry &) = delete;
+
+        Counter &counter(const std::string &name, const std::string &help, const Labels &labels = {});
+
+        Gauge &gauge(const std::string &name, const std::string &help, const Labels &labels = {});
+
+        Histogram &histogram(const std::string &name, const std::string &help, const std::vector<double> &bounds,
+                             const Labels &labels = {});
+
+        // Prometheus text exposition format 0.0.4
+        std::string serialize() const;
+
+    private:
+        struct Family {
+            std::string help;
+            std::string type;
+            std::map<std::string, std::unique_ptr<Counter>> counters;
+            std::map<std::string, std::unique_ptr<Gauge>> gauges;
+            std::map<std::string, std::unique_ptr<Histogram>> histograms;
+        };
+
+        mutable std::mutex mutex_;
+        std::map<std::string, Family> families_;
+
+        Family &family(const std::string &name, const std::string &help, const std::string &type);
+    };
+
+    Registry &registry();
+
+    // Serves registry over HTTP on "host:port" or "unix:/path/to/socket",
+    // /trace path returns call setup trace instead
+    class Server {
+    public:
+        Server(std::string listen, std::shared_ptr<spdlog::logger> logger);
+
+        Server(const Server &) = delete;
+
+        Server &operator=(const Server &) = delete;
+
+        virtual ~Server();
+
+        void start();
+
+    private:
+        const std::string listen_;
+        std::shared_ptr<spdlog::logger> logger_;
+
+        int fd_{-1};
+        std::string unix_path_;
+        std::atomic<bool> is_closed_{false};
+        std::thread thread_;
+
+        void loop();
+
+        void serve(int client_fd);
+    };
+}
+
+#endif //TG2SIP_METRICS_H
@@ -53,6 +53,11 @@ public:
         return value;
     };
 
+    size_t size() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        return q.size();
+    };
+
 private:
     std::queue<std::optional<T>> q;
     std::mutex mutex;
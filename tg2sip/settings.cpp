@@ -15,7 +15,10 @@
  * along with this program; If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <sstream>
 #include <thread>
 #include "settings.h"
 
@@ -42,6 +45,12 @@ Settings::Settings(INIReader &reader) {
     public_address_ = reader.Get("sip", "public_address", "");
     stun_server_ = reader.Get("sip", "stun_server", "");
     raw_pcm_ = reader.GetBoolean("sip", "raw_pcm", true);
+    codec_ = reader.Get("sip", "codec", "");
+    std::transform(codec_.begin(), codec_.end(), codec_.begin(), ::toupper);
+    if (codec_.empty()) {
+        codec_ = raw_pcm_ ? "L16" : "OPUS";
+    }
+    direct_media_ = reader.GetBoolean("sip", "direct_media", false);
     sip_thread_count_ = static_cast<unsigned int>(reader.GetInteger("sip", "thread_count", 1));
     sip_port_range_ = static_cast<unsigned int>(reader.GetInteger("sip", "port_range", 0));
 
@@ -49,6 +58,18 @@ Settings::Settings(INIReader &reader) {
     api_id_ = static_cast<int>(reader.GetInteger("telegram", "api_id", 0));
     api_hash_ = reader.Get("telegram", "api_hash", "");
     db_folder_ = reader.Get("telegram", "database_folder", "");
+    {
+        std::istringstream folders(reader.Get("telegram", "extra_database_folders", ""));
+        std::string folder;
+        while (std::getline(folders, folder, ',')) {
+            folder.erase(0, folder.find_first_not_of(" \t"));
+            folder.erase(folder.find_last_not_of(" \t") + 1);
+            if (!folder.empty()) {
+                extra_db_folders_.push_back(folder);
+            }
+        }
+    }
+    account_dial_limit_ = static_cast<unsigned int>(reader.GetInteger("telegram", "account_dial_limit", 0));
     system_language_code_ = reader.Get("telegram", "database_folder", "en-US");
     device_model_ = reader.Get("telegram", "device_model", "PC");
     system_version_ = reader.Get("telegram", "system_version", "Linux");
@@ -72,9 +93,41 @@ Settings::Settings(INIReader &reader) {
     voip_proxy_port_ = static_cast<uint16_t>(reader.GetInteger("telegram", "voip_proxy_port", 0));
     voip_proxy_username_ = reader.Get("telegram", "voip_proxy_username", "");
     voip_proxy_password_ = reader.Get("telegram", "voip_proxy_password", "");
+    voip_proxy_pool_size_ = static_cast<unsigned int>(reader.GetInteger("telegram", "voip_proxy_pool_size", 2));
 
     extra_wait_time_ = static_cast<unsigned int>(reader.GetInteger("other", "extra_wait_time", 30));
     peer_flood_time_ = static_cast<unsigned int>(reader.GetInteger("other", "peer_flood_time", 86400));
+    metrics_listen_ = reader.Get("other", "metrics_listen", "");
+    trace_file_ = reader.Get("other", "trace_file", "tg2sip_trace.json");
+    capture_folder_ = reader.Get("other", "capture_folder", "");
+    voip_pool_size_ = static_cast<unsigned int>(reader.GetInteger("other", "voip_pool_size", 2));
+    voip_reaper_threads_ = static_cast<unsigned int>(std::max(reader.GetInteger("other", "voip_reaper_threads", 2), 1L));
+    voip_state_file_ = reader.Get("other", "voip_state_file", "voip_state.json");
+    max_calls_ = static_cast<unsigned int>(reader.GetInteger("other", "max_calls", 0));
+    max_cpu_load_ = static_cast<unsigned int>(std::clamp(reader.GetInteger("other", "max_cpu_load", 0), 0L, 100L));
+    max_media_lag_ = static_cast<unsigned int>(reader.GetInteger("other", "max_media_lag", 0));
+    overload_retry_after_ = static_cast<unsigned int>(reader.GetInteger("other", "overload_retry_after", 30));
+    drain_timeout_ = static_cast<unsigned int>(reader.GetInteger("other", "drain_timeout", 30));
+    drain_concurrency_ = static_cast<unsigned int>(std::max(reader.GetInteger("other", "drain_concurrency", 20), 1L));
+    media_sched_policy_ = reader.Get("other", "media_sched_policy", "none");
+    media_sched_priority_ = static_cast<int>(std::clamp(reader.GetInteger("other", "media_sched_priority", 10), 1L, 99L));
+    media_thread_stack_ = static_cast<unsigned int>(reader.GetInteger("other", "media_thread_stack", 0));
+
+    if (!parse_cpu_list(reader.Get("other", "media_cpus", ""), media_cpus_) ||
+        !parse_cpu_list(reader.Get("other", "other_cpus", ""), other_cpus_)) {
+        std::cerr << "Bad CPU list in media_cpus or other_cpus!\n";
+        return;
+    }
+
+    if (media_sched_policy_ != "none" && media_sched_policy_ != "fifo" && media_sched_policy_ != "rr") {
+        std::cerr << "Unsupported media_sched_policy " << media_sched_policy_ << "!\n";
+        return;
+    }
+
+    if (codec_ != "L16" && codec_ != "OPUS" && codec_ != "PCMU" && codec_ != "PCMA" && codec_ != "G722") {
+        std::cerr << "Unsupported SIP codec " << codec_ << "!\n";
+        return;
+    }
 
     if (api_id_ == 0 || api_hash_.empty()) {
         std::cerr << "TDLib api settings must be set!\n";
@@ -83,3 +136,53 @@ Settings::Settings(INIReader &reader) {
 
     is_loaded_ = true;
 }
+
+bool Settings::parse_cpu_list(const std::string &list, std::vector<int> &cpus) {
+    // comma separated ids and ranges, e.g. "2-3,6"
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+        if (item.empty()) {
+            continue;
+        }
+        int first, last;
+        char tail;
+        auto dash = item.find('-');
+        if (dash == std::string::npos) {
+            if (std::sscanf(item.c_str(), "%d%c", &first, &tail) != 1) {
+                return false;
+            }
+            last = first;
+        } else if (std::sscanf(item.c_str(), "%d-%d%c", &first, &last, &tail) != 2) {
+            return false;
+        }
+        if (first < 0 || last < first) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return true;
+}
+
+std::string Settings::codec_id() const {
+    if (codec_ == "OPUS") {
+        return "opus/48000/2";
+    } else if (codec_ == "PCMU" || codec_ == "PCMA") {
+        return codec_ + "/8000/1";
+    } else if (codec_ == "G722") {
+        return "G722/16000/1";
+    }
+    return "L16/48000/1";
+}
+
+unsigned int Settings::clock_rate() const {
+    if (codec_ == "PCMU" || codec_ == "PCMA") {
+        return 8000;
+    } else if (codec_ == "G722") {
+        return 16000;
+    }
+    return 48000;
+}
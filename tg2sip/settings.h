@@ -18,6 +18,7 @@
 #ifndef TG2SIP_SETTINGS_H
 #define TG2SIP_SETTINGS_H
 
+#include <vector>
 #include <INIReader.h>
 
 class Settings {
@@ -38,12 +39,16 @@ private:
     std::string public_address_;
     std::string stun_server_;
     bool raw_pcm_;
+    std::string codec_;
+    bool direct_media_;
     unsigned int sip_thread_count_;
     unsigned int sip_port_range_;
 
     int api_id_;
     std::string api_hash_;
     std::string db_folder_;
+    std::vector<std::string> extra_db_folders_;
+    unsigned int account_dial_limit_;
     std::string system_language_code_;
     std::string device_model_;
     std::string system_version_;
@@ -67,9 +72,29 @@ private:
     uint16_t voip_proxy_port_;
     std::string voip_proxy_username_;
     std::string voip_proxy_password_;
+    unsigned int voip_proxy_pool_size_;
 
     unsigned int extra_wait_time_;
     unsigned int peer_flood_time_;
+    std::string metrics_listen_;
+    std::string trace_file_;
+    std::string capture_folder_;
+    unsigned int voip_pool_size_;
+    unsigned int voip_reaper_threads_;
+    std::string voip_state_file_;
+    unsigned int max_calls_;
+    unsigned int max_cpu_load_;
+    unsigned int max_media_lag_;
+    unsigned int overload_retry_after_;
+    unsigned int drain_timeout_;
+    unsigned int drain_concurrency_;
+    std::vector<int> media_cpus_;
+    std::vector<int> other_cpus_;
+    std::string media_sched_policy_;
+    int media_sched_priority_;
+    unsigned int media_thread_stack_;
+
+    static bool parse_cpu_list(const std::string &list, std::vector<int> &cpus);
 
 public:
     explicit Settings(INIReader &reader);
@@ -106,6 +131,16 @@ public:
 
     bool raw_pcm() const { return raw_pcm_; };
 
+    // one of L16, OPUS, PCMU, PCMA, G722
+    string codec() const { return codec_; };
+
+    // pjsua codec id and clock rate of the SIP side media
+    string codec_id() const;
+
+    unsigned int clock_rate() const;
+
+    bool direct_media() const { return direct_media_; };
+
     unsigned int sip_thread_count() const { return sip_thread_count_; };
 
     unsigned int sip_port_range() const { return sip_port_range_; };
@@ -116,6 +151,12 @@ public:
 
     std::string db_folder() const { return db_folder_; };
 
+    // databases of further accounts, each authorized with gen_db
+    std::vector<std::string> extra_db_folders() const { return extra_db_folders_; };
+
+    // outbound calls per account per hour, 0 for no limit
+    unsigned int account_dial_limit() const { return account_dial_limit_; };
+
     std::string sys_lang_code() const { return system_language_code_; };
 
     std::string device_model() const { return device_model_; };
@@ -154,9 +195,53 @@ public:
 
     std::string voip_proxy_password() const { return voip_proxy_password_; };
 
+    unsigned int voip_proxy_pool_size() const { return voip_proxy_pool_size_; };
+
     unsigned int extra_wait_time() const { return extra_wait_time_; };
 
     unsigned int peer_flood_time() const { return peer_flood_time_; };
+
+    string metrics_listen() const { return metrics_listen_; };
+
+    string trace_file() const { return trace_file_; };
+
+    string capture_folder() const { return capture_folder_; };
+
+    unsigned int voip_pool_size() const { return voip_pool_size_; };
+
+    unsigned int voip_reaper_threads() const { return voip_reaper_threads_; };
+
+    string voip_state_file() const { return voip_state_file_; };
+
+    // admission control limits, 0 disables each of them
+    unsigned int max_calls() const { return max_calls_; };
+
+    // percent of all cores
+    unsigned int max_cpu_load() const { return max_cpu_load_; };
+
+    // milliseconds
+    unsigned int max_media_lag() const { return max_media_lag_; };
+
+    // seconds
+    unsigned int overload_retry_after() const { return overload_retry_after_; };
+
+    // seconds
+    unsigned int drain_timeout() const { return drain_timeout_; };
+
+    unsigned int drain_concurrency() const { return drain_concurrency_; };
+
+    // CPU ids, empty when not pinned
+    std::vector<int> media_cpus() const { return media_cpus_; };
+
+    std::vector<int> other_cpus() const { return other_cpus_; };
+
+    // none, fifo or rr
+    std::string media_sched_policy() const { return media_sched_policy_; };
+
+    int media_sched_priority() const { return media_sched_priority_; };
+
+    // KiB, 0 keeps the libtgvoip default
+    unsigned int media_thread_stack() const { return media_thread_stack_; };
 };
 
 #endif //TG2SIP_SETTINGS_H
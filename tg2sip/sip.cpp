@@ -15,15 +15,20 @@
  * along with this program; If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include "sip.h"
+#include <libtgvoip/logging.h>
 
 using namespace sip;
 
 void LogWriter::write(const pj::LogEntry &entry) {
-    auto msg = entry.msg;
     // 6 = DTRACE, 5 = TRACE, ... , 0 = FATAL
-    int spd_log_level = entry.level > 5 ? 0 : 5 - entry.level;
-    logger->log(static_cast<spdlog::level::level_enum>(spd_log_level), msg);
+    auto level = static_cast<spdlog::level::level_enum>(entry.level > 5 ? 0 : 5 - entry.level);
+    if (!logger->should_log(level)) {
+        return;
+    }
+    // pjsip logs from its media threads too, hand the line over instead of writing it here
+    tgvoip_log_async(logger.get(), level, entry.msg.data(), entry.msg.size());
 }
 
 AccountConfig::AccountConfig(Settings &settings) {
@@ -78,6 +83,28 @@ pj::AudioMedia *Call::audio_media() {
     return aud_med;
 }
 
+void Call::addHandler(std::function<void(pj::OnStreamDestroyedParam &)> &&handler) {
+    onStreamDestroyedHandler = std::move(handler);
+}
+
+void Call::onStreamCreated(pj::OnStreamCreatedParam &prm) {
+    stream_port_ = static_cast<pjmedia_port *>(prm.pPort);
+
+    if (conf_placeholder_) {
+        // pjsua adds whatever port is returned here to conference bridge,
+        // give it the placeholder so that stream port is driven by DirectBridge only
+        prm.pPort = conf_placeholder_;
+        prm.destroyPort = false;
+    }
+}
+
+void Call::onStreamDestroyed(pj::OnStreamDestroyedParam &prm) {
+    if (onStreamDestroyedHandler) {
+        onStreamDestroyedHandler(prm);
+    }
+    stream_port_ = nullptr;
+}
+
 void Call::onCallState(pj::OnCallStateParam &prm) {
     if (onCallStateHandler) {
         onCallStateHandler(prm);
@@ -94,9 +121,139 @@ const string Call::localUser() {
     return local_user_;
 }
 
-Client::Client(std::unique_ptr<Account> account_, std::unique_ptr<AccountConfig> account_cfg_,
-                     OptionalQueue<events::Event> &events_, Settings &settings,
-                     std::shared_ptr<spdlog::logger> logger_, LogWriter *sip_log_writer)
+DirectBridge::DirectBridge(unsigned clock_rate, unsigned ptime)
+        : clock_rate_(clock_rate),
+          samples_per_frame_(clock_rate * ptime / 1000) {
+    pool_ = pjsua_pool_create("direct%p", 512, 512);
+
+    // one null port shared by all calls, conference bridge keeps its slots but never reaches real streams
+    auto status = pjmedia_null_port_create(pool_, clock_rate_, 1, samples_per_frame_, 16, &placeholder_);
+    if (status != PJ_SUCCESS) {
+        pj_pool_release(pool_);
+        throw pj::Error(status, "pjmedia_null_port_create()", "", __FILE__, __LINE__);
+    }
+}
+
+DirectBridge::~DirectBridge() {
+    // clocks must be stopped before the ports they drive go away
+    connections_.clear();
+    pjmedia_port_destroy(placeholder_);
+    pj_pool_release(pool_);
+}
+
+DirectBridge::Connection::~Connection() {
+    if (clock) {
+        // waits for running tick to finish
+        pjmedia_clock_destroy(clock);
+    }
+    if (pool) {
+        pj_pool_release(pool);
+    }
+}
+
+void DirectBridge::connect(pjsua_call_id call_id, pjmedia_port *stream, pjmedia_port *input, pjmedia_port *output) {
+    auto stream_size = PJMEDIA_PIA_AVG_FSZ(&stream->info);
+
+    if (stream->info.fmt.id != PJMEDIA_FORMAT_L16 || input->info.fmt.id != PJMEDIA_FORMAT_L16
+        || output->info.fmt.id != PJMEDIA_FORMAT_L16) {
+        throw std::runtime_error{"MEDIA_FORMAT_MISMATCH"};
+    }
+
+    if (PJMEDIA_PIA_SRATE(&stream->info) != clock_rate_
+        || PJMEDIA_PIA_SRATE(&input->info) != clock_rate_
+        || PJMEDIA_PIA_SRATE(&output->info) != clock_rate_) {
+        throw std::runtime_error{"MEDIA_CLOCK_RATE_MISMATCH"};
+    }
+
+    auto connection = std::make_unique<Connection>();
+    connection->stream = stream;
+    connection->input = input;
+    connection->output = output;
+
+    auto input_size = PJMEDIA_PIA_AVG_FSZ(&input->info);
+    if (input_size % stream_size != 0 || PJMEDIA_PIA_AVG_FSZ(&output->info) != stream_size
+        || stream_size > sizeof(connection->pcm_buffer)) {
+        throw std::runtime_error{"MEDIA_PTIME_MISMATCH"};
+    }
+    connection->input_buffer.resize(input_size);
+
+    connection->pool = pjsua_pool_create("direct%p", 512, 512);
+
+    auto status = pjmedia_clock_create(connection->pool, clock_rate_, 1, samples_per_frame_, 0, &on_clock_tick,
+                                       connection.get(), &connection->clock);
+    if (status != PJ_SUCCESS) {
+        throw pj::Error(status, "pjmedia_clock_create()", "", __FILE__, __LINE__);
+    }
+
+    // previous connection of the same call, if any, is stopped once the lock is released
+    std::unique_ptr<Connection> replaced;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &slot = connections_[call_id];
+        replaced = std::move(slot);
+        slot = std::move(connection);
+        pjmedia_clock_start(slot->clock);
+    }
+}
+
+void DirectBridge::disconnect(pjsua_call_id call_id) {
+    std::unique_ptr<Connection> connection;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = connections_.find(call_id);
+        if (it == connections_.end()) {
+            return;
+        }
+        connection = std::move(it->second);
+        connections_.erase(it);
+    }
+    // clock is stopped here, outside of the lock, so other calls don't wait for it
+}
+
+void DirectBridge::on_clock_tick(const pj_timestamp *ts, void *user_data) {
+    tick(*static_cast<Connection *>(user_data));
+}
+
+void DirectBridge::tick(Connection &c) {
+    pjmedia_frame frame;
+    auto stream_size = PJMEDIA_PIA_AVG_FSZ(&c.stream->info);
+
+    // SIP -> TG
+    pj_bzero(&frame, sizeof(pjmedia_frame));
+    frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+    frame.buf = c.pcm_buffer;
+    frame.size = stream_size;
+    if (pjmedia_port_get_frame(c.stream, &frame) == PJ_SUCCESS) {
+        // missing frames are replaced with silence to keep input clock running
+        if (frame.type == PJMEDIA_FRAME_TYPE_AUDIO && frame.size == stream_size) {
+            memcpy(&c.input_buffer[c.input_filled], frame.buf, stream_size);
+        } else {
+            memset(&c.input_buffer[c.input_filled], 0, stream_size);
+        }
+        c.input_filled += stream_size;
+
+        if (c.input_filled == c.input_buffer.size()) {
+            frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+            frame.buf = c.input_buffer.data();
+            frame.size = c.input_buffer.size();
+            pjmedia_port_put_frame(c.input, &frame);
+            c.input_filled = 0;
+        }
+    }
+
+    // TG -> SIP
+    pj_bzero(&frame, sizeof(pjmedia_frame));
+    frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+    frame.buf = c.pcm_buffer;
+    frame.size = stream_size;
+    if (pjmedia_port_get_frame(c.output, &frame) == PJ_SUCCESS) {
+        pjmedia_port_put_frame(c.stream, &frame);
+    }
+}
+
+PjClient::PjClient(std::unique_ptr<Account> account_, std::unique_ptr<AccountConfig> account_cfg_,
+                   OptionalQueue<events::Event> &events_, Settings &settings,
+                   std::shared_ptr<spdlog::logger> logger_, LogWriter *sip_log_writer)
         : account(std::move(account_)),
           account_cfg(std::move(account_cfg_)),
           events(events_),
@@ -109,6 +266,11 @@ Client::Client(std::unique_ptr<Account> account_, std::unique_ptr<AccountConfig>
         init_pj_endpoint(settings, sip_log_writer);
     }
 
+    if (settings.direct_media()) {
+        // direct media is L16 only, must match its ptime set in init_pj_endpoint
+        direct_bridge = std::make_unique<DirectBridge>(settings.clock_rate(), 10);
+    }
+
     account->addHandler([this](pj::OnIncomingCallParam &prm) {
         auto call = std::make_shared<Call>(*account, logger, prm.callId);
         auto ci = call->getInfo();
@@ -126,11 +288,11 @@ Client::Client(std::unique_ptr<Account> account_, std::unique_ptr<AccountConfig>
 
 }
 
-Client::~Client() {
-    TRACE(logger, "~Client");
+PjClient::~PjClient() {
+    TRACE(logger, "~PjClient");
 }
 
-void Client::init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer) {
+void PjClient::init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer) {
     using namespace pj;
 
     auto log_writer = sip_log_writer;
@@ -158,12 +320,15 @@ void Client::init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer) {
     // set SIP threads number
     ep_cfg.medConfig.threadCnt = settings.sip_thread_count();
 
-    // 10ms ptime required to keep L16 RTP packet below MTU
+    // 10ms conference bridge frames keep TG audio ports in step with libtgvoip
     ep_cfg.medConfig.audioFramePtime = 10;
-    ep_cfg.medConfig.ptime = 10;
+    // 10ms ptime required to keep L16 RTP packet below MTU, other codecs use their
+    // default (20ms) to halve packet rate and RTP overhead
+    bool l16 = settings.codec_id().rfind("L16/", 0) == 0;
+    ep_cfg.medConfig.ptime = l16 ? 10 : 0;
 
     // must be the same as used in media ports
-    ep_cfg.medConfig.clockRate = 48000;
+    ep_cfg.medConfig.clockRate = settings.clock_rate();
 
     // in case of trouble check:
     //      PJSUA_MAX_CALLS
@@ -173,6 +338,12 @@ void Client::init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer) {
 
     ep_cfg.uaConfig.maxCalls = PJSUA_MAX_CALLS;
 
+    if (settings.direct_media()) {
+        // each call still takes one conference slot for its placeholder port (and nothing else),
+        // make sure slots never run out before calls do
+        ep_cfg.medConfig.maxMediaPorts = std::max<unsigned>(ep_cfg.medConfig.maxMediaPorts, PJSUA_MAX_CALLS + 1);
+    }
+
     auto stun_server = settings.stun_server();
     if (!stun_server.empty()) {
         ep_cfg.uaConfig.stunServer.emplace_back(stun_server);
@@ -183,8 +354,8 @@ void Client::init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer) {
 
     // pjSIP with switch board require matching of SIP audio
     // and TG audio port clock rate so we MUST force
-    // using 48kHz codecs for all SIP calls
-    std::string codecId = settings.raw_pcm() ? "L16/48000/1" : "opus/48000/2";
+    // single codec for all SIP calls, TG audio ports follow its clock rate
+    std::string codecId = settings.codec_id();
     CodecInfoVector codecVector = ep.codecEnum();
 
     for (auto const &value : codecVector) {
@@ -207,11 +378,11 @@ void Client::init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer) {
     ep.libStart();
 }
 
-void Client::start() {
+void PjClient::start() {
     account->create(*account_cfg);
 }
 
-std::string Client::user_from_uri(const std::string &uri) {
+std::string PjClient::user_from_uri(const std::string &uri) {
     std::string user{};
 
     pj_pool_t *pj_pool = pjsua_pool_create("temp%p", 2048, 1024);
@@ -235,7 +406,7 @@ std::string Client::user_from_uri(const std::string &uri) {
     return user;
 }
 
-pjsua_call_id Client::Dial(const std::string &uri, const pj::CallOpParam &prm) {
+pjsua_call_id PjClient::Dial(const std::string &uri, const pj::CallOpParam &prm) {
     auto call = std::make_shared<Call>(*account, logger);
     set_default_handlers(call);
 
@@ -247,7 +418,7 @@ pjsua_call_id Client::Dial(const std::string &uri, const pj::CallOpParam &prm) {
     return sip_id;
 }
 
-void Client::set_default_handlers(const std::shared_ptr<Call> &call) {
+void PjClient::set_default_handlers(const std::shared_ptr<Call> &call) {
     call->addHandler([this, call_wpt = std::weak_ptr<Call>(call)](pj::OnCallStateParam &prm) {
         if (auto call_spt = call_wpt.lock()) {
             events.emplace(events::CallStateUpdate{call_spt->getId(), call_spt->getInfo().state});
@@ -259,18 +430,32 @@ void Client::set_default_handlers(const std::shared_ptr<Call> &call) {
             events.emplace(events::CallMediaStateUpdate{call_spt->getId(), call_spt->hasMedia()});
         }
     });
+
+    if (direct_bridge) {
+        call->conf_placeholder_ = direct_bridge->placeholder();
+
+        // stream port is about to be destroyed, so stop driving it right away
+        call->addHandler([this, call_wpt = std::weak_ptr<Call>(call)](pj::OnStreamDestroyedParam &prm) {
+            if (auto call_spt = call_wpt.lock()) {
+                direct_bridge->disconnect(call_spt->getId());
+            }
+        });
+    }
 }
 
-void Client::Hangup(const pjsua_call_id call_id, const pj::CallOpParam &prm) {
+void PjClient::Hangup(const pjsua_call_id call_id, const pj::CallOpParam &prm) {
     auto it = calls.find(call_id);
     if (it != calls.end()) {
+        if (direct_bridge) {
+            direct_bridge->disconnect(call_id);
+        }
         auto call = it->second;
         call->hangup(prm);
         calls.erase(it);
     }
 }
 
-void Client::BridgeAudio(const pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output) {
+void PjClient::BridgeAudio(const pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output) {
 
     auto it = calls.find(call_id);
 
@@ -289,7 +474,28 @@ void Client::BridgeAudio(const pjsua_call_id call_id, pj::AudioMedia *input, pj:
 
 }
 
-void Client::Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) {
+void PjClient::ConnectAudio(const pjsua_call_id call_id, pjmedia_port *input, pjmedia_port *output) {
+
+    if (!direct_bridge) {
+        throw std::runtime_error{"DIRECT_MEDIA_DISABLED"};
+    }
+
+    auto it = calls.find(call_id);
+
+    if (it == calls.end()) {
+        throw std::runtime_error{"CALL_NOT_FOUND"};
+    }
+
+    auto stream_port = it->second->stream_port();
+
+    if (stream_port == nullptr) {
+        throw std::runtime_error{"SIP_MEDIA_NOT_READY"};
+    }
+
+    direct_bridge->connect(call_id, stream_port, input, output);
+}
+
+void PjClient::Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) {
     auto it = calls.find(call_id);
 
     if (it == calls.end()) {
@@ -300,7 +506,7 @@ void Client::Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) {
     call->answer(prm);
 }
 
-void Client::DialDtmf(pjsua_call_id call_id, const string &dtmf_digits) {
+void PjClient::DialDtmf(pjsua_call_id call_id, const string &dtmf_digits) {
     auto it = calls.find(call_id);
 
     if (it == calls.end()) {
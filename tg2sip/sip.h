@@ -19,6 +19,7 @@
 #define TG2SIP_SIP_H
 
 #include <variant>
+#include <mutex>
 #include <pjsua2.hpp>
 #include "logging.h"
 #include "settings.h"
@@ -72,20 +73,31 @@ namespace sip {
 
         void addHandler(std::function<void(pj::OnCallMediaStateParam &)> &&handler);
 
+        void addHandler(std::function<void(pj::OnStreamDestroyedParam &)> &&handler);
+
         const std::string localUser();
 
         pj::AudioMedia *audio_media();
 
+        pjmedia_port *stream_port() const { return stream_port_; };
 
     private:
-        friend class Client;
+        friend class PjClient;
 
         void onCallState(pj::OnCallStateParam &prm) override;
 
         void onCallMediaState(pj::OnCallMediaStateParam &prm) override;
 
+        void onStreamCreated(pj::OnStreamCreatedParam &prm) override;
+
+        void onStreamDestroyed(pj::OnStreamDestroyedParam &prm) override;
+
         std::function<void(pj::OnCallStateParam &)> onCallStateHandler;
         std::function<void(pj::OnCallMediaStateParam &)> onCallMediaStateHandler;
+        std::function<void(pj::OnStreamDestroyedParam &)> onStreamDestroyedHandler;
+        pjmedia_port *stream_port_{nullptr};
+        // handed to pjsua conference instead of the stream port when set
+        pjmedia_port *conf_placeholder_{nullptr};
         std::string local_user_;
         std::shared_ptr<spdlog::logger> logger;
     };
@@ -103,29 +115,102 @@ namespace sip {
         std::shared_ptr<spdlog::logger> logger;
     };
 
+    // Drives call stream ports and tgvoip ports with a clock of their own for every call,
+    // so directly connected calls neither take part in conference bridge ticks nor wait for each other
+    class DirectBridge {
+    public:
+        DirectBridge(unsigned clock_rate, unsigned ptime);
+
+        DirectBridge(const DirectBridge &) = delete;
+
+        DirectBridge &operator=(const DirectBridge &) = delete;
+
+        ~DirectBridge();
+
+        void connect(pjsua_call_id call_id, pjmedia_port *stream, pjmedia_port *input, pjmedia_port *output);
+
+        void disconnect(pjsua_call_id call_id);
+
+        // stands in for call stream ports in pjsua conference, see Call::onStreamCreated
+        pjmedia_port *placeholder() const { return placeholder_; };
+
+    private:
+        struct Connection {
+            ~Connection();
+
+            pjmedia_port *stream{nullptr};
+            pjmedia_port *input{nullptr};
+            pjmedia_port *output{nullptr};
+            // stream frames are collected here until the input port frame is complete
+            std::vector<char> input_buffer;
+            size_t input_filled{0};
+
+            pj_pool_t *pool{nullptr};
+            pjmedia_clock *clock{nullptr};
+
+            // one stream frame, 10ms at up to 48kHz
+            char pcm_buffer[960];
+        };
+
+        static void on_clock_tick(const pj_timestamp *ts, void *user_data);
+
+        static void tick(Connection &c);
+
+        unsigned clock_rate_;
+        unsigned samples_per_frame_;
+
+        // guards connections_ only, clock threads never take it
+        std::mutex mutex_;
+        std::map<pjsua_call_id, std::unique_ptr<Connection>> connections_;
+
+        pj_pool_t *pool_{nullptr};
+        pjmedia_port *placeholder_{nullptr};
+    };
+
+    // Call control used by gateway. PjClient is the real implementation,
+    // benchmarks replace it with a scripted fake.
     class Client {
     public:
-        Client(std::unique_ptr<Account> account_, std::unique_ptr<AccountConfig> account_cfg_,
-               OptionalQueue<events::Event> &events, Settings &settings,
-               std::shared_ptr<spdlog::logger> logger_, LogWriter *sip_log_writer);
+        virtual ~Client() = default;
+
+        virtual pjsua_call_id Dial(const std::string &uri, const pj::CallOpParam &prm) = 0;
 
-        Client(const Client &) = delete;
+        virtual void Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) = 0;
 
-        Client &operator=(const Client &) = delete;
+        virtual void Hangup(pjsua_call_id call_id, const pj::CallOpParam &prm) = 0;
 
-        virtual ~Client();
+        virtual void DialDtmf(pjsua_call_id call_id, const string &dtmf_digits) = 0;
+
+        virtual void BridgeAudio(pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output) = 0;
+
+        virtual void ConnectAudio(pjsua_call_id call_id, pjmedia_port *input, pjmedia_port *output) = 0;
+    };
+
+    class PjClient : public Client {
+    public:
+        PjClient(std::unique_ptr<Account> account_, std::unique_ptr<AccountConfig> account_cfg_,
+                 OptionalQueue<events::Event> &events, Settings &settings,
+                 std::shared_ptr<spdlog::logger> logger_, LogWriter *sip_log_writer);
+
+        PjClient(const PjClient &) = delete;
+
+        PjClient &operator=(const PjClient &) = delete;
+
+        ~PjClient() override;
 
         void start();
 
-        pjsua_call_id Dial(const std::string &uri, const pj::CallOpParam &prm);
+        pjsua_call_id Dial(const std::string &uri, const pj::CallOpParam &prm) override;
 
-        void Answer(pjsua_call_id call_id, const pj::CallOpParam &prm);
+        void Answer(pjsua_call_id call_id, const pj::CallOpParam &prm) override;
 
-        void Hangup(pjsua_call_id call_id, const pj::CallOpParam &prm);
+        void Hangup(pjsua_call_id call_id, const pj::CallOpParam &prm) override;
 
-        void DialDtmf(pjsua_call_id call_id, const string &dtmf_digits);
+        void DialDtmf(pjsua_call_id call_id, const string &dtmf_digits) override;
 
-        void BridgeAudio(pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output);
+        void BridgeAudio(pjsua_call_id call_id, pj::AudioMedia *input, pj::AudioMedia *output) override;
+
+        void ConnectAudio(pjsua_call_id call_id, pjmedia_port *input, pjmedia_port *output) override;
 
     private:
         std::shared_ptr<spdlog::logger> logger;
@@ -136,6 +221,8 @@ namespace sip {
         OptionalQueue<events::Event> &events;
         std::map<int, std::shared_ptr<Call>> calls;
 
+        std::unique_ptr<DirectBridge> direct_bridge;
+
         static void init_pj_endpoint(Settings &settings, LogWriter *sip_log_writer);
 
         static std::string user_from_uri(const std::string &uri);
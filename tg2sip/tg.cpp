@@ -15,36 +15,50 @@
  * along with this program; If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <cxxabi.h>
 #include "tg.h"
 #include "queue.h"
+#include "metrics.h"
 
 using namespace tg;
 
-Client::Client(Settings &settings, std::shared_ptr<spdlog::logger> logger_,
-               OptionalQueue<Object> &events_)
-        : logger(std::move(logger_)), events(events_) {
+namespace {
+    // td_api function class name, e.g. "getUser"
+    std::string function_name(const td_api::Function &f) {
+        int status = 0;
+        std::unique_ptr<char, void (*)(void *)> demangled(
+                abi::__cxa_demangle(typeid(f).name(), nullptr, nullptr, &status), std::free);
+        std::string name = status == 0 && demangled ? demangled.get() : typeid(f).name();
+        auto pos = name.rfind("::");
+        return pos == std::string::npos ? name : name.substr(pos + 2);
+    }
+}
+
+TdClient::TdClient(Settings &settings, std::string database_folder, std::shared_ptr<spdlog::logger> logger_,
+                   OptionalQueue<Object> &events_)
+        : logger(std::move(logger_)), events(events_), database_folder(std::move(database_folder)) {
 
     client = std::make_unique<td::Client>();
     init_lib_parameters(settings);
     init_proxy(settings);
 }
 
-Client::~Client() {
-    TRACE(logger, "~Client");
+TdClient::~TdClient() {
+    TRACE(logger, "~TdClient");
     is_closed = true;
     if (thread_.joinable()) {
         thread_.join();
     }
     client.release();
-    TRACE(logger, "~Client done");
+    TRACE(logger, "~TdClient done");
 }
 
-void Client::init_lib_parameters(Settings &settings) {
+void TdClient::init_lib_parameters(Settings &settings) {
     lib_parameters = td_api::make_object<td_api::tdlibParameters>();
 
     lib_parameters->api_id_ = settings.api_id();
     lib_parameters->api_hash_ = settings.api_hash();
-    lib_parameters->database_directory_ = settings.db_folder();
+    lib_parameters->database_directory_ = database_folder;
 
     lib_parameters->system_language_code_ = settings.sys_lang_code();
     lib_parameters->device_model_ = settings.device_model();
@@ -58,7 +72,7 @@ void Client::init_lib_parameters(Settings &settings) {
     lib_parameters->enable_storage_optimizer_ = true;
 }
 
-void Client::init_proxy(Settings &settings) {
+void TdClient::init_proxy(Settings &settings) {
     if (settings.proxy_enabled()) {
         auto socks_proxy_type = td_api::make_object<td_api::proxyTypeSocks5>(
                 settings.proxy_username(),
@@ -74,7 +88,7 @@ void Client::init_proxy(Settings &settings) {
     }
 }
 
-void Client::loop() {
+void TdClient::loop() {
     TRACE(logger, "TG client thread started");
 
     while (!is_closed) {
@@ -84,12 +98,12 @@ void Client::loop() {
     TRACE(logger, "TG client thread ended");
 }
 
-void Client::start() {
-    thread_ = std::thread(&Client::loop, this);
+void TdClient::start() {
+    thread_ = std::thread(&TdClient::loop, this);
     pthread_setname_np(thread_.native_handle(), "tg_client");
 }
 
-void Client::process_response(td::Client::Response response) {
+void TdClient::process_response(td::Client::Response response) {
 
     if (!response.object) {
         return;
@@ -108,7 +122,7 @@ void Client::process_response(td::Client::Response response) {
     }
 }
 
-void Client::process_update(Object update) {
+void TdClient::process_update(Object update) {
     switch (update->get_id()) {
         case td_api::updateAuthorizationState::ID: {
             auto update_authorization_state = td_api::move_object_as<td_api::updateAuthorizationState>(update);
@@ -118,7 +132,7 @@ void Client::process_update(Object update) {
         case td_api::updateConnectionState::ID: {
             auto update_connection_state = td_api::move_object_as<td_api::updateConnectionState>(update);
             if (update_connection_state->state_->get_id() == td_api::connectionStateReady::ID) {
-                logger->info("TG client connected");
+                logger->info("TG client connected (database '{}')", database_folder);
             }
             break;
         }
@@ -132,15 +146,23 @@ void Client::process_update(Object update) {
     }
 }
 
-void Client::send_query(td_api::object_ptr<td_api::Function> f, std::function<void(Object)> handler) {
+void TdClient::send_query(td_api::object_ptr<td_api::Function> f, std::function<void(Object)> handler) {
     auto query_id = next_query_id();
     if (handler) {
-        handlers.emplace(query_id, std::move(handler));
+        auto &latency = metrics::registry().histogram(
+                "tg2sip_tdlib_query_seconds", "TDLib query round trip time",
+                {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10},
+                {{"method", function_name(*f)}});
+        auto start = std::chrono::steady_clock::now();
+        handlers.emplace(query_id, [&latency, start, handler = std::move(handler)](Object object) {
+            latency.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            handler(std::move(object));
+        });
     }
     client->send({query_id, std::move(f)});
 }
 
-std::future<Client::Object> Client::send_query_async(td_api::object_ptr<td_api::Function> f) {
+std::future<Client::Object> TdClient::send_query_async(td_api::object_ptr<td_api::Function> f) {
 
     if (std::this_thread::get_id() == thread_.get_id()) {
         logger->critical("Call of send_query_async from TG thread will cause deadlock");
@@ -161,28 +183,28 @@ std::future<Client::Object> Client::send_query_async(td_api::object_ptr<td_api::
     return future;
 }
 
-std::uint64_t Client::next_query_id() {
+std::uint64_t TdClient::next_query_id() {
     return ++current_query_id;
 }
 
-auto Client::create_authentication_query_handler() {
+auto TdClient::create_authentication_query_handler() {
     return [this](Object object) {
         check_authentication_error(std::move(object));
     };
 }
 
-void Client::check_authentication_error(Object object) {
+void TdClient::check_authentication_error(Object object) {
     if (object->get_id() == td_api::error::ID) {
         auto error = td_api::move_object_as<td_api::error>(object);
         logger->error("TG client authorization error\n{}", to_string(error));
     }
 }
 
-void Client::on_authorization_state_update(td_api::object_ptr<td_api::AuthorizationState> authorization_state) {
+void TdClient::on_authorization_state_update(td_api::object_ptr<td_api::AuthorizationState> authorization_state) {
     switch (authorization_state->get_id()) {
         case td_api::authorizationStateReady::ID:
             is_ready_.set_value(true);
-            logger->info("TG client authorization ready");
+            logger->info("TG client authorization ready (database '{}')", database_folder);
             break;
         case td_api::authorizationStateWaitEncryptionKey::ID:
             send_query(td_api::make_object<td_api::checkDatabaseEncryptionKey>(),
@@ -196,7 +218,7 @@ void Client::on_authorization_state_update(td_api::object_ptr<td_api::Authorizat
         }
         default:
             is_ready_.set_value(false);
-            logger->error("TG client auto sign-on failed");
+            logger->error("TG client auto sign-on failed (database '{}')", database_folder);
             break;
     }
 }
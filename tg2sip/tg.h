@@ -32,20 +32,33 @@ namespace tg {
 
     namespace td_api = td::td_api;
 
+    // TDLib access used by gateway. TdClient is the real implementation,
+    // benchmarks replace it with a scripted fake.
     class Client {
     public:
         using Object = td_api::object_ptr<td_api::Object>;
 
-        virtual ~Client();
+        virtual ~Client() = default;
 
-        explicit Client(Settings &settings, std::shared_ptr<spdlog::logger> logger_,
-                          OptionalQueue<Object> &events_);
+        virtual void send_query(td_api::object_ptr<td_api::Function> f,
+                                std::function<void(Object)> handler = nullptr) = 0;
+
+        virtual std::future<Object> send_query_async(td_api::object_ptr<td_api::Function> f) = 0;
+    };
+
+    class TdClient : public Client {
+    public:
+        ~TdClient() override;
+
+        // database_folder selects the account, settings.db_folder() is the first one
+        TdClient(Settings &settings, std::string database_folder, std::shared_ptr<spdlog::logger> logger_,
+                 OptionalQueue<Object> &events_);
 
         void start();
 
-        void send_query(td_api::object_ptr<td_api::Function> f, std::function<void(Object)> handler = nullptr);
+        void send_query(td_api::object_ptr<td_api::Function> f, std::function<void(Object)> handler = nullptr) override;
 
-        std::future<Object> send_query_async(td_api::object_ptr<td_api::Function> f);
+        std::future<Object> send_query_async(td_api::object_ptr<td_api::Function> f) override;
 
         std::future<bool> is_ready() { return is_ready_.get_future(); };
 
@@ -53,6 +66,7 @@ namespace tg {
 
         std::shared_ptr<spdlog::logger> logger;
         OptionalQueue<Object> &events;
+        const std::string database_folder;
 
         const double WAIT_TIMEOUT = 10;
 
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include "trace.h"
+
+namespace {
+    // enough for a few thousand calls worth of setup events
+    const size_t RING_CAPACITY = 1 << 16;
+
+    size_t round_up_pow2(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    void append_escaped(std::ostringstream &out, const char *str) {
+        for (; str && *str; ++str) {
+            switch (*str) {
+                case '"':
+                    out << "\\\"";
+                    break;
+                case '\\':
+                    out << "\\\\";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(*str) >= 0x20) {
+                        out << *str;
+                    }
+            }
+        }
+    }
+}
+
+namespace trace {
+
+    Ring::Ring(size_t capacity)
+            : mask_(round_up_pow2(capacity) - 1),
+              slots_(new Slot[mask_ + 1]) {}
+
+    void Ring::record(Phase phase, const char *category, const char *name, int64_t tid) noexcept {
+        auto ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        auto index = head_.fetch_add(1, std::memory_order_relaxed);
+        auto &slot = slots_[index & mask_];
+
+        // seqlock: readers skip the slot while it is being overwritten
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.ts.store(ts, std::memory_order_relaxed);
+        slot.category.store(category, std::memory_order_relaxed);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.tid.store(tid, std::memory_order_relaxed);
+        slot.phase.store(static_cast<char>(phase), std::memory_order_relaxed);
+        slot.seq.store(index + 1, std::memory_order_release);
+    }
+
+    std::string Ring::to_json() const {
+        std::ostringstream out;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        auto pid = getpid();
+        auto head = head_.load(std::memory_order_acquire);
+        auto capacity = mask_ + 1;
+        bool first = true;
+
+        for (auto index = head > capacity ? head - capacity : 0; index < head; ++index) {
+            auto &slot = slots_[index & mask_];
+
+            auto seq = slot.seq.load(std::memory_order_acquire);
+            if (seq != index + 1) {
+                continue;
+            }
+            auto ts = slot.ts.load(std::memory_order_relaxed);
+            auto category = slot.category.load(std::memory_order_relaxed);
+            auto name = slot.name.load(std::memory_order_relaxed);
+            auto tid = slot.tid.load(std::memory_order_relaxed);
+            auto phase = slot.phase.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+
+            if (!first) {
+                out << ",";
+            }
+            first = false;
+
+            out << "{\"name\":\"";
+            append_escaped(out, name);
+            out << "\",\"cat\":\"";
+            append_escaped(out, category);
+            out << "\",\"ph\":\"" << phase << "\",\"ts\":" << ts / 1000 << "." << ts % 1000 / 100
+                << ",\"pid\":" << pid << ",\"tid\":" << tid;
+            if (phase == static_cast<char>(Phase::Instant)) {
+                out << ",\"s\":\"t\"";
+            }
+            out << "}";
+        }
+
+        out << "]}";
+        return out.str();
+    }
+
+    Ring &ring() {
+        static Ring instance(RING_CAPACITY);
+        return instance;
+    }
+
+    bool dump(const std::string &path) {
+        std::ofstream file(path, std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file << ring().to_json();
+        return static_cast<bool>(file);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TG2SIP_TRACE_H
+#define TG2SIP_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace trace {
+
+    enum class Phase : char {
+        Begin = 'B',
+        End = 'E',
+        Instant = 'i'
+    };
+
+    // Fixed size lock-free ring of trace events, oldest events are overwritten.
+    // Names and categories are not copied and must have static storage duration.
+    class Ring {
+    public:
+        explicit Ring(size_t capacity);
+
+        Ring(const Ring &) = delete;
+
+        Ring &operator=(const Ring &) = delete;
+
+        void record(Phase phase, const char *category, const char *name, int64_t tid) noexcept;
+
+        // Chrome/Perfetto trace event JSON of events currently in the ring
+        std::string to_json() const;
+
+    private:
+        struct Slot {
+            std::atomic<uint64_t> seq{0};
+            std::atomic<int64_t> ts{0};
+            std::atomic<const char *> category{nullptr};
+            std::atomic<const char *> name{nullptr};
+            std::atomic<int64_t> tid{0};
+            std::atomic<char> phase{0};
+        };
+
+        const size_t mask_;
+        std::unique_ptr<Slot[]> slots_;
+        std::atomic<uint64_t> head_{0};
+    };
+
+    Ring &ring();
+
+    inline void begin(const char *category, const char *name, int64_t tid) noexcept {
+        ring().record(Phase::Begin, category, name, tid);
+    }
+
+    inline void end(const char *category, const char *name, int64_t tid) noexcept {
+        ring().record(Phase::End, category, name, tid);
+    }
+
+    inline void instant(const char *category, const char *name, int64_t tid) noexcept {
+        ring().record(Phase::Instant, category, name, tid);
+    }
+
+    // writes ring().to_json() to file, returns false on failure
+    bool dump(const std::string &path);
+}
+
+#endif //TG2SIP_TRACE_H
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <pjlib.h>
+#include <libtgvoip/Socks5Pool.h>
+#include "voip_pool.h"
+#include "logging.h"
+#include "metrics.h"
+
+using tgvoip::VoIPController;
+
+namespace {
+    metrics::Gauge &idle_gauge() {
+        static auto &idle = metrics::registry().gauge(
+                "tg2sip_voip_pool_idle", "Pre-built VoIP controllers waiting for a call");
+        return idle;
+    }
+
+    // controllers register and unregister pjmedia ports on pool threads
+    void register_pj_thread(const char *name, pj_thread_desc &thread_desc, spdlog::logger &logger) {
+        pj_thread_t *pj_thread = nullptr;
+        if (!pj_thread_is_registered()) {
+            pj_bzero(thread_desc, sizeof(thread_desc));
+            if (pj_thread_register(name, thread_desc, &pj_thread) != PJ_SUCCESS) {
+                logger.error("failed to register {} thread in pjlib", name);
+            }
+        }
+    }
+}
+
+VoipPool::VoipPool(const Settings &settings, std::shared_ptr<spdlog::logger> logger)
+        : logger_(std::move(logger)), settings_(settings),
+          config_(3000,   /*init_timeout*/
+                  3000,   /*recv_timeout*/
+                  tgvoip::DATA_SAVING_NEVER, /*data_saving*/
+                  settings.aec_enabled(),   /*enableAEC*/
+                  settings.ns_enabled(),  /*enableNS*/
+                  settings.agc_enabled(),  /*enableAGC*/
+                  false   /*enableCallUpgrade*/),
+          size_(settings.voip_pool_size()),
+          state_file_(settings.voip_state_file()) {
+
+    config_.registerSoftwareAudioPorts = !settings.direct_media();
+    config_.softwareAudioClockRate = settings.clock_rate();
+
+    load_state();
+
+    if (settings.voip_proxy_enabled()) {
+        tgvoip::Socks5Pool::GetSharedInstance()->Configure(
+                settings.voip_proxy_address(),
+                settings.voip_proxy_port(),
+                settings.voip_proxy_username(),
+                settings.voip_proxy_password(),
+                settings.voip_proxy_pool_size()
+        );
+    }
+
+    thread_ = std::thread(&VoipPool::loop, this);
+    pthread_setname_np(thread_.native_handle(), "voip_pool");
+    for (unsigned int i = 0; i < settings.voip_reaper_threads(); i++) {
+        reapers_.emplace_back(&VoipPool::reap, this);
+        pthread_setname_np(reapers_.back().native_handle(), "voip_reaper");
+    }
+}
+
+VoipPool::~VoipPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_closed_ = true;
+    }
+    cv_.notify_one();
+    reaper_cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    // reapers finish what is released before they exit
+    for (auto &reaper : reapers_) {
+        reaper.join();
+    }
+    // idle controllers were never started
+    for (auto &controller : idle_) {
+        controller->Stop();
+    }
+    tgvoip::Socks5Pool::GetSharedInstance()->Configure("", 0, "", "", 0);
+}
+
+std::shared_ptr<VoIPController> VoipPool::create() const {
+    auto controller = std::make_shared<VoIPController>();
+    controller->SetConfig(config_);
+    if (settings_.voip_proxy_enabled()) {
+        controller->SetProxy(
+                tgvoip::PROXY_SOCKS5,
+                settings_.voip_proxy_address(),
+                settings_.voip_proxy_port(),
+                settings_.voip_proxy_username(),
+                settings_.voip_proxy_password()
+        );
+    }
+    return controller;
+}
+
+std::shared_ptr<VoIPController> VoipPool::acquire() {
+    static auto &hits = metrics::registry().counter(
+            "tg2sip_voip_pool_hits_total", "Calls that got a pre-built VoIP controller");
+    static auto &misses = metrics::registry().counter(
+            "tg2sip_voip_pool_misses_total", "Calls that had to build a VoIP controller in place");
+
+    std::shared_ptr<VoIPController> controller;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+            controller = std::move(idle_.front());
+            idle_.pop_front();
+            idle_gauge().set(idle_.size());
+        }
+    }
+
+    if (controller) {
+        hits.inc();
+        cv_.notify_one();
+    } else {
+        misses.inc();
+        controller = create();
+    }
+
+    std::vector<uint8_t> state;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        state = persistent_state_;
+    }
+    controller->SetPersistentState(std::move(state));
+    return controller;
+}
+
+void VoipPool::release(std::shared_ptr<VoIPController> controller,
+                       std::function<void(VoIPController &)> on_stopped) {
+    if (!controller) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        retired_.emplace_back(Retired{std::move(controller), std::move(on_stopped)});
+    }
+    reaper_cv_.notify_one();
+}
+
+size_t VoipPool::reaping() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return retired_.size() + stopping_;
+}
+
+void VoipPool::loop() {
+    TRACE(logger_, "VoIP pool thread started");
+
+    pj_thread_desc thread_desc;
+    register_pj_thread("voip_pool", thread_desc, *logger_);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (is_closed_) {
+            break;
+        }
+
+        if (idle_.size() < size_) {
+            lock.unlock();
+            std::shared_ptr<VoIPController> controller;
+            try {
+                controller = create();
+            } catch (const std::exception &e) {
+                logger_->error("failed to pre-build VoIP controller: {}", e.what());
+            }
+            lock.lock();
+            if (controller) {
+                idle_.emplace_back(std::move(controller));
+                idle_gauge().set(idle_.size());
+                continue;
+            }
+        }
+
+        cv_.wait_for(lock, std::chrono::seconds(1));
+    }
+
+    TRACE(logger_, "VoIP pool thread ended");
+}
+
+void VoipPool::reap() {
+    pj_thread_desc thread_desc;
+    register_pj_thread("voip_reaper", thread_desc, *logger_);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (retired_.empty()) {
+            if (is_closed_) {
+                break;
+            }
+            reaper_cv_.wait(lock);
+            continue;
+        }
+
+        auto retired = std::move(retired_.front());
+        retired_.pop_front();
+        stopping_++;
+        lock.unlock();
+
+        retired.controller->Stop();
+        if (retired.on_stopped) {
+            retired.on_stopped(*retired.controller);
+        }
+        // a call that never connected may not have probed the network at all
+        std::vector<uint8_t> state;
+        if (retired.controller->WasEstablished()) {
+            state = retired.controller->GetPersistentState();
+        }
+        retired.controller.reset();
+
+        lock.lock();
+        stopping_--;
+        if (!state.empty()) {
+            // the last call to finish knows best, but only about what it has learned itself
+            persistent_state_ = VoIPController::MergePersistentState(persistent_state_, state);
+            state_seq_++;
+        }
+        // once per burst of finished calls rather than per call, shutdown ends all of them at once
+        if (!state_file_.empty() && state_seq_ > 0 && retired_.empty() && stopping_ == 0) {
+            auto merged = persistent_state_;
+            auto seq = state_seq_;
+            lock.unlock();
+            save_state(merged, seq);
+            lock.lock();
+        }
+    }
+}
+
+void VoipPool::load_state() {
+    if (state_file_.empty()) {
+        return;
+    }
+    FILE *file = fopen(state_file_.c_str(), "rb");
+    if (!file) {
+        if (errno != ENOENT) {
+            logger_->warn("failed to read VoIP state from {}: {}", state_file_, strerror(errno));
+        }
+        return;
+    }
+    unsigned char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        persistent_state_.insert(persistent_state_.end(), buffer, buffer + length);
+    }
+    fclose(file);
+    DEBUG(logger_, "loaded {} bytes of VoIP state from {}", persistent_state_.size(), state_file_);
+}
+
+void VoipPool::save_state(const std::vector<uint8_t> &state, uint64_t seq) {
+    std::lock_guard<std::mutex> file_lock(state_file_mutex_);
+    if (seq <= saved_seq_) {
+        return;
+    }
+    auto tmp_path = state_file_ + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        logger_->warn("failed to write VoIP state to {}: {}", tmp_path, strerror(errno));
+        return;
+    }
+    auto is_written = fwrite(state.data(), 1, state.size(), file) == state.size()
+                      && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    is_written = fclose(file) == 0 && is_written;
+    if (!is_written || rename(tmp_path.c_str(), state_file_.c_str()) != 0) {
+        logger_->warn("failed to write VoIP state to {}: {}", state_file_, strerror(errno));
+        unlink(tmp_path.c_str());
+        return;
+    }
+    saved_seq_ = seq;
+}
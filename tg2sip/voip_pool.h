@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2017-2018 infactum (infactum@gmail.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TG2SIP_VOIP_POOL_H
+#define TG2SIP_VOIP_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <libtgvoip/VoIPController.h>
+#include <spdlog/spdlog.h>
+#include "settings.h"
+
+/*
+ * Keeps a few VoIPControllers constructed and configured ahead of time, so that
+ * sockets, pjmedia ports and the rest of constructor work are off the call setup path.
+ *
+ * Controllers are not reusable once started, so a finished call hands its controller
+ * back only to be stopped and destroyed by reaper threads, while the pool thread builds
+ * a replacement. Stop() joins several controller threads, this keeps it off the gateway
+ * thread, which matters most on shutdown, when every call ends at once.
+ *
+ * The pool also carries libtgvoip persistent state (proxy capabilities, IPv4/NAT64
+ * detection, relay statistics) from finished calls to new ones and keeps it in
+ * voip_state_file, so that a restart doesn't bring the probing back to every call.
+ *
+ * In VoIP proxy mode it also starts libtgvoip Socks5Pool, which keeps SOCKS5 UDP
+ * associations ready so that calls skip the proxy handshake.
+ */
+class VoipPool {
+public:
+    VoipPool(const Settings &settings, std::shared_ptr<spdlog::logger> logger);
+
+    ~VoipPool();
+
+    VoipPool(const VoipPool &) = delete;
+
+    VoipPool &operator=(const VoipPool &) = delete;
+
+    // configuration every pooled controller already has
+    const tgvoip::VoIPController::Config &config() const { return config_; };
+
+    // configured but not started controller, built in place when the pool is empty
+    std::shared_ptr<tgvoip::VoIPController> acquire();
+
+    /*
+     * Takes a controller of a finished call, it is stopped and destroyed on a reaper thread
+     * and its persistent state is kept. on_stopped runs there in between, final statistics
+     * are only known once the controller threads are joined.
+     */
+    void release(std::shared_ptr<tgvoip::VoIPController> controller,
+                 std::function<void(tgvoip::VoIPController &)> on_stopped = nullptr);
+
+    // released controllers not destroyed yet
+    size_t reaping();
+
+private:
+    struct Retired {
+        std::shared_ptr<tgvoip::VoIPController> controller;
+        std::function<void(tgvoip::VoIPController &)> on_stopped;
+    };
+
+    std::shared_ptr<spdlog::logger> logger_;
+    const Settings &settings_;
+    tgvoip::VoIPController::Config config_;
+    const size_t size_;
+    const std::string state_file_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable reaper_cv_;
+    std::deque<std::shared_ptr<tgvoip::VoIPController>> idle_;
+    std::deque<Retired> retired_;
+    // taken by reapers and not destroyed yet
+    size_t stopping_{0};
+    std::vector<uint8_t> persistent_state_;
+    // bumped on every change of persistent_state_, so that a reaper never overwrites the file with an older one
+    uint64_t state_seq_{0};
+    bool is_closed_{false};
+    std::thread thread_;
+    std::vector<std::thread> reapers_;
+    // reapers finishing at once would write the state file concurrently
+    std::mutex state_file_mutex_;
+    // under state_file_mutex_
+    uint64_t saved_seq_{0};
+
+    std::shared_ptr<tgvoip::VoIPController> create() const;
+
+    void load_state();
+
+    /*
+     * Write to a temporary file and rename, so a crash never leaves a truncated state behind.
+     * Skipped when a state with a later seq is already written.
+     */
+    void save_state(const std::vector<uint8_t> &state, uint64_t seq);
+
+    void loop();
+
+    void reap();
+};
+
+#endif //TG2SIP_VOIP_POOL_H